@@ -0,0 +1,42 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+//
+// Counting replacement of the global operator new. It lives in its own translation unit, so the compiler
+// does not see allocations from the headers inlined next to a delete that calls std::free.
+
+#include "allocations.h"
+
+#include <cstdlib>
+#include <new>
+
+
+namespace {
+    size_t count = 0;
+    size_t bytes = 0;
+}
+
+void *operator new(size_t size) {
+    count++;
+    bytes += size;
+    if (void *pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+namespace bench {
+    size_t allocationCount() {
+        return count;
+    }
+
+    size_t allocatedBytes() {
+        return bytes;
+    }
+}
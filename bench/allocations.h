@@ -0,0 +1,12 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <cstddef>
+
+
+namespace bench {
+    // totals of the replaced global operator new since the start, single-threaded
+    size_t allocationCount();
+    size_t allocatedBytes();
+}
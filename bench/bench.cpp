@@ -0,0 +1,351 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+//
+// Microbenchmarks of the packet parser and builder. Every benchmark reports the time, the bytes
+// allocated and the number of allocations per operation.
+//
+// Usage: dns_bench [corpus directory] [name filter]
+
+#include "allocations.h"
+
+#include "../src/dns.h"
+#include "../src/names.h"
+#include "../src/output.h"
+#include "../src/pcap.h"
+#include "../src/sweep.h"
+#include "../src/udp.h"
+#include "../src/utils.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <array>
+#include <memory_resource>
+#include <fcntl.h>
+
+
+const auto MIN_BENCHMARK_TIME = std::chrono::milliseconds(200);
+const size_t MAX_ITERATIONS = size_t{1} << 30;
+
+namespace bench {
+    typedef std::chrono::steady_clock Clock;
+
+    // keeps the compiler from dropping a result nobody reads
+    template<typename T>
+    void keep(T &&value) {
+        asm volatile("" : : "r"(&value) : "memory");
+    }
+
+    struct Measurement {
+        double nanoseconds;
+        double bytes;
+        double allocations;
+    };
+
+    template<typename Body>
+    Measurement measure(Body &body, size_t iterations) {
+        const size_t allocationsBefore = allocationCount();
+        const size_t bytesBefore = allocatedBytes();
+        const auto start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            body();
+        }
+        const auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        return {
+            elapsed / iterations,
+            static_cast<double>(allocatedBytes() - bytesBefore) / iterations,
+            static_cast<double>(allocationCount() - allocationsBefore) / iterations,
+        };
+    }
+
+    class Runner {
+    public:
+        explicit Runner(std::string filter) : filter(std::move(filter)) {
+            std::cout << std::left << std::setw(56) << "benchmark" << std::right << std::setw(12) << "ns/op"
+                      << std::setw(12) << "B/op" << std::setw(12) << "allocs/op" << std::endl;
+        }
+
+        /**
+         * Doubles the iteration count until one round takes at least MIN_BENCHMARK_TIME.
+         */
+        template<typename Body>
+        void run(const std::string &name, Body body) {
+            if (name.find(filter) == std::string::npos) {
+                return;
+            }
+            body();
+            size_t iterations = 1;
+            Measurement result{};
+            while (true) {
+                const auto start = Clock::now();
+                result = measure(body, iterations);
+                if (Clock::now() - start >= MIN_BENCHMARK_TIME || iterations >= MAX_ITERATIONS) {
+                    break;
+                }
+                iterations *= 2;
+            }
+            std::cout << std::left << std::setw(56) << name << std::right << std::fixed
+                      << std::setw(12) << std::setprecision(1) << result.nanoseconds
+                      << std::setw(12) << std::setprecision(1) << result.bytes
+                      << std::setw(12) << std::setprecision(2) << result.allocations << std::endl;
+        }
+
+    private:
+        std::string filter;
+    };
+
+    struct CorpusPacket {
+        std::string name;
+        dns::Packet packet;
+    };
+
+    std::vector<CorpusPacket> loadCorpus(const std::filesystem::path &directory) {
+        std::vector<CorpusPacket> corpus;
+        for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+            if (entry.path().extension() != ".bin") {
+                continue;
+            }
+            std::ifstream file(entry.path(), std::ios::binary);
+            dns::Packet packet((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            corpus.push_back({entry.path().stem().string(), std::move(packet)});
+        }
+        std::sort(corpus.begin(), corpus.end(), [](const CorpusPacket &lhs, const CorpusPacket &rhs) {
+            return lhs.name < rhs.name;
+        });
+        return corpus;
+    }
+
+    // visits every name and every record the way the text output does
+    size_t walk(const dns::DNSMessage &message) {
+        size_t visited = 0;
+        for (const auto &section : {message.answers(), message.authorities(), message.additionals()}) {
+            for (const dns::ResourceRecordView &record : section) {
+                record.name.forEachLabel([&](std::string_view label) { visited += label.size(); });
+                std::visit([&](const auto &data) { keep(data); }, dns::rdata::decode(record));
+                visited++;
+            }
+        }
+        return visited;
+    }
+
+    /**
+     * Sends every datagram arriving on a loopback port straight back, enough for a query to see its own ID.
+     */
+    class EchoServer {
+    public:
+        EchoServer() {
+            fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), length) < 0
+                || getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to open echo socket");
+            }
+            port = ntohs(address.sin_port);
+            thread = std::thread([this]() {
+                uint8_t buffer[DNS_PACKET_SIZE];
+                sockaddr_storage peer{};
+                socklen_t peerLength = sizeof(peer);
+                while (!stopped.load()) {
+                    ssize_t received = recvfrom(fd, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr *>(&peer), &peerLength);
+                    if (received > 0) {
+                        sendto(fd, buffer, received, 0, reinterpret_cast<sockaddr *>(&peer), peerLength);
+                    }
+                    peerLength = sizeof(peer);
+                }
+            });
+        }
+
+        ~EchoServer() {
+            stopped.store(true);
+            // wakes the blocked recvfrom
+            shutdown(fd, SHUT_RDWR);
+            thread.join();
+            close(fd);
+        }
+
+        uint16_t getPort() const {
+            return port;
+        }
+
+    private:
+        int fd;
+        uint16_t port;
+        std::atomic<bool> stopped = false;
+        std::thread thread;
+    };
+
+    // offset of the deepest name in the packet: the target of the last CNAME, the question otherwise
+    size_t deepestNameOffset(const dns::Packet &packet) {
+        size_t offset = DNS_HEADER_SIZE;
+        for (const dns::ResourceRecordView &record : dns::parseResponsePacket(packet).answers()) {
+            if (record.type == TYPE_CNAME) {
+                offset = record.rdataOffset;
+            }
+        }
+        return offset;
+    }
+
+    // the packet as a captured Ethernet frame of a UDP response from port 53
+    dns::Packet udpFrame(const dns::Packet &packet) {
+        const size_t udpLength = 8 + packet.size();
+        const size_t ipLength = 20 + udpLength;
+        dns::Packet frame(14, 0);
+        frame[12] = ETHERTYPE_IPV4 >> 8;
+        frame[13] = ETHERTYPE_IPV4 & 0xFF;
+        const uint8_t ip[] = {0x45, 0, static_cast<uint8_t>(ipLength >> 8), static_cast<uint8_t>(ipLength),
+                              0, 1, 0, 0, 64, IP_PROTOCOL_UDP, 0, 0, 127, 0, 0, 1, 127, 0, 0, 1};
+        frame.insert(frame.end(), std::begin(ip), std::end(ip));
+        const uint8_t udp[] = {0, 53, 0x9C, 0x40, static_cast<uint8_t>(udpLength >> 8),
+                               static_cast<uint8_t>(udpLength), 0, 0};
+        frame.insert(frame.end(), std::begin(udp), std::end(udp));
+        frame.insert(frame.end(), packet.begin(), packet.end());
+        return frame;
+    }
+}
+
+int main(int argc, const char **argv) {
+    const std::filesystem::path directory = argc > 1 ? argv[1] : "bench/corpus";
+    std::vector<bench::CorpusPacket> corpus;
+    try {
+        corpus = bench::loadCorpus(directory);
+        for (const bench::CorpusPacket &entry : corpus) {
+            bench::walk(dns::parseResponsePacket(entry.packet));
+        }
+    } catch (const std::exception &err) {
+        std::cerr << directory.string() << ": " << err.what() << std::endl;
+        return -1;
+    }
+    if (corpus.empty()) {
+        std::cerr << "No .bin packets in " << directory.string() << std::endl;
+        return -1;
+    }
+    bench::Runner runner(argc > 2 ? argv[2] : "");
+    output::TextSink sink(open("/dev/null", O_WRONLY | O_CLOEXEC));
+    output::JsonSink jsonSink(open("/dev/null", O_WRONLY | O_CLOEXEC));
+    // per-message arena: everything of one operation comes from the buffer, released before the next one
+    std::array<std::byte, 4096> arenaBuffer;
+    std::pmr::monotonic_buffer_resource arena(arenaBuffer.data(), arenaBuffer.size(), std::pmr::null_memory_resource());
+
+    for (const bench::CorpusPacket &entry : corpus) {
+        const dns::Packet &packet = entry.packet;
+        runner.run("parseResponsePacket/" + entry.name, [&]() {
+            bench::keep(dns::parseResponsePacket(packet));
+        });
+        runner.run("parseResponsePacket+walk/" + entry.name, [&]() {
+            bench::keep(bench::walk(dns::parseResponsePacket(packet)));
+        });
+        const size_t offset = bench::deepestNameOffset(packet);
+        runner.run("parseDomainNameFromPacket/" + entry.name, [&]() {
+            bench::keep(dns::parsing::utils::parseDomainNameFromPacket(packet, offset));
+        });
+        runner.run("parseDomainNameFromPacket/arena/" + entry.name, [&]() {
+            bench::keep(dns::parsing::utils::parseDomainNameFromPacket(packet, offset, &arena));
+            arena.release();
+        });
+        runner.run("TextSink/" + entry.name, [&]() {
+            sink.write(dns::parseResponsePacket(packet));
+        });
+        runner.run("JsonSink/" + entry.name, [&]() {
+            jsonSink.write(dns::parseResponsePacket(packet));
+        });
+        const dns::Packet frame = bench::udpFrame(packet);
+        pcap::Decoder decoder(DEFAULT_DNS_PORT, nullptr);
+        runner.run("pcap::Decoder/" + entry.name, [&]() {
+            decoder.decode({frame, LINKTYPE_ETHERNET});
+        });
+    }
+
+    const std::string shortName = "www.fit.vut.cz";
+    const std::string longName = "a-rather-long-label-for-a-benchmark.subdomain.department.example-university.edu";
+    runner.run("encodeDNSName/short", [&]() {
+        bench::keep(dns::constructorUtils::encodeDNSName(shortName));
+    });
+    runner.run("encodeDNSName/long", [&]() {
+        bench::keep(dns::constructorUtils::encodeDNSName(longName));
+    });
+    runner.run("encodeDNSName/long-arena", [&]() {
+        bench::keep(dns::constructorUtils::encodeDNSName(longName, &arena));
+        arena.release();
+    });
+    std::string mixedCase = "A-Rather-Long-Label-For-A-Benchmark.SubDomain.Department.Example-University.EDU";
+    runner.run("names::toLower/long", [&]() {
+        std::string copy = mixedCase;
+        names::toLower(copy);
+        bench::keep(copy);
+    });
+    runner.run("names::equalsIgnoreCase/long", [&]() {
+        bench::keep(names::equalsIgnoreCase(mixedCase.data(), longName.data(), longName.size()));
+    });
+    runner.run("names::hashIgnoreCase/long", [&]() {
+        bench::keep(names::hashIgnoreCase(mixedCase.data(), mixedCase.size()));
+    });
+
+    const std::string ipv4 = "147.229.9.26";
+    const std::string ipv6 = "2001:67c:1220:809::93e5:91a";
+    runner.run("reverseIPv4", [&]() {
+        bench::keep(dns::constructorUtils::reverseIPv4(ipv4));
+    });
+    runner.run("reverseIPv6", [&]() {
+        bench::keep(dns::constructorUtils::reverseIPv6(ipv6));
+    });
+    dns::Question reused;
+    runner.run("constructQuestion/reverse-ipv6-reused", [&]() {
+        dns::constructQuestion(reused, ipv6, true, true);
+        bench::keep(reused);
+    });
+    // ranges large enough never to run out, every name is patched from the previous one
+    sweep::SweepQuerySource sweepIpv4(sweep::parseRange("0.0.0.0/0"));
+    runner.run("SweepQuerySource/ipv4", [&]() {
+        bench::keep(sweepIpv4.next(reused));
+    });
+    sweep::SweepQuerySource sweepIpv6(sweep::parseRange("2001:67c:1220:809::/64"));
+    runner.run("SweepQuerySource/ipv6", [&]() {
+        bench::keep(sweepIpv6.next(reused));
+    });
+
+    const dns::Question question{std::pmr::string(shortName), TYPE_A, CLASS_IN};
+    runner.run("constructQueryPacket", [&]() {
+        bench::keep(dns::constructQueryPacket(0x1234, FLAG_RD, question));
+    });
+    runner.run("constructQueryPacket/edns", [&]() {
+        bench::keep(dns::constructQueryPacket(0x1234, FLAG_RD, question, 1232));
+    });
+    runner.run("constructQueryPacket/arena", [&]() {
+        bench::keep(dns::constructQueryPacket(0x1234, FLAG_RD, question, 1232, &arena));
+        arena.release();
+    });
+    dns::Packet reusedPacket;
+    runner.run("writeQueryPacket/reused", [&]() {
+        dns::writeQueryPacket(reusedPacket, 0x1234, FLAG_RD, question, 1232);
+        bench::keep(reusedPacket);
+    });
+    DNSConfiguration args{};
+    args.servers.push_back("127.0.0.1");
+    args.address = ipv6;
+    args.reverseQuery = true;
+    args.queryTypeAAAA = true;
+    runner.run("constructQueryPacket/args-reverse-ipv6", [&]() {
+        bench::keep(dns::constructQueryPacket(args));
+    });
+
+    // loopback round trips, setting up the socket for every query against reusing an endpoint
+    bench::EchoServer echo;
+    const dns::Packet query = dns::constructQueryPacket(0x1234, FLAG_RD, question);
+    runner.run("udp::sendQuery/loopback", [&]() {
+        bench::keep(udp::sendQuery("127.0.0.1", echo.getPort(), query, 1));
+    });
+    udp::ServerEndpoint endpoint("127.0.0.1", echo.getPort());
+    runner.run("udp::sendQuery/loopback-endpoint", [&]() {
+        bench::keep(udp::sendQuery(endpoint, query, 1));
+    });
+    return 0;
+}
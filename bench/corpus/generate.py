@@ -0,0 +1,191 @@
+# Author: Aliaksandr Skuratovich (xskura01)
+#
+# Writes the response packets the benchmarks run against. They are built to match the layout of
+# answers seen from public resolvers: compression like a real server uses it, typical TTLs and
+# record counts, EDNS0 OPT records, and one pathological compression chain.
+#
+# Usage: python3 generate.py [output directory]
+
+import os
+import struct
+import sys
+
+TYPE_A, TYPE_NS, TYPE_CNAME, TYPE_SOA, TYPE_PTR, TYPE_MX, TYPE_TXT, TYPE_AAAA, TYPE_OPT = \
+    1, 2, 5, 6, 12, 15, 16, 28, 41
+TYPE_RRSIG, TYPE_HTTPS = 46, 65
+CLASS_IN = 1
+QUESTION_OFFSET = 12
+
+
+def name(text):
+    out = b''
+    for label in text.rstrip('.').split('.'):
+        if label:
+            out += bytes([len(label)]) + label.encode()
+    return out + b'\x00'
+
+
+def pointer(offset):
+    return struct.pack('>H', 0xC000 | offset)
+
+
+def record(owner, rtype, ttl, rdata, rclass=CLASS_IN):
+    return owner + struct.pack('>HHIH', rtype, rclass, ttl, len(rdata)) + rdata
+
+
+def opt(payload=1232, dnssec_ok=False):
+    return record(b'\x00', TYPE_OPT, 0x8000 if dnssec_ok else 0, b'', rclass=payload)
+
+
+class Message:
+    def __init__(self, qname, qtype, flags=0x8180, qid=0x1234):
+        self.header = [qid, flags, 1, 0, 0, 0]
+        self.body = name(qname) + struct.pack('>HH', qtype, CLASS_IN)
+
+    def offset(self):
+        return 12 + len(self.body)
+
+    def add(self, section, data):
+        self.header[3 + section] += 1
+        self.body += data
+
+    def packet(self):
+        return struct.pack('>HHHHHH', *self.header) + self.body
+
+
+def a_records():
+    msg = Message('www.google.com', TYPE_A)
+    for i in range(6):
+        msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_A, 300, bytes([142, 250, 74, 100 + i])))
+    msg.add(2, opt())
+    return msg.packet()
+
+
+def aaaa_records():
+    msg = Message('www.google.com', TYPE_AAAA)
+    for i in range(4):
+        address = bytes([0x2a, 0x00, 0x14, 0x50, 0x40, 0x01, 0x08, 0x1c] + [0] * 7 + [0x60 + i])
+        msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_AAAA, 300, address))
+    msg.add(2, opt())
+    return msg.packet()
+
+
+def cname_chain():
+    msg = Message('www.microsoft.com', TYPE_A)
+    targets = ['www.microsoft.com-c-3.edgekey.net', 'www.microsoft.com-c-3.edgekey.net.globalredir.akadns.net',
+               'e13678.dscb.akamaiedge.net']
+    owner = pointer(QUESTION_OFFSET)
+    for target in targets:
+        rdata_offset = msg.offset() + len(owner) + 10
+        msg.add(0, record(owner, TYPE_CNAME, 3600, name(target)))
+        owner = pointer(rdata_offset)
+    msg.add(0, record(owner, TYPE_A, 20, bytes([23, 45, 229, 175])))
+    msg.add(2, opt())
+    return msg.packet()
+
+
+def mx_records():
+    msg = Message('gmail.com', TYPE_MX)
+    # the first exchange is written out, the others point into it
+    first = msg.offset() + 2 + 10 + 2
+    msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_MX, 3600,
+                      struct.pack('>H', 5) + name('gmail-smtp-in.l.google.com')))
+    for i in range(1, 5):
+        rdata = struct.pack('>H', i * 10) + name('alt%d' % i)[:-1] + pointer(first)
+        msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_MX, 3600, rdata))
+    msg.add(2, opt())
+    return msg.packet()
+
+
+def txt_records():
+    msg = Message('google.com', TYPE_TXT)
+    for text in [b'v=spf1 include:_spf.google.com ~all',
+                 b'google-site-verification=wD8N7i1JTNTkezJ49swvWW48f8_9xveREV4oB-0Hf5o',
+                 b'docusign=05958488-4752-4ef2-95eb-aa7ba8a3bd0e',
+                 b'MS=E4A68B9AB2BB9670BCE15412F62916164C0B20BB',
+                 b'apple-domain-verification=30afIBcvSuDV2PLX',
+                 b'facebook-domain-verification=22rm551cu4k0ab0bxsw536tlds4h95']:
+        msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_TXT, 3600, bytes([len(text)]) + text))
+    msg.add(2, opt())
+    return msg.packet()
+
+
+def ptr_record():
+    msg = Message('8.8.8.8.in-addr.arpa', TYPE_PTR)
+    msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_PTR, 21600, name('dns.google')))
+    return msg.packet()
+
+
+def nxdomain():
+    msg = Message('does-not-exist.example.com', TYPE_A, flags=0x8183)
+    zone = QUESTION_OFFSET + len('does-not-exist') + 1
+    rdata = name('ns.icann.org') + name('noc.dns.icann.org') + struct.pack('>IIIII', 2023120601, 7200, 3600,
+                                                                           1209600, 3600)
+    msg.add(1, record(pointer(zone), TYPE_SOA, 3600, rdata))
+    msg.add(2, opt())
+    return msg.packet()
+
+
+def referral_with_glue():
+    msg = Message('www.example.com', TYPE_A, flags=0x8000)
+    tld = QUESTION_OFFSET + len(name('www.example')) - 1
+    servers = []
+    for letter in 'abcdefghijklm':
+        rdata_offset = msg.offset() + 2 + 10
+        msg.add(1, record(pointer(tld), TYPE_NS, 172800, bytes([1]) + letter.encode() + name('gtld-servers.net')))
+        servers.append(rdata_offset)
+    for i, offset in enumerate(servers):
+        msg.add(2, record(pointer(offset), TYPE_A, 172800, bytes([192, 5, 6, 30 + i])))
+        msg.add(2, record(pointer(offset), TYPE_AAAA, 172800, bytes([0x20, 0x01, 0x05, 0x03] + [0] * 11 + [i])))
+    msg.add(2, opt(dnssec_ok=True))
+    return msg.packet()
+
+
+def https_signed():
+    # an HTTPS record with the usual parameters and its signature, as answered with the DO bit set
+    msg = Message('cloudflare.com', TYPE_HTTPS)
+    params = struct.pack('>HH', 1, 6) + b'\x02h3\x02h2'
+    params += struct.pack('>HH', 4, 8) + bytes([104, 16, 132, 229, 104, 16, 133, 229])
+    params += struct.pack('>HH', 6, 32) + bytes([0x26, 0x06, 0x47, 0x00] + [0] * 10 + [0x68, 0x10]) * 2
+    msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_HTTPS, 300, struct.pack('>H', 1) + b'\x00' + params))
+    rdata = struct.pack('>HBBIIIH', TYPE_HTTPS, 13, 2, 300, 1700086400, 1700000000, 34505)
+    rdata += name('cloudflare.com') + bytes(range(64))
+    msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_RRSIG, 300, rdata))
+    msg.add(2, opt(dnssec_ok=True))
+    return msg.packet()
+
+
+def deep_compression():
+    # the owner of every additional record is one label and a pointer to the owner of the previous one,
+    # the CNAME target points at the last owner: 100 hops to decode a single name
+    msg = Message('deep.example', TYPE_A)
+    target = msg.offset() + 2 + 10
+    msg.add(0, record(pointer(QUESTION_OFFSET), TYPE_CNAME, 60, pointer(0)))
+    owners = []
+    for i in range(100):
+        owners.append(msg.offset())
+        owner = b'\x01a' + (pointer(owners[-2]) if i else b'\x00')
+        msg.add(2, record(owner, TYPE_A, 60, bytes([10, 0, i // 256, i % 256])))
+    packet = bytearray(msg.packet())
+    packet[target:target + 2] = pointer(owners[-1])
+    return bytes(packet)
+
+
+CORPUS = {
+    'a.bin': a_records,
+    'aaaa.bin': aaaa_records,
+    'cname_chain.bin': cname_chain,
+    'mx.bin': mx_records,
+    'txt.bin': txt_records,
+    'ptr.bin': ptr_record,
+    'nxdomain.bin': nxdomain,
+    'referral.bin': referral_with_glue,
+    'deep_compression.bin': deep_compression,
+    'https_signed.bin': https_signed,
+}
+
+if __name__ == '__main__':
+    directory = sys.argv[1] if len(sys.argv) > 1 else os.path.dirname(os.path.abspath(__file__))
+    for filename, build in CORPUS.items():
+        with open(os.path.join(directory, filename), 'wb') as file:
+            file.write(build())
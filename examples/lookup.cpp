@@ -0,0 +1,66 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+//
+// Looks up the A and AAAA records of every name on the command line through libdnsclient: the A records of
+// all names at once with resolveMany, the AAAA records with one coroutine per name.
+//
+// Usage: dnsclient_example server port name...
+
+#include "../src/dnsclient.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+void print(const std::string &name, const char *type, const dnsclient::Result &result) {
+    std::cout << name << " " << type << ": ";
+    if (result.error) {
+        std::cout << result.error.message() << std::endl;
+        return;
+    }
+    std::cout << "rcode " << static_cast<int>(result.rcode);
+    for (const dnsclient::Record &record : result.answers) {
+        std::cout << ", " << record.data;
+    }
+    std::cout << std::endl;
+}
+
+dnsclient::Task<> lookupAddresses(dnsclient::Resolver &resolver, std::vector<std::string> names) {
+    std::vector<dnsclient::Question> questions;
+    for (const std::string &name : names) {
+        questions.push_back({name, dnsclient::types::A});
+    }
+    std::vector<dnsclient::Result> results = co_await resolver.resolveMany(questions);
+    for (size_t i = 0; i < names.size(); ++i) {
+        print(names[i], "A", results[i]);
+    }
+}
+
+dnsclient::Task<> lookupIpv6Address(dnsclient::Resolver &resolver, std::string name) {
+    dnsclient::Result result = co_await resolver.query(name, dnsclient::types::AAAA);
+    print(name, "AAAA", result);
+}
+
+int main(int argc, const char **argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " server port name..." << std::endl;
+        return -1;
+    }
+    const std::vector<std::string> names(argv + 3, argv + argc);
+    try {
+        dnsclient::Resolver resolver({.servers = {argv[1]}, .port = static_cast<uint16_t>(std::stoi(argv[2]))});
+        std::vector<dnsclient::Task<>> tasks;
+        tasks.push_back(lookupAddresses(resolver, names));
+        for (const std::string &name : names) {
+            tasks.push_back(lookupIpv6Address(resolver, name));
+        }
+        resolver.run();
+        for (dnsclient::Task<> &task : tasks) {
+            task.get();
+        }
+    } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -3,8 +3,11 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <optional>
 #include <cstdint>
+#include <cctype>
+#include <cstring>
 #include <getopt.h>
 #include <system_error>
 #include <iostream>
@@ -16,18 +19,172 @@ void ThrowUsageMessage(const std::string &description) {
     auto retStr = (
         description.length() ? description + "\n\n" : ""
     ) + (
-        "Usage: dns [-r] [-x] [-6] -s server [-p port] address\n"
+        "Usage: dns [-r] [-x] [-6] [-t] [-e size] [-c cache] [-f format] -s server[,server...] [-p port] [--race] address\n"
+        "       dns [-r] [-x] [-6] [-t] [-e size] [-c cache] [-f format] -s server[,server...] [-p port] [--race] (-b file | --sweep cidr) [-w window] [-u] [-j workers [-a]]\n"
+        "       dns [-r] [-x] [-6] [-e size] -s server [-p port] --load file [--qps rate] [--duration seconds] [-w window] [-u]\n"
+        "       dns -i [-x] [-6] [-t] [-e size] [-c cache] [-f format] [-s root[,root...]] [-p port] (address | -b file | --sweep cidr)\n"
+        "       dns [-r] [-x] [-6] [-e size] -s server [-p port] -c cache --watch file [--refresh-ahead percent] [--duration seconds] [-w window] [-u]\n"
+        "       dns [-r] [-e size] -s server [-p port] --listen [address:]port [--duration seconds] [-u]\n"
+        "       dns [-f format] -s server [-p port] (--axfr zone | --ixfr zone:serial)\n"
+        "       dns --pcap file [--summary] [-f format] [-p port] [-j threads [-a]]\n"
         "-r: Recursion Desired\n"
+        "-i: iterative resolution from the root servers, -s replaces the built-in root hints\n"
         "-x: Reversed query\n"
         "-6: AAAA query\n"
-        "-s: DNS server name or IP address\n"
-        "-p port: port number to send a query, default is 53\n"
+        "-t: send queries over TCP, by default only truncated UDP responses are retried over TCP\n"
+        "-s: DNS server name or IP address, or a comma separated list to pick the fastest from\n"
+        "-p port: port number to send a query, default is 53, in pcap mode the port of the DNS traffic to decode\n"
+        "-b file: batch mode, read \"name [type]\" lines from file (\"-\" for stdin)\n"
+        "--sweep cidr: batch of PTR queries for every address of a range, e.g. 192.0.2.0/24 or 2001:db8::/112\n"
+        "-w window: number of batch queries in flight, default is 100, unlimited in load mode\n"
+        "-u: send batch queries through io_uring, falls back to epoll when the kernel lacks support\n"
+        "-j workers: spread batch queries over this many threads, each with its own sockets, or parse a capture on them\n"
+        "-a: pin each worker thread to its own CPU core\n"
+        "-e size: use EDNS0 and advertise this UDP payload size (512-65535), e.g. 1232 or 4096\n"
+        "-c cache: answer from and store responses into a cache file shared between runs\n"
+        "-f format: output format, text (default), json or binary\n"
+        "--load file: replay \"name [type]\" lines from file against the server and report latency percentiles\n"
+        "--qps rate: send load queries at this many queries per second, default is as fast as possible\n"
+        "--duration seconds: replay the load file in a loop for this long, default is a single pass, or stop watching after it\n"
+        "--watch file: keep the answers of \"name [type]\" lines from file fresh in the cache (-c) until SIGINT or SIGTERM\n"
+        "--listen [address:]port: forward queries received on this UDP and TCP port (on 127.0.0.1 by default) to the server\n"
+        "--axfr zone: transfer the whole zone over TCP, its records are written as they arrive\n"
+        "--ixfr zone:serial: transfer the changes to the zone since this serial, or the whole zone if the server sends it\n"
+        "--refresh-ahead percent: refresh watched answers when this share of their TTL is left (1-50), default is 10\n"
+        "--race: also send a slow query to a second server, of the other address family if there is one\n"
+        "--pcap file: decode the DNS messages of a pcap or pcapng capture file instead of sending queries\n"
+        "--summary: print counts of the captured messages by kind, RCODE and QTYPE instead of the messages\n"
+        "--stats format: statistics dump at exit and on SIGUSR1, text (default) or prometheus, needs make stats\n"
     );
     throw std::system_error(errno, std::generic_category(), retStr);
 }
 
 namespace argparser {
 
+    // values returned by getopt_long for options without a short form
+    enum LONG_OPTION {
+        LONG_OPTION_LOAD = 256,
+        LONG_OPTION_QPS,
+        LONG_OPTION_DURATION,
+        LONG_OPTION_STATS,
+        LONG_OPTION_RACE,
+        LONG_OPTION_SWEEP,
+        LONG_OPTION_PCAP,
+        LONG_OPTION_SUMMARY,
+        LONG_OPTION_WATCH,
+        LONG_OPTION_REFRESH_AHEAD,
+        LONG_OPTION_LISTEN,
+        LONG_OPTION_AXFR,
+        LONG_OPTION_IXFR
+    };
+
+    const option LONG_OPTIONS[] = {
+        {"load", required_argument, nullptr, LONG_OPTION_LOAD},
+        {"qps", required_argument, nullptr, LONG_OPTION_QPS},
+        {"duration", required_argument, nullptr, LONG_OPTION_DURATION},
+        {"stats", required_argument, nullptr, LONG_OPTION_STATS},
+        {"race", no_argument, nullptr, LONG_OPTION_RACE},
+        {"sweep", required_argument, nullptr, LONG_OPTION_SWEEP},
+        {"pcap", required_argument, nullptr, LONG_OPTION_PCAP},
+        {"summary", no_argument, nullptr, LONG_OPTION_SUMMARY},
+        {"watch", required_argument, nullptr, LONG_OPTION_WATCH},
+        {"refresh-ahead", required_argument, nullptr, LONG_OPTION_REFRESH_AHEAD},
+        {"listen", required_argument, nullptr, LONG_OPTION_LISTEN},
+        {"axfr", required_argument, nullptr, LONG_OPTION_AXFR},
+        {"ixfr", required_argument, nullptr, LONG_OPTION_IXFR},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    size_t parseCount(const char *value, const std::string &option) {
+        try {
+            size_t consumed = 0;
+            long long number = std::stoll(value, &consumed);
+            if (consumed == std::strlen(value) && number > 0) {
+                return static_cast<size_t>(number);
+            }
+        } catch (const std::logic_error &) {
+        }
+        ThrowUsageMessage(option + " must be a positive number");
+        return 0;
+    }
+
+    OUTPUT_FORMAT parseOutputFormat(const std::string &format) {
+        if (format == "text") {
+            return OUTPUT_FORMAT_TEXT;
+        }
+        if (format == "json") {
+            return OUTPUT_FORMAT_JSON;
+        }
+        if (format != "binary") {
+            ThrowUsageMessage("Format (-f) must be one of text, json, binary");
+        }
+        return OUTPUT_FORMAT_BINARY;
+    }
+
+    STATS_FORMAT parseStatsFormat(const std::string &format) {
+#ifndef STATS
+        ThrowUsageMessage("Statistics (--stats) require a build with statistics enabled (make stats)");
+#endif
+        if (format == "prometheus") {
+            return STATS_FORMAT_PROMETHEUS;
+        }
+        if (format != "text") {
+            ThrowUsageMessage("Statistics format (--stats) must be one of text, prometheus");
+        }
+        return STATS_FORMAT_TEXT;
+    }
+
+    std::vector<std::string> parseServers(const std::string &list) {
+        std::vector<std::string> servers;
+        size_t start = 0;
+        while (true) {
+            const size_t end = list.find(',', start);
+            servers.push_back(list.substr(start, end == std::string::npos ? std::string::npos : end - start));
+            if (servers.back().empty()) {
+                ThrowUsageMessage("Server (-s) list must not contain empty names");
+            }
+            if (end == std::string::npos) {
+                return servers;
+            }
+            start = end + 1;
+        }
+    }
+
+    // "[address:]port", an IPv6 address in brackets
+    void parseListen(const std::string &value, DNSConfiguration &args) {
+        const size_t colon = value.rfind(':');
+        std::string address = colon == std::string::npos ? "127.0.0.1" : value.substr(0, colon);
+        if (address.size() >= 2 && address.front() == '[' && address.back() == ']') {
+            address = address.substr(1, address.size() - 2);
+        }
+        const std::string port = colon == std::string::npos ? value : value.substr(colon + 1);
+        const size_t number = parseCount(port.c_str(), "Listen (--listen) port");
+        if (address.empty() || number > UINT16_MAX) {
+            ThrowUsageMessage("Listen (--listen) must be a port between 1 and 65535, optionally preceded by \"address:\"");
+        }
+        args.listenAddress = address;
+        args.listenPort = static_cast<uint16_t>(number);
+    }
+
+    // "zone:serial", the serial of the version of the zone the client has
+    void parseIxfr(const std::string &value, DNSConfiguration &args) {
+        const size_t colon = value.rfind(':');
+        if (colon != std::string::npos && colon > 0 && colon + 1 < value.size()
+            && std::isdigit(static_cast<unsigned char>(value[colon + 1]))) {
+            try {
+                size_t consumed = 0;
+                unsigned long long serial = std::stoull(value.substr(colon + 1), &consumed);
+                if (colon + 1 + consumed == value.size() && serial <= UINT32_MAX) {
+                    args.transferZone = value.substr(0, colon);
+                    args.transferSerial = static_cast<uint32_t>(serial);
+                    return;
+                }
+            } catch (const std::logic_error &) {
+            }
+        }
+        ThrowUsageMessage("IXFR (--ixfr) must be \"zone:serial\" with a serial between 0 and 4294967295");
+    }
+
     DNSConfiguration parseArguments(int argc, const char **argv) {
         if (argc == 1) {
             ThrowUsageMessage("");
@@ -36,7 +193,7 @@ namespace argparser {
         DNSConfiguration args{};
         int option;
         int currentIdx = 0;
-        while ((option = getopt(argc, (char *const *) (argv), "rx6s:p:")) != -1) {
+        while ((option = getopt_long(argc, (char *const *) (argv), "rix6tuas:p:b:w:j:f:e:c:", LONG_OPTIONS, nullptr)) != -1) {
             currentIdx += 1;
             switch (option) {
                 case 'r':
@@ -45,6 +202,12 @@ namespace argparser {
                     }
                     args.recursionRequested = true;
                     break;
+                case 'i':
+                    if (args.iterative) {
+                        ThrowUsageMessage("Iterative (-i) flag can be specified only once");
+                    }
+                    args.iterative = true;
+                    break;
                 case 'x':
                     if (args.reverseQuery) {
                         ThrowUsageMessage("Reversed query (-x) flag can be specified only once");
@@ -57,11 +220,29 @@ namespace argparser {
                     }
                     args.queryTypeAAAA = true;
                     break;
+                case 't':
+                    if (args.tcpOnly) {
+                        ThrowUsageMessage("TCP (-t) flag can be specified only once");
+                    }
+                    args.tcpOnly = true;
+                    break;
+                case 'u':
+                    if (args.ioUring) {
+                        ThrowUsageMessage("io_uring (-u) flag can be specified only once");
+                    }
+                    args.ioUring = true;
+                    break;
+                case 'a':
+                    if (args.pinWorkers) {
+                        ThrowUsageMessage("Pin workers (-a) flag can be specified only once");
+                    }
+                    args.pinWorkers = true;
+                    break;
                 case 's':
-                    if (!args.server.empty()) {
+                    if (!args.servers.empty()) {
                         ThrowUsageMessage("Server (-s) parameter can be specified only once");
                     }
-                    args.server = optarg;
+                    args.servers = parseServers(optarg);
                     break;
                 case 'p':
                     if (args.port) {
@@ -69,6 +250,130 @@ namespace argparser {
                     }
                     args.port = static_cast<uint16_t>(std::stoi(optarg));
                     break;
+                case 'b':
+                    if (args.batchFile) {
+                        ThrowUsageMessage("Batch file (-b) parameter can be specified only once");
+                    }
+                    args.batchFile = optarg;
+                    break;
+                case 'w':
+                    if (args.window) {
+                        ThrowUsageMessage("Window (-w) parameter can be specified only once");
+                    }
+                    args.window = parseCount(optarg, "Window (-w)");
+                    break;
+                case 'j':
+                    if (args.workers) {
+                        ThrowUsageMessage("Workers (-j) parameter can be specified only once");
+                    }
+                    args.workers = parseCount(optarg, "Workers (-j)");
+                    break;
+                case 'e': {
+                    if (args.ednsPayloadSize) {
+                        ThrowUsageMessage("EDNS0 payload size (-e) parameter can be specified only once");
+                    }
+                    size_t size = parseCount(optarg, "EDNS0 payload size (-e)");
+                    if (size < EDNS_MIN_PAYLOAD_SIZE || size > UINT16_MAX) {
+                        ThrowUsageMessage("EDNS0 payload size (-e) must be between 512 and 65535");
+                    }
+                    args.ednsPayloadSize = static_cast<uint16_t>(size);
+                    break;
+                }
+                case 'c':
+                    if (args.cacheFile) {
+                        ThrowUsageMessage("Cache (-c) parameter can be specified only once");
+                    }
+                    args.cacheFile = optarg;
+                    break;
+                case 'f':
+                    if (args.outputFormat) {
+                        ThrowUsageMessage("Format (-f) parameter can be specified only once");
+                    }
+                    args.outputFormat = parseOutputFormat(optarg);
+                    break;
+                case LONG_OPTION_LOAD:
+                    if (args.loadFile) {
+                        ThrowUsageMessage("Load file (--load) parameter can be specified only once");
+                    }
+                    args.loadFile = optarg;
+                    break;
+                case LONG_OPTION_QPS:
+                    if (args.qps) {
+                        ThrowUsageMessage("QPS (--qps) parameter can be specified only once");
+                    }
+                    args.qps = parseCount(optarg, "QPS (--qps)");
+                    break;
+                case LONG_OPTION_DURATION:
+                    if (args.durationSec) {
+                        ThrowUsageMessage("Duration (--duration) parameter can be specified only once");
+                    }
+                    args.durationSec = parseCount(optarg, "Duration (--duration)");
+                    break;
+                case LONG_OPTION_STATS:
+                    if (args.statsFormat) {
+                        ThrowUsageMessage("Statistics (--stats) parameter can be specified only once");
+                    }
+                    args.statsFormat = parseStatsFormat(optarg);
+                    break;
+                case LONG_OPTION_RACE:
+                    if (args.race) {
+                        ThrowUsageMessage("Race (--race) flag can be specified only once");
+                    }
+                    args.race = true;
+                    break;
+                case LONG_OPTION_SWEEP:
+                    if (args.sweepRange) {
+                        ThrowUsageMessage("Sweep (--sweep) parameter can be specified only once");
+                    }
+                    args.sweepRange = optarg;
+                    break;
+                case LONG_OPTION_PCAP:
+                    if (args.pcapFile) {
+                        ThrowUsageMessage("Capture file (--pcap) parameter can be specified only once");
+                    }
+                    args.pcapFile = optarg;
+                    break;
+                case LONG_OPTION_SUMMARY:
+                    if (args.pcapSummary) {
+                        ThrowUsageMessage("Summary (--summary) flag can be specified only once");
+                    }
+                    args.pcapSummary = true;
+                    break;
+                case LONG_OPTION_WATCH:
+                    if (args.watchFile) {
+                        ThrowUsageMessage("Watch file (--watch) parameter can be specified only once");
+                    }
+                    args.watchFile = optarg;
+                    break;
+                case LONG_OPTION_REFRESH_AHEAD: {
+                    if (args.refreshAheadPercent) {
+                        ThrowUsageMessage("Refresh ahead (--refresh-ahead) parameter can be specified only once");
+                    }
+                    size_t percent = parseCount(optarg, "Refresh ahead (--refresh-ahead)");
+                    if (percent > REFRESH_MAX_AHEAD_PERCENT) {
+                        ThrowUsageMessage("Refresh ahead (--refresh-ahead) must be between 1 and 50");
+                    }
+                    args.refreshAheadPercent = percent;
+                    break;
+                }
+                case LONG_OPTION_LISTEN:
+                    if (args.listenAddress) {
+                        ThrowUsageMessage("Listen (--listen) parameter can be specified only once");
+                    }
+                    parseListen(optarg, args);
+                    break;
+                case LONG_OPTION_AXFR:
+                    if (args.transferZone) {
+                        ThrowUsageMessage("Zone transfer (--axfr or --ixfr) parameter can be specified only once");
+                    }
+                    args.transferZone = optarg;
+                    break;
+                case LONG_OPTION_IXFR:
+                    if (args.transferZone) {
+                        ThrowUsageMessage("Zone transfer (--axfr or --ixfr) parameter can be specified only once");
+                    }
+                    parseIxfr(optarg, args);
+                    break;
                 case '?':
                 default:
                     ThrowUsageMessage("unknown option \"" + std::string(argv[currentIdx]) + "\"");
@@ -76,16 +381,140 @@ namespace argparser {
             }
         }
 
-        if (args.server.empty()) {
+        if (args.pcapSummary && !args.pcapFile) {
+            ThrowUsageMessage("Summary (--summary) flag requires a capture file (--pcap)");
+        }
+
+        if (args.pcapFile) {
+            if (args.recursionRequested || args.iterative || args.reverseQuery || args.queryTypeAAAA || args.tcpOnly
+                || args.ioUring || args.race || !args.servers.empty() || args.batchFile || args.sweepRange
+                || args.window || args.ednsPayloadSize || args.cacheFile || args.loadFile || args.watchFile
+                || args.listenAddress || args.transferZone || args.qps || args.durationSec
+                || args.refreshAheadPercent) {
+                ThrowUsageMessage("Capture file (--pcap) can only be combined with summary (--summary), format (-f), "
+                                  "port (-p), workers (-j) and pin workers (-a)");
+            }
+            if (optind != argc) {
+                ThrowUsageMessage("Address cannot be combined with a capture file (--pcap)");
+            }
+            if (args.pinWorkers && !args.workers) {
+                ThrowUsageMessage("Pin workers (-a) flag requires workers (-j)");
+            }
+            return args;
+        }
+
+        if (args.servers.empty() && !args.iterative) {
             ThrowUsageMessage("Server -s parameter must be specified");
         }
 
-        if (optind == argc - 1) {
+        if (args.iterative && (args.recursionRequested || args.loadFile || args.window || args.ioUring
+                               || args.workers || args.race)) {
+            ThrowUsageMessage("Iterative mode (-i) cannot be combined with recursion (-r), load mode (--load), "
+                              "window (-w), io_uring (-u), workers (-j) or race (--race)");
+        }
+
+        if (args.race && args.servers.size() < 2) {
+            ThrowUsageMessage("Race (--race) flag requires at least two servers (-s)");
+        }
+
+        if (args.loadFile && (args.servers.size() > 1 || args.race)) {
+            ThrowUsageMessage("Load mode (--load) takes a single server (-s) and no race (--race)");
+        }
+
+        if (args.refreshAheadPercent && !args.watchFile) {
+            ThrowUsageMessage("Refresh ahead (--refresh-ahead) parameter requires watch mode (--watch)");
+        }
+
+        if (args.transferZone) {
+            if (args.recursionRequested || args.iterative || args.reverseQuery || args.queryTypeAAAA || args.tcpOnly
+                || args.ioUring || args.race || args.workers || args.window || args.ednsPayloadSize || args.cacheFile
+                || args.batchFile || args.sweepRange || args.loadFile || args.watchFile || args.listenAddress
+                || args.qps || args.durationSec || args.servers.size() > 1) {
+                ThrowUsageMessage("Zone transfer (--axfr or --ixfr) takes a single server (-s) and only combines with "
+                                  "port (-p) and format (-f)");
+            }
+            if (optind != argc) {
+                ThrowUsageMessage("Address cannot be combined with a zone transfer (--axfr or --ixfr)");
+            }
+            return args;
+        }
+
+        if (args.listenAddress) {
+            if (args.iterative || args.batchFile || args.sweepRange || args.loadFile || args.watchFile || args.reverseQuery
+                || args.queryTypeAAAA || args.tcpOnly || args.race || args.workers || args.window || args.outputFormat
+                || args.cacheFile || args.qps || args.servers.size() > 1) {
+                ThrowUsageMessage("Listen (--listen) takes a single server (-s) and only combines with recursion (-r), "
+                                  "EDNS0 (-e), port (-p), duration (--duration) and io_uring (-u)");
+            }
+            if (optind != argc) {
+                ThrowUsageMessage("Address cannot be combined with listen (--listen)");
+            }
+            return args;
+        }
+
+        if (args.watchFile) {
+            if (args.iterative || args.batchFile || args.sweepRange || args.loadFile || args.tcpOnly || args.race
+                || args.workers || args.outputFormat || args.qps || args.servers.size() > 1) {
+                ThrowUsageMessage("Watch mode (--watch) takes a single server (-s) and cannot be combined with iterative (-i), "
+                                  "batch (-b), sweep (--sweep) or load (--load) mode, TCP (-t), race (--race), workers (-j), "
+                                  "format (-f) or QPS (--qps)");
+            }
+            if (!args.cacheFile) {
+                ThrowUsageMessage("Watch mode (--watch) requires a cache file (-c) to keep the answers in");
+            }
+            if (optind != argc) {
+                ThrowUsageMessage("Address cannot be combined with watch mode (--watch)");
+            }
+            return args;
+        }
+
+        if (args.batchFile && args.loadFile) {
+            ThrowUsageMessage("Batch mode (-b) cannot be combined with load mode (--load)");
+        }
+
+        if (args.sweepRange && (args.batchFile || args.loadFile || args.reverseQuery || args.queryTypeAAAA)) {
+            ThrowUsageMessage("Sweep (--sweep) cannot be combined with batch (-b) or load (--load) mode, "
+                              "reversed (-x) or AAAA (-6) queries");
+        }
+
+        if (args.batchFile || args.sweepRange) {
+            if (optind != argc) {
+                ThrowUsageMessage("Address cannot be combined with batch mode (-b) or sweep (--sweep)");
+            }
+        } else if (args.loadFile) {
+            if (optind != argc) {
+                ThrowUsageMessage("Address cannot be combined with load mode (--load)");
+            }
+        } else if (optind == argc - 1) {
             args.address = argv[optind++];
         } else {
             ThrowUsageMessage("Too many arguments");
         }
 
+        if (args.window && !args.batchFile && !args.sweepRange && !args.loadFile) {
+            ThrowUsageMessage("Window (-w) parameter requires batch (-b), sweep (--sweep) or load (--load) mode");
+        }
+
+        if (args.ioUring && !args.batchFile && !args.sweepRange && !args.loadFile) {
+            ThrowUsageMessage("io_uring (-u) flag requires batch (-b), sweep (--sweep) or load (--load) mode");
+        }
+
+        if ((args.qps || args.durationSec) && !args.loadFile) {
+            ThrowUsageMessage("QPS (--qps) and duration (--duration) parameters require load mode (--load)");
+        }
+
+        if (args.loadFile && (args.tcpOnly || args.cacheFile || args.outputFormat)) {
+            ThrowUsageMessage("TCP (-t), cache (-c) and format (-f) cannot be combined with load mode (--load)");
+        }
+
+        if (args.workers && !args.batchFile && !args.sweepRange) {
+            ThrowUsageMessage("Workers (-j) parameter requires batch mode (-b) or sweep (--sweep)");
+        }
+
+        if (args.pinWorkers && !args.workers) {
+            ThrowUsageMessage("Pin workers (-a) flag requires workers (-j)");
+        }
+
         return args;
     }
 }
@@ -0,0 +1,732 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <optional>
+#include <istream>
+#include <memory_resource>
+#include <span>
+#include <string_view>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cctype>
+
+#include "cache.h"
+#include "dns.h"
+#include "names.h"
+#include "output.h"
+#include "retransmit.h"
+#include "stats.h"
+#include "tcp.h"
+#include "transport.h"
+#include "udp.h"
+#include "upstream.h"
+#include "utils.h"
+
+
+const size_t DEFAULT_BATCH_WINDOW = 100;
+const size_t DNS_ID_SPACE = 0x10000;
+
+namespace batch {
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Produces questions one at a time, so the batch engine never holds more than the in-flight window in memory.
+     */
+    class QuerySource {
+    public:
+        virtual ~QuerySource() = default;
+
+        // writes the next question into `question`, reusing its name buffer, false once the input is exhausted
+        virtual bool next(dns::Question &question) = 0;
+    };
+
+    /**
+     * Reads "name [type]" lines. Empty lines and lines starting with '#' are skipped.
+     * Names without a type follow the -x and -6 flags the same way a single query does.
+     * The line buffer is kept and the fields are split in place, so reading a line does not allocate.
+     */
+    class StreamQuerySource : public QuerySource {
+    public:
+        StreamQuerySource(std::istream &input, const DNSConfiguration &args) : input(input), defaults(args) {}
+
+        bool next(dns::Question &question) override {
+            while (std::getline(input, line)) {
+                lineNumber++;
+                std::string_view fields[3];
+                const size_t count = split(line, fields);
+                if (count == 0 || fields[0][0] == '#') {
+                    continue;
+                }
+                if (count > 2) {
+                    std::cerr << "line " << lineNumber << ": too many fields, skipped" << std::endl;
+                    continue;
+                }
+                try {
+                    makeQuestion(question, fields[0], fields[1]);
+                    return true;
+                } catch (const std::system_error &err) {
+                    std::cerr << "line " << lineNumber << ": " << err.what() << ", skipped" << std::endl;
+                }
+            }
+            return false;
+        }
+
+    private:
+        // whitespace separated fields the way operator>> reads them, counts at most one beyond `fields`
+        static size_t split(std::string_view text, std::span<std::string_view> fields) {
+            size_t count = 0;
+            size_t position = 0;
+            while (count <= fields.size()) {
+                while (position < text.size() && std::isspace(static_cast<unsigned char>(text[position]))) {
+                    position++;
+                }
+                if (position == text.size()) {
+                    break;
+                }
+                const size_t start = position;
+                while (position < text.size() && !std::isspace(static_cast<unsigned char>(text[position]))) {
+                    position++;
+                }
+                if (count < fields.size()) {
+                    fields[count] = text.substr(start, position - start);
+                }
+                count++;
+            }
+            return count;
+        }
+
+        // the name is checked here, a bad one would otherwise only fail when its query is built
+        void makeQuestion(dns::Question &question, std::string_view name, std::string_view type) const {
+            if (type.empty()) {
+                dns::constructQuestion(question, name, defaults.reverseQuery, defaults.queryTypeAAAA);
+            } else {
+                auto qtype = dns::parsing::utils::stringToType(type);
+                if (!qtype) {
+                    throw std::system_error(EINVAL, std::generic_category(),
+                                            "unknown type \"" + std::string(type) + "\"");
+                }
+                question.name.assign(name);
+                question.qtype = *qtype;
+                question.qclass = CLASS_IN;
+            }
+            names::validate(question.name);
+        }
+
+        std::istream &input;
+        const DNSConfiguration &defaults;
+        std::string line;
+        size_t lineNumber = 0;
+    };
+
+    /**
+     * Hands out transaction IDs in a random order and never reuses an ID that is still in flight.
+     * Free IDs wait in a ring as large as the ID space, releasing one never allocates.
+     */
+    class IdAllocator {
+    public:
+        IdAllocator() : freeIds(DNS_ID_SPACE), count(DNS_ID_SPACE) {
+            for (size_t id = 0; id < DNS_ID_SPACE; ++id) {
+                freeIds[id] = static_cast<uint16_t>(id);
+            }
+            std::shuffle(freeIds.begin(), freeIds.end(), std::mt19937{std::random_device{}()});
+        }
+
+        uint16_t acquire() {
+            const uint16_t id = freeIds[head];
+            head = (head + 1) % DNS_ID_SPACE;
+            count--;
+            return id;
+        }
+
+        void release(uint16_t id) {
+            freeIds[(head + count) % DNS_ID_SPACE] = id;
+            count++;
+        }
+
+    private:
+        std::vector<uint16_t> freeIds;
+        size_t head = 0;
+        size_t count;
+    };
+
+    struct InFlightQuery {
+        bool active = false;
+        bool overTcp = false;
+        dns::Question question;
+        dns::pmr::Packet packet;
+        // header and question, the part of the query a response has to echo
+        size_t questionEnd;
+        // last transmission
+        Clock::time_point sentAt;
+        Clock::time_point expiresAt{};
+        unsigned transmissions = 0;
+        // timers armed for an older state of the query carry an older generation and are ignored
+        uint32_t generation = 0;
+        // upstream of the last transmission, or of the TCP connection
+        size_t server = 0;
+        // upstream that got a copy of the query in a race
+        std::optional<size_t> racer;
+        Clock::time_point racerSentAt{};
+    };
+
+    /**
+     * One slot per transaction ID whose name and packet live in `resource`. With a pool resource the buffers
+     * of a finished query go back to the pool and the next query takes them again, so an engine stops
+     * allocating once its window is warm, whichever IDs come up.
+     */
+    std::vector<InFlightQuery> makeSlots(std::pmr::memory_resource *resource) {
+        std::vector<InFlightQuery> slots;
+        slots.reserve(DNS_ID_SPACE);
+        for (size_t id = 0; id < DNS_ID_SPACE; ++id) {
+            slots.push_back({.question = {std::pmr::string(resource), 0, 0}, .packet = dns::pmr::Packet(resource)});
+        }
+        return slots;
+    }
+
+    /**
+     * Turns the free slot of `id` into a query for `question`, built in the slot's resource. The generation
+     * is kept, timers armed for the previous query of the slot stay stale.
+     */
+    void startQuery(InFlightQuery &query, uint16_t id, uint16_t flags, const dns::Question &question,
+                    uint16_t ednsPayloadSize) {
+        std::pmr::memory_resource *resource = query.packet.get_allocator().resource();
+        query.packet = dns::constructQueryPacket(id, flags, question, ednsPayloadSize, resource);
+        query.questionEnd = dns::parsing::utils::skipName(query.packet, DNS_HEADER_SIZE) + 4;
+        query.question = question;
+        query.active = true;
+        query.overTcp = false;
+        query.sentAt = {};
+        query.expiresAt = {};
+        query.transmissions = 0;
+        query.server = 0;
+        query.racer.reset();
+        query.racerSentAt = {};
+    }
+
+    // marks the query done and gives its buffers back to the slot's resource
+    void finishQuery(InFlightQuery &query) {
+        query.active = false;
+        query.packet.clear();
+        query.packet.shrink_to_fit();
+        query.question.name.clear();
+        query.question.name.shrink_to_fit();
+    }
+
+    struct Summary {
+        size_t sent = 0;
+        size_t answered = 0;
+        size_t timedOut = 0;
+        size_t unmatched = 0;
+        size_t malformed = 0;
+        size_t truncated = 0;
+        size_t retransmitted = 0;
+        size_t raced = 0;
+        size_t cached = 0;
+        const char *transport = "";
+        udp::SyscallStats sendCalls;
+        udp::SyscallStats receiveCalls;
+
+        void merge(const Summary &other) {
+            sent += other.sent;
+            answered += other.answered;
+            timedOut += other.timedOut;
+            unmatched += other.unmatched;
+            malformed += other.malformed;
+            truncated += other.truncated;
+            retransmitted += other.retransmitted;
+            raced += other.raced;
+            cached += other.cached;
+            if (!*transport) {
+                transport = other.transport;
+            }
+            sendCalls.merge(other.sendCalls);
+            receiveCalls.merge(other.receiveCalls);
+        }
+    };
+
+    /**
+     * The response belongs to the query only if it echoes the same question: same wire-format name
+     * (compared case-insensitively), type and class.
+     */
+    bool responseMatches(dns::PacketView response, const InFlightQuery &query) {
+        const dns::PacketView packet = query.packet;
+        if (response.size() < query.questionEnd || !(response[2] & (FLAG_QR >> 8))) {
+            return false;
+        }
+        if (response[4] != packet[4] || response[5] != packet[5]) {
+            return false;
+        }
+        const size_t typeOffset = query.questionEnd - 4;
+        return names::equalsIgnoreCase(dns::PacketView(packet).subspan(DNS_HEADER_SIZE, typeOffset - DNS_HEADER_SIZE),
+                                       response.subspan(DNS_HEADER_SIZE, typeOffset - DNS_HEADER_SIZE))
+               && std::equal(packet.begin() + typeOffset, packet.begin() + query.questionEnd,
+                             response.begin() + typeOffset);
+    }
+
+    struct Settings {
+        uint16_t flags;
+        size_t window;
+        int timeoutSec;
+        // send every query over TCP instead of only the truncated ones
+        bool tcpOnly;
+        // advertised EDNS0 payload size, 0 sends queries without an OPT record
+        uint16_t ednsPayloadSize;
+        // send a query that is slower than usual to a second server as well
+        bool race;
+    };
+
+    /**
+     * Keeps up to `window` queries in flight over the UDP transports of the upstreams, refilling the window
+     * from the source as responses arrive or queries time out. Every query goes to the upstream with the
+     * lowest smoothed RTT. Without an answer it is sent again to the next best one after the retransmission
+     * timeout, doubled every time. With racing, a copy goes to a partner upstream, preferably of the other
+     * address family, once the query takes about twice as long as usual. Queries answered with the TC flag
+     * are sent again over the persistent, pipelined TCP connection of the upstream that truncated them.
+     * With a cache, hits are written out without a query and answers are stored for later runs.
+     */
+    class Engine {
+    public:
+        Engine(std::vector<upstream::Upstream> &upstreams, cache::Cache *cache, const Settings &settings,
+               output::Sink &output)
+                : upstreams(upstreams), selector(upstream::makeSelector(upstreams)), cache(cache), settings(settings),
+                  output(output), inFlight(makeSlots(&buffers)), timeout(settings.timeoutSec) {
+            for (size_t server = 0; server < upstreams.size(); ++server) {
+                receivers.emplace_back(*this, server);
+            }
+        }
+
+        Summary run(QuerySource &source) {
+            const size_t window = std::min(settings.window, DNS_ID_SPACE);
+            bool exhausted = false;
+
+            while (!exhausted || active > 0 || !backlog.empty()) {
+                while (active + staged.size() < window) {
+                    if (!backlog.empty()) {
+                        incoming = std::move(backlog.front());
+                        backlog.pop_front();
+                    } else if (exhausted || !source.next(incoming)) {
+                        exhausted = true;
+                        break;
+                    }
+                    stage(incoming);
+                }
+                sendStaged();
+
+                if (active == 0) {
+                    if (!backlog.empty()) {
+                        upstreams[blocked].transport->waitWritable();
+                        receiveUdp();
+                    }
+                    continue;
+                }
+
+                waitForEvents();
+                receiveUdp();
+                receiveTcp();
+                wheel.advance(Clock::now(), [this](uint64_t key) {
+                    onTimer(key);
+                });
+                retransmit();
+            }
+            output.flush();
+            summary.transport = upstreams.front().transport->name();
+            for (const upstream::Upstream &upstream : upstreams) {
+                summary.sendCalls.merge(upstream.transport->getSendStats());
+                summary.receiveCalls.merge(upstream.transport->getReceiveStats());
+            }
+            return summary;
+        }
+
+    private:
+        // tells the engine which upstream a datagram came from
+        class Receiver : public transport::ResponseHandler {
+        public:
+            Receiver(Engine &engine, size_t server) : engine(engine), server(server) {}
+
+            void onResponse(dns::PacketView packet) override {
+                engine.handleResponse(packet, false, server);
+            }
+
+        private:
+            Engine &engine;
+            size_t server;
+        };
+
+        struct Retransmission {
+            uint16_t id;
+            size_t server;
+            // a copy for the race partner rather than a retransmission after a timeout
+            bool race;
+        };
+
+        void stage(const dns::Question &question) {
+            if (answerFromCache(question)) {
+                return;
+            }
+            uint16_t id = ids.acquire();
+            startQuery(inFlight[id], id, settings.flags, question, settings.ednsPayloadSize);
+            inFlight[id].overTcp = settings.tcpOnly;
+            inFlight[id].server = selector.pick();
+            if (settings.tcpOnly) {
+                commit(id);
+                sendOverTcp(id);
+            } else {
+                staged.push_back(id);
+            }
+        }
+
+        /**
+         * Hands the staged queries of every upstream to its transport at once, whatever a transport
+         * cannot take right now goes back to the backlog.
+         */
+        void sendStaged() {
+            if (staged.empty()) {
+                return;
+            }
+            std::vector<uint16_t> &batch = sendBatch;
+            for (size_t server = 0; server < upstreams.size(); ++server) {
+                batch.clear();
+                packets.clear();
+                for (uint16_t id : staged) {
+                    if (inFlight[id].server == server) {
+                        batch.push_back(id);
+                        packets.push_back(inFlight[id].packet);
+                    }
+                }
+                if (batch.empty()) {
+                    continue;
+                }
+                size_t sent;
+                {
+                    statsPhase(PHASE_SEND);
+                    sent = upstreams[server].transport->send(packets);
+                }
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    if (i < sent) {
+                        commit(batch[i]);
+                        continue;
+                    }
+                    InFlightQuery &query = inFlight[batch[i]];
+                    backlog.push_back(query.question);
+                    finishQuery(query);
+                    ids.release(batch[i]);
+                    blocked = server;
+                }
+            }
+            staged.clear();
+        }
+
+        void commit(uint16_t id) {
+            InFlightQuery &query = inFlight[id];
+            statsCount(COUNTER_BYTES_OUT, query.packet.size());
+            query.sentAt = Clock::now();
+            query.expiresAt = query.sentAt + timeout;
+            query.transmissions = 1;
+            query.racer.reset();
+            // TCP does its own retransmissions, only the overall timeout applies
+            if (query.overTcp) {
+                arm(id, query.expiresAt);
+            } else if (settings.race && selector.size() > 1) {
+                arm(id, query.sentAt + selector.raceDelay(query.server));
+            } else {
+                arm(id, query.sentAt + selector.rtt(query.server).backoff(1));
+            }
+            budget.deposit();
+            active++;
+            summary.sent++;
+        }
+
+        void arm(uint16_t id, Clock::time_point when) {
+            InFlightQuery &query = inFlight[id];
+            query.generation++;
+            wheel.schedule((uint64_t{query.generation} << 16) | id, std::min(when, query.expiresAt));
+        }
+
+        void onTimer(uint64_t key) {
+            const uint16_t id = key & 0xFFFF;
+            InFlightQuery &query = inFlight[id];
+            if (!query.active || query.generation != key >> 16) {
+                return;
+            }
+            const Clock::time_point now = Clock::now();
+            if (now >= query.expiresAt) {
+                std::cerr << query.question.name << " " << dns::parsing::utils::typeToString(query.question.qtype)
+                          << ": timed out" << std::endl;
+                finish(id);
+                summary.timedOut++;
+                return;
+            }
+            if (query.overTcp) {
+                arm(id, query.expiresAt);
+                return;
+            }
+            if (settings.race && !query.racer && query.transmissions == 1) {
+                if (std::optional<size_t> partner = selector.partner(query.server)) {
+                    retransmits.push_back({id, *partner, true});
+                    return;
+                }
+            }
+            if (query.transmissions > MAX_RETRANSMITS) {
+                arm(id, query.expiresAt);
+                return;
+            }
+            // the ranking only matters with other servers to choose from, a lone server just backs off
+            if (selector.size() > 1) {
+                selector.rtt(query.server).penalize();
+            }
+            const size_t fallback = selector.fallback(query.server);
+            // only a retransmission to the same server draws on the budget, moving on to another one is free
+            if (fallback == query.server && !budget.withdraw()) {
+                arm(id, query.expiresAt);
+                return;
+            }
+            retransmits.push_back({id, fallback, false});
+        }
+
+        // sends every query whose timer fired in this turn of the wheel at once, one call per upstream
+        void retransmit() {
+            if (retransmits.empty()) {
+                return;
+            }
+            std::vector<Retransmission> &batch = retransmitBatch;
+            for (size_t server = 0; server < upstreams.size(); ++server) {
+                batch.clear();
+                packets.clear();
+                for (const Retransmission &retransmission : retransmits) {
+                    if (retransmission.server == server) {
+                        batch.push_back(retransmission);
+                        packets.push_back(inFlight[retransmission.id].packet);
+                    }
+                }
+                if (batch.empty()) {
+                    continue;
+                }
+                const size_t sent = upstreams[server].transport->send(packets);
+                const Clock::time_point now = Clock::now();
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    const uint16_t id = batch[i].id;
+                    InFlightQuery &query = inFlight[id];
+                    if (i >= sent) {
+                        // socket buffer full, try again on the next tick
+                        arm(id, now + WHEEL_TICK);
+                        continue;
+                    }
+                    statsCount(COUNTER_BYTES_OUT, query.packet.size());
+                    if (batch[i].race) {
+                        debugMsg("Racing " << query.question.name << " against server " << server << std::endl);
+                        query.racer = server;
+                        query.racerSentAt = now;
+                        summary.raced++;
+                        // both servers get a fair chance before anything is retransmitted
+                        arm(id, std::max(query.sentAt + selector.rtt(query.server).backoff(1),
+                                         now + selector.rtt(server).backoff(1)));
+                        continue;
+                    }
+                    debugMsg("Retransmitting " << query.question.name << " to server " << server << " after "
+                             << query.transmissions << " tries" << std::endl);
+                    statsCount(COUNTER_RETRIES, 1);
+                    query.server = server;
+                    query.sentAt = now;
+                    query.transmissions++;
+                    summary.retransmitted++;
+                    arm(id, now + selector.rtt(server).backoff(query.transmissions));
+                }
+            }
+            retransmits.clear();
+        }
+
+        bool answerFromCache(const dns::Question &question) {
+            if (!cache) {
+                return false;
+            }
+            cache::makeKey(question, cacheKey);
+            if (!cache->lookup(cacheKey, dns::randomQueryId(), cacheHit)) {
+                return false;
+            }
+            output.write(dns::parseResponsePacket(cacheHit));
+            summary.cached++;
+            return true;
+        }
+
+        void waitForEvents() {
+            statsPhase(PHASE_WAIT);
+            // rounded up, waking before the wheel's next tick would only spin
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                    std::min<Clock::duration>(wheel.untilNext(Clock::now()), timeout));
+            fds.clear();
+            for (const upstream::Upstream &upstream : upstreams) {
+                fds.push_back({upstream.transport->descriptor(), POLLIN, 0});
+                if (upstream.connection->descriptor() >= 0) {
+                    fds.push_back({upstream.connection->descriptor(),
+                                   static_cast<short>(POLLIN | (upstream.connection->wantsWrite() ? POLLOUT : 0)), 0});
+                }
+            }
+            if (poll(fds.data(), fds.size(), static_cast<int>(std::max<int64_t>(remaining.count(), 0))) < 0
+                && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll sockets");
+            }
+        }
+
+        void receiveUdp() {
+            for (size_t server = 0; server < upstreams.size(); ++server) {
+                upstreams[server].transport->receive(receivers[server]);
+            }
+        }
+
+        void receiveTcp() {
+            for (size_t server = 0; server < upstreams.size(); ++server) {
+                tcp::Connection &connection = *upstreams[server].connection;
+                try {
+                    connection.flush();
+                    connection.receive([this, server](std::span<const uint8_t> message) {
+                        handleResponse(message, true, server);
+                    });
+                } catch (const std::system_error &err) {
+                    // the server closed the connection and it could not be made again
+                    failConnection(server, err);
+                }
+            }
+        }
+
+        void sendOverTcp(uint16_t id) {
+            const size_t server = inFlight[id].server;
+            try {
+                upstreams[server].connection->send(id, inFlight[id].packet);
+            } catch (const std::system_error &err) {
+                fail(id, err);
+                failConnection(server, err);
+            }
+        }
+
+        /**
+         * A TCP connection that cannot be made fails the queries waiting on it rather than the whole run,
+         * like a timeout. They are not retried, the next query over TCP tries to connect again.
+         */
+        void failConnection(size_t server, const std::system_error &err) {
+            abandoned.clear();
+            upstreams[server].connection->forEachOutstanding([this](uint16_t id) {
+                abandoned.push_back(id);
+            });
+            for (uint16_t id : abandoned) {
+                const InFlightQuery &query = inFlight[id];
+                if (query.active && query.overTcp && query.server == server) {
+                    fail(id, err);
+                }
+            }
+        }
+
+        void fail(uint16_t id, const std::system_error &err) {
+            const InFlightQuery &query = inFlight[id];
+            std::cerr << query.question.name << " " << dns::parsing::utils::typeToString(query.question.qtype)
+                      << ": " << err.what() << std::endl;
+            finish(id);
+            summary.timedOut++;
+        }
+
+        void handleResponse(dns::PacketView packet, bool viaTcp, size_t server) {
+            statsCount(COUNTER_BYTES_IN, packet.size());
+            if (packet.size() < DNS_HEADER_SIZE) {
+                summary.unmatched++;
+                return;
+            }
+            uint16_t id = (packet[0] << 8) | packet[1];
+            InFlightQuery &query = inFlight[id];
+            if (!query.active || query.overTcp != viaTcp || (viaTcp && query.server != server)
+                || !responseMatches(packet, query)) {
+                debugMsg("Dropping unexpected response with ID " << id << std::endl);
+                summary.unmatched++;
+                return;
+            }
+            // Karn's algorithm, an answer to a retransmitted query may belong to any of its copies
+            if (!viaTcp && query.transmissions == 1) {
+                if (server == query.server) {
+                    selector.rtt(server).sample(Clock::now() - query.sentAt);
+                } else if (server == query.racer) {
+                    selector.rtt(server).sample(Clock::now() - query.racerSentAt);
+                    // the primary lost the race, it takes at least this long
+                    selector.rtt(query.server).sample(Clock::now() - query.sentAt);
+                }
+            }
+            if (!viaTcp && dns::isTruncated(packet)) {
+                debugMsg("Response for " << query.question.name << " truncated, retrying over TCP" << std::endl);
+                query.overTcp = true;
+                query.server = server;
+                arm(id, query.expiresAt);
+                statsCount(COUNTER_BYTES_OUT, query.packet.size());
+                statsCount(COUNTER_RETRIES, 1);
+                summary.truncated++;
+                sendOverTcp(id);
+                return;
+            }
+            try {
+                output.write(dns::parseResponsePacket(packet));
+                if (cache) {
+                    cache::makeKey(query.question, cacheKey);
+                    cache->store(cacheKey, packet);
+                }
+                summary.answered++;
+            } catch (const std::system_error &err) {
+                std::cerr << query.question.name << ": " << err.what() << std::endl;
+                summary.malformed++;
+            }
+            finish(id);
+        }
+
+        void finish(uint16_t id) {
+            InFlightQuery &query = inFlight[id];
+            if (query.overTcp) {
+                upstreams[query.server].connection->forget(id);
+            }
+            finishQuery(query);
+            ids.release(id);
+            active--;
+        }
+
+        std::vector<upstream::Upstream> &upstreams;
+        upstream::Selector selector;
+        std::vector<Receiver> receivers;
+        cache::Cache *cache;
+        const Settings &settings;
+        output::Sink &output;
+        // names and packets of the queries in flight, recycled from one query to the next
+        std::pmr::unsynchronized_pool_resource buffers;
+        IdAllocator ids;
+        std::vector<InFlightQuery> inFlight;
+        retransmit::TimerWheel wheel;
+        retransmit::RetryBudget budget;
+        const std::chrono::seconds timeout;
+        size_t active = 0;
+        Summary summary{};
+        // built but not yet sent, flushed together by sendStaged()
+        std::vector<uint16_t> staged;
+        // the next question to stage, filled in place by the source
+        dns::Question incoming;
+        // one upstream's share of the staged queries or retransmissions and their packets, kept between turns
+        std::vector<uint16_t> sendBatch;
+        std::vector<Retransmission> retransmitBatch;
+        std::vector<dns::PacketView> packets;
+        // questions a transport could not take yet
+        std::deque<dns::Question> backlog;
+        // upstream whose transport refused queries last
+        size_t blocked = 0;
+        // due for another transmission, flushed together by retransmit()
+        std::vector<Retransmission> retransmits;
+        std::vector<pollfd> fds;
+        // IDs of the queries of a TCP connection that failed
+        std::vector<uint16_t> abandoned;
+        // cache key of the question at hand and the response found for it, kept between lookups
+        std::string cacheKey;
+        dns::Packet cacheHit;
+    };
+
+    Summary run(QuerySource &source, std::vector<upstream::Upstream> &upstreams, cache::Cache *cache,
+                const Settings &settings, output::Sink &output) {
+        Engine engine(upstreams, cache, settings, output);
+        return engine.run(source);
+    }
+}
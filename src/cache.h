@@ -0,0 +1,310 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "dns.h"
+#include "names.h"
+#include "utils.h"
+
+
+const char CACHE_MAGIC[8] = {'D', 'N', 'S', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t CACHE_VERSION = 2;
+const uint32_t CACHE_SLOT_COUNT = 16384;
+const size_t CACHE_SLOT_SIZE = 2048;
+const size_t CACHE_PROBE_LIMIT = 8;
+
+namespace cache {
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t slotCount;
+        uint32_t slotSize;
+        uint32_t reserved;
+    };
+
+    /**
+     * One entry of the shared table. `sequence` is a seqlock: odd while a writer is inside,
+     * readers retry or give up when it changes under them.
+     */
+    struct Slot {
+        uint32_t sequence;
+        uint32_t hash;
+        // wall clock seconds, the file is shared between processes
+        int64_t storedAt;
+        int64_t expiresAt;
+        uint16_t keyLength;
+        uint16_t responseLength;
+        uint32_t reserved;
+        uint8_t data[CACHE_SLOT_SIZE - 32];
+    };
+
+    static_assert(sizeof(Slot) == CACHE_SLOT_SIZE, "cache slot layout changed");
+
+    int64_t now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * Lowercased wire-format name followed by type and class, written over `key` so a caller that keeps
+     * the string around makes keys without allocating.
+     */
+    void makeKey(const dns::Question &question, std::string &key) {
+        key.resize(names::wireLength(question.name));
+        key.resize(names::presentationToWire(question.name, reinterpret_cast<uint8_t *>(key.data())));
+        names::toLower(key);
+        key += static_cast<char>(question.qtype >> 8);
+        key += static_cast<char>(question.qtype & 0xFF);
+        key += static_cast<char>(question.qclass >> 8);
+        key += static_cast<char>(question.qclass & 0xFF);
+    }
+
+    // the same key from a question of a received message
+    std::string makeKey(const dns::QuestionView &question) {
+        std::string key;
+        question.name.appendWireTo(key);
+        names::toLower(key);
+        key += static_cast<char>(question.qtype >> 8);
+        key += static_cast<char>(question.qtype & 0xFF);
+        key += static_cast<char>(question.qclass >> 8);
+        key += static_cast<char>(question.qclass & 0xFF);
+        return key;
+    }
+
+    uint32_t hashKey(std::string_view key) {
+        return names::hashIgnoreCase(key.data(), key.size());
+    }
+
+    /**
+     * How long a response may be cached: the smallest TTL of its records for answers,
+     * min(SOA TTL, SOA MINIMUM) for NXDOMAIN and NODATA (RFC 2308). Nothing for anything else.
+     */
+    std::optional<uint32_t> cacheableTtl(const dns::DNSMessage &message) {
+        const DNSHeader &header = message.getHeader();
+        const uint16_t rcode = header.flags & RCODE_MASK;
+        if (header.flags & FLAG_TRUNC || (rcode != 0 && rcode != RCODE_NXDOMAIN)) {
+            return std::nullopt;
+        }
+        if (rcode == 0 && header.ancount > 0) {
+            std::optional<uint32_t> ttl;
+            for (const auto &section : {message.answers(), message.authorities(), message.additionals()}) {
+                for (const dns::ResourceRecordView &record : section) {
+                    if (record.type != TYPE_OPT) {
+                        ttl = std::min(ttl.value_or(record.ttl), record.ttl);
+                    }
+                }
+            }
+            return ttl;
+        }
+        for (const dns::ResourceRecordView &record : message.authorities()) {
+            if (record.type == TYPE_SOA) {
+                return std::min(record.ttl, std::get<dns::rdata::SOA>(dns::rdata::decode(record)).minimum);
+            }
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Lowers every TTL of the response but the OPT pseudo-record by the seconds it spent in a cache.
+     */
+    void age(dns::Packet &response, uint32_t elapsed) {
+        // parsing checks the whole packet, so rewriting TTLs while walking the records cannot stop halfway
+        const dns::DNSMessage message = dns::DNSMessage::parse(response);
+        for (const auto &section : {message.answers(), message.authorities(), message.additionals()}) {
+            for (const dns::ResourceRecordView &record : section) {
+                if (record.type == TYPE_OPT) {
+                    continue;
+                }
+                const size_t offset = record.rdataOffset - 6;
+                const uint32_t ttl = record.ttl > elapsed ? record.ttl - elapsed : 0;
+                for (size_t i = 0; i < 4; ++i) {
+                    response[offset + i] = static_cast<uint8_t>(ttl >> (24 - i * 8));
+                }
+            }
+        }
+    }
+
+    /**
+     * Positive and negative response cache in a memory-mapped file. Every process that opens the
+     * same file shares the entries, lookups and stores do not take any lock besides the slot seqlock.
+     */
+    class Cache {
+    public:
+        explicit Cache(const std::string &path) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to open cache file " + path);
+            }
+            const size_t size = sizeof(FileHeader) + CACHE_SLOT_SIZE * size_t{CACHE_SLOT_COUNT};
+            try {
+                initialize(size);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            mappingSize = size;
+            slots = reinterpret_cast<Slot *>(static_cast<uint8_t *>(mapping) + sizeof(FileHeader));
+        }
+
+        Cache(const Cache &) = delete;
+        Cache &operator=(const Cache &) = delete;
+
+        ~Cache() {
+            munmap(mapping, mappingSize);
+            close(fd);
+        }
+
+        /**
+         * Returns the cached response with `id` and TTLs lowered by the time spent in the cache.
+         */
+        std::optional<dns::Packet> lookup(const dns::Question &question, uint16_t id) const {
+            std::string key;
+            makeKey(question, key);
+            dns::Packet response;
+            if (!lookup(key, id, response)) {
+                return std::nullopt;
+            }
+            return response;
+        }
+
+        /**
+         * The same for a key made by makeKey, the hit is copied into `response` so its capacity is reused.
+         * Returns false on a miss, `response` is left with unspecified contents then.
+         */
+        bool lookup(std::string_view key, uint16_t id, dns::Packet &response) const {
+            const uint32_t hash = hashKey(key);
+            const int64_t current = now();
+            for (size_t probe = 0; probe < CACHE_PROBE_LIMIT; ++probe) {
+                Slot &slot = slots[(hash + probe) % CACHE_SLOT_COUNT];
+                std::atomic_ref<uint32_t> sequence(slot.sequence);
+                const uint32_t before = sequence.load(std::memory_order_acquire);
+                if (before & 1 || slot.hash != hash || slot.keyLength != key.size()) {
+                    continue;
+                }
+                const int64_t storedAt = slot.storedAt;
+                const int64_t expiresAt = slot.expiresAt;
+                const size_t responseLength = std::min<size_t>(slot.responseLength, sizeof(slot.data) - key.size());
+                const bool sameKey = std::memcmp(slot.data, key.data(), key.size()) == 0;
+                response.assign(slot.data + key.size(), slot.data + key.size() + responseLength);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) != before || !sameKey) {
+                    continue;
+                }
+                if (current < storedAt || current >= expiresAt) {
+                    return false;
+                }
+                try {
+                    age(response, static_cast<uint32_t>(current - storedAt));
+                } catch (const std::system_error &) {
+                    return false;
+                }
+                response[0] = id >> 8;
+                response[1] = id & 0xFF;
+                return true;
+            }
+            return false;
+        }
+
+        void store(const dns::Question &question, dns::PacketView response) {
+            std::string key;
+            makeKey(question, key);
+            store(key, response);
+        }
+
+        void store(std::string_view key, dns::PacketView response) {
+            std::optional<uint32_t> ttl;
+            try {
+                ttl = cacheableTtl(dns::DNSMessage::parse(response));
+            } catch (const std::system_error &) {
+                return;
+            }
+            if (!ttl || *ttl == 0 || key.size() + response.size() > sizeof(Slot::data)) {
+                return;
+            }
+            const uint32_t hash = hashKey(key);
+            const int64_t current = now();
+
+            // reuse the slot of the same key, otherwise the free or soonest expiring one
+            Slot *victim = nullptr;
+            for (size_t probe = 0; probe < CACHE_PROBE_LIMIT; ++probe) {
+                Slot &slot = slots[(hash + probe) % CACHE_SLOT_COUNT];
+                if (slot.hash == hash && slot.keyLength == key.size()
+                    && std::memcmp(slot.data, key.data(), key.size()) == 0) {
+                    victim = &slot;
+                    break;
+                }
+                if (!victim || slot.expiresAt < victim->expiresAt) {
+                    victim = &slot;
+                }
+            }
+
+            std::atomic_ref<uint32_t> sequence(victim->sequence);
+            uint32_t before = sequence.load(std::memory_order_relaxed);
+            if (before & 1 || !sequence.compare_exchange_strong(before, before + 1, std::memory_order_acquire)) {
+                // another process is writing this slot, caching is best effort
+                return;
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            victim->hash = hash;
+            victim->storedAt = current;
+            victim->expiresAt = current + *ttl;
+            victim->keyLength = static_cast<uint16_t>(key.size());
+            victim->responseLength = static_cast<uint16_t>(response.size());
+            std::memcpy(victim->data, key.data(), key.size());
+            std::memcpy(victim->data + key.size(), response.data(), response.size());
+            sequence.store(before + 2, std::memory_order_release);
+        }
+
+    private:
+        void initialize(size_t size) {
+            // only one process may create the layout, the others wait for it
+            if (flock(fd, LOCK_EX) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to lock cache file");
+            }
+            struct stat status{};
+            fstat(fd, &status);
+            FileHeader expected{};
+            std::memcpy(expected.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+            expected.version = CACHE_VERSION;
+            expected.slotCount = CACHE_SLOT_COUNT;
+            expected.slotSize = CACHE_SLOT_SIZE;
+
+            FileHeader existing{};
+            bool valid = static_cast<size_t>(status.st_size) == size
+                         && pread(fd, &existing, sizeof(existing), 0) == sizeof(existing)
+                         && std::memcmp(&existing, &expected, sizeof(FileHeader)) == 0;
+            if (!valid && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0
+                           || pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected))) {
+                int err = errno;
+                flock(fd, LOCK_UN);
+                throw std::system_error(err, std::generic_category(), "Failed to initialize cache file");
+            }
+            flock(fd, LOCK_UN);
+
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "Failed to map cache file");
+            }
+        }
+
+        int fd = -1;
+        void *mapping = nullptr;
+        size_t mappingSize = 0;
+        Slot *slots = nullptr;
+    };
+}
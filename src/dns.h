@@ -4,14 +4,23 @@
 
 #include <string>
 #include <vector>
+#include <memory_resource>
 #include <optional>
 #include <cstring>
 #include <arpa/inet.h>
-#include <sstream>
-#include <functional>
 #include <tuple>
+#include <random>
+#include <algorithm>
+#include <span>
+#include <string_view>
+#include <charconv>
+#include <system_error>
+#include <variant>
+#include <array>
 
 #include "argparser.h"
+#include "names.h"
+#include "stats.h"
 #include "utils.h"
 
 
@@ -24,13 +33,35 @@ const uint16_t TYPE_NS = 0x0002;
 const uint16_t TYPE_MX = 0x000F;
 const uint16_t TYPE_TXT = 0x0010;
 const uint16_t TYPE_SOA = 0x0006;
+const uint16_t TYPE_OPT = 0x0029;
+const uint16_t TYPE_SRV = 0x0021;
+const uint16_t TYPE_NAPTR = 0x0023;
+const uint16_t TYPE_DS = 0x002B;
+const uint16_t TYPE_RRSIG = 0x002E;
+const uint16_t TYPE_DNSKEY = 0x0030;
+const uint16_t TYPE_SVCB = 0x0040;
+const uint16_t TYPE_HTTPS = 0x0041;
+const uint16_t TYPE_CAA = 0x0101;
+// QTYPEs only, zone transfers never carry records of these types
+const uint16_t TYPE_IXFR = 0x00FB;
+const uint16_t TYPE_AXFR = 0x00FC;
 
 // flags
 const uint16_t FLAG_AUTHORITATIVE = 0x0400;
 const uint16_t FLAG_RECURSIVE = 0x0100;
 const uint16_t FLAG_TRUNC = 0x200;
 const uint16_t FLAG_RD = 0x0100;
+const uint16_t FLAG_QR = 0x8000;
+const uint16_t FLAG_RA = 0x0080;
+const uint16_t OPCODE_MASK = 0x7800;
 const uint16_t PACKET_COMPRESSED = 0xC0;
+const uint16_t RCODE_MASK = 0x000F;
+const uint8_t RCODE_NOERROR = 0;
+const uint8_t RCODE_FORMERR = 1;
+const uint8_t RCODE_SERVFAIL = 2;
+const uint8_t RCODE_NXDOMAIN = 3;
+const uint8_t RCODE_NOTIMP = 4;
+const uint32_t EDNS_FLAG_DO = 0x8000;
 
 const uint16_t DEFAULT_DNS_PORT = 53;
 
@@ -43,6 +74,9 @@ const uint16_t CLASS_NONE = 254;
 const uint16_t CLASS_ANY = 255;
 
 const size_t INET6_ADDRLEN = 16;
+const size_t DNS_HEADER_SIZE = 12;
+const size_t MAX_NAME_LENGTH = 255;
+const size_t MAX_COMPRESSION_HOPS = 127;
 
 struct DNSHeader {
     uint16_t id;
@@ -61,11 +95,28 @@ namespace dns {
         std::string address;
     };
 
+    /**
+     * The name takes its memory from a polymorphic resource: a copy gets the default heap, a slot built with
+     * a pool keeps it when a question is assigned to it, so engines reusing their slots do not allocate.
+     */
+    struct Question {
+        std::pmr::string name;
+        uint16_t qtype;
+        uint16_t qclass;
+    };
+
     typedef std::vector<uint8_t> Packet;
+    typedef std::span<const uint8_t> PacketView;
+
+    namespace pmr {
+        // a packet built in a caller's memory resource, e.g. a pool or a per-message arena
+        typedef std::pmr::vector<uint8_t> Packet;
+    }
 
     namespace parsing {
 
         namespace utils {
+            // RFC 3597 notation for classes without a mnemonic
             std::string classToString(const uint16_t qclass) {
                 switch (qclass) {
                     case CLASS_IN:
@@ -81,441 +132,969 @@ namespace dns {
                     case CLASS_ANY:
                         return "ANY";
                     default:
-                        return "UNKNOWN";
+                        return "CLASS" + std::to_string(qclass);
                 }
             }
 
-            std::string typeToString(const uint16_t type) {
-                switch (type) {
-                    case TYPE_A:
-                        return "A";
-                    case TYPE_AAAA:
-                        return "AAAA";
-                    case TYPE_CNAME:
-                        return "CNAME";
-                    case TYPE_SOA:
-                        return "SOA";
-                    case TYPE_NS:
-                        return "NS";
-                    case TYPE_MX:
-                        return "MX";
-                    case TYPE_TXT:
-                        return "TXT";
-                    case TYPE_PTR:
-                        return "PTR";
-                    default:
-                        std::cerr << "unknown type: " << type << std::endl;
-                        return "UNKNOWN";
+            std::string rcodeToString(size_t rcode) {
+                static const char *names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+                                              "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE"};
+                return rcode < std::size(names) ? names[rcode] : "RCODE" + std::to_string(rcode);
+            }
+
+            [[noreturn]] void throwMalformed(const std::string &reason) {
+                throw std::system_error(EBADMSG, std::generic_category(), "Malformed DNS packet: " + reason);
+            }
+
+            uint16_t readUint16(PacketView packet, size_t offset) {
+                if (offset + 2 > packet.size()) {
+                    throwMalformed("16-bit field past the end of the packet");
                 }
+                return static_cast<uint16_t>((packet[offset] << 8) | packet[offset + 1]);
             }
 
-            parserResult parseDomainNameFromPacket(const Packet &packet, size_t offset) {
-                std::string name;
-                bool jumped = false;
-                size_t original_offset = offset;
-
-                while (packet[offset] != 0) {
-                    if (packet[offset] >= PACKET_COMPRESSED) {
-                        if (!jumped) {
-                            jumped = true;
-                            original_offset = offset + 2;
-                        }
-                        offset = ((packet[offset] & 0x3F) << 8) | packet[offset + 1];
-                    } else {
-                        if (!name.empty()) {
-                            name += '.';
-                        }
-                        size_t length = packet[offset++];
-                        // Add error checking for length and packet size
-                        for (size_t i = 0; i < length; ++i) {
-                            name += static_cast<char>(packet[offset++]);
+            uint32_t readUint32(PacketView packet, size_t offset) {
+                if (offset + 4 > packet.size()) {
+                    throwMalformed("32-bit field past the end of the packet");
+                }
+                return (static_cast<uint32_t>(packet[offset]) << 24) | (packet[offset + 1] << 16)
+                       | (packet[offset + 2] << 8) | packet[offset + 3];
+            }
+
+            /**
+             * Returns the offset right after a name stored at `offset`, without following compression pointers.
+             */
+            size_t skipName(PacketView packet, size_t offset) {
+                while (true) {
+                    if (offset >= packet.size()) {
+                        throwMalformed("name past the end of the packet");
+                    }
+                    uint8_t length = packet[offset];
+                    if (length == 0) {
+                        return offset + 1;
+                    }
+                    if ((length & PACKET_COMPRESSED) == PACKET_COMPRESSED) {
+                        if (offset + 2 > packet.size()) {
+                            throwMalformed("compression pointer past the end of the packet");
                         }
+                        return offset + 2;
+                    }
+                    if (length & PACKET_COMPRESSED) {
+                        throwMalformed("unsupported label type");
                     }
+                    offset += length + 1;
                 }
+            }
+        }
+    }
 
-                if (!jumped) {
-                    offset++; // Skip the trailing 0
-                } else {
-                    offset = original_offset; // Use the original offset if compression was used
+    /**
+     * Domain name stored somewhere in a packet. Nothing is decoded until the labels are read,
+     * compression pointers are followed lazily and every step is bounds checked.
+     */
+    class NameView {
+    public:
+        NameView() = default;
+
+        NameView(PacketView packet, size_t offset) : packet(packet), offset(offset) {}
+
+        // calls visit(std::string_view label) for every label, root label excluded
+        template<typename Visitor>
+        void forEachLabel(Visitor visit) const {
+            size_t position = offset;
+            size_t hops = 0;
+            size_t wireLength = 1;
+            while (true) {
+                if (position >= packet.size()) {
+                    parsing::utils::throwMalformed("name past the end of the packet");
+                }
+                uint8_t length = packet[position];
+                if (length == 0) {
+                    return;
+                }
+                if ((length & PACKET_COMPRESSED) == PACKET_COMPRESSED) {
+                    if (++hops > MAX_COMPRESSION_HOPS) {
+                        parsing::utils::throwMalformed("compression pointer loop");
+                    }
+                    statsCount(COUNTER_COMPRESSION_HOPS, 1);
+                    position = parsing::utils::readUint16(packet, position) & 0x3FFF;
+                    continue;
+                }
+                if (length & PACKET_COMPRESSED) {
+                    parsing::utils::throwMalformed("unsupported label type");
+                }
+                if (position + 1 + length > packet.size()) {
+                    parsing::utils::throwMalformed("label past the end of the packet");
+                }
+                wireLength += length + 1;
+                if (wireLength > MAX_NAME_LENGTH) {
+                    parsing::utils::throwMalformed("name longer than 255 bytes");
                 }
+                visit(std::string_view(reinterpret_cast<const char *>(packet.data() + position + 1), length));
+                position += length + 1;
+            }
+        }
 
-                return {name, offset};
+        /**
+         * Calls visit(PacketView run) for every run of labels that lie back to back in the packet, length bytes
+         * included. Only compression pointers split a name into several runs.
+         */
+        template<typename Visitor>
+        void forEachRun(Visitor visit) const {
+            const char *runStart = nullptr;
+            const char *runEnd = nullptr;
+            forEachLabel([&](std::string_view label) {
+                const char *lengthByte = label.data() - 1;
+                if (lengthByte != runEnd) {
+                    if (runStart) {
+                        visit(PacketView(reinterpret_cast<const uint8_t *>(runStart), runEnd - runStart));
+                    }
+                    runStart = lengthByte;
+                }
+                runEnd = label.data() + label.size();
+            });
+            if (runStart) {
+                visit(PacketView(reinterpret_cast<const uint8_t *>(runStart), runEnd - runStart));
             }
         }
 
-        parserResult parseSOARecord(const Packet &response, size_t offset) {
-            std::stringstream output;
-            std::string mname, rname;
+        template<typename String>
+        void appendTo(String &output) const {
+            bool first = true;
+            forEachRun([&](PacketView run) {
+                if (!first) {
+                    output += '.';
+                }
+                names::appendWireRun(output, run);
+                first = false;
+            });
+        }
+
+        std::string toString() const {
+            std::string output;
+            appendTo(output);
+            return output;
+        }
 
-            std::tie(mname, offset) = utils::parseDomainNameFromPacket(response, offset);
-            std::tie(rname, offset) = utils::parseDomainNameFromPacket(response, offset);
+        std::pmr::string toString(std::pmr::memory_resource *resource) const {
+            std::pmr::string output(resource);
+            appendTo(output);
+            return output;
+        }
 
-            uint32_t serial = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
-            offset += 4;
-            uint32_t refresh = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
-            offset += 4;
-            uint32_t retry = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
-            offset += 4;
-            uint32_t expire = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
-            offset += 4;
-            uint32_t minimum = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
+        // uncompressed wire format, including the root label
+        void appendWireTo(std::string &output) const {
+            forEachRun([&](PacketView run) {
+                output.append(reinterpret_cast<const char *>(run.data()), run.size());
+            });
+            output += '\0';
+        }
+
+        size_t wireOffset() const {
+            return offset;
+        }
+
+    private:
+        PacketView packet;
+        size_t offset = 0;
+    };
+
+    struct QuestionView {
+        NameView name;
+        uint16_t qtype;
+        uint16_t qclass;
+
+        static QuestionView read(PacketView packet, size_t &offset) {
+            QuestionView question{NameView(packet, offset), 0, 0};
+            offset = parsing::utils::skipName(packet, offset);
+            question.qtype = parsing::utils::readUint16(packet, offset);
+            question.qclass = parsing::utils::readUint16(packet, offset + 2);
             offset += 4;
+            return question;
+        }
+    };
+
+    struct ResourceRecordView {
+        NameView name;
+        uint16_t type;
+        uint16_t rclass;
+        uint32_t ttl;
+        // whole packet, rdata may contain compression pointers to anywhere in it
+        PacketView packet;
+        size_t rdataOffset;
+        uint16_t rdlength;
+
+        PacketView rdata() const {
+            return packet.subspan(rdataOffset, rdlength);
+        }
+
+        static ResourceRecordView read(PacketView packet, size_t &offset) {
+            ResourceRecordView record{NameView(packet, offset), 0, 0, 0, packet, 0, 0};
+            offset = parsing::utils::skipName(packet, offset);
+            record.type = parsing::utils::readUint16(packet, offset);
+            record.rclass = parsing::utils::readUint16(packet, offset + 2);
+            record.ttl = parsing::utils::readUint32(packet, offset + 4);
+            record.rdlength = parsing::utils::readUint16(packet, offset + 8);
+            record.rdataOffset = offset + 10;
+            if (record.rdataOffset + record.rdlength > packet.size()) {
+                parsing::utils::throwMalformed("RDATA past the end of the packet");
+            }
+            offset = record.rdataOffset + record.rdlength;
+            return record;
+        }
+    };
+
+    /**
+     * Forward range over the entries of one message section, each entry is read on dereference.
+     */
+    template<typename Entry>
+    class Section {
+    public:
+        class iterator {
+        public:
+            iterator(PacketView packet, size_t offset, uint16_t remaining)
+                    : packet(packet), offset(offset), remaining(remaining) {}
+
+            Entry operator*() const {
+                size_t position = offset;
+                return Entry::read(packet, position);
+            }
+
+            iterator &operator++() {
+                Entry::read(packet, offset);
+                remaining--;
+                return *this;
+            }
+
+            bool operator==(const iterator &other) const {
+                return remaining == other.remaining;
+            }
+
+        private:
+            PacketView packet;
+            size_t offset;
+            uint16_t remaining;
+        };
 
-            output << mname << ", ";
-            output << rname << ", ";
-            output << serial << ", ";
-            output << refresh << ", ";
-            output << retry << ", ";
-            output << expire << ", ";
-            output << minimum;
+        Section(PacketView packet, size_t offset, uint16_t count) : packet(packet), offset(offset), count(count) {}
 
-            return {output.str(), offset};
+        iterator begin() const {
+            return {packet, offset, count};
         }
 
-        parserResult parseMXRecord(const Packet &response, size_t offset) {
-                std::stringstream output;
+        iterator end() const {
+            return {packet, offset, 0};
+        }
 
-                uint16_t preference = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-                offset += 2;
+        uint16_t size() const {
+            return count;
+        }
+
+    private:
+        PacketView packet;
+        size_t offset;
+        uint16_t count;
+    };
 
-                std::string mailExchange;
-                std::tie(mailExchange, offset) = utils::parseDomainNameFromPacket(response, offset);
+    /**
+     * Parsed DNS message referencing the packet buffer, which has to outlive it.
+     * parse() validates the layout of every section once, entries are then read on demand.
+     */
+    class DNSMessage {
+    public:
+        static DNSMessage parse(PacketView packet) {
+            DNSMessage message;
+            message.packet = packet;
+            if (packet.size() < DNS_HEADER_SIZE) {
+                parsing::utils::throwMalformed("packet shorter than the header");
+            }
+            message.header.id = parsing::utils::readUint16(packet, 0);
+            message.header.flags = parsing::utils::readUint16(packet, 2);
+            message.header.qdcount = parsing::utils::readUint16(packet, 4);
+            message.header.ancount = parsing::utils::readUint16(packet, 6);
+            message.header.nscount = parsing::utils::readUint16(packet, 8);
+            message.header.arcount = parsing::utils::readUint16(packet, 10);
+
+            size_t offset = DNS_HEADER_SIZE;
+            message.offsets[0] = offset;
+            for (uint16_t i = 0; i < message.header.qdcount; ++i) {
+                QuestionView::read(packet, offset);
+            }
+            const uint16_t counts[] = {message.header.ancount, message.header.nscount, message.header.arcount};
+            for (size_t section = 0; section < 3; ++section) {
+                message.offsets[section + 1] = offset;
+                for (uint16_t i = 0; i < counts[section]; ++i) {
+                    ResourceRecordView::read(packet, offset);
+                }
+            }
+            return message;
+        }
 
-                output << "Preference: " << preference << ", Mail Exchange: " << mailExchange;
-                return {output.str(), offset};
+        const DNSHeader &getHeader() const {
+            return header;
         }
 
-        parserResult parseDefaultRecord(const Packet &response, size_t offset) {
-            std::string output;
-            std::tie(output, offset) = utils::parseDomainNameFromPacket(response, offset);
-            return {output, offset};
+        Section<QuestionView> questions() const {
+            return {packet, offsets[0], header.qdcount};
         }
 
-        parserResult parseTXTRecord(const Packet &response, size_t offset, uint16_t rdlength) {
-            std::string output;
-            size_t initialOffset = offset;
-
-            while (offset - initialOffset < rdlength) {
-                uint8_t stringLength = response[offset++];
-                std::string txtString(response.begin() + offset, response.begin() + offset + stringLength);
-                output += txtString + " ";
-                offset += stringLength;
-            }
-
-            if (output.empty()) {
-                output.pop_back();
-            }
-            return {output, offset};
-        }
-
-        parserResult parseARecord(const Packet &response, size_t offset) {
-            in_addr addr{};
-            std::memcpy(&addr, response.data() + offset, sizeof(struct in_addr));
-            offset += sizeof(struct in_addr);
-            return {std::string(inet_ntoa(addr)), offset};
-        }
-
-        parserResult parseAAAARecord(const Packet &response, size_t offset) {
-            char ipv6_str[INET6_ADDRSTRLEN];
-            inet_ntop(AF_INET6, response.data() + offset, ipv6_str, INET6_ADDRSTRLEN);
-            offset += INET6_ADDRLEN;
-            return {std::string(ipv6_str), offset};
-        }
-
-        parserResult parseSection(
-                const Packet &response,
-                size_t offset,
-                const int count,
-                const std::function<parserResult(const Packet &, size_t)> &parseFunction
-        ) {
-            std::stringstream output;
-            debugMsg("Parsing section with " << count << " entries" << std::endl);
-            for (int i = 0; i < count; ++i) {
-                std::string sectionOutput;
-                std::tie(sectionOutput, offset) = parseFunction(response, offset);
-                debugMsg(
-                        " >>> PARSED SECTION " << i
-                                               << ": offset " << offset << ", "
-                                               << "output \"" << sectionOutput << "\""
-                                               << std::endl
-                );
-                output << "  " << sectionOutput << '\n';
-            }
-            debugMsg("-----------------" << std::endl);
-            return {output.str(), offset};
-        }
-
-        parserResult parseCommonSection(
-                const Packet &response,
-                size_t offset,
-                const std::function<parserResult(const uint16_t type, const Packet &, size_t,uint16_t)> &parseTypeSpecific) {
-            std::stringstream output;
-            std::string name;
-            std::tie(name, offset) = utils::parseDomainNameFromPacket(response, offset);
-
-            const uint16_t type = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
-            const uint16_t authclass = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
-            const uint32_t ttl = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
-            offset += 4;
-            const uint16_t rdlength = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
+        Section<ResourceRecordView> answers() const {
+            return {packet, offsets[1], header.ancount};
+        }
 
-            std::string typeSpecificOutput;
-            size_t fake_offset;
-            std::tie(typeSpecificOutput, fake_offset) = parseTypeSpecific(type, response, offset, rdlength);
+        Section<ResourceRecordView> authorities() const {
+            return {packet, offsets[2], header.nscount};
+        }
 
-            output << name << ", ";
-            output << utils::typeToString(type) << ", ";
-            output << utils::classToString(authclass) << ", ";
-            output << ttl << ", ";
-            output << typeSpecificOutput;
+        Section<ResourceRecordView> additionals() const {
+            return {packet, offsets[3], header.arcount};
+        }
 
-            return {output.str(), offset + rdlength};
+        PacketView getPacket() const {
+            return packet;
         }
 
-        parserResult parseTypeSpecificSection(uint16_t type, const Packet &response, size_t offset,
-                                              uint16_t rdlength) {
-            switch (type) {
-                case TYPE_A:
-                    return parseARecord(response, offset);
-                case TYPE_AAAA:
-                    return parseAAAARecord(response, offset);
-                case TYPE_SOA:
-                    return parseSOARecord(response, offset);
-                case TYPE_MX:
-                    return parseMXRecord(response, offset);
-                case TYPE_TXT:
-                    return parseTXTRecord(response, offset, rdlength);
-                case TYPE_NS:
-                case TYPE_CNAME:
-                case TYPE_PTR:
-                    return parseDefaultRecord(response, offset);
-                default:
-                    return {"[Unsupported Type Data]", offset + rdlength};
+        // the EDNS0 OPT pseudo-record from the additional section, if the server sent one
+        std::optional<ResourceRecordView> opt() const {
+            for (const ResourceRecordView &record : additionals()) {
+                if (record.type == TYPE_OPT) {
+                    return record;
+                }
             }
+            return std::nullopt;
         }
 
-        parserResult parseQuestionSection(const Packet &response, size_t offset) {
-            std::stringstream output;
-            std::string qname{};
-            std::tie(qname, offset) = utils::parseDomainNameFromPacket(response, offset);
-            uint16_t qtype = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
-            uint16_t qclass = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
+    private:
+        PacketView packet;
+        DNSHeader header{};
+        size_t offsets[4]{};
+    };
 
-            output << qname << ", ";
-            output << utils::typeToString(qtype) << ", ";
-            output << utils::classToString(qclass);
+    namespace parsing {
+        namespace utils {
+            parserResult parseDomainNameFromPacket(const Packet &packet, size_t offset) {
+                return {NameView(packet, offset).toString(), skipName(packet, offset)};
+            }
 
-            return {output.str(), offset};
+            // the name in `resource`, so a caller with a per-message arena parses without touching the heap
+            std::tuple<std::pmr::string, size_t> parseDomainNameFromPacket(PacketView packet, size_t offset,
+                                                                           std::pmr::memory_resource *resource) {
+                return {NameView(packet, offset).toString(resource), skipName(packet, offset)};
+            }
         }
+    }
+
+    /**
+     * Typed views of record data. Like the rest of the message they reference the packet buffer.
+     * Every type reads itself from a record with read() and throws when the RDATA does not fit it.
+     */
+    namespace rdata {
+        namespace utils {
+            // offset right after a name in RDATA, which must end before `end`
+            size_t skipName(const ResourceRecordView &record, size_t offset, size_t end) {
+                offset = parsing::utils::skipName(record.packet, offset);
+                if (offset > end) {
+                    parsing::utils::throwMalformed("name past the end of the record");
+                }
+                return offset;
+            }
+
+            // <character-string> of RFC 1035, a length byte and that many bytes
+            std::string_view readString(const ResourceRecordView &record, size_t &offset, size_t end) {
+                if (offset >= end || offset + 1 + record.packet[offset] > end) {
+                    parsing::utils::throwMalformed("character-string past the end of the record");
+                }
+                const size_t length = record.packet[offset];
+                std::string_view string(reinterpret_cast<const char *>(record.packet.data() + offset + 1), length);
+                offset += 1 + length;
+                return string;
+            }
 
-        parserResult parseAnswerSection(const Packet &response, size_t offset) {
-            std::stringstream output;
-            std::string name;
-            std::tie(name, offset) = utils::parseDomainNameFromPacket(response, offset);
+            void requireLength(const ResourceRecordView &record, size_t minimum, const char *type) {
+                if (record.rdlength < minimum) {
+                    parsing::utils::throwMalformed(std::string(type) + " record too short");
+                }
+            }
+        }
 
-            // parse type
-            uint16_t type = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
+        struct A {
+            PacketView address;
 
-            // ansclass
-            uint16_t ansclass = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2;
+            static A read(const ResourceRecordView &record) {
+                if (record.rdlength != sizeof(in_addr)) {
+                    parsing::utils::throwMalformed("A record with wrong length");
+                }
+                return {record.rdata()};
+            }
+        };
 
-            // ttl
-            uint32_t ttl = ntohl(*reinterpret_cast<const uint32_t *>(response.data() + offset));
-            offset += 4;
+        struct AAAA {
+            PacketView address;
 
-            // rdlength
-            uint16_t rdlength = ntohs(*reinterpret_cast<const uint16_t *>(response.data() + offset));
-            offset += 2; // Skipping RDATA length
+            static AAAA read(const ResourceRecordView &record) {
+                if (record.rdlength != INET6_ADDRLEN) {
+                    parsing::utils::throwMalformed("AAAA record with wrong length");
+                }
+                return {record.rdata()};
+            }
+        };
 
+        // NS, CNAME and PTR
+        struct DomainName {
+            NameView target;
 
-            // parse type specific section
-            std::string typeSpecificOutput;
-            std::tie(typeSpecificOutput, offset) = parseTypeSpecificSection(type, response, offset, rdlength);
+            static DomainName read(const ResourceRecordView &record) {
+                utils::skipName(record, record.rdataOffset, record.rdataOffset + record.rdlength);
+                return {NameView(record.packet, record.rdataOffset)};
+            }
+        };
 
-            output << name << ", ";
-            output << utils::typeToString(type) << ", ";
-            output << utils::classToString(ansclass) << ", ";
-            output << ttl << ", ";
-            output << typeSpecificOutput;
+        struct MX {
+            uint16_t preference;
+            NameView exchange;
 
-            return {output.str(), offset};
+            static MX read(const ResourceRecordView &record) {
+                utils::requireLength(record, 3, "MX");
+                const size_t offset = record.rdataOffset;
+                utils::skipName(record, offset + 2, offset + record.rdlength);
+                return {parsing::utils::readUint16(record.packet, offset), NameView(record.packet, offset + 2)};
+            }
+        };
+
+        struct SOA {
+            NameView mname;
+            NameView rname;
+            uint32_t serial;
+            uint32_t refresh;
+            uint32_t retry;
+            uint32_t expire;
+            uint32_t minimum;
+
+            static SOA read(const ResourceRecordView &record) {
+                const PacketView packet = record.packet;
+                const size_t offset = record.rdataOffset;
+                const size_t rnameOffset = parsing::utils::skipName(packet, offset);
+                const size_t numbersOffset = parsing::utils::skipName(packet, rnameOffset);
+                if (numbersOffset + 20 > offset + record.rdlength) {
+                    parsing::utils::throwMalformed("SOA record too short");
+                }
+                return {
+                    NameView(packet, offset),
+                    NameView(packet, rnameOffset),
+                    parsing::utils::readUint32(packet, numbersOffset),
+                    parsing::utils::readUint32(packet, numbersOffset + 4),
+                    parsing::utils::readUint32(packet, numbersOffset + 8),
+                    parsing::utils::readUint32(packet, numbersOffset + 12),
+                    parsing::utils::readUint32(packet, numbersOffset + 16),
+                };
+            }
+        };
+
+        struct TXT {
+            PacketView strings;
+
+            // calls visit(std::string_view) for every character-string
+            template<typename Visitor>
+            void forEachString(Visitor visit) const {
+                size_t offset = 0;
+                while (offset < strings.size()) {
+                    uint8_t length = strings[offset++];
+                    visit(std::string_view(reinterpret_cast<const char *>(strings.data() + offset), length));
+                    offset += length;
+                }
+            }
+
+            static TXT read(const ResourceRecordView &record) {
+                const PacketView strings = record.rdata();
+                for (size_t position = 0; position < strings.size(); position += strings[position] + 1) {
+                    if (position + 1 + strings[position] > strings.size()) {
+                        parsing::utils::throwMalformed("TXT string past the end of the record");
+                    }
+                }
+                return {strings};
+            }
+        };
+
+        /**
+         * EDNS0 pseudo-record (RFC 6891), CLASS carries the payload size and TTL the extended header.
+         */
+        struct OPT {
+            uint16_t udpPayloadSize;
+            uint8_t extendedRcode;
+            uint8_t version;
+            bool dnssecOk;
+            PacketView options;
+
+            static OPT read(const ResourceRecordView &record) {
+                return {
+                    record.rclass,
+                    static_cast<uint8_t>(record.ttl >> 24),
+                    static_cast<uint8_t>((record.ttl >> 16) & 0xFF),
+                    (record.ttl & EDNS_FLAG_DO) != 0,
+                    record.rdata(),
+                };
+            }
+        };
+
+        // RFC 2782
+        struct SRV {
+            uint16_t priority;
+            uint16_t weight;
+            uint16_t port;
+            NameView target;
+
+            static SRV read(const ResourceRecordView &record) {
+                utils::requireLength(record, 7, "SRV");
+                const PacketView packet = record.packet;
+                const size_t offset = record.rdataOffset;
+                utils::skipName(record, offset + 6, offset + record.rdlength);
+                return {
+                    parsing::utils::readUint16(packet, offset),
+                    parsing::utils::readUint16(packet, offset + 2),
+                    parsing::utils::readUint16(packet, offset + 4),
+                    NameView(packet, offset + 6),
+                };
+            }
+        };
+
+        // RFC 3403
+        struct NAPTR {
+            uint16_t order;
+            uint16_t preference;
+            std::string_view flags;
+            std::string_view services;
+            std::string_view regexp;
+            NameView replacement;
+
+            static NAPTR read(const ResourceRecordView &record) {
+                utils::requireLength(record, 8, "NAPTR");
+                const size_t end = record.rdataOffset + record.rdlength;
+                size_t offset = record.rdataOffset + 4;
+                NAPTR naptr{
+                    parsing::utils::readUint16(record.packet, record.rdataOffset),
+                    parsing::utils::readUint16(record.packet, record.rdataOffset + 2),
+                    utils::readString(record, offset, end),
+                    utils::readString(record, offset, end),
+                    utils::readString(record, offset, end),
+                    NameView(record.packet, offset),
+                };
+                utils::skipName(record, offset, end);
+                return naptr;
+            }
+        };
+
+        // RFC 4034
+        struct DS {
+            uint16_t keyTag;
+            uint8_t algorithm;
+            uint8_t digestType;
+            PacketView digest;
+
+            static DS read(const ResourceRecordView &record) {
+                utils::requireLength(record, 5, "DS");
+                const PacketView data = record.rdata();
+                return {parsing::utils::readUint16(data, 0), data[2], data[3], data.subspan(4)};
+            }
+        };
+
+        // RFC 4034
+        struct DNSKEY {
+            uint16_t flags;
+            uint8_t protocol;
+            uint8_t algorithm;
+            PacketView publicKey;
+
+            static DNSKEY read(const ResourceRecordView &record) {
+                utils::requireLength(record, 5, "DNSKEY");
+                const PacketView data = record.rdata();
+                return {parsing::utils::readUint16(data, 0), data[2], data[3], data.subspan(4)};
+            }
+        };
+
+        // RFC 4034, the signer name is never compressed
+        struct RRSIG {
+            uint16_t typeCovered;
+            uint8_t algorithm;
+            uint8_t labels;
+            uint32_t originalTtl;
+            uint32_t expiration;
+            uint32_t inception;
+            uint16_t keyTag;
+            NameView signer;
+            PacketView signature;
+
+            static RRSIG read(const ResourceRecordView &record) {
+                utils::requireLength(record, 19, "RRSIG");
+                const PacketView packet = record.packet;
+                const size_t offset = record.rdataOffset;
+                const size_t end = offset + record.rdlength;
+                const size_t signatureOffset = utils::skipName(record, offset + 18, end);
+                return {
+                    parsing::utils::readUint16(packet, offset),
+                    packet[offset + 2],
+                    packet[offset + 3],
+                    parsing::utils::readUint32(packet, offset + 4),
+                    parsing::utils::readUint32(packet, offset + 8),
+                    parsing::utils::readUint32(packet, offset + 12),
+                    parsing::utils::readUint16(packet, offset + 16),
+                    NameView(packet, offset + 18),
+                    packet.subspan(signatureOffset, end - signatureOffset),
+                };
+            }
+        };
+
+        // RFC 8659
+        struct CAA {
+            uint8_t flags;
+            std::string_view tag;
+            PacketView value;
+
+            static CAA read(const ResourceRecordView &record) {
+                utils::requireLength(record, 2, "CAA");
+                const size_t end = record.rdataOffset + record.rdlength;
+                size_t offset = record.rdataOffset + 1;
+                const std::string_view tag = utils::readString(record, offset, end);
+                return {record.packet[record.rdataOffset], tag, record.packet.subspan(offset, end - offset)};
+            }
+        };
+
+        /**
+         * SVCB and HTTPS (RFC 9460). The parameters are kept in wire format, forEachParam() walks them.
+         */
+        struct SVCB {
+            uint16_t priority;
+            NameView target;
+            PacketView params;
+
+            // calls visit(uint16_t key, PacketView value) for every SvcParam
+            template<typename Visitor>
+            void forEachParam(Visitor visit) const {
+                size_t offset = 0;
+                while (offset < params.size()) {
+                    const uint16_t key = parsing::utils::readUint16(params, offset);
+                    const uint16_t length = parsing::utils::readUint16(params, offset + 2);
+                    visit(key, params.subspan(offset + 4, length));
+                    offset += 4 + length;
+                }
+            }
+
+            static SVCB read(const ResourceRecordView &record) {
+                utils::requireLength(record, 3, "SVCB");
+                const size_t end = record.rdataOffset + record.rdlength;
+                const size_t paramsOffset = utils::skipName(record, record.rdataOffset + 2, end);
+                const PacketView params = record.packet.subspan(paramsOffset, end - paramsOffset);
+                for (size_t offset = 0; offset < params.size();) {
+                    if (offset + 4 > params.size()
+                        || offset + 4 + parsing::utils::readUint16(params, offset + 2) > params.size()) {
+                        parsing::utils::throwMalformed("SvcParam past the end of the record");
+                    }
+                    offset += 4 + parsing::utils::readUint16(params, offset + 2);
+                }
+                return {parsing::utils::readUint16(record.packet, record.rdataOffset),
+                        NameView(record.packet, record.rdataOffset + 2), params};
+            }
+        };
+
+        // types without a decoder, written in the generic RFC 3597 form
+        struct Unknown {
+            PacketView data;
+        };
+
+        typedef std::variant<A, AAAA, DomainName, MX, SOA, TXT, OPT, SRV, NAPTR, DS, DNSKEY, RRSIG, CAA, SVCB,
+                             Unknown> RecordData;
+
+        /**
+         * Entry of the record type registry: the code, the mnemonic and the decoder of one type.
+         */
+        struct TypeInfo {
+            uint16_t code;
+            std::string_view mnemonic;
+            RecordData (*decode)(const ResourceRecordView &record);
+        };
+
+        template<typename Data>
+        RecordData decodeAs(const ResourceRecordView &record) {
+            return Data::read(record);
         }
 
-        parserResult parseAuthoritySection(const Packet &response, size_t offset) {
-            return parseCommonSection(response, offset, parseTypeSpecificSection);
+        // every type this tool knows, declared once
+        constexpr TypeInfo TYPES[] = {
+            {TYPE_A, "A", decodeAs<A>},
+            {TYPE_NS, "NS", decodeAs<DomainName>},
+            {TYPE_CNAME, "CNAME", decodeAs<DomainName>},
+            {TYPE_SOA, "SOA", decodeAs<SOA>},
+            {TYPE_PTR, "PTR", decodeAs<DomainName>},
+            {TYPE_MX, "MX", decodeAs<MX>},
+            {TYPE_TXT, "TXT", decodeAs<TXT>},
+            {TYPE_AAAA, "AAAA", decodeAs<AAAA>},
+            {TYPE_SRV, "SRV", decodeAs<SRV>},
+            {TYPE_NAPTR, "NAPTR", decodeAs<NAPTR>},
+            {TYPE_OPT, "OPT", decodeAs<OPT>},
+            {TYPE_DS, "DS", decodeAs<DS>},
+            {TYPE_RRSIG, "RRSIG", decodeAs<RRSIG>},
+            {TYPE_DNSKEY, "DNSKEY", decodeAs<DNSKEY>},
+            {TYPE_SVCB, "SVCB", decodeAs<SVCB>},
+            {TYPE_HTTPS, "HTTPS", decodeAs<SVCB>},
+            {TYPE_CAA, "CAA", decodeAs<CAA>},
+        };
+
+        /**
+         * Dense index from a type code to its entry in TYPES plus one, zero for unknown types, so that dispatch
+         * is one byte load. Built at compile time, a duplicate code fails the build.
+         */
+        constexpr auto TYPE_INDEX = []() {
+            std::array<uint8_t, TYPE_CAA + 1> index{};
+            for (size_t i = 0; i < std::size(TYPES); ++i) {
+                if (TYPES[i].code >= index.size() || index[TYPES[i].code]) {
+                    throw "record type registered twice or beyond the index";
+                }
+                index[TYPES[i].code] = static_cast<uint8_t>(i + 1);
+            }
+            return index;
+        }();
+
+        const TypeInfo *findType(uint16_t code) {
+            return code < TYPE_INDEX.size() && TYPE_INDEX[code] ? &TYPES[TYPE_INDEX[code] - 1] : nullptr;
         }
 
-        parserResult parseAdditionalSection(const Packet &response, size_t offset) {
-            return parseCommonSection(response, offset, parseTypeSpecificSection);
+        RecordData decode(const ResourceRecordView &record) {
+            const TypeInfo *type = findType(record.type);
+            return type ? type->decode(record) : Unknown{record.rdata()};
         }
     }
 
-    namespace constructorUtils {
-        std::vector<uint8_t> encodeDNSName(const std::string &domain) {
-            std::vector<uint8_t> encodedName;
-            size_t lastPos = 0;
-            size_t pos = domain.find('.');
-            while (pos != std::string::npos) {
-                encodedName.push_back(static_cast<uint8_t>(pos - lastPos));
-                for (size_t i = lastPos; i < pos; ++i) {
-                    encodedName.push_back(static_cast<uint8_t>(domain[i]));
+    namespace parsing::utils {
+        std::optional<std::string_view> typeName(const uint16_t type) {
+            const rdata::TypeInfo *info = rdata::findType(type);
+            if (info) {
+                return info->mnemonic;
+            }
+            switch (type) {
+                case TYPE_IXFR:
+                    return "IXFR";
+                case TYPE_AXFR:
+                    return "AXFR";
+                default:
+                    return std::nullopt;
+            }
+        }
+
+        // RFC 3597 notation for types without a mnemonic
+        std::string typeToString(const uint16_t type) {
+            const std::optional<std::string_view> name = typeName(type);
+            return name ? std::string(*name) : "TYPE" + std::to_string(type);
+        }
+
+        // a mnemonic in any case or the TYPEnnn form
+        std::optional<uint16_t> stringToType(std::string_view type) {
+            std::string upper(type);
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+            for (const rdata::TypeInfo &info : rdata::TYPES) {
+                if (info.mnemonic == upper && info.code != TYPE_OPT) {
+                    return info.code;
                 }
-                lastPos = pos + 1;
-                pos = domain.find('.', lastPos);
             }
-            encodedName.push_back(static_cast<uint8_t>(domain.size() - lastPos));
-            for (size_t i = lastPos; i < domain.size(); ++i) {
-                encodedName.push_back(static_cast<uint8_t>(domain[i]));
+            if (upper.starts_with("TYPE")) {
+                uint16_t code = 0;
+                const char *begin = upper.data() + 4;
+                const char *end = upper.data() + upper.size();
+                auto [parsed, error] = std::from_chars(begin, end, code);
+                if (begin != end && error == std::errc() && parsed == end) {
+                    return code;
+                }
             }
-            encodedName.push_back(0);
+            return std::nullopt;
+        }
+    }
+
+    namespace constructorUtils {
+        // appends the wire format of `domain` to any byte buffer, sized once and written in place
+        template<typename Buffer>
+        void appendDNSName(Buffer &output, std::string_view domain) {
+            const size_t offset = output.size();
+            output.resize(offset + names::wireLength(domain));
+            output.resize(offset + names::presentationToWire(domain, output.data() + offset));
+        }
+
+        std::vector<uint8_t> encodeDNSName(const std::string &domain) {
+            std::vector<uint8_t> encodedName;
+            appendDNSName(encodedName, domain);
             return encodedName;
         }
 
-        std::string reverseIPv4(const std::string &ip) {
-            struct sockaddr_in sa{};
+        std::pmr::vector<uint8_t> encodeDNSName(std::string_view domain, std::pmr::memory_resource *resource) {
+            std::pmr::vector<uint8_t> encodedName(resource);
+            appendDNSName(encodedName, domain);
+            return encodedName;
+        }
 
-            if (inet_pton(AF_INET, ip.c_str(), &(sa.sin_addr)) != 1) {
-                throw std::system_error(EINVAL, std::system_category(), "Invalid IPv4 address");
+        /**
+         * Appends the reverse lookup labels of an address, least significant first and each followed by a dot:
+         * one decimal label per byte for AF_INET, one hex label per nibble for AF_INET6.
+         */
+        template<typename String>
+        void appendReverseLabels(String &output, std::span<const uint8_t> address, int family) {
+            const char *hexadec = "0123456789abcdef";
+            for (size_t i = address.size(); i-- > 0;) {
+                const uint8_t byte = address[i];
+                if (family == AF_INET) {
+                    char digits[3];
+                    const auto end = std::to_chars(std::begin(digits), std::end(digits), byte).ptr;
+                    output.append(digits, end);
+                    output += '.';
+                } else {
+                    output += hexadec[byte & 0x0F];
+                    output += '.';
+                    output += hexadec[byte >> 4];
+                    output += '.';
+                }
             }
+        }
 
-            std::stringstream buffer;
-            for (int i = 0; i < 4; i++) {
-                buffer << std::to_string((sa.sin_addr.s_addr >> (i * 8)) & 0xFF) << ".";
+        /**
+         * Appends the in-addr.arpa name of an IPv4 address or the ip6.arpa name of an IPv6 one. The address
+         * is copied to the stack for inet_pton, so nothing is allocated beyond what `output` needs.
+         */
+        template<typename String>
+        void appendReverseName(String &output, std::string_view ip, int family) {
+            char text[INET6_ADDRSTRLEN] = {};
+            uint8_t address[sizeof(in6_addr)];
+            const bool fits = ip.size() < sizeof(text);
+            if (fits) {
+                ip.copy(text, ip.size());
+            }
+            if (!fits || inet_pton(family, text, address) != 1) {
+                throw std::system_error(EINVAL, std::system_category(),
+                                        family == AF_INET ? "Invalid IPv4 address" : "Invalid IPv6 address");
+            }
+            if (family == AF_INET) {
+                appendReverseLabels(output, {address, sizeof(in_addr)}, AF_INET);
+                output += "in-addr.arpa";
+            } else {
+                appendReverseLabels(output, {address, sizeof(in6_addr)}, AF_INET6);
+                output += "ip6.arpa";
             }
-            buffer << "in-addr.arpa";
-            return buffer.str();
         }
 
-        std::string reverseIPv6(const std::string &ip) {
-            struct sockaddr_in6 sa{};
-            // validate
-            if (inet_pton(AF_INET6, ip.c_str(), &(sa.sin6_addr)) != 1) {
-                throw std::system_error(EINVAL, std::system_category(), "Invalid IPv6 address");
-            }
+        std::string reverseIPv4(const std::string &ip) {
+            std::string result;
+            appendReverseName(result, ip, AF_INET);
+            return result;
+        }
 
-            const char *hexadec = "0123456789abcdef";
+        std::string reverseIPv6(const std::string &ip) {
             std::string result;
-            for (int i = 15; i >= 0; --i) {
-                uint8_t byte = sa.sin6_addr.s6_addr[i];
-                result += hexadec[byte & 0x0F];
-                result += '.';
-                result += hexadec[byte >> 4];
-                result += '.';
-            }
-            result += "ip6.arpa";
+            appendReverseName(result, ip, AF_INET6);
             return result;
         }
     }
 
-    std::tuple<Packet, Server> constructQueryPacket(const DNSConfiguration &args) {
-        Packet packet;
-        std::string address = args.address;
+    uint16_t randomQueryId() {
+        static std::mt19937 generator{std::random_device{}()};
+        return static_cast<uint16_t>(std::uniform_int_distribution<uint32_t>(0, 0xFFFF)(generator));
+    }
 
-        uint16_t flags = args.recursionRequested ? FLAG_RD : 0;
+    /**
+     * Writes the question a single query for `address` asks into `question`, reusing its name buffer:
+     * A or AAAA, or the PTR of the address with `reverseQuery`.
+     */
+    void constructQuestion(Question &question, std::string_view address, bool reverseQuery, bool queryTypeAAAA) {
+        question.qclass = CLASS_IN;
+        if (!reverseQuery) {
+            question.name.assign(address);
+            question.qtype = queryTypeAAAA ? TYPE_AAAA : TYPE_A;
+            return;
+        }
+        question.name.clear();
+        constructorUtils::appendReverseName(question.name, address, queryTypeAAAA ? AF_INET6 : AF_INET);
+        question.qtype = TYPE_PTR;
+    }
 
-        packet.push_back(42); packet.push_back(69); // ID
-        packet.push_back(flags >> 8);
-        packet.push_back(flags & 0xFF);
-        // QDCOUNT (number of questions)
-        packet.push_back(0);
-        packet.push_back(1);
-        // ANCOUNT (number of answers)
-        packet.push_back(0);
-        packet.push_back(0);
-        // NSCOUNT (number of authority records)
-        packet.push_back(0);
-        packet.push_back(0);
-        // ARCOUNT (number of additional records)
-        packet.push_back(0);
-        packet.push_back(0);
-
-
-        uint16_t qtype = args.queryTypeAAAA ? TYPE_AAAA : TYPE_A;
-        if (args.reverseQuery) {
-            qtype = TYPE_PTR;
-            address = (args.queryTypeAAAA ? constructorUtils::reverseIPv6 : constructorUtils::reverseIPv4)(
-                    args.address);
-        }
-        std::vector<uint8_t> qname = constructorUtils::encodeDNSName(address);
-        packet.insert(packet.end(), qname.begin(), qname.end());
-
-        packet.push_back(qtype >> 8);
-        packet.push_back(qtype & 0xFF);
-        packet.push_back(CLASS_IN >> 8);
-        packet.push_back(CLASS_IN & 0xFF);
+    Question constructQuestion(const DNSConfiguration &args) {
+        Question question;
+        constructQuestion(question, args.address, args.reverseQuery, args.queryTypeAAAA);
+        return question;
+    }
 
+    /**
+     * Writes the query to `packet`, replacing what it held. The size is known up front, so the buffer is
+     * resized once and filled in place, a reused buffer keeps its capacity. A non-zero `ednsPayloadSize`
+     * adds an EDNS0 OPT record advertising that UDP payload size.
+     */
+    template<typename Buffer>
+    void writeQueryPacket(Buffer &packet, uint16_t id, uint16_t flags, const Question &question,
+                          uint16_t ednsPayloadSize = 0) {
+        statsPhase(PHASE_CONSTRUCT);
+        // header, name, type and class, OPT record
+        packet.resize(DNS_HEADER_SIZE + names::wireLength(question.name) + 4 + (ednsPayloadSize ? 11 : 0));
+        uint8_t *output = packet.data();
+        // ID, flags, QDCOUNT = 1, ANCOUNT = 0, NSCOUNT = 0, ARCOUNT = 1 with an OPT record
+        const uint8_t header[DNS_HEADER_SIZE] = {
+            static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id & 0xFF),
+            static_cast<uint8_t>(flags >> 8), static_cast<uint8_t>(flags & 0xFF),
+            0, 1,
+            0, 0,
+            0, 0,
+            0, static_cast<uint8_t>(ednsPayloadSize ? 1 : 0),
+        };
+        std::memcpy(output, header, DNS_HEADER_SIZE);
+        output += DNS_HEADER_SIZE;
+        output += names::presentationToWire(question.name, output);
+
+        *output++ = question.qtype >> 8;
+        *output++ = question.qtype & 0xFF;
+        *output++ = question.qclass >> 8;
+        *output++ = question.qclass & 0xFF;
+
+        if (ednsPayloadSize) {
+            // root name, TYPE, CLASS = payload size, TTL = extended RCODE, version and flags, RDLENGTH
+            const uint8_t opt[] = {
+                0,
+                TYPE_OPT >> 8, TYPE_OPT & 0xFF,
+                static_cast<uint8_t>(ednsPayloadSize >> 8), static_cast<uint8_t>(ednsPayloadSize & 0xFF),
+                0, 0, 0, 0,
+                0, 0,
+            };
+            std::memcpy(output, opt, sizeof(opt));
+            output += sizeof(opt);
+        }
+        packet.resize(output - packet.data());
+    }
+
+    Packet constructQueryPacket(uint16_t id, uint16_t flags, const Question &question, uint16_t ednsPayloadSize = 0) {
+        Packet packet;
+        writeQueryPacket(packet, id, flags, question, ednsPayloadSize);
+        return packet;
+    }
+
+    // the same query allocated from `resource`
+    pmr::Packet constructQueryPacket(uint16_t id, uint16_t flags, const Question &question, uint16_t ednsPayloadSize,
+                                     std::pmr::memory_resource *resource) {
+        pmr::Packet packet(resource);
+        writeQueryPacket(packet, id, flags, question, ednsPayloadSize);
+        return packet;
+    }
+
+    std::tuple<Packet, Server> constructQueryPacket(const DNSConfiguration &args) {
+        uint16_t flags = args.recursionRequested ? FLAG_RD : 0;
         return {
-            packet,
+            constructQueryPacket(randomQueryId(), flags, constructQuestion(args), args.ednsPayloadSize.value_or(0)),
             {
                 .port = args.port.value_or(DEFAULT_DNS_PORT),
-                .address = args.server,
+                .address = args.servers.front(),
             }
         };
     }
 
-    std::string parseResponsePacket(const Packet &response) {
-        std::stringstream output;
-        size_t offset = 0;
+    bool isTruncated(PacketView response) {
+        return response.size() >= DNS_HEADER_SIZE && (parsing::utils::readUint16(response, 2) & FLAG_TRUNC);
+    }
 
-        // Parse the header
-        DNSHeader header{};
-        std::memcpy(&header, response.data() + offset, sizeof(DNSHeader));
-        header.id = ntohs(header.id);
-        header.flags = ntohs(header.flags);
-        header.qdcount = ntohs(header.qdcount);
-        header.ancount = ntohs(header.ancount);
-        header.nscount = ntohs(header.nscount);
-        header.arcount = ntohs(header.arcount);
-        offset += sizeof(DNSHeader);
-
-        // Print header flags
-        output << "Authoritative: " << ((header.flags & FLAG_AUTHORITATIVE) ? "Yes" : "No") << ", ";
-        output << "Recursive: " << ((header.flags & FLAG_RECURSIVE) ? "Yes" : "No") << ", ";
-        output << "Truncated: " << ((header.flags & FLAG_TRUNC) ? "Yes" : "No") << std::endl;
-
-        // Process sections
-        debugMsg("PARSE QUESTION SECTION" << std::endl);
-        std::string sectionOutput;
-        output << "Question section (" << header.qdcount << ")" << std::endl;
-        std::tie(sectionOutput, offset) = parsing::parseSection(
-                response, offset, header.qdcount,
-                parsing::parseQuestionSection
-        );
-        output << sectionOutput;
-
-        // fixme: the error is maybe here in answer so I increase too much of offset at the end of the function
-        debugMsg("PARSE ANSWER SECTION" << std::endl);
-        output << "Answer section (" << header.ancount << ")" << std::endl;
-        std::tie(sectionOutput, offset) = parsing::parseSection(
-                response, offset, header.ancount,
-                parsing::parseAnswerSection
-        );
-        output << sectionOutput;
-
-        debugMsg("PARSE AUTHORITY SECTION" << std::endl);
-        output << "Authority section (" << header.nscount << ")" << std::endl;
-        std::tie(sectionOutput, offset) = parsing::parseSection(
-                response, offset, header.nscount,
-                parsing::parseAuthoritySection
-        );
-        output << sectionOutput;
-
-        debugMsg("PARSE ADDITIONAL SECTION" << std::endl);
-        output << "Additional section (" << header.arcount << ")" << std::endl;
-        std::tie(sectionOutput, offset) = parsing::parseSection(
-                response, offset, header.arcount,
-                parsing::parseAdditionalSection
-        );
-        output << sectionOutput;
-
-        debugMsg("\n\n");
-        return output.str();
+    /**
+     * The returned message references `response`, which has to outlive it.
+     */
+    DNSMessage parseResponsePacket(PacketView response) {
+        statsPhase(PHASE_PARSE);
+        return DNSMessage::parse(response);
     }
 }
@@ -0,0 +1,361 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#include "dnsclient.h"
+
+#include "batch.h"
+#include "dns.h"
+#include "output.h"
+#include "retransmit.h"
+#include "tcp.h"
+#include "udp.h"
+
+#include <deque>
+#include <poll.h>
+
+
+// the random ID of a new query is drawn again while it collides, so the window stays well below the ID space
+const size_t CLIENT_MAX_WINDOW = DNS_ID_SPACE / 2;
+
+namespace dnsclient {
+
+    /**
+     * Single-threaded engine behind a Resolver, the batch engine turned inside out: questions come from
+     * awaiting coroutines instead of a query source, and results go back to them instead of to a sink.
+     * Slots are indexed by query ID, timers carry the ID and the generation of the slot like in batch.h.
+     */
+    struct Resolver::Engine {
+        struct Server {
+            std::unique_ptr<udp::Socket> socket;
+            std::unique_ptr<tcp::Connection> connection;
+            retransmit::RttEstimator rtt;
+            // IDs and generations of the transmissions the socket did not take yet
+            std::vector<std::pair<uint16_t, uint32_t>> outbox;
+        };
+
+        struct Slot {
+            batch::InFlightQuery query;
+            Query *waiter = nullptr;
+        };
+
+        explicit Engine(const Options &options)
+                : options(options), slots(DNS_ID_SPACE),
+                  bufferSize(std::max<size_t>(options.ednsPayloadSize, DNS_PACKET_SIZE)),
+                  window(std::clamp<size_t>(options.window, 1, CLIENT_MAX_WINDOW)),
+                  ring(MMSG_BATCH_SIZE, bufferSize) {
+            if (options.servers.empty()) {
+                throw std::system_error(EINVAL, std::generic_category(), "Resolver needs at least one server");
+            }
+            const int timeoutSec = static_cast<int>(
+                    std::chrono::ceil<std::chrono::seconds>(options.timeout).count());
+            for (const std::string &server : options.servers) {
+                Server &entry = servers.emplace_back();
+                entry.socket = std::make_unique<udp::Socket>(server, options.port, bufferSize);
+                entry.socket->reserveReceiveBuffer(window * (bufferSize + DATAGRAM_OVERHEAD));
+                entry.connection = std::make_unique<tcp::Connection>(server, options.port, timeoutSec, false);
+            }
+        }
+
+        void submit(Query &query) {
+            query.submitted = true;
+            backlog.push_back(&query);
+        }
+
+        // the awaiting coroutine went away, whatever state its query is in
+        void cancel(Query &query) {
+            if (query.id) {
+                release(*query.id);
+            }
+            std::erase(backlog, &query);
+            std::replace(completed.begin(), completed.end(), &query, static_cast<Query *>(nullptr));
+            std::replace(resuming.begin(), resuming.end(), &query, static_cast<Query *>(nullptr));
+        }
+
+        bool poll(std::chrono::milliseconds timeout) {
+            start();
+            flush();
+            const retransmit::Clock::time_point now = retransmit::Clock::now();
+            auto wait = std::min<retransmit::Clock::duration>(timeout, timers.untilNext(now));
+            if (!completed.empty() || (!backlog.empty() && inFlight < window)) {
+                wait = retransmit::Clock::duration::zero();
+            }
+            if (inFlight) {
+                waitForEvents(std::chrono::ceil<std::chrono::milliseconds>(wait));
+                receive();
+            }
+            timers.advance(retransmit::Clock::now(), [this](uint64_t key) { onTimer(key); });
+            resume();
+            return pending() > 0;
+        }
+
+        size_t pending() const {
+            return inFlight + backlog.size() + completed.size();
+        }
+
+    private:
+        // takes questions from the backlog while the window has room
+        void start() {
+            const uint16_t flags = options.recursionDesired ? FLAG_RD : 0;
+            while (inFlight < window && !backlog.empty()) {
+                Query &query = *backlog.front();
+                backlog.pop_front();
+                uint16_t id;
+                do {
+                    id = dns::randomQueryId();
+                } while (slots[id].query.active);
+                Slot &slot = slots[id];
+                batch::InFlightQuery &inFlightQuery = slot.query;
+                question.name.assign(query.question.name);
+                question.qtype = query.question.type;
+                question.qclass = query.question.qclass;
+                try {
+                    batch::startQuery(inFlightQuery, id, flags, question, options.ednsPayloadSize);
+                } catch (const std::system_error &err) {
+                    query.result.error = err.code();
+                    completed.push_back(&query);
+                    continue;
+                }
+                inFlightQuery.expiresAt = retransmit::Clock::now() + options.timeout;
+                slot.waiter = &query;
+                query.id = id;
+                inFlight++;
+                transmit(id, fastestServer());
+            }
+        }
+
+        size_t fastestServer() const {
+            size_t fastest = 0;
+            for (size_t server = 1; server < servers.size(); ++server) {
+                if (servers[server].rtt.rto() < servers[fastest].rtt.rto()) {
+                    fastest = server;
+                }
+            }
+            return fastest;
+        }
+
+        void transmit(uint16_t id, size_t server) {
+            batch::InFlightQuery &query = slots[id].query;
+            query.generation++;
+            query.server = server;
+            query.transmissions++;
+            query.sentAt = retransmit::Clock::now();
+            servers[server].outbox.emplace_back(id, query.generation);
+            arm(id, std::min(query.sentAt + servers[server].rtt.backoff(query.transmissions), query.expiresAt));
+        }
+
+        void arm(uint16_t id, retransmit::Clock::time_point when) {
+            timers.schedule((static_cast<uint64_t>(slots[id].query.generation) << 16) | id, when);
+        }
+
+        // hands queued transmissions to the sockets, what they do not take waits for POLLOUT
+        void flush() {
+            for (Server &server : servers) {
+                packets.clear();
+                std::erase_if(server.outbox, [this](const auto &entry) {
+                    const batch::InFlightQuery &query = slots[entry.first].query;
+                    return !query.active || query.generation != entry.second;
+                });
+                for (const auto &[id, generation] : server.outbox) {
+                    packets.push_back(slots[id].query.packet);
+                }
+                const size_t sent = packets.empty() ? 0 : server.socket->sendMany(packets);
+                server.outbox.erase(server.outbox.begin(), server.outbox.begin() + sent);
+            }
+        }
+
+        void waitForEvents(std::chrono::milliseconds timeout) {
+            std::vector<pollfd> descriptors;
+            for (const Server &server : servers) {
+                descriptors.push_back({server.socket->descriptor(),
+                                       static_cast<short>(POLLIN | (server.outbox.empty() ? 0 : POLLOUT)), 0});
+                if (server.connection->descriptor() >= 0) {
+                    descriptors.push_back({server.connection->descriptor(),
+                                           static_cast<short>(POLLIN | (server.connection->wantsWrite() ? POLLOUT : 0)),
+                                           0});
+                }
+            }
+            if (::poll(descriptors.data(), descriptors.size(), static_cast<int>(timeout.count())) < 0 && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll resolver sockets");
+            }
+        }
+
+        void receive() {
+            for (size_t server = 0; server < servers.size(); ++server) {
+                size_t received;
+                while ((received = servers[server].socket->receiveMany(ring)) > 0) {
+                    for (size_t i = 0; i < received; ++i) {
+                        onResponse(ring.message(i), server, false);
+                    }
+                }
+                tcp::Connection &connection = *servers[server].connection;
+                connection.flush();
+                connection.receive([&](std::span<const uint8_t> message) {
+                    onResponse(message, server, true);
+                });
+            }
+        }
+
+        void onResponse(dns::PacketView packet, size_t server, bool viaTcp) {
+            if (packet.size() < DNS_HEADER_SIZE) {
+                return;
+            }
+            const uint16_t id = (packet[0] << 8) | packet[1];
+            batch::InFlightQuery &query = slots[id].query;
+            if (!query.active || query.overTcp != viaTcp || !batch::responseMatches(packet, query)) {
+                return;
+            }
+            // Karn's algorithm, only answers to a single transmission are timed
+            if (!viaTcp && query.transmissions == 1 && server == query.server) {
+                servers[server].rtt.sample(retransmit::Clock::now() - query.sentAt);
+            }
+            if (!viaTcp && dns::isTruncated(packet)) {
+                query.overTcp = true;
+                query.server = server;
+                query.generation++;
+                try {
+                    servers[server].connection->send(id, query.packet);
+                } catch (const std::system_error &err) {
+                    complete(id, err.code());
+                    return;
+                }
+                arm(id, query.expiresAt);
+                return;
+            }
+            Result &result = slots[id].waiter->result;
+            result.packet.assign(packet.begin(), packet.end());
+            try {
+                const dns::DNSMessage message = dns::parseResponsePacket(result.packet);
+                result.rcode = message.getHeader().flags & RCODE_MASK;
+                for (const dns::ResourceRecordView &view : message.answers()) {
+                    Record &record = result.answers.emplace_back();
+                    view.name.appendTo(record.name);
+                    record.type = view.type;
+                    record.qclass = view.rclass;
+                    record.ttl = view.ttl;
+                    std::visit(output::TextRecordData(record.data), dns::rdata::decode(view));
+                }
+            } catch (const std::system_error &err) {
+                result.answers.clear();
+                complete(id, err.code());
+                return;
+            }
+            complete(id, {});
+        }
+
+        void onTimer(uint64_t key) {
+            const uint16_t id = key & 0xFFFF;
+            batch::InFlightQuery &query = slots[id].query;
+            if (!query.active || query.generation != key >> 16) {
+                return;
+            }
+            const retransmit::Clock::time_point now = retransmit::Clock::now();
+            if (now >= query.expiresAt) {
+                complete(id, std::make_error_code(std::errc::timed_out));
+                return;
+            }
+            if (query.overTcp || query.transmissions > MAX_RETRANSMITS) {
+                query.generation++;
+                arm(id, query.expiresAt);
+                return;
+            }
+            servers[query.server].rtt.penalize();
+            transmit(id, (query.server + 1) % servers.size());
+        }
+
+        void complete(uint16_t id, std::error_code error) {
+            Slot &slot = slots[id];
+            slot.waiter->result.error = error;
+            completed.push_back(slot.waiter);
+            release(id);
+        }
+
+        void release(uint16_t id) {
+            Slot &slot = slots[id];
+            if (slot.query.overTcp) {
+                servers[slot.query.server].connection->forget(id);
+            }
+            batch::finishQuery(slot.query);
+            slot.query.generation++;
+            slot.waiter->id.reset();
+            slot.waiter = nullptr;
+            inFlight--;
+        }
+
+        // a resumed coroutine may destroy queries that completed in the same round, cancel() clears them here
+        void resume() {
+            resuming.swap(completed);
+            for (size_t i = 0; i < resuming.size(); ++i) {
+                if (Query *query = std::exchange(resuming[i], nullptr)) {
+                    query->submitted = false;
+                    query->awaiting.resume();
+                }
+            }
+            resuming.clear();
+        }
+
+        Options options;
+        std::vector<Server> servers;
+        std::vector<Slot> slots;
+        size_t bufferSize;
+        size_t window;
+        udp::MessageRing ring;
+        retransmit::TimerWheel timers;
+        std::deque<Query *> backlog;
+        std::vector<Query *> completed;
+        std::vector<Query *> resuming;
+        // the question of the query being started and the packets of a flush, kept between calls
+        dns::Question question;
+        std::vector<dns::PacketView> packets;
+        size_t inFlight = 0;
+    };
+
+    Resolver::Query::~Query() {
+        if (submitted) {
+            engine.cancel(*this);
+        }
+    }
+
+    void Resolver::Query::await_suspend(std::coroutine_handle<> handle) {
+        awaiting = handle;
+        engine.submit(*this);
+    }
+
+    Resolver::Resolver(const Options &options) : engine(std::make_unique<Engine>(options)) {}
+
+    Resolver::~Resolver() = default;
+
+    Resolver::Query Resolver::query(std::string name, uint16_t type, uint16_t qclass) {
+        return Query(*engine, {std::move(name), type, qclass});
+    }
+
+    Task<Result> Resolver::resolveOne(Question question) {
+        co_return co_await query(std::move(question.name), question.type, question.qclass);
+    }
+
+    Task<std::vector<Result>> Resolver::resolveMany(std::span<const Question> questions) {
+        // every task is submitted before the first one is awaited
+        std::vector<Task<Result>> tasks;
+        tasks.reserve(questions.size());
+        for (const Question &question : questions) {
+            tasks.push_back(resolveOne(question));
+        }
+        std::vector<Result> results;
+        results.reserve(tasks.size());
+        for (Task<Result> &task : tasks) {
+            results.push_back(co_await task);
+        }
+        co_return results;
+    }
+
+    bool Resolver::poll(std::chrono::milliseconds timeout) {
+        return engine->poll(timeout);
+    }
+
+    void Resolver::run() {
+        while (poll(std::chrono::milliseconds(1000))) {
+        }
+    }
+
+    size_t Resolver::pending() const {
+        return engine->pending();
+    }
+}
@@ -0,0 +1,298 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+/**
+ * Public interface of libdnsclient, the resolver of the dns tool as a library. Unlike the other headers
+ * it only declares, the implementation is compiled once into the library (make lib), so any number of
+ * translation units can include this file.
+ *
+ *     dnsclient::Task<> lookup(dnsclient::Resolver &resolver) {
+ *         dnsclient::Result result = co_await resolver.query("www.fit.vut.cz", dnsclient::types::AAAA);
+ *         ...
+ *     }
+ *
+ *     dnsclient::Resolver resolver({.servers = {"1.1.1.1"}});
+ *     dnsclient::Task<> task = lookup(resolver);
+ *     resolver.run();
+ *
+ * A resolver is driven by run() or poll() on one thread, coroutines awaiting it are resumed from there.
+ * Nothing blocks apart from the server name lookups in the constructor: queries go out over non-blocking
+ * UDP sockets, truncated answers are retried over non-blocking TCP connections.
+ */
+
+#include <string>
+#include <vector>
+#include <span>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include <optional>
+#include <exception>
+#include <coroutine>
+#include <system_error>
+
+namespace dnsclient {
+
+    namespace types {
+        constexpr uint16_t A = 1;
+        constexpr uint16_t NS = 2;
+        constexpr uint16_t CNAME = 5;
+        constexpr uint16_t SOA = 6;
+        constexpr uint16_t PTR = 12;
+        constexpr uint16_t MX = 15;
+        constexpr uint16_t TXT = 16;
+        constexpr uint16_t AAAA = 28;
+        constexpr uint16_t SRV = 33;
+        constexpr uint16_t HTTPS = 65;
+    }
+
+    struct Question {
+        std::string name;
+        uint16_t type;
+        uint16_t qclass = 1;
+    };
+
+    struct Record {
+        std::string name;
+        uint16_t type;
+        uint16_t qclass;
+        uint32_t ttl;
+        // RDATA as the text output of the dns tool shows it
+        std::string data;
+    };
+
+    struct Result {
+        // ETIMEDOUT when no server answered, EBADMSG for a malformed answer, EINVAL for an invalid name
+        std::error_code error;
+        uint8_t rcode = 0;
+        std::vector<Record> answers;
+        // the whole response in wire format
+        std::vector<uint8_t> packet;
+    };
+
+    struct Options {
+        std::vector<std::string> servers;
+        uint16_t port = 53;
+        bool recursionDesired = true;
+        // advertised EDNS0 payload size, 0 sends queries without an OPT record
+        uint16_t ednsPayloadSize = 0;
+        std::chrono::milliseconds timeout{4000};
+        // queries in flight at once, the others wait their turn
+        size_t window = 1000;
+    };
+
+    template<typename T = void>
+    class Task;
+
+    namespace detail {
+        // resumes whoever awaits the task once it finished
+        struct FinalAwaiter {
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            template<typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept {
+                std::coroutine_handle<> continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        struct PromiseBase {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+
+            // tasks start right away, so every query of a batch is submitted before the first one is awaited
+            std::suspend_never initial_suspend() const noexcept {
+                return {};
+            }
+
+            FinalAwaiter final_suspend() const noexcept {
+                return {};
+            }
+
+            void unhandled_exception() {
+                exception = std::current_exception();
+            }
+        };
+
+        template<typename T>
+        struct Promise : PromiseBase {
+            std::optional<T> value;
+
+            Task<T> get_return_object();
+
+            template<typename Value>
+            void return_value(Value &&result) {
+                value.emplace(std::forward<Value>(result));
+            }
+
+            T take() {
+                if (exception) {
+                    std::rethrow_exception(exception);
+                }
+                return std::move(*value);
+            }
+        };
+
+        template<>
+        struct Promise<void> : PromiseBase {
+            Task<void> get_return_object();
+
+            void return_void() {}
+
+            void take() {
+                if (exception) {
+                    std::rethrow_exception(exception);
+                }
+            }
+        };
+    }
+
+    /**
+     * Coroutine that starts when called and can be awaited by another coroutine, or checked with done()
+     * and read with get() once the resolver ran it to the end. Destroying an unfinished task cancels the
+     * queries it awaits.
+     */
+    template<typename T>
+    class Task {
+    public:
+        typedef detail::Promise<T> promise_type;
+
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+        Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+        Task &operator=(Task &&other) noexcept {
+            if (this != &other) {
+                destroy();
+                handle = std::exchange(other.handle, nullptr);
+            }
+            return *this;
+        }
+
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+
+        ~Task() {
+            destroy();
+        }
+
+        bool done() const {
+            return handle.done();
+        }
+
+        // result of a finished task, rethrows what escaped the coroutine
+        T get() {
+            return handle.promise().take();
+        }
+
+        bool await_ready() const noexcept {
+            return handle.done();
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation = awaiting;
+        }
+
+        T await_resume() {
+            return handle.promise().take();
+        }
+
+    private:
+        void destroy() {
+            if (handle) {
+                handle.destroy();
+                handle = nullptr;
+            }
+        }
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    namespace detail {
+        template<typename T>
+        Task<T> Promise<T>::get_return_object() {
+            return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+        }
+
+        inline Task<void> Promise<void>::get_return_object() {
+            return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+        }
+    }
+
+    class Resolver {
+        struct Engine;
+
+    public:
+        /**
+         * Awaitable of one question. It is submitted when awaited and resumes the awaiting coroutine with
+         * the result, failures included, from within run() or poll().
+         */
+        class Query {
+        public:
+            Query(const Query &) = delete;
+            Query &operator=(const Query &) = delete;
+
+            ~Query();
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> awaiting);
+
+            Result await_resume() {
+                return std::move(result);
+            }
+
+        private:
+            friend class Resolver;
+            friend struct Engine;
+
+            Query(Engine &engine, Question question) : engine(engine), question(std::move(question)) {}
+
+            Engine &engine;
+            Question question;
+            std::coroutine_handle<> awaiting;
+            Result result;
+            // query ID while the question is in flight
+            std::optional<uint16_t> id;
+            bool submitted = false;
+        };
+
+        // resolves the server names, throws std::system_error when one cannot be used
+        explicit Resolver(const Options &options);
+        ~Resolver();
+
+        Resolver(const Resolver &) = delete;
+        Resolver &operator=(const Resolver &) = delete;
+
+        Query query(std::string name, uint16_t type, uint16_t qclass = 1);
+
+        // every question in flight at once, the results in the order of the questions
+        Task<std::vector<Result>> resolveMany(std::span<const Question> questions);
+
+        /**
+         * Sends what is waiting, handles the responses and timeouts that are due and resumes the coroutines
+         * whose queries completed. Waits at most `timeout` for something to happen and returns whether
+         * any query is still outstanding.
+         */
+        bool poll(std::chrono::milliseconds timeout);
+
+        // polls until no query is outstanding
+        void run();
+
+        // queries submitted and not completed yet
+        size_t pending() const;
+
+    private:
+        Task<Result> resolveOne(Question question);
+
+        std::unique_ptr<Engine> engine;
+    };
+}
@@ -0,0 +1,655 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory_resource>
+#include <chrono>
+#include <optional>
+#include <ostream>
+#include <algorithm>
+#include <unordered_map>
+#include <system_error>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "dns.h"
+#include "tcp.h"
+#include "transport.h"
+#include "udp.h"
+#include "utils.h"
+
+
+// a client TCP connection without any query for this long is closed (RFC 7766)
+const auto FORWARD_TCP_IDLE_TIMEOUT = std::chrono::seconds(10);
+const size_t FORWARD_MAX_CONNECTIONS = 256;
+const int FORWARD_LISTEN_BACKLOG = 128;
+// answers kept in memory, expired ones are dropped first when the cache is full
+const size_t FORWARD_CACHE_ENTRIES = 65536;
+// upstream responses the receive buffer is sized for
+const size_t FORWARD_RECEIVE_WINDOW = 1024;
+
+namespace forward {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Settings {
+        uint16_t flags;
+        uint16_t ednsPayloadSize;
+        int timeoutSec;
+        // stop after this long, run until SIGINT or SIGTERM without it
+        std::optional<std::chrono::seconds> duration;
+    };
+
+    struct Summary {
+        size_t queries = 0;
+        size_t cached = 0;
+        size_t coalesced = 0;
+        size_t forwarded = 0;
+        size_t answered = 0;
+        size_t timedOut = 0;
+        size_t truncated = 0;
+        size_t malformed = 0;
+        size_t unmatched = 0;
+        size_t connections = 0;
+        const char *transport = "";
+        udp::SyscallStats sendCalls;
+        udp::SyscallStats receiveCalls;
+    };
+
+    std::ostream &operator<<(std::ostream &stream, const Summary &summary) {
+        stream << "Queries: " << summary.queries << ", From cache: " << summary.cached
+               << ", Coalesced: " << summary.coalesced << ", Forwarded: " << summary.forwarded
+               << ", Answered: " << summary.answered << ", Timed out: " << summary.timedOut
+               << ", Retried over TCP: " << summary.truncated << ", Malformed: " << summary.malformed
+               << ", Unmatched: " << summary.unmatched << ", TCP clients: " << summary.connections << std::endl;
+        stream << summary.transport << " send: " << summary.sendCalls << std::endl;
+        stream << summary.transport << " receive: " << summary.receiveCalls << std::endl;
+        return stream;
+    }
+
+    // where the answer to a query goes
+    struct Client {
+        bool tcp = false;
+        sockaddr_storage address{};
+        socklen_t addressLength = 0;
+        // serial number of the TCP connection
+        uint64_t connection = 0;
+    };
+
+    // a client waiting for the answer to its query
+    struct Waiter {
+        Client client;
+        uint16_t id;
+        bool recursionDesired;
+        // question section of the query as the client sent it, echoed in the answer
+        std::string question;
+        // largest answer the client takes, longer ones are truncated
+        size_t limit;
+    };
+
+    /**
+     * Caching DNS forwarder. Queries arrive over UDP and TCP on a local address and are sent on to the
+     * upstream server, identical questions asked while one is already on its way wait for the same upstream
+     * answer instead of sending their own. Answers are kept in memory for their TTL and served with the TTLs
+     * lowered by the time spent there. Truncated upstream answers are fetched again over TCP.
+     */
+    class Forwarder : private transport::ResponseHandler {
+    public:
+        Forwarder(const std::string &address, uint16_t port, transport::Transport &transport,
+                  tcp::Connection &tcpUpstream, const Settings &settings)
+                : transport(transport), tcpUpstream(tcpUpstream), settings(settings), inFlight(batch::makeSlots(&buffers)),
+                  keys(DNS_ID_SPACE), timeout(settings.timeoutSec), buffer(UINT16_MAX) {
+            udp::AddressInfo res = udp::resolveServer(address, port, SOCK_DGRAM);
+            try {
+                udpFd = openListener(res.get(), SOCK_DGRAM);
+                tcpFd = openListener(res.get(), SOCK_STREAM);
+            } catch (...) {
+                closeListeners();
+                throw;
+            }
+        }
+
+        Forwarder(const Forwarder &) = delete;
+        Forwarder &operator=(const Forwarder &) = delete;
+
+        ~Forwarder() {
+            for (auto &[serial, connection] : connections) {
+                close(connection.fd);
+            }
+            closeListeners();
+        }
+
+        Summary run() {
+            const Clock::time_point start = Clock::now();
+            const StopSignals stop;
+            std::vector<pollfd> descriptors;
+            std::vector<uint64_t> polled;
+            while (!stop.requested()) {
+                const Clock::time_point now = Clock::now();
+                if (settings.duration && now - start >= *settings.duration) {
+                    break;
+                }
+
+                descriptors.clear();
+                polled.clear();
+                descriptors.push_back({udpFd, POLLIN, 0});
+                descriptors.push_back({connections.size() < FORWARD_MAX_CONNECTIONS ? tcpFd : -1, POLLIN, 0});
+                descriptors.push_back({transport.descriptor(), POLLIN, 0});
+                descriptors.push_back({tcpUpstream.descriptor(),
+                                       static_cast<short>(POLLIN | (tcpUpstream.wantsWrite() ? POLLOUT : 0)), 0});
+                for (const auto &[serial, connection] : connections) {
+                    descriptors.push_back({connection.fd, static_cast<short>(
+                            POLLIN | (connection.outgoingOffset < connection.outgoing.size() ? POLLOUT : 0)), 0});
+                    polled.push_back(serial);
+                }
+                waitFor(descriptors, nextDeadline(start, now), stop.waitMask());
+
+                if (descriptors[0].revents) {
+                    receiveQueries();
+                }
+                if (descriptors[1].revents) {
+                    acceptConnections();
+                }
+                for (size_t i = 0; i < polled.size(); ++i) {
+                    if (descriptors[i + 4].revents) {
+                        serveConnection(polled[i]);
+                    }
+                }
+                sendStaged();
+                transport.receive(*this);
+                if (descriptors[3].revents) {
+                    tcpUpstream.flush();
+                    tcpUpstream.receive([&](std::span<const uint8_t> message) {
+                        onResponse(message, true);
+                    });
+                }
+                expire();
+                closeIdle();
+            }
+
+            summary.transport = transport.name();
+            summary.sendCalls = transport.getSendStats();
+            summary.receiveCalls = transport.getReceiveStats();
+            return summary;
+        }
+
+    private:
+        struct Connection {
+            int fd;
+            std::vector<uint8_t> incoming;
+            std::vector<uint8_t> outgoing;
+            size_t outgoingOffset = 0;
+            Clock::time_point lastActive;
+            // writing failed, the connection is closed on the next turn
+            bool broken = false;
+        };
+
+        // the clients waiting for one upstream query
+        struct Flight {
+            uint16_t id;
+            std::vector<Waiter> waiters;
+        };
+
+        struct CacheEntry {
+            dns::Packet response;
+            Clock::time_point storedAt;
+            Clock::time_point expiresAt;
+        };
+
+        static int openListener(const addrinfo *address, int type) {
+            int fd = socket(address->ai_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to create listening socket");
+            }
+            int enable = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+            if (type == SOCK_DGRAM) {
+                // bursts of queries from many clients, best effort as the kernel caps it at net.core.rmem_max
+                int size = static_cast<int>(FORWARD_RECEIVE_WINDOW * (DNS_PACKET_SIZE + DATAGRAM_OVERHEAD));
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            }
+            if (bind(fd, address->ai_addr, address->ai_addrlen) < 0
+                || (type == SOCK_STREAM && listen(fd, FORWARD_LISTEN_BACKLOG) < 0)) {
+                int err = errno;
+                close(fd);
+                throw std::system_error(err, std::generic_category(), "Failed to listen for DNS queries");
+            }
+            return fd;
+        }
+
+        void closeListeners() {
+            if (udpFd >= 0) {
+                close(udpFd);
+            }
+            if (tcpFd >= 0) {
+                close(tcpFd);
+            }
+        }
+
+        Clock::duration nextDeadline(Clock::time_point start, Clock::time_point now) const {
+            Clock::duration wait = Clock::duration::max();
+            if (!sendOrder.empty()) {
+                wait = inFlight[sendOrder.front().first].sentAt + timeout - now;
+            }
+            for (const auto &[serial, connection] : connections) {
+                wait = std::min<Clock::duration>(wait, connection.lastActive + FORWARD_TCP_IDLE_TIMEOUT - now);
+            }
+            if (settings.duration) {
+                wait = std::min<Clock::duration>(wait, start + *settings.duration - now);
+            }
+            return wait;
+        }
+
+        static void waitFor(std::vector<pollfd> &descriptors, Clock::duration wait, const sigset_t &waitMask) {
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::clamp<Clock::duration>(wait, Clock::duration::zero(), std::chrono::hours(24))).count();
+            const timespec timeout{static_cast<time_t>(nanoseconds / 1000000000), static_cast<long>(nanoseconds % 1000000000)};
+            if (ppoll(descriptors.data(), descriptors.size(), &timeout, &waitMask) < 0) {
+                if (errno != EINTR) {
+                    throw std::system_error(errno, std::generic_category(), "Failed to poll sockets");
+                }
+                for (pollfd &descriptor : descriptors) {
+                    descriptor.revents = 0;
+                }
+            }
+        }
+
+        void receiveQueries() {
+            while (true) {
+                Client client;
+                client.addressLength = sizeof(client.address);
+                ssize_t received = recvfrom(udpFd, buffer.data(), buffer.size(), MSG_DONTWAIT,
+                                            reinterpret_cast<sockaddr *>(&client.address), &client.addressLength);
+                if (received < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        throw std::system_error(errno, std::generic_category(), "Failed to receive DNS query");
+                    }
+                    return;
+                }
+                onQuery(dns::PacketView(buffer.data(), received), client);
+            }
+        }
+
+        void acceptConnections() {
+            while (connections.size() < FORWARD_MAX_CONNECTIONS) {
+                int fd = accept4(tcpFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    // EAGAIN once the backlog is empty, a connection reset while queued is skipped as well
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    }
+                    return;
+                }
+                int enable = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+                connections[nextConnection++] = {fd, {}, {}, 0, Clock::now(), false};
+                summary.connections++;
+            }
+        }
+
+        // reads the length-prefixed queries of a client connection and writes what is waiting for it
+        void serveConnection(uint64_t serial) {
+            Connection &connection = connections.at(serial);
+            bool closed = false;
+            while (true) {
+                ssize_t received = recv(connection.fd, buffer.data(), buffer.size(), 0);
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (received <= 0) {
+                    closed = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+                connection.incoming.insert(connection.incoming.end(), buffer.begin(), buffer.begin() + received);
+                connection.lastActive = Clock::now();
+            }
+
+            Client client;
+            client.tcp = true;
+            client.connection = serial;
+            size_t offset = 0;
+            while (connection.incoming.size() - offset >= 2) {
+                const size_t length = (connection.incoming[offset] << 8) | connection.incoming[offset + 1];
+                if (connection.incoming.size() - offset - 2 < length) {
+                    break;
+                }
+                onQuery(dns::PacketView(connection.incoming.data() + offset + 2, length), client);
+                offset += 2 + length;
+            }
+            connection.incoming.erase(connection.incoming.begin(), connection.incoming.begin() + offset);
+            if (closed || connection.broken || !flushConnection(connection)) {
+                close(connection.fd);
+                connections.erase(serial);
+            }
+        }
+
+        // returns false when the connection failed
+        static bool flushConnection(Connection &connection) {
+            while (connection.outgoingOffset < connection.outgoing.size()) {
+                ssize_t written = send(connection.fd, connection.outgoing.data() + connection.outgoingOffset,
+                                       connection.outgoing.size() - connection.outgoingOffset, MSG_NOSIGNAL);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+                }
+                connection.outgoingOffset += written;
+            }
+            connection.outgoing.clear();
+            connection.outgoingOffset = 0;
+            return true;
+        }
+
+        void closeIdle() {
+            const Clock::time_point now = Clock::now();
+            std::erase_if(connections, [&](const auto &entry) {
+                const Connection &connection = entry.second;
+                const bool idle = now - connection.lastActive >= FORWARD_TCP_IDLE_TIMEOUT
+                                  && connection.outgoingOffset == connection.outgoing.size();
+                if (idle || connection.broken) {
+                    close(connection.fd);
+                }
+                return idle || connection.broken;
+            });
+        }
+
+        void onQuery(dns::PacketView query, const Client &client) {
+            summary.queries++;
+            if (query.size() < DNS_HEADER_SIZE || query[2] & (FLAG_QR >> 8)) {
+                // not a query, there is nobody to tell
+                summary.malformed++;
+                return;
+            }
+            const uint16_t flags = dns::parsing::utils::readUint16(query, 2);
+            Waiter waiter{client, dns::parsing::utils::readUint16(query, 0), (flags & FLAG_RD) != 0, {},
+                          client.tcp ? size_t{UINT16_MAX} : size_t{EDNS_MIN_PAYLOAD_SIZE}};
+            if (flags & OPCODE_MASK) {
+                reply(waiter, errorResponse(waiter, RCODE_NOTIMP));
+                return;
+            }
+
+            std::optional<dns::QuestionView> question;
+            try {
+                const dns::DNSMessage message = dns::DNSMessage::parse(query);
+                if (message.getHeader().qdcount == 1) {
+                    question = *message.questions().begin();
+                    const size_t questionEnd = dns::parsing::utils::skipName(query, DNS_HEADER_SIZE) + 4;
+                    waiter.question.assign(query.begin() + DNS_HEADER_SIZE, query.begin() + questionEnd);
+                }
+                for (const dns::ResourceRecordView &record : message.additionals()) {
+                    if (record.type == TYPE_OPT && !client.tcp) {
+                        waiter.limit = std::max<size_t>(record.rclass, EDNS_MIN_PAYLOAD_SIZE);
+                    }
+                }
+            } catch (const std::system_error &) {
+                question.reset();
+            }
+            if (!question) {
+                summary.malformed++;
+                reply(waiter, errorResponse(waiter, RCODE_FORMERR));
+                return;
+            }
+
+            const std::string key = cache::makeKey(*question);
+            if (std::optional<dns::Packet> response = lookup(key)) {
+                summary.cached++;
+                reply(waiter, *response);
+                return;
+            }
+            auto flight = flights.find(key);
+            if (flight != flights.end()) {
+                summary.coalesced++;
+                flight->second.waiters.push_back(std::move(waiter));
+                return;
+            }
+            if (active == DNS_ID_SPACE) {
+                reply(waiter, errorResponse(waiter, RCODE_SERVFAIL));
+                return;
+            }
+
+            const uint16_t id = ids.acquire();
+            upstreamQuestion.name.clear();
+            question->name.appendTo(upstreamQuestion.name);
+            upstreamQuestion.qtype = question->qtype;
+            upstreamQuestion.qclass = question->qclass;
+            batch::startQuery(inFlight[id], id, settings.flags, upstreamQuestion, settings.ednsPayloadSize);
+            inFlight[id].generation++;
+            keys[id] = key;
+            flights[key] = {id, {std::move(waiter)}};
+            active++;
+            staged.push_back(id);
+        }
+
+        // sends the upstream queries of this turn together
+        void sendStaged() {
+            if (staged.empty()) {
+                return;
+            }
+            packets.clear();
+            for (uint16_t id : staged) {
+                packets.push_back(inFlight[id].packet);
+            }
+            const size_t sent = transport.send(packets);
+            const Clock::time_point now = Clock::now();
+            for (size_t i = 0; i < staged.size(); ++i) {
+                const uint16_t id = staged[i];
+                if (i < sent) {
+                    inFlight[id].sentAt = now;
+                    sendOrder.push_back({id, inFlight[id].generation});
+                    summary.forwarded++;
+                } else {
+                    // the socket buffer is full, shedding the query is cheaper than queueing it
+                    fail(id);
+                }
+            }
+            staged.clear();
+        }
+
+        void onResponse(dns::PacketView packet) override {
+            onResponse(packet, false);
+        }
+
+        void onResponse(dns::PacketView packet, bool viaTcp) {
+            if (packet.size() < DNS_HEADER_SIZE) {
+                summary.unmatched++;
+                return;
+            }
+            const uint16_t id = (packet[0] << 8) | packet[1];
+            batch::InFlightQuery &query = inFlight[id];
+            if (!query.active || query.overTcp != viaTcp || !batch::responseMatches(packet, query)) {
+                summary.unmatched++;
+                return;
+            }
+            if (!viaTcp && dns::isTruncated(packet)) {
+                summary.truncated++;
+                query.overTcp = true;
+                query.generation++;
+                query.sentAt = Clock::now();
+                try {
+                    tcpUpstream.send(id, query.packet);
+                } catch (const std::system_error &err) {
+                    debugMsg("Failed to retry over TCP: " << err.what() << std::endl);
+                    fail(id);
+                    return;
+                }
+                sendOrder.push_back({id, query.generation});
+                return;
+            }
+
+            summary.answered++;
+            store(keys[id], packet);
+            auto flight = flights.find(keys[id]);
+            for (const Waiter &waiter : flight->second.waiters) {
+                reply(waiter, dns::Packet(packet.begin(), packet.end()));
+            }
+            finish(id);
+        }
+
+        // answers everyone waiting for the query with SERVFAIL
+        void fail(uint16_t id) {
+            auto flight = flights.find(keys[id]);
+            for (const Waiter &waiter : flight->second.waiters) {
+                reply(waiter, errorResponse(waiter, RCODE_SERVFAIL));
+            }
+            finish(id);
+        }
+
+        void finish(uint16_t id) {
+            batch::InFlightQuery &query = inFlight[id];
+            if (query.overTcp) {
+                tcpUpstream.forget(id);
+            }
+            batch::finishQuery(query);
+            flights.erase(keys[id]);
+            ids.release(id);
+            active--;
+        }
+
+        void expire() {
+            const Clock::time_point now = Clock::now();
+            while (!sendOrder.empty()) {
+                const auto [id, generation] = sendOrder.front();
+                const batch::InFlightQuery &query = inFlight[id];
+                if (query.active && query.generation == generation) {
+                    if (now - query.sentAt < timeout) {
+                        break;
+                    }
+                    summary.timedOut++;
+                    fail(id);
+                }
+                sendOrder.pop_front();
+            }
+        }
+
+        std::optional<dns::Packet> lookup(const std::string &key) {
+            auto entry = answers.find(key);
+            if (entry == answers.end()) {
+                return std::nullopt;
+            }
+            const Clock::time_point now = Clock::now();
+            if (now >= entry->second.expiresAt) {
+                answers.erase(entry);
+                return std::nullopt;
+            }
+            dns::Packet response = entry->second.response;
+            cache::age(response, static_cast<uint32_t>(
+                    std::chrono::duration_cast<std::chrono::seconds>(now - entry->second.storedAt).count()));
+            return response;
+        }
+
+        void store(const std::string &key, dns::PacketView response) {
+            std::optional<uint32_t> ttl;
+            try {
+                ttl = cache::cacheableTtl(dns::DNSMessage::parse(response));
+            } catch (const std::system_error &) {
+                return;
+            }
+            if (!ttl || *ttl == 0) {
+                return;
+            }
+            const Clock::time_point now = Clock::now();
+            if (answers.size() >= FORWARD_CACHE_ENTRIES && !answers.contains(key)) {
+                std::erase_if(answers, [&](const auto &entry) {
+                    return now >= entry.second.expiresAt;
+                });
+                if (answers.size() >= FORWARD_CACHE_ENTRIES) {
+                    answers.erase(answers.begin());
+                }
+            }
+            answers[key] = {dns::Packet(response.begin(), response.end()), now, now + std::chrono::seconds(*ttl)};
+        }
+
+        // header of the client's query with the rcode, and its question if it had a readable one
+        static dns::Packet errorResponse(const Waiter &waiter, uint8_t rcode) {
+            const uint16_t flags = FLAG_QR | FLAG_RA | (waiter.recursionDesired ? FLAG_RD : 0) | rcode;
+            dns::Packet response = {
+                    static_cast<uint8_t>(waiter.id >> 8), static_cast<uint8_t>(waiter.id & 0xFF),
+                    static_cast<uint8_t>(flags >> 8), static_cast<uint8_t>(flags & 0xFF),
+                    0, static_cast<uint8_t>(waiter.question.empty() ? 0 : 1), 0, 0, 0, 0, 0, 0,
+            };
+            response.insert(response.end(), waiter.question.begin(), waiter.question.end());
+            return response;
+        }
+
+        /**
+         * Sends the upstream answer to a client with its ID, RD bit and question spelled as it asked.
+         * An answer larger than the client takes is cut down to the header and question with TC set.
+         */
+        void reply(const Waiter &waiter, dns::Packet response) {
+            response[0] = waiter.id >> 8;
+            response[1] = waiter.id & 0xFF;
+            response[2] = (response[2] & ~(FLAG_RD >> 8)) | (waiter.recursionDesired ? FLAG_RD >> 8 : 0);
+            size_t questionEnd = 0;
+            try {
+                questionEnd = dns::parsing::utils::skipName(response, DNS_HEADER_SIZE) + 4;
+            } catch (const std::system_error &) {
+            }
+            if (questionEnd == DNS_HEADER_SIZE + waiter.question.size() && questionEnd <= response.size()) {
+                std::memcpy(response.data() + DNS_HEADER_SIZE, waiter.question.data(), waiter.question.size());
+            }
+            if (response.size() > waiter.limit) {
+                response.resize(DNS_HEADER_SIZE);
+                response[2] |= FLAG_TRUNC >> 8;
+                response[4] = 0;
+                response[5] = waiter.question.empty() ? 0 : 1;
+                std::fill(response.begin() + 6, response.end(), 0);
+                response.insert(response.end(), waiter.question.begin(), waiter.question.end());
+            }
+
+            if (!waiter.client.tcp) {
+                // best effort like any UDP answer, a full socket buffer drops it
+                sendto(udpFd, response.data(), response.size(), MSG_DONTWAIT,
+                       reinterpret_cast<const sockaddr *>(&waiter.client.address), waiter.client.addressLength);
+                return;
+            }
+            auto connection = connections.find(waiter.client.connection);
+            if (connection == connections.end()) {
+                return;
+            }
+            std::vector<uint8_t> &outgoing = connection->second.outgoing;
+            outgoing.push_back(static_cast<uint8_t>(response.size() >> 8));
+            outgoing.push_back(static_cast<uint8_t>(response.size() & 0xFF));
+            outgoing.insert(outgoing.end(), response.begin(), response.end());
+            connection->second.broken = !flushConnection(connection->second);
+        }
+
+        transport::Transport &transport;
+        tcp::Connection &tcpUpstream;
+        const Settings &settings;
+        int udpFd = -1;
+        int tcpFd = -1;
+        // names and packets of the upstream queries in flight, recycled from one query to the next
+        std::pmr::unsynchronized_pool_resource buffers;
+        batch::IdAllocator ids;
+        std::vector<batch::InFlightQuery> inFlight;
+        // cache key of the question each query ID asks upstream
+        std::vector<std::string> keys;
+        std::unordered_map<std::string, Flight> flights;
+        std::unordered_map<std::string, CacheEntry> answers;
+        // queries built this turn and not sent yet, and their packets
+        std::vector<uint16_t> staged;
+        std::vector<dns::PacketView> packets;
+        // the question of a received query as it goes upstream, built in place
+        dns::Question upstreamQuestion;
+        // upstream queries by send time, with the generation they were sent in
+        std::deque<std::pair<uint16_t, uint32_t>> sendOrder;
+        std::unordered_map<uint64_t, Connection> connections;
+        uint64_t nextConnection = 0;
+        const std::chrono::seconds timeout;
+        size_t active = 0;
+        std::vector<uint8_t> buffer;
+        Summary summary;
+    };
+}
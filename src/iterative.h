@@ -0,0 +1,370 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <system_error>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "names.h"
+#include "retransmit.h"
+#include "tcp.h"
+#include "udp.h"
+#include "utils.h"
+
+
+// root servers from the IANA root hints file, IPv4 first so hosts without IPv6 do not wait on them
+const char *const ROOT_HINTS[] = {
+    "198.41.0.4", "170.247.170.2", "192.33.4.12", "199.7.91.13", "192.203.230.10", "192.5.5.241",
+    "192.112.36.4", "198.97.190.53", "192.36.148.17", "192.58.128.30", "193.0.14.129", "199.7.83.42",
+    "202.12.27.33",
+    "2001:503:ba3e::2:30", "2801:1b8:10::b", "2001:500:2::c", "2001:500:2d::d", "2001:500:a8::e",
+    "2001:500:2f::f", "2001:500:12::d0d", "2001:500:1::53", "2001:7fe::53", "2001:503:c27::2:30",
+    "2001:7fd::1", "2001:500:9f::42", "2001:dc3::35",
+};
+// a name is given up on after this many referrals
+const size_t ITERATIVE_MAX_REFERRALS = 16;
+// name server addresses without glue are looked up iteratively too, at most this many levels deep
+const size_t ITERATIVE_MAX_DEPTH = 4;
+// servers of one zone asked before the zone counts as unreachable
+const size_t ITERATIVE_MAX_ATTEMPTS = 3;
+const int ITERATIVE_SERVER_TIMEOUT_SEC = 2;
+
+namespace iterative {
+    typedef retransmit::Clock Clock;
+
+    // lower case without the trailing dot, the root zone is the empty string
+    std::string canonicalName(std::string_view name) {
+        if (!name.empty() && name.back() == '.') {
+            name.remove_suffix(1);
+        }
+        std::string canonical(name);
+        names::toLower(canonical);
+        return canonical;
+    }
+
+    bool isSubdomain(const std::string &name, const std::string &zone) {
+        if (zone.empty() || name == zone) {
+            return true;
+        }
+        return name.size() > zone.size() && name.ends_with(zone) && name[name.size() - zone.size() - 1] == '.';
+    }
+
+    std::string parentZone(const std::string &zone) {
+        const size_t dot = zone.find('.');
+        return dot == std::string::npos ? std::string() : zone.substr(dot + 1);
+    }
+
+    struct NameServer {
+        std::string name;
+        std::vector<std::string> addresses;
+    };
+
+    struct Delegation {
+        std::vector<NameServer> servers;
+        Clock::time_point expiresAt;
+    };
+
+    /**
+     * Name servers of every zone a referral pointed to, kept until the TTL of their NS records runs out.
+     * The root zone is seeded from the hints and never expires.
+     */
+    class DelegationCache {
+    public:
+        explicit DelegationCache(const std::vector<std::string> &roots) {
+            Delegation &root = zones[""];
+            root.expiresAt = Clock::time_point::max();
+            for (const std::string &address : roots) {
+                root.servers.push_back({address, {address}});
+            }
+        }
+
+        // deepest zone enclosing `name` with a live delegation, expired ones are dropped on the way
+        std::string closest(const std::string &name) {
+            const Clock::time_point now = Clock::now();
+            for (std::string zone = name; !zone.empty(); zone = parentZone(zone)) {
+                auto found = zones.find(zone);
+                if (found == zones.end()) {
+                    continue;
+                }
+                if (found->second.expiresAt > now) {
+                    return zone;
+                }
+                zones.erase(found);
+            }
+            return "";
+        }
+
+        void store(const std::string &zone, Delegation delegation) {
+            zones[zone] = std::move(delegation);
+        }
+
+        // the lookup of a name server without glue may have replaced or dropped the delegation meanwhile
+        void storeAddresses(const std::string &zone, const std::string &server, const std::vector<std::string> &addresses) {
+            auto found = zones.find(zone);
+            if (found == zones.end()) {
+                return;
+            }
+            for (NameServer &cached : found->second.servers) {
+                if (cached.name == server) {
+                    cached.addresses = addresses;
+                }
+            }
+        }
+
+        Delegation &at(const std::string &zone) {
+            return zones.at(zone);
+        }
+
+    private:
+        std::unordered_map<std::string, Delegation> zones;
+    };
+
+    struct Settings {
+        uint16_t port;
+        uint16_t ednsPayloadSize;
+        bool tcpOnly;
+    };
+
+    struct Summary {
+        size_t resolved = 0;
+        size_t failed = 0;
+        size_t referrals = 0;
+        // resolutions that started below the root thanks to a cached delegation
+        size_t delegationHits = 0;
+        size_t queries = 0;
+    };
+
+    /**
+     * Resolves names without a recursive server: starts at the closest cached delegation, the root servers at
+     * first, and follows referrals using the NS records of the authority section and the glue addresses of the
+     * additional section until a server answers authoritatively. Queries go out without the RD flag.
+     */
+    class Resolver {
+    public:
+        Resolver(const std::vector<std::string> &roots, const Settings &settings)
+                : delegations(roots), settings(settings) {}
+
+        /**
+         * Returns the final response as the authoritative server sent it, NXDOMAIN and NODATA included.
+         * CNAMEs are not followed.
+         */
+        dns::Packet resolve(const dns::Question &question) {
+            try {
+                dns::Packet response = resolve(question, 0);
+                summary.resolved++;
+                return response;
+            } catch (const std::system_error &) {
+                summary.failed++;
+                throw;
+            }
+        }
+
+        const Summary &getSummary() const {
+            return summary;
+        }
+
+    private:
+        dns::Packet resolve(const dns::Question &question, size_t depth) {
+            const std::string name = canonicalName(question.name);
+            std::string zone = delegations.closest(name);
+            if (!zone.empty()) {
+                summary.delegationHits++;
+            }
+            for (size_t referrals = 0; referrals <= ITERATIVE_MAX_REFERRALS; ++referrals) {
+                debugMsg("Asking zone \"" << zone << "\" for " << name << std::endl);
+                std::optional<std::string> next;
+                size_t attempts = 0;
+                for (const std::string &address : addresses(zone, depth)) {
+                    if (attempts++ == ITERATIVE_MAX_ATTEMPTS) {
+                        break;
+                    }
+                    dns::Packet response;
+                    try {
+                        response = ask(address, question);
+                        const dns::DNSMessage message = dns::parseResponsePacket(response);
+                        if (isFinal(message)) {
+                            return response;
+                        }
+                        next = followReferral(message, zone, name);
+                    } catch (const std::system_error &err) {
+                        debugMsg(address << ": " << err.what() << std::endl);
+                        continue;
+                    }
+                    if (next) {
+                        break;
+                    }
+                    debugMsg(address << ": neither an answer nor a referral below \"" << zone << "\"" << std::endl);
+                }
+                if (!next) {
+                    throw std::system_error(EHOSTUNREACH, std::generic_category(),
+                                            "No server of zone \"" + zone + "\" answered for " + name);
+                }
+                summary.referrals++;
+                zone = std::move(*next);
+            }
+            throw std::system_error(ELOOP, std::generic_category(), "Too many referrals for " + name);
+        }
+
+        static bool isFinal(const dns::DNSMessage &message) {
+            const DNSHeader &header = message.getHeader();
+            const uint8_t rcode = header.flags & RCODE_MASK;
+            if (rcode == RCODE_NXDOMAIN) {
+                return true;
+            }
+            return rcode == RCODE_NOERROR && (header.ancount > 0 || header.flags & FLAG_AUTHORITATIVE);
+        }
+
+        /**
+         * Caches the delegation of a referral to a zone below `zone` that encloses `name` and returns the zone.
+         * Glue is only taken for name servers inside `zone`, the server has no authority over other addresses.
+         */
+        std::optional<std::string> followReferral(const dns::DNSMessage &message, const std::string &zone,
+                                                  const std::string &name) {
+            std::optional<std::string> child;
+            Delegation delegation{{}, Clock::time_point::max()};
+            for (const dns::ResourceRecordView &record : message.authorities()) {
+                if (record.type != TYPE_NS) {
+                    continue;
+                }
+                const std::string owner = canonicalName(record.name.toString());
+                if (!child) {
+                    if (owner == zone || !isSubdomain(owner, zone) || !isSubdomain(name, owner)) {
+                        continue;
+                    }
+                    child = owner;
+                } else if (owner != *child) {
+                    continue;
+                }
+                const auto target = std::get<dns::rdata::DomainName>(dns::rdata::decode(record)).target;
+                delegation.servers.push_back({canonicalName(target.toString()), {}});
+                delegation.expiresAt = std::min(delegation.expiresAt, Clock::now() + std::chrono::seconds(record.ttl));
+            }
+            if (!child) {
+                return std::nullopt;
+            }
+            for (const dns::ResourceRecordView &record : message.additionals()) {
+                if (record.type != TYPE_A && record.type != TYPE_AAAA) {
+                    continue;
+                }
+                const std::string owner = canonicalName(record.name.toString());
+                if (!isSubdomain(owner, zone)) {
+                    continue;
+                }
+                for (NameServer &server : delegation.servers) {
+                    if (server.name == owner) {
+                        server.addresses.push_back(formatAddress(record));
+                    }
+                }
+            }
+            debugMsg("Referral from \"" << zone << "\" to \"" << *child << "\" with "
+                     << delegation.servers.size() << " name servers" << std::endl);
+            delegations.store(*child, std::move(delegation));
+            return child;
+        }
+
+        static std::string formatAddress(const dns::ResourceRecordView &record) {
+            const dns::PacketView address = record.rdata();
+            if (address.size() != (record.type == TYPE_A ? sizeof(in_addr) : INET6_ADDRLEN)) {
+                dns::parsing::utils::throwMalformed("glue address with wrong length");
+            }
+            char buffer[INET6_ADDRSTRLEN];
+            inet_ntop(record.type == TYPE_A ? AF_INET : AF_INET6, address.data(), buffer, sizeof(buffer));
+            return buffer;
+        }
+
+        /**
+         * Addresses of the name servers of `zone`, fastest first and the ones never asked before the slow ones.
+         * Without glue the addresses of the name servers are looked up and cached with the delegation.
+         */
+        std::vector<std::string> addresses(const std::string &zone, size_t depth) {
+            std::vector<std::string> found = knownAddresses(zone);
+            if (found.empty() && depth < ITERATIVE_MAX_DEPTH) {
+                const std::vector<NameServer> servers = delegations.at(zone).servers;
+                for (const NameServer &server : servers) {
+                    try {
+                        dns::Packet response = resolve({std::pmr::string(server.name), TYPE_A, CLASS_IN}, depth + 1);
+                        std::vector<std::string> resolved;
+                        for (const dns::ResourceRecordView &record : dns::parseResponsePacket(response).answers()) {
+                            if (record.type == TYPE_A && canonicalName(record.name.toString()) == server.name) {
+                                resolved.push_back(formatAddress(record));
+                            }
+                        }
+                        if (resolved.empty()) {
+                            continue;
+                        }
+                        delegations.storeAddresses(zone, server.name, resolved);
+                        found = std::move(resolved);
+                        break;
+                    } catch (const std::system_error &err) {
+                        debugMsg(server.name << ": " << err.what() << std::endl);
+                    }
+                }
+            }
+            std::stable_sort(found.begin(), found.end(), [this](const std::string &a, const std::string &b) {
+                return score(a) < score(b);
+            });
+            return found;
+        }
+
+        std::vector<std::string> knownAddresses(const std::string &zone) {
+            std::vector<std::string> found;
+            for (const NameServer &server : delegations.at(zone).servers) {
+                found.insert(found.end(), server.addresses.begin(), server.addresses.end());
+            }
+            return found;
+        }
+
+        Clock::duration score(const std::string &address) const {
+            auto found = endpoints.find(address);
+            if (found == endpoints.end() || !found->second->getRtt().hasSample()) {
+                return Clock::duration::zero();
+            }
+            return found->second->getRtt().getSrtt();
+        }
+
+        dns::Packet ask(const std::string &address, const dns::Question &question) {
+            const dns::Packet query = dns::constructQueryPacket(dns::randomQueryId(), 0, question,
+                                                                settings.ednsPayloadSize);
+            summary.queries++;
+            if (settings.tcpOnly) {
+                return tcp::sendQuery(address, settings.port, query, ITERATIVE_SERVER_TIMEOUT_SEC);
+            }
+            std::unique_ptr<udp::ServerEndpoint> &endpoint = endpoints[address];
+            if (!endpoint) {
+                const size_t bufferSize = std::max<size_t>(settings.ednsPayloadSize, DNS_PACKET_SIZE);
+                endpoint = std::make_unique<udp::ServerEndpoint>(address, settings.port, 1, bufferSize);
+            }
+            dns::Packet response;
+            try {
+                response = udp::sendQuery(*endpoint, query, ITERATIVE_SERVER_TIMEOUT_SEC);
+            } catch (const std::system_error &) {
+                endpoint->getRtt().penalize();
+                throw;
+            }
+            if (dns::isTruncated(response)) {
+                debugMsg("Response truncated, retrying over TCP" << std::endl);
+                statsCount(COUNTER_RETRIES, 1);
+                response = tcp::sendQuery(address, settings.port, query, ITERATIVE_SERVER_TIMEOUT_SEC);
+            }
+            return response;
+        }
+
+        DelegationCache delegations;
+        // one endpoint per server address, so sockets and RTT estimates are reused across names
+        std::unordered_map<std::string, std::unique_ptr<udp::ServerEndpoint>> endpoints;
+        Settings settings;
+        Summary summary;
+    };
+
+    std::vector<std::string> rootHints() {
+        return {std::begin(ROOT_HINTS), std::end(ROOT_HINTS)};
+    }
+}
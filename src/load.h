@@ -0,0 +1,375 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory_resource>
+#include <array>
+#include <chrono>
+#include <optional>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <system_error>
+#include <poll.h>
+
+#include "batch.h"
+#include "dns.h"
+#include "transport.h"
+#include "utils.h"
+
+
+// every power of two is split into this many buckets, below it every value has its own bucket
+const uint64_t HISTOGRAM_SUB_BUCKETS = 128;
+// largest latency kept apart, about 39 hours in microseconds
+const uint64_t HISTOGRAM_MAX_VALUE = (uint64_t{1} << 47) - 1;
+// the pacer lets this much of a second worth of queries go out in one burst
+const double PACER_BURST_SEC = 0.01;
+// queries built and handed to the transport at once
+const size_t LOAD_SEND_CHUNK = 256;
+
+namespace load {
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Log-linear histogram in the spirit of HdrHistogram: values below HISTOGRAM_SUB_BUCKETS are exact,
+     * larger ones fall into buckets no wider than 1/64 of their value, so percentiles are off by at most 1.6%.
+     */
+    class Histogram {
+    public:
+        Histogram() : counts(indexOf(HISTOGRAM_MAX_VALUE) + 1) {}
+
+        void record(uint64_t value) {
+            value = std::min(value, HISTOGRAM_MAX_VALUE);
+            counts[indexOf(value)]++;
+            total++;
+            sum += value;
+            minimum = std::min(minimum, value);
+            maximum = std::max(maximum, value);
+        }
+
+        // highest value that falls into the same bucket as the value at `percentile`
+        uint64_t percentile(double percentile) const {
+            if (!total) {
+                return 0;
+            }
+            const auto rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(total)));
+            uint64_t seen = 0;
+            for (size_t index = 0; index < counts.size(); ++index) {
+                seen += counts[index];
+                if (seen >= std::max<uint64_t>(rank, 1)) {
+                    return std::min(highestIn(index), maximum);
+                }
+            }
+            return maximum;
+        }
+
+        uint64_t count() const {
+            return total;
+        }
+
+        uint64_t min() const {
+            return total ? minimum : 0;
+        }
+
+        uint64_t max() const {
+            return maximum;
+        }
+
+        double mean() const {
+            return total ? static_cast<double>(sum) / static_cast<double>(total) : 0;
+        }
+
+    private:
+        static constexpr uint64_t HALF = HISTOGRAM_SUB_BUCKETS / 2;
+
+        static size_t indexOf(uint64_t value) {
+            if (value < HISTOGRAM_SUB_BUCKETS) {
+                return value;
+            }
+            // shift so the value lands in [HALF, SUB_BUCKETS)
+            const int shift = std::bit_width(value) - std::bit_width(HISTOGRAM_SUB_BUCKETS - 1);
+            return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HALF + ((value >> shift) - HALF);
+        }
+
+        static uint64_t highestIn(size_t index) {
+            if (index < HISTOGRAM_SUB_BUCKETS) {
+                return index;
+            }
+            const uint64_t shift = (index - HISTOGRAM_SUB_BUCKETS) / HALF + 1;
+            const uint64_t subBucket = (index - HISTOGRAM_SUB_BUCKETS) % HALF + HALF;
+            return ((subBucket + 1) << shift) - 1;
+        }
+
+        std::vector<uint64_t> counts;
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        uint64_t minimum = UINT64_MAX;
+        uint64_t maximum = 0;
+    };
+
+    /**
+     * Token bucket refilled at `rate` tokens per second. A rate of 0 never limits anything.
+     */
+    class Pacer {
+    public:
+        explicit Pacer(double rate)
+                : rate(rate), burst(std::max(1.0, rate * PACER_BURST_SEC)), tokens(burst), last(Clock::now()) {}
+
+        size_t available(Clock::time_point now) {
+            if (rate == 0) {
+                return SIZE_MAX;
+            }
+            tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+            last = now;
+            return static_cast<size_t>(tokens);
+        }
+
+        void consume(size_t count) {
+            if (rate != 0) {
+                tokens -= static_cast<double>(count);
+            }
+        }
+
+        // how long until the next token, zero when one is available
+        Clock::duration untilNext() const {
+            if (rate == 0 || tokens >= 1) {
+                return Clock::duration::zero();
+            }
+            return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - tokens) / rate));
+        }
+
+    private:
+        double rate;
+        double burst;
+        double tokens;
+        Clock::time_point last;
+    };
+
+    struct Settings {
+        uint16_t flags;
+        uint16_t ednsPayloadSize;
+        int timeoutSec;
+        // most queries waiting for an answer at once
+        size_t window;
+        // queries per second, 0 sends as fast as the transport takes them
+        size_t qps;
+        // replay the list in a loop for this long, a single pass without it
+        std::optional<std::chrono::seconds> duration;
+    };
+
+    struct Report {
+        std::chrono::duration<double> sendTime{};
+        std::chrono::duration<double> totalTime{};
+        size_t sent = 0;
+        size_t answered = 0;
+        size_t timedOut = 0;
+        size_t truncated = 0;
+        size_t unmatched = 0;
+        std::array<size_t, 16> rcodes{};
+        // microseconds from send to the matching response
+        Histogram latency;
+        const char *transport = "";
+        udp::SyscallStats sendCalls;
+        udp::SyscallStats receiveCalls;
+    };
+
+    std::ostream &operator<<(std::ostream &stream, const Report &report) {
+        const double milliseconds = 1000.0;
+        stream << std::fixed << std::setprecision(2);
+        stream << "Duration: " << report.totalTime.count() << " s, Sent: " << report.sent << " ("
+               << (report.sendTime.count() > 0 ? report.sent / report.sendTime.count() : 0) << " qps)"
+               << ", Answered: " << report.answered << ", Timed out: " << report.timedOut
+               << ", Truncated: " << report.truncated << ", Unmatched: " << report.unmatched << std::endl;
+        stream << std::setprecision(3) << "Latency (ms): min " << report.latency.min() / milliseconds
+               << ", mean " << report.latency.mean() / milliseconds
+               << ", p50 " << report.latency.percentile(50) / milliseconds
+               << ", p90 " << report.latency.percentile(90) / milliseconds
+               << ", p99 " << report.latency.percentile(99) / milliseconds
+               << ", p99.9 " << report.latency.percentile(99.9) / milliseconds
+               << ", max " << report.latency.max() / milliseconds << std::endl;
+        stream << "RCODE:";
+        bool first = true;
+        for (size_t rcode = 0; rcode < report.rcodes.size(); ++rcode) {
+            if (report.rcodes[rcode]) {
+                stream << (first ? " " : ", ") << dns::parsing::utils::rcodeToString(rcode) << ": " << report.rcodes[rcode];
+                first = false;
+            }
+        }
+        stream << (first ? " none" : "") << std::endl;
+        stream << report.transport << " send: " << report.sendCalls << std::endl;
+        stream << report.transport << " receive: " << report.receiveCalls << std::endl;
+        return stream;
+    }
+
+    /**
+     * Replays a list of questions against one server, open loop: queries go out at the paced rate
+     * whether or not earlier ones were answered. Only the latency and the outcome of each query is kept,
+     * responses are not rendered.
+     */
+    class Generator : private transport::ResponseHandler {
+    public:
+        Generator(transport::Transport &transport, const Settings &settings)
+                : transport(transport), settings(settings), inFlight(batch::makeSlots(&buffers)), timeout(settings.timeoutSec),
+                  pacer(static_cast<double>(settings.qps)) {}
+
+        Report run(const std::vector<dns::Question> &questions) {
+            const size_t window = std::clamp<size_t>(settings.window, 1, DNS_ID_SPACE);
+            const Clock::time_point start = Clock::now();
+            Clock::time_point lastSend = start;
+            size_t next = 0;
+
+            while (true) {
+                const Clock::time_point now = Clock::now();
+                const bool issuing = settings.duration ? now - start < *settings.duration : next < questions.size();
+                size_t budget = 0;
+                if (issuing) {
+                    budget = std::min({window - active, LOAD_SEND_CHUNK, pacer.available(now)});
+                    if (!settings.duration) {
+                        budget = std::min(budget, questions.size() - next);
+                    }
+                    const size_t sent = issue(questions, next, budget);
+                    lastSend = sent ? Clock::now() : lastSend;
+                    budget -= sent;
+                }
+                while (!sendOrder.empty() && !inFlight[sendOrder.front()].active) {
+                    sendOrder.pop_front();
+                }
+                if (!issuing && sendOrder.empty()) {
+                    break;
+                }
+                if (sendOrder.empty()) {
+                    // nothing to wait for but the transport or the pacer
+                    if (budget) {
+                        transport.waitWritable();
+                    } else {
+                        waitFor(pacer.untilNext());
+                    }
+                    transport.receive(*this);
+                    continue;
+                }
+
+                Clock::duration wait = inFlight[sendOrder.front()].sentAt + timeout - Clock::now();
+                if (issuing && active < window) {
+                    wait = std::min(wait, budget ? std::chrono::milliseconds(1) : pacer.untilNext());
+                }
+                waitFor(wait);
+                transport.receive(*this);
+                expire();
+            }
+
+            report.sendTime = lastSend - start;
+            report.totalTime = Clock::now() - start;
+            report.transport = transport.name();
+            report.sendCalls = transport.getSendStats();
+            report.receiveCalls = transport.getReceiveStats();
+            return report;
+        }
+
+    private:
+        // builds up to `count` queries from the list, returns how many the transport took
+        size_t issue(const std::vector<dns::Question> &questions, size_t &next, size_t count) {
+            staged.clear();
+            packets.clear();
+            for (size_t i = 0; i < count; ++i) {
+                const dns::Question &question = questions[(next + i) % questions.size()];
+                uint16_t id = ids.acquire();
+                batch::startQuery(inFlight[id], id, settings.flags, question, settings.ednsPayloadSize);
+                staged.push_back(id);
+                packets.push_back(inFlight[id].packet);
+            }
+            const size_t sent = count ? transport.send(packets) : 0;
+            const Clock::time_point now = Clock::now();
+            for (size_t i = 0; i < staged.size(); ++i) {
+                if (i < sent) {
+                    inFlight[staged[i]].sentAt = now;
+                    sendOrder.push_back(staged[i]);
+                } else {
+                    batch::finishQuery(inFlight[staged[i]]);
+                    ids.release(staged[i]);
+                }
+            }
+            next = settings.duration ? (next + sent) % questions.size() : next + sent;
+            active += sent;
+            report.sent += sent;
+            pacer.consume(sent);
+            return sent;
+        }
+
+        void waitFor(Clock::duration wait) const {
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::max(wait, Clock::duration::zero())).count();
+            const timespec timeout{static_cast<time_t>(nanoseconds / 1000000000), static_cast<long>(nanoseconds % 1000000000)};
+            pollfd pfd{transport.descriptor(), POLLIN, 0};
+            if (ppoll(&pfd, 1, &timeout, nullptr) < 0 && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll transport");
+            }
+        }
+
+        void onResponse(dns::PacketView packet) override {
+            const Clock::time_point now = Clock::now();
+            if (packet.size() < DNS_HEADER_SIZE) {
+                report.unmatched++;
+                return;
+            }
+            const uint16_t id = (packet[0] << 8) | packet[1];
+            batch::InFlightQuery &query = inFlight[id];
+            if (!query.active || !batch::responseMatches(packet, query)) {
+                report.unmatched++;
+                return;
+            }
+            report.latency.record(std::chrono::duration_cast<std::chrono::microseconds>(now - query.sentAt).count());
+            report.rcodes[packet[3] & RCODE_MASK]++;
+            if (dns::isTruncated(packet)) {
+                report.truncated++;
+            }
+            report.answered++;
+            finish(id);
+        }
+
+        void finish(uint16_t id) {
+            batch::finishQuery(inFlight[id]);
+            ids.release(id);
+            active--;
+        }
+
+        void expire() {
+            const Clock::time_point now = Clock::now();
+            while (!sendOrder.empty()) {
+                const uint16_t id = sendOrder.front();
+                if (inFlight[id].active) {
+                    if (now - inFlight[id].sentAt < timeout) {
+                        break;
+                    }
+                    finish(id);
+                    report.timedOut++;
+                }
+                sendOrder.pop_front();
+            }
+        }
+
+        transport::Transport &transport;
+        const Settings &settings;
+        // names and packets of the queries in flight, recycled from one query to the next
+        std::pmr::unsynchronized_pool_resource buffers;
+        batch::IdAllocator ids;
+        std::vector<batch::InFlightQuery> inFlight;
+        // queries of the current issue() and their packets, kept between calls
+        std::vector<uint16_t> staged;
+        std::vector<dns::PacketView> packets;
+        std::deque<uint16_t> sendOrder;
+        const std::chrono::seconds timeout;
+        size_t active = 0;
+        Pacer pacer;
+        Report report;
+    };
+
+    Report run(const std::vector<dns::Question> &questions, transport::Transport &transport, const Settings &settings) {
+        Generator generator(transport, settings);
+        return generator.run(questions);
+    }
+}
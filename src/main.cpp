@@ -1,44 +1,441 @@
 // Author: Aliaksandr Skuratovich (xskura01)
 
 #include "argparser.h"
+#include "batch.h"
+#include "cache.h"
 #include "dns.h"
+#include "forward.h"
+#include "iterative.h"
+#include "load.h"
+#include "output.h"
+#include "pcap.h"
+#include "refresh.h"
+#include "stats.h"
+#include "sweep.h"
+#include "tcp.h"
+#include "transfer.h"
+#include "transport.h"
 #include "udp.h"
+#include "upstream.h"
+#include "uring.h"
 #include "utils.h"
+#include "workers.h"
 
 #include <iostream>
+#include <fstream>
+#include <memory>
 
 
 const size_t TIMEOUT_SEC = 4;
 
-int main(int argc, const char** argv) {
-    DNSConfiguration args{};
+std::unique_ptr<cache::Cache> openCache(const DNSConfiguration &args) {
+    return args.cacheFile ? std::make_unique<cache::Cache>(*args.cacheFile) : nullptr;
+}
+
+std::unique_ptr<transport::Transport> openTransport(const DNSConfiguration &args, const std::string &server,
+                                                    size_t bufferSize, size_t window) {
+    const uint16_t port = args.port.value_or(DEFAULT_DNS_PORT);
+    if (args.ioUring) {
+        try {
+            return std::make_unique<uring::UringTransport>(server, port, bufferSize, window);
+        } catch (const std::system_error &err) {
+            std::cerr << err.what() << ", falling back to epoll" << std::endl;
+        }
+    }
+    return std::make_unique<transport::EpollTransport>(server, port, bufferSize, window);
+}
+
+std::vector<upstream::Upstream> openUpstreams(const DNSConfiguration &args, size_t bufferSize, size_t window) {
+    const uint16_t port = args.port.value_or(DEFAULT_DNS_PORT);
+    std::vector<upstream::Upstream> upstreams;
+    for (const std::string &server : args.servers) {
+        upstreams.push_back({openTransport(args, server, bufferSize, window),
+                             std::make_unique<tcp::Connection>(server, port, TIMEOUT_SEC), {}});
+    }
+    return upstreams;
+}
+
+// questions of the batch file or the sweep range, `file` keeps the batch file open
+std::unique_ptr<batch::QuerySource> openQuerySource(const DNSConfiguration &args, std::ifstream &file) {
+    if (args.sweepRange) {
+        return std::make_unique<sweep::SweepQuerySource>(sweep::parseRange(*args.sweepRange));
+    }
+    if (*args.batchFile == "-") {
+        return std::make_unique<batch::StreamQuerySource>(std::cin, args);
+    }
+    file.open(*args.batchFile);
+    if (!file) {
+        throw std::system_error(errno, std::generic_category(), "Failed to open batch file " + *args.batchFile);
+    }
+    return std::make_unique<batch::StreamQuerySource>(file, args);
+}
+
+int runBatch(const DNSConfiguration &args) {
+    batch::Summary summary;
+    std::vector<workers::WorkerResult> workerResults;
     try {
-        args = argparser::parseArguments(argc, argv);
+        std::ifstream file;
+        std::unique_ptr<batch::QuerySource> source = openQuerySource(args, file);
+        std::unique_ptr<cache::Cache> cache = openCache(args);
+        const size_t window = args.window.value_or(DEFAULT_BATCH_WINDOW);
+        const size_t bufferSize = std::max<size_t>(args.ednsPayloadSize.value_or(0), DNS_PACKET_SIZE);
+        const OUTPUT_FORMAT format = args.outputFormat.value_or(OUTPUT_FORMAT_TEXT);
+        const batch::Settings settings{
+            .flags = static_cast<uint16_t>(args.recursionRequested ? FLAG_RD : 0),
+            .window = window,
+            .timeoutSec = TIMEOUT_SEC,
+            .tcpOnly = args.tcpOnly,
+            .ednsPayloadSize = args.ednsPayloadSize.value_or(0),
+            .race = args.race,
+        };
+        if (args.workers) {
+            const workers::Options options{*args.workers, args.pinWorkers, format};
+            workers::Result result = workers::run(*source, options, settings, cache.get(), [&]() {
+                return openUpstreams(args, bufferSize, window);
+            });
+            summary = result.total;
+            workerResults = std::move(result.workers);
+        } else {
+            std::vector<upstream::Upstream> upstreams = openUpstreams(args, bufferSize, window);
+            auto sink = output::makeSink(format, STDOUT_FILENO);
+            summary = batch::run(*source, upstreams, cache.get(), settings, *sink);
+        }
     } catch (const std::system_error &err) {
         std::cerr << err.what() << std::endl;
         return -1;
     }
 
+    bool failed = false;
+    for (size_t i = 0; i < workerResults.size(); ++i) {
+        const workers::WorkerResult &worker = workerResults[i];
+        std::cerr << "Worker " << i << ": Sent: " << worker.summary.sent << ", Answered: " << worker.summary.answered
+                  << ", Stolen: " << worker.stolen;
+        if (worker.error) {
+            std::cerr << ", Failed: " << *worker.error;
+            failed = true;
+        }
+        std::cerr << std::endl;
+    }
+    std::cerr << "Sent: " << summary.sent << ", Answered: " << summary.answered
+              << ", Timed out: " << summary.timedOut << ", Unmatched: " << summary.unmatched
+              << ", Malformed: " << summary.malformed << ", Retransmitted: " << summary.retransmitted
+              << ", Raced: " << summary.raced
+              << ", Retried over TCP: " << summary.truncated
+              << ", From cache: " << summary.cached << std::endl;
+    std::cerr << summary.transport << " send: " << summary.sendCalls << std::endl;
+    std::cerr << summary.transport << " receive: " << summary.receiveCalls << std::endl;
+    return failed ? -1 : 0;
+}
+
+int runLoad(const DNSConfiguration &args) {
+    std::ifstream file;
+    if (*args.loadFile != "-") {
+        file.open(*args.loadFile);
+        if (!file) {
+            std::cerr << "Failed to open load file " << *args.loadFile << std::endl;
+            return -1;
+        }
+    }
+    std::istream &input = *args.loadFile == "-" ? std::cin : file;
+
+    load::Report report;
+    try {
+        batch::StreamQuerySource source(input, args);
+        std::vector<dns::Question> questions;
+        dns::Question question;
+        while (source.next(question)) {
+            questions.push_back(question);
+        }
+        if (questions.empty()) {
+            std::cerr << "No queries in load file " << *args.loadFile << std::endl;
+            return -1;
+        }
+        const size_t window = args.window.value_or(DNS_ID_SPACE);
+        const size_t bufferSize = std::max<size_t>(args.ednsPayloadSize.value_or(0), DNS_PACKET_SIZE);
+        const load::Settings settings{
+            .flags = static_cast<uint16_t>(args.recursionRequested ? FLAG_RD : 0),
+            .ednsPayloadSize = args.ednsPayloadSize.value_or(0),
+            .timeoutSec = TIMEOUT_SEC,
+            .window = window,
+            .qps = args.qps.value_or(0),
+            .duration = args.durationSec ? std::optional(std::chrono::seconds(*args.durationSec)) : std::nullopt,
+        };
+        auto transport = openTransport(args, args.servers.front(), bufferSize, window);
+        report = load::run(questions, *transport, settings);
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+    std::cout << report;
+    return 0;
+}
+
+int runWatch(const DNSConfiguration &args) {
+    std::ifstream file;
+    if (*args.watchFile != "-") {
+        file.open(*args.watchFile);
+        if (!file) {
+            std::cerr << "Failed to open watch file " << *args.watchFile << std::endl;
+            return -1;
+        }
+    }
+    std::istream &input = *args.watchFile == "-" ? std::cin : file;
+
+    refresh::Summary summary;
+    try {
+        batch::StreamQuerySource source(input, args);
+        std::vector<dns::Question> watchList;
+        dns::Question question;
+        while (source.next(question)) {
+            watchList.push_back(question);
+        }
+        if (watchList.empty()) {
+            std::cerr << "No names in watch file " << *args.watchFile << std::endl;
+            return -1;
+        }
+        const size_t window = args.window.value_or(DEFAULT_BATCH_WINDOW);
+        const size_t bufferSize = std::max<size_t>(args.ednsPayloadSize.value_or(0), DNS_PACKET_SIZE);
+        const refresh::Settings settings{
+            .flags = static_cast<uint16_t>(args.recursionRequested ? FLAG_RD : 0),
+            .ednsPayloadSize = args.ednsPayloadSize.value_or(0),
+            .timeoutSec = TIMEOUT_SEC,
+            .window = window,
+            .ahead = static_cast<double>(args.refreshAheadPercent.value_or(REFRESH_DEFAULT_AHEAD_PERCENT)) / 100,
+            .duration = args.durationSec ? std::optional(std::chrono::seconds(*args.durationSec)) : std::nullopt,
+        };
+        std::unique_ptr<cache::Cache> cache = openCache(args);
+        auto transport = openTransport(args, args.servers.front(), bufferSize, window);
+        summary = refresh::run(watchList, *transport, *cache, settings);
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+    std::cerr << summary;
+    return 0;
+}
+
+int runForward(const DNSConfiguration &args) {
+    forward::Summary summary;
+    try {
+        const size_t bufferSize = std::max<size_t>(args.ednsPayloadSize.value_or(0), DNS_PACKET_SIZE);
+        const forward::Settings settings{
+            .flags = static_cast<uint16_t>(args.recursionRequested ? FLAG_RD : 0),
+            .ednsPayloadSize = args.ednsPayloadSize.value_or(0),
+            .timeoutSec = TIMEOUT_SEC,
+            .duration = args.durationSec ? std::optional(std::chrono::seconds(*args.durationSec)) : std::nullopt,
+        };
+        auto transport = openTransport(args, args.servers.front(), bufferSize, FORWARD_RECEIVE_WINDOW);
+        tcp::Connection tcpUpstream(args.servers.front(), args.port.value_or(DEFAULT_DNS_PORT), TIMEOUT_SEC, false);
+        forward::Forwarder forwarder(*args.listenAddress, *args.listenPort, *transport, tcpUpstream, settings);
+        summary = forwarder.run();
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+    std::cerr << summary;
+    return 0;
+}
+
+int runTransfer(const DNSConfiguration &args) {
+    transfer::Summary summary;
+    try {
+        const transfer::Settings settings{
+            .zone = *args.transferZone,
+            .serial = args.transferSerial,
+            .timeoutSec = TIMEOUT_SEC,
+        };
+        auto sink = output::makeSink(args.outputFormat.value_or(OUTPUT_FORMAT_TEXT), STDOUT_FILENO);
+        summary = transfer::run(args.servers.front(), args.port.value_or(DEFAULT_DNS_PORT), settings, *sink);
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+    std::cerr << summary;
+    return 0;
+}
+
+int runIterative(const DNSConfiguration &args) {
+    const bool batched = args.batchFile || args.sweepRange;
+    const iterative::Settings settings{
+        .port = args.port.value_or(DEFAULT_DNS_PORT),
+        .ednsPayloadSize = args.ednsPayloadSize.value_or(0),
+        .tcpOnly = args.tcpOnly,
+    };
+    iterative::Resolver resolver(args.servers.empty() ? iterative::rootHints() : args.servers, settings);
+    size_t cached = 0;
+    try {
+        std::ifstream file;
+        std::unique_ptr<batch::QuerySource> source = batched ? openQuerySource(args, file) : nullptr;
+        std::unique_ptr<cache::Cache> cache = openCache(args);
+        auto sink = output::makeSink(args.outputFormat.value_or(OUTPUT_FORMAT_TEXT), STDOUT_FILENO);
+        // the delegation cache is shared by every name of a batch, a single query is a batch of one
+        dns::Question question = batched ? dns::Question{} : dns::constructQuestion(args);
+        for (bool more = !batched || source->next(question); more; more = batched && source->next(question)) {
+            std::optional<dns::Packet> response;
+            if (cache) {
+                response = cache->lookup(question, dns::randomQueryId());
+                cached += response.has_value();
+            }
+            try {
+                if (!response) {
+                    response = resolver.resolve(question);
+                    if (cache) {
+                        cache->store(question, *response);
+                    }
+                }
+                sink->write(dns::parseResponsePacket(*response));
+            } catch (const std::system_error &err) {
+                if (!batched) {
+                    throw;
+                }
+                std::cerr << question.name << ": " << err.what() << std::endl;
+            }
+        }
+        sink->flush();
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+
+    if (batched) {
+        const iterative::Summary &summary = resolver.getSummary();
+        std::cerr << "Resolved: " << summary.resolved << ", Failed: " << summary.failed
+                  << ", Queries: " << summary.queries << ", Referrals: " << summary.referrals
+                  << ", Delegation cache hits: " << summary.delegationHits
+                  << ", From cache: " << cached << std::endl;
+    }
+    return 0;
+}
+
+int runPcap(const DNSConfiguration &args) {
+    pcap::Summary summary;
+    try {
+        const pcap::Options options{
+            .threads = args.workers.value_or(1),
+            .pin = args.pinWorkers,
+            .port = args.port.value_or(DEFAULT_DNS_PORT),
+            .format = args.outputFormat.value_or(OUTPUT_FORMAT_TEXT),
+            .summaryOnly = args.pcapSummary,
+        };
+        summary = pcap::run(*args.pcapFile, options);
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+    if (args.pcapSummary) {
+        std::cout << summary;
+    } else {
+        pcap::printTotals(std::cerr, summary);
+    }
+    return 0;
+}
+
+// TCP has its own retransmissions, the next server is only tried when one fails altogether
+std::vector<uint8_t> sendQueryTcp(const std::vector<std::string> &servers, uint16_t port, const dns::Packet &queryPacket) {
+    for (size_t i = 0;; ++i) {
+        try {
+            return tcp::sendQuery(servers[i], port, queryPacket, TIMEOUT_SEC);
+        } catch (const std::system_error &err) {
+            if (i + 1 == servers.size()) {
+                throw;
+            }
+            debugMsg(servers[i] << ": " << err.what() << ", trying the next server" << std::endl);
+        }
+    }
+}
+
+int runSingle(const DNSConfiguration &args) {
+    std::unique_ptr<cache::Cache> cache;
     dns::Packet queryPacket;
     dns::Server server;
+    dns::Question question;
     try {
+        cache = openCache(args);
         tie(queryPacket, server) = dns::constructQueryPacket(args);
+        question = dns::constructQuestion(args);
     } catch (const std::system_error &err) {
         std::cerr << err.what() << std::endl;
         return -1;
     }
 
-    std::vector<uint8_t> response;
+    std::optional<std::vector<uint8_t>> response;
+    if (cache) {
+        response = cache->lookup(question, (queryPacket[0] << 8) | queryPacket[1]);
+    }
+    if (!response) {
+        try {
+            debugMsg("Sending DNS query to " << server.address << ":" << server.port << " for " << args.address << std::endl);
+            if (args.tcpOnly) {
+                response = sendQueryTcp(args.servers, server.port, queryPacket);
+            } else {
+                const size_t bufferSize = std::max<size_t>(args.ednsPayloadSize.value_or(0), DNS_PACKET_SIZE);
+                std::vector<std::unique_ptr<udp::ServerEndpoint>> endpoints;
+                for (const std::string &address : args.servers) {
+                    endpoints.push_back(std::make_unique<udp::ServerEndpoint>(address, server.port, 1, bufferSize));
+                }
+                upstream::Selector selector = upstream::makeSelector(endpoints);
+                upstream::Answer answer = upstream::sendQuery(endpoints, selector, queryPacket, TIMEOUT_SEC, args.race);
+                response = std::move(answer.response);
+                if (dns::isTruncated(*response)) {
+                    debugMsg("Response truncated, retrying over TCP" << std::endl);
+                    statsCount(COUNTER_RETRIES, 1);
+                    response = tcp::sendQuery(args.servers[answer.server], server.port, queryPacket, TIMEOUT_SEC);
+                }
+            }
+        } catch (std::system_error &err) {
+            std::cerr << err.what() << std::endl;
+            return -1;
+        }
+        if (cache) {
+            cache->store(question, *response);
+        }
+    }
+
     try {
-        debugMsg("Sending DNS query to " << server << ":" << port << " for " << address << std::endl);
-        response = udp::sendQuery(server.address, server.port, queryPacket, TIMEOUT_SEC);
-    } catch (std::system_error &err) {
+        auto sink = output::makeSink(args.outputFormat.value_or(OUTPUT_FORMAT_TEXT), STDOUT_FILENO);
+        sink->write(dns::parseResponsePacket(*response));
+        sink->flush();
+    } catch (const std::system_error &err) {
         std::cerr << err.what() << std::endl;
         return -1;
     }
 
-    const auto result = dns::parseResponsePacket(response);
-    std::cout << result;
-
     return 0;
 }
+
+int main(int argc, const char** argv) {
+    DNSConfiguration args{};
+    try {
+        args = argparser::parseArguments(argc, argv);
+    } catch (const std::system_error &err) {
+        std::cerr << err.what() << std::endl;
+        return -1;
+    }
+
+#ifdef STATS
+    stats::install(args.statsFormat.value_or(STATS_FORMAT_TEXT));
+#endif
+
+    if (args.pcapFile) {
+        return runPcap(args);
+    }
+    if (args.iterative) {
+        return runIterative(args);
+    }
+    if (args.batchFile || args.sweepRange) {
+        return runBatch(args);
+    }
+    if (args.loadFile) {
+        return runLoad(args);
+    }
+    if (args.watchFile) {
+        return runWatch(args);
+    }
+    if (args.listenAddress) {
+        return runForward(args);
+    }
+    if (args.transferZone) {
+        return runTransfer(args);
+    }
+    return runSingle(args);
+}
@@ -0,0 +1,274 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <span>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+const size_t MAX_LABEL_LENGTH = 63;
+// wire format limit of RFC 1035, including the length bytes and the root label
+const size_t MAX_WIRE_NAME_LENGTH = 255;
+
+/**
+ * Byte-string routines for domain names. The SIMD paths are picked at compile time: AVX2 with -mavx2
+ * (make native), SSE2 on any x86-64, plain 64-bit words (SWAR) everywhere else.
+ */
+namespace names {
+    const uint64_t WORD_ONES = 0x0101010101010101ull;
+    const uint64_t WORD_HIGH_BITS = 0x8080808080808080ull;
+
+    uint64_t loadWord(const char *data) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        return word;
+    }
+
+    // ASCII lowercase of 8 bytes at once, bytes outside 'A'-'Z' are left alone
+    uint64_t toLowerWord(uint64_t word) {
+        const uint64_t heptets = word & ~WORD_HIGH_BITS;
+        // the high bit of every byte says >= 'A' and > 'Z', the sums never carry into the next byte
+        const uint64_t atLeastA = heptets + (0x80 - 'A') * WORD_ONES;
+        const uint64_t aboveZ = heptets + (0x80 - 'Z' - 1) * WORD_ONES;
+        const uint64_t upper = atLeastA & ~aboveZ & ~word & WORD_HIGH_BITS;
+        return word | (upper >> 2);
+    }
+
+    char toLowerByte(char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+    }
+
+#if defined(__AVX2__)
+    const size_t VECTOR_SIZE = 32;
+    typedef __m256i Vector;
+
+    Vector loadVector(const char *data) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    }
+
+    Vector toLowerVector(Vector v) {
+        // signed compares, bytes of 0x80 and above are negative and never upper case
+        const Vector upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                              _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+        return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+    }
+
+    // bit per byte, set where the vectors are equal
+    uint32_t equalMask(Vector a, Vector b) {
+        return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+    }
+
+    // bit per byte, set for bytes outside the printable range 0x21-0x7E
+    uint32_t unprintableMask(Vector v) {
+        const Vector printable = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x20)),
+                                                  _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7F), v));
+        return ~static_cast<uint32_t>(_mm256_movemask_epi8(printable));
+    }
+
+    void storeVector(char *data, Vector v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(data), v);
+    }
+
+    const uint32_t FULL_MASK = 0xFFFFFFFFu;
+#elif defined(__SSE2__)
+    const size_t VECTOR_SIZE = 16;
+    typedef __m128i Vector;
+
+    Vector loadVector(const char *data) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    }
+
+    Vector toLowerVector(Vector v) {
+        // signed compares, bytes of 0x80 and above are negative and never upper case
+        const Vector upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                           _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+        return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    }
+
+    uint32_t equalMask(Vector a, Vector b) {
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)));
+    }
+
+    uint32_t unprintableMask(Vector v) {
+        const Vector printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x20)),
+                                               _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+        return ~static_cast<uint32_t>(_mm_movemask_epi8(printable)) & 0xFFFFu;
+    }
+
+    void storeVector(char *data, Vector v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data), v);
+    }
+
+    const uint32_t FULL_MASK = 0xFFFFu;
+#endif
+
+    void toLower(char *data, size_t length) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+        for (; i + VECTOR_SIZE <= length; i += VECTOR_SIZE) {
+            storeVector(data + i, toLowerVector(loadVector(data + i)));
+        }
+#endif
+        for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+            const uint64_t word = toLowerWord(loadWord(data + i));
+            std::memcpy(data + i, &word, sizeof(word));
+        }
+        for (; i < length; ++i) {
+            data[i] = toLowerByte(data[i]);
+        }
+    }
+
+    void toLower(std::string &text) {
+        toLower(text.data(), text.size());
+    }
+
+    bool equalsIgnoreCase(const char *a, const char *b, size_t length) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+        for (; i + VECTOR_SIZE <= length; i += VECTOR_SIZE) {
+            if (equalMask(toLowerVector(loadVector(a + i)), toLowerVector(loadVector(b + i))) != FULL_MASK) {
+                return false;
+            }
+        }
+#endif
+        for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+            if (toLowerWord(loadWord(a + i)) != toLowerWord(loadWord(b + i))) {
+                return false;
+            }
+        }
+        for (; i < length; ++i) {
+            if (toLowerByte(a[i]) != toLowerByte(b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool equalsIgnoreCase(std::span<const uint8_t> a, std::span<const uint8_t> b) {
+        return a.size() == b.size() && equalsIgnoreCase(reinterpret_cast<const char *>(a.data()),
+                                                        reinterpret_cast<const char *>(b.data()), a.size());
+    }
+
+    /**
+     * Case-insensitive 32-bit hash. It mixes one 64-bit word at a time, lowercased with SWAR rather than SIMD,
+     * so every build computes the same value for the cache files they share.
+     */
+    uint32_t hashIgnoreCase(const char *data, size_t length) {
+        const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+        uint64_t hash = length * multiplier;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+            hash = (hash ^ toLowerWord(loadWord(data + i))) * multiplier;
+            hash ^= hash >> 29;
+        }
+        if (i < length) {
+            uint64_t tail = 0;
+            std::memcpy(&tail, data + i, length - i);
+            hash = (hash ^ toLowerWord(tail)) * multiplier;
+            hash ^= hash >> 29;
+        }
+        hash *= multiplier;
+        return static_cast<uint32_t>(hash >> 32);
+    }
+
+    // printable ASCII without the space, the label separator '.' included
+    bool isPrintable(const char *data, size_t length) {
+        size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+        for (; i + VECTOR_SIZE <= length; i += VECTOR_SIZE) {
+            if (unprintableMask(loadVector(data + i))) {
+                return false;
+            }
+        }
+#endif
+        for (; i < length; ++i) {
+            if (data[i] <= ' ' || data[i] >= 0x7F) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[noreturn]] void throwInvalid(std::string_view name, const std::string &reason) {
+        throw std::system_error(EINVAL, std::generic_category(),
+                                "Invalid domain name \"" + std::string(name) + "\": " + reason);
+    }
+
+    // wire format size of a presentation name, without validating it
+    size_t wireLength(std::string_view name) {
+        if (!name.empty() && name.back() == '.') {
+            name.remove_suffix(1);
+        }
+        return name.empty() ? 1 : name.size() + 2;
+    }
+
+    /**
+     * Writes the wire format of `name` to `output`, which has room for wireLength(name) bytes, and returns
+     * the number of bytes written. The labels are copied in one go and their separators found with memchr,
+     * only the length bytes are written one by one. A trailing dot is optional, "" and "." are the root.
+     */
+    size_t presentationToWire(std::string_view name, uint8_t *output) {
+        std::string_view labels = name;
+        if (!labels.empty() && labels.back() == '.') {
+            labels.remove_suffix(1);
+        }
+        if (labels.empty()) {
+            output[0] = 0;
+            return 1;
+        }
+        if (labels.size() + 2 > MAX_WIRE_NAME_LENGTH) {
+            throwInvalid(name, "longer than 255 bytes");
+        }
+        if (!isPrintable(labels.data(), labels.size())) {
+            throwInvalid(name, "contains a space, a control or a non-ASCII character");
+        }
+        std::memcpy(output + 1, labels.data(), labels.size());
+        size_t start = 0;
+        while (true) {
+            const void *dot = std::memchr(labels.data() + start, '.', labels.size() - start);
+            const size_t end = dot ? static_cast<const char *>(dot) - labels.data() : labels.size();
+            const size_t length = end - start;
+            if (length == 0) {
+                throwInvalid(name, "empty label");
+            }
+            if (length > MAX_LABEL_LENGTH) {
+                throwInvalid(name, "label longer than 63 bytes");
+            }
+            output[start] = static_cast<uint8_t>(length);
+            if (!dot) {
+                output[end + 1] = 0;
+                return end + 2;
+            }
+            start = end + 1;
+        }
+    }
+
+    // throws for a name presentationToWire refuses, so it can be turned down before it is queried
+    void validate(std::string_view name) {
+        uint8_t wire[MAX_WIRE_NAME_LENGTH];
+        presentationToWire(name, wire);
+    }
+
+    /**
+     * Appends a run of consecutive uncompressed labels in wire format, length bytes included and the root
+     * label excluded, as dotted text. The run is copied in one go, then the length bytes become dots.
+     */
+    template<typename String>
+    void appendWireRun(String &output, std::span<const uint8_t> run) {
+        const size_t base = output.size();
+        output.append(reinterpret_cast<const char *>(run.data()) + 1, run.size() - 1);
+        for (size_t position = run[0]; position + 1 < run.size(); position += run[position + 1] + 1) {
+            output[base + position] = '.';
+        }
+    }
+}
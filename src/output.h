@@ -0,0 +1,1005 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <variant>
+#include <charconv>
+#include <system_error>
+#include <ctime>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "dns.h"
+#include "stats.h"
+#include "utils.h"
+
+
+const size_t OUTPUT_FLUSH_THRESHOLD = 64 * 1024;
+
+// frame kinds of the binary output
+const uint8_t FRAME_MESSAGE = 0;
+const uint8_t FRAME_QUESTION = 1;
+const uint8_t FRAME_ANSWER = 2;
+const uint8_t FRAME_AUTHORITY = 3;
+const uint8_t FRAME_ADDITIONAL = 4;
+
+namespace output {
+
+    namespace utils {
+        template<typename Number>
+        void appendNumber(std::string &output, Number number) {
+            char buffer[24];
+            auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+            output.append(buffer, result.ptr);
+        }
+
+        void appendUint16(std::string &output, uint16_t number) {
+            output += static_cast<char>(number >> 8);
+            output += static_cast<char>(number & 0xFF);
+        }
+
+        void appendUint32(std::string &output, uint32_t number) {
+            appendUint16(output, number >> 16);
+            appendUint16(output, number & 0xFFFF);
+        }
+
+        void appendAddress(std::string &output, int family, dns::PacketView address) {
+            char buffer[INET6_ADDRSTRLEN];
+            inet_ntop(family, address.data(), buffer, sizeof(buffer));
+            output += buffer;
+        }
+
+        void appendHex(std::string &output, dns::PacketView data) {
+            const char *hexadec = "0123456789abcdef";
+            for (uint8_t byte : data) {
+                output += hexadec[byte >> 4];
+                output += hexadec[byte & 0x0F];
+            }
+        }
+
+        void appendBase64(std::string &output, dns::PacketView data) {
+            const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            size_t i = 0;
+            for (; i + 3 <= data.size(); i += 3) {
+                const uint32_t group = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+                for (int shift = 18; shift >= 0; shift -= 6) {
+                    output += alphabet[(group >> shift) & 0x3F];
+                }
+            }
+            if (i < data.size()) {
+                const uint32_t group = (data[i] << 16) | (i + 1 < data.size() ? data[i + 1] << 8 : 0);
+                output += alphabet[group >> 18];
+                output += alphabet[(group >> 12) & 0x3F];
+                output += i + 1 < data.size() ? alphabet[(group >> 6) & 0x3F] : '=';
+                output += '=';
+            }
+        }
+
+        // YYYYMMDDHHmmSS in UTC, the presentation of RRSIG validity times (RFC 4034)
+        void appendTimestamp(std::string &output, uint32_t seconds) {
+            const time_t time = seconds;
+            struct tm utc{};
+            gmtime_r(&time, &utc);
+            char buffer[16];
+            const size_t length = strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%S", &utc);
+            output.append(buffer, length);
+        }
+
+        // generic RFC 3597 form of RDATA: \# length hex
+        void appendGenericData(std::string &output, dns::PacketView data) {
+            output += "\\# ";
+            appendNumber(output, data.size());
+            if (!data.empty()) {
+                output += ' ';
+                appendHex(output, data);
+            }
+        }
+
+        void appendSvcParamKey(std::string &output, uint16_t key) {
+            static const char *names[] = {"mandatory", "alpn", "no-default-alpn", "port", "ipv4hint", "ech",
+                                          "ipv6hint"};
+            if (key < std::size(names)) {
+                output += names[key];
+            } else {
+                output += "key";
+                appendNumber(output, key);
+            }
+        }
+
+        /**
+         * Presentation of a SvcParam value (RFC 9460), values of unknown keys or of the wrong length as hex.
+         */
+        void appendSvcParamValue(std::string &output, uint16_t key, dns::PacketView value) {
+            const size_t mark = output.size();
+            auto appendList = [&](size_t itemSize, auto appendItem) {
+                if (value.empty() || value.size() % itemSize) {
+                    return false;
+                }
+                for (size_t offset = 0; offset < value.size(); offset += itemSize) {
+                    if (offset) {
+                        output += ',';
+                    }
+                    appendItem(value.subspan(offset, itemSize));
+                }
+                return true;
+            };
+            bool known = false;
+            switch (key) {
+                case 0:
+                    known = appendList(2, [&](dns::PacketView item) {
+                        appendSvcParamKey(output, static_cast<uint16_t>((item[0] << 8) | item[1]));
+                    });
+                    break;
+                case 1:
+                    known = !value.empty();
+                    for (size_t offset = 0; known && offset < value.size(); offset += value[offset] + 1) {
+                        if (offset + 1 + value[offset] > value.size()) {
+                            known = false;
+                            break;
+                        }
+                        if (offset) {
+                            output += ',';
+                        }
+                        output.append(reinterpret_cast<const char *>(value.data()) + offset + 1, value[offset]);
+                    }
+                    break;
+                case 3:
+                    if (value.size() == 2) {
+                        appendNumber(output, (value[0] << 8) | value[1]);
+                        known = true;
+                    }
+                    break;
+                case 4:
+                    known = appendList(sizeof(in_addr), [&](dns::PacketView item) {
+                        appendAddress(output, AF_INET, item);
+                    });
+                    break;
+                case 5:
+                    appendBase64(output, value);
+                    known = true;
+                    break;
+                case 6:
+                    known = appendList(INET6_ADDRLEN, [&](dns::PacketView item) {
+                        appendAddress(output, AF_INET6, item);
+                    });
+                    break;
+                default:
+                    break;
+            }
+            if (!known) {
+                output.resize(mark);
+                appendHex(output, value);
+            }
+        }
+
+        void appendJsonString(std::string &output, std::string_view value) {
+            const char *hexadec = "0123456789abcdef";
+            output += '"';
+            for (unsigned char c : value) {
+                if (c == '"' || c == '\\') {
+                    output += '\\';
+                    output += static_cast<char>(c);
+                } else if (c < 0x20 || c >= 0x7F) {
+                    // bytes outside printable ASCII are written as latin-1 code points
+                    output += "\\u00";
+                    output += hexadec[c >> 4];
+                    output += hexadec[c & 0x0F];
+                } else {
+                    output += static_cast<char>(c);
+                }
+            }
+            output += '"';
+        }
+
+        // characters appendJsonString writes for the byte
+        size_t jsonEscapedLength(unsigned char c) {
+            if (c == '"' || c == '\\') {
+                return 2;
+            }
+            return c < 0x20 || c >= 0x7F ? 6 : 1;
+        }
+
+        /**
+         * The same as appendJsonString of the presentation format, without building it in a string of its own:
+         * the name is written straight into the output and escaped in place from the back.
+         */
+        void appendJsonName(std::string &output, const dns::NameView &name) {
+            const char *hexadec = "0123456789abcdef";
+            output += '"';
+            const size_t start = output.size();
+            name.appendTo(output);
+            const size_t end = output.size();
+            size_t escapedEnd = start;
+            for (size_t i = start; i < end; ++i) {
+                escapedEnd += jsonEscapedLength(output[i]);
+            }
+            output.resize(escapedEnd);
+            // every byte is read before the escaped bytes behind it can overwrite it
+            for (size_t from = end, to = escapedEnd; from > start && to > from;) {
+                const unsigned char c = output[--from];
+                const size_t length = jsonEscapedLength(c);
+                to -= length;
+                if (length == 1) {
+                    output[to] = static_cast<char>(c);
+                } else if (length == 2) {
+                    output[to] = '\\';
+                    output[to + 1] = static_cast<char>(c);
+                } else {
+                    output.replace(to, 4, "\\u00");
+                    output[to + 4] = hexadec[c >> 4];
+                    output[to + 5] = hexadec[c & 0x0F];
+                }
+            }
+            output += '"';
+        }
+    }
+
+    /**
+     * File descriptor the sinks write to. Several sinks may share one, chunks are written whole
+     * under the lock so messages of different sinks never interleave.
+     */
+    class Output {
+    public:
+        explicit Output(int fd) : fd(fd) {}
+
+        Output(const Output &) = delete;
+        Output &operator=(const Output &) = delete;
+
+        // `separator` goes in front of the chunk unless it is the first thing written
+        void write(std::string_view separator, std::string_view chunk) {
+            if (chunk.empty()) {
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (!empty) {
+                writeAll(separator);
+            }
+            writeAll(chunk);
+            empty = false;
+        }
+
+    private:
+        void writeAll(std::string_view data) const {
+            size_t written = 0;
+            while (written < data.size()) {
+                ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+                if (result < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "Failed to write output");
+                }
+                written += result;
+            }
+        }
+
+        int fd;
+        std::mutex lock;
+        bool empty = true;
+    };
+
+    /**
+     * Destination for parsed messages. Rendered output is collected in a buffer and written to the
+     * output in large chunks, a message that fails to render leaves nothing behind.
+     */
+    class Sink {
+    public:
+        explicit Sink(int fd) : ownOutput(std::make_unique<Output>(fd)), output(*ownOutput) {
+            buffer.reserve(OUTPUT_FLUSH_THRESHOLD * 2);
+        }
+
+        explicit Sink(Output &output) : output(output) {
+            buffer.reserve(OUTPUT_FLUSH_THRESHOLD * 2);
+        }
+
+        Sink(const Sink &) = delete;
+        Sink &operator=(const Sink &) = delete;
+
+        virtual ~Sink() {
+            try {
+                flush();
+            } catch (const std::system_error &err) {
+                std::cerr << err.what() << std::endl;
+            }
+        }
+
+        void write(const dns::DNSMessage &message) {
+            statsPhase(PHASE_FORMAT);
+            const size_t mark = buffer.size();
+            try {
+                if (mark) {
+                    buffer += separator();
+                }
+                render(message);
+            } catch (...) {
+                buffer.resize(mark);
+                throw;
+            }
+            if (buffer.size() >= OUTPUT_FLUSH_THRESHOLD) {
+                flush();
+            }
+        }
+
+        void flush() {
+            try {
+                output.write(separator(), buffer);
+            } catch (...) {
+                buffer.clear();
+                throw;
+            }
+            buffer.clear();
+        }
+
+    protected:
+        virtual void render(const dns::DNSMessage &message) = 0;
+
+        // written between two messages
+        virtual std::string_view separator() const {
+            return {};
+        }
+
+        std::string buffer;
+
+    private:
+        std::unique_ptr<Output> ownOutput;
+        Output &output;
+    };
+
+    /**
+     * Appends RDATA in the layout of the text output, for std::visit over dns::rdata::RecordData.
+     */
+    class TextRecordData {
+    public:
+        explicit TextRecordData(std::string &buffer) : buffer(buffer) {}
+
+        void operator()(const dns::rdata::A &data) const {
+            utils::appendAddress(buffer, AF_INET, data.address);
+        }
+
+        void operator()(const dns::rdata::AAAA &data) const {
+            utils::appendAddress(buffer, AF_INET6, data.address);
+        }
+
+        void operator()(const dns::rdata::DomainName &data) const {
+            data.target.appendTo(buffer);
+        }
+
+        void operator()(const dns::rdata::MX &data) const {
+            buffer += "Preference: ";
+            utils::appendNumber(buffer, data.preference);
+            buffer += ", Mail Exchange: ";
+            data.exchange.appendTo(buffer);
+        }
+
+        void operator()(const dns::rdata::SOA &data) const {
+            data.mname.appendTo(buffer);
+            buffer += ", ";
+            data.rname.appendTo(buffer);
+            for (uint32_t number : {data.serial, data.refresh, data.retry, data.expire, data.minimum}) {
+                buffer += ", ";
+                utils::appendNumber(buffer, number);
+            }
+        }
+
+        void operator()(const dns::rdata::TXT &data) const {
+            bool firstString = true;
+            data.forEachString([&](std::string_view string) {
+                if (!firstString) {
+                    buffer += ' ';
+                }
+                buffer.append(string);
+                firstString = false;
+            });
+        }
+
+        void operator()(const dns::rdata::OPT &data) const {
+            buffer += "UDP payload size: ";
+            utils::appendNumber(buffer, data.udpPayloadSize);
+            buffer += ", Extended RCODE: ";
+            utils::appendNumber(buffer, data.extendedRcode);
+            buffer += ", Version: ";
+            utils::appendNumber(buffer, data.version);
+            buffer += ", DNSSEC OK: ";
+            buffer += data.dnssecOk ? "Yes" : "No";
+        }
+
+        void operator()(const dns::rdata::SRV &data) const {
+            buffer += "Priority: ";
+            utils::appendNumber(buffer, data.priority);
+            buffer += ", Weight: ";
+            utils::appendNumber(buffer, data.weight);
+            buffer += ", Port: ";
+            utils::appendNumber(buffer, data.port);
+            buffer += ", Target: ";
+            data.target.appendTo(buffer);
+        }
+
+        void operator()(const dns::rdata::NAPTR &data) const {
+            buffer += "Order: ";
+            utils::appendNumber(buffer, data.order);
+            buffer += ", Preference: ";
+            utils::appendNumber(buffer, data.preference);
+            buffer += ", Flags: ";
+            buffer += data.flags;
+            buffer += ", Services: ";
+            buffer += data.services;
+            buffer += ", Regexp: ";
+            buffer += data.regexp;
+            buffer += ", Replacement: ";
+            data.replacement.appendTo(buffer);
+        }
+
+        void operator()(const dns::rdata::DS &data) const {
+            buffer += "Key Tag: ";
+            utils::appendNumber(buffer, data.keyTag);
+            buffer += ", Algorithm: ";
+            utils::appendNumber(buffer, data.algorithm);
+            buffer += ", Digest Type: ";
+            utils::appendNumber(buffer, data.digestType);
+            buffer += ", Digest: ";
+            utils::appendHex(buffer, data.digest);
+        }
+
+        void operator()(const dns::rdata::DNSKEY &data) const {
+            buffer += "Flags: ";
+            utils::appendNumber(buffer, data.flags);
+            buffer += ", Protocol: ";
+            utils::appendNumber(buffer, data.protocol);
+            buffer += ", Algorithm: ";
+            utils::appendNumber(buffer, data.algorithm);
+            buffer += ", Public Key: ";
+            utils::appendBase64(buffer, data.publicKey);
+        }
+
+        void operator()(const dns::rdata::RRSIG &data) const {
+            buffer += "Type Covered: ";
+            buffer += dns::parsing::utils::typeToString(data.typeCovered);
+            buffer += ", Algorithm: ";
+            utils::appendNumber(buffer, data.algorithm);
+            buffer += ", Labels: ";
+            utils::appendNumber(buffer, data.labels);
+            buffer += ", Original TTL: ";
+            utils::appendNumber(buffer, data.originalTtl);
+            buffer += ", Expiration: ";
+            utils::appendTimestamp(buffer, data.expiration);
+            buffer += ", Inception: ";
+            utils::appendTimestamp(buffer, data.inception);
+            buffer += ", Key Tag: ";
+            utils::appendNumber(buffer, data.keyTag);
+            buffer += ", Signer: ";
+            data.signer.appendTo(buffer);
+            buffer += ", Signature: ";
+            utils::appendBase64(buffer, data.signature);
+        }
+
+        void operator()(const dns::rdata::CAA &data) const {
+            buffer += "Flags: ";
+            utils::appendNumber(buffer, data.flags);
+            buffer += ", Tag: ";
+            buffer += data.tag;
+            buffer += ", Value: ";
+            buffer.append(reinterpret_cast<const char *>(data.value.data()), data.value.size());
+        }
+
+        void operator()(const dns::rdata::SVCB &data) const {
+            buffer += "Priority: ";
+            utils::appendNumber(buffer, data.priority);
+            buffer += ", Target: ";
+            data.target.appendTo(buffer);
+            buffer += ", Params:";
+            data.forEachParam([&](uint16_t key, dns::PacketView value) {
+                buffer += ' ';
+                utils::appendSvcParamKey(buffer, key);
+                if (!value.empty()) {
+                    buffer += '=';
+                    utils::appendSvcParamValue(buffer, key, value);
+                }
+            });
+        }
+
+        void operator()(const dns::rdata::Unknown &data) const {
+            utils::appendGenericData(buffer, data.data);
+        }
+
+    private:
+        std::string &buffer;
+    };
+
+    /**
+     * Human-readable layout, one block per message and an empty line between messages.
+     */
+    class TextSink : public Sink {
+    public:
+        using Sink::Sink;
+
+    protected:
+        void render(const dns::DNSMessage &message) override {
+            const DNSHeader &header = message.getHeader();
+            buffer += "Authoritative: ";
+            buffer += (header.flags & FLAG_AUTHORITATIVE) ? "Yes" : "No";
+            buffer += ", Recursive: ";
+            buffer += (header.flags & FLAG_RECURSIVE) ? "Yes" : "No";
+            buffer += ", Truncated: ";
+            buffer += (header.flags & FLAG_TRUNC) ? "Yes" : "No";
+            buffer += '\n';
+
+            buffer += "Question section (";
+            utils::appendNumber(buffer, header.qdcount);
+            buffer += ")\n";
+            for (const dns::QuestionView &question : message.questions()) {
+                buffer += "  ";
+                question.name.appendTo(buffer);
+                buffer += ", ";
+                buffer += dns::parsing::utils::typeToString(question.qtype);
+                buffer += ", ";
+                buffer += dns::parsing::utils::classToString(question.qclass);
+                buffer += '\n';
+            }
+            renderSection("Answer", message.answers());
+            renderSection("Authority", message.authorities());
+            renderSection("Additional", message.additionals());
+        }
+
+    private:
+        void renderSection(const char *title, const dns::Section<dns::ResourceRecordView> &section) {
+            buffer += title;
+            buffer += " section (";
+            utils::appendNumber(buffer, section.size());
+            buffer += ")\n";
+            for (const dns::ResourceRecordView &record : section) {
+                if (record.type == TYPE_OPT) {
+                    // CLASS and TTL of the pseudo-record are not a class and a TTL
+                    buffer += "  OPT, ";
+                    TextRecordData{buffer}(std::get<dns::rdata::OPT>(dns::rdata::decode(record)));
+                    buffer += '\n';
+                    continue;
+                }
+                buffer += "  ";
+                record.name.appendTo(buffer);
+                buffer += ", ";
+                buffer += dns::parsing::utils::typeToString(record.type);
+                buffer += ", ";
+                buffer += dns::parsing::utils::classToString(record.rclass);
+                buffer += ", ";
+                utils::appendNumber(buffer, record.ttl);
+                buffer += ", ";
+                std::visit(TextRecordData(buffer), dns::rdata::decode(record));
+                buffer += '\n';
+            }
+        }
+
+        std::string_view separator() const override {
+            return "\n";
+        }
+    };
+
+    /**
+     * One JSON object per line. Types and classes are written as numeric codes.
+     */
+    class JsonSink : public Sink {
+    public:
+        using Sink::Sink;
+
+    protected:
+        void render(const dns::DNSMessage &message) override {
+            const DNSHeader &header = message.getHeader();
+            buffer += "{\"id\":";
+            utils::appendNumber(buffer, header.id);
+            buffer += ",\"rcode\":";
+            utils::appendNumber(buffer, header.flags & 0x000F);
+            buffer += ",\"authoritative\":";
+            buffer += (header.flags & FLAG_AUTHORITATIVE) ? "true" : "false";
+            buffer += ",\"recursive\":";
+            buffer += (header.flags & FLAG_RECURSIVE) ? "true" : "false";
+            buffer += ",\"truncated\":";
+            buffer += (header.flags & FLAG_TRUNC) ? "true" : "false";
+
+            buffer += ",\"question\":[";
+            bool firstEntry = true;
+            for (const dns::QuestionView &question : message.questions()) {
+                buffer += firstEntry ? "{\"name\":" : ",{\"name\":";
+                utils::appendJsonName(buffer, question.name);
+                buffer += ",\"type\":";
+                utils::appendNumber(buffer, question.qtype);
+                buffer += ",\"class\":";
+                utils::appendNumber(buffer, question.qclass);
+                buffer += '}';
+                firstEntry = false;
+            }
+            buffer += ']';
+            renderSection("answer", message.answers());
+            renderSection("authority", message.authorities());
+            renderSection("additional", message.additionals());
+            buffer += "}\n";
+        }
+
+    private:
+        void renderSection(const char *key, const dns::Section<dns::ResourceRecordView> &section) {
+            buffer += ",\"";
+            buffer += key;
+            buffer += "\":[";
+            bool firstEntry = true;
+            for (const dns::ResourceRecordView &record : section) {
+                buffer += firstEntry ? "{\"name\":" : ",{\"name\":";
+                utils::appendJsonName(buffer, record.name);
+                buffer += ",\"type\":";
+                utils::appendNumber(buffer, record.type);
+                buffer += ",\"class\":";
+                utils::appendNumber(buffer, record.rclass);
+                buffer += ",\"ttl\":";
+                utils::appendNumber(buffer, record.ttl);
+                buffer += ",\"data\":";
+                std::visit([this](const auto &data) { renderData(data); }, dns::rdata::decode(record));
+                buffer += '}';
+                firstEntry = false;
+            }
+            buffer += ']';
+        }
+
+        void renderData(const dns::rdata::A &data) {
+            buffer += '"';
+            utils::appendAddress(buffer, AF_INET, data.address);
+            buffer += '"';
+        }
+
+        void renderData(const dns::rdata::AAAA &data) {
+            buffer += '"';
+            utils::appendAddress(buffer, AF_INET6, data.address);
+            buffer += '"';
+        }
+
+        void renderData(const dns::rdata::DomainName &data) {
+            utils::appendJsonName(buffer, data.target);
+        }
+
+        void renderData(const dns::rdata::MX &data) {
+            buffer += "{\"preference\":";
+            utils::appendNumber(buffer, data.preference);
+            buffer += ",\"exchange\":";
+            utils::appendJsonName(buffer, data.exchange);
+            buffer += '}';
+        }
+
+        void renderData(const dns::rdata::SOA &data) {
+            buffer += "{\"mname\":";
+            utils::appendJsonName(buffer, data.mname);
+            buffer += ",\"rname\":";
+            utils::appendJsonName(buffer, data.rname);
+            buffer += ",\"serial\":";
+            utils::appendNumber(buffer, data.serial);
+            buffer += ",\"refresh\":";
+            utils::appendNumber(buffer, data.refresh);
+            buffer += ",\"retry\":";
+            utils::appendNumber(buffer, data.retry);
+            buffer += ",\"expire\":";
+            utils::appendNumber(buffer, data.expire);
+            buffer += ",\"minimum\":";
+            utils::appendNumber(buffer, data.minimum);
+            buffer += '}';
+        }
+
+        void renderData(const dns::rdata::TXT &data) {
+            buffer += '[';
+            bool firstString = true;
+            data.forEachString([&](std::string_view string) {
+                if (!firstString) {
+                    buffer += ',';
+                }
+                utils::appendJsonString(buffer, string);
+                firstString = false;
+            });
+            buffer += ']';
+        }
+
+        void renderData(const dns::rdata::OPT &data) {
+            buffer += "{\"udpPayloadSize\":";
+            utils::appendNumber(buffer, data.udpPayloadSize);
+            buffer += ",\"extendedRcode\":";
+            utils::appendNumber(buffer, data.extendedRcode);
+            buffer += ",\"version\":";
+            utils::appendNumber(buffer, data.version);
+            buffer += ",\"dnssecOk\":";
+            buffer += data.dnssecOk ? "true" : "false";
+            buffer += ",\"options\":\"";
+            utils::appendHex(buffer, data.options);
+            buffer += "\"}";
+        }
+
+        void renderData(const dns::rdata::SRV &data) {
+            buffer += "{\"priority\":";
+            utils::appendNumber(buffer, data.priority);
+            buffer += ",\"weight\":";
+            utils::appendNumber(buffer, data.weight);
+            buffer += ",\"port\":";
+            utils::appendNumber(buffer, data.port);
+            buffer += ",\"target\":";
+            utils::appendJsonName(buffer, data.target);
+            buffer += '}';
+        }
+
+        void renderData(const dns::rdata::NAPTR &data) {
+            buffer += "{\"order\":";
+            utils::appendNumber(buffer, data.order);
+            buffer += ",\"preference\":";
+            utils::appendNumber(buffer, data.preference);
+            buffer += ",\"flags\":";
+            utils::appendJsonString(buffer, data.flags);
+            buffer += ",\"services\":";
+            utils::appendJsonString(buffer, data.services);
+            buffer += ",\"regexp\":";
+            utils::appendJsonString(buffer, data.regexp);
+            buffer += ",\"replacement\":";
+            utils::appendJsonName(buffer, data.replacement);
+            buffer += '}';
+        }
+
+        void renderData(const dns::rdata::DS &data) {
+            buffer += "{\"keyTag\":";
+            utils::appendNumber(buffer, data.keyTag);
+            buffer += ",\"algorithm\":";
+            utils::appendNumber(buffer, data.algorithm);
+            buffer += ",\"digestType\":";
+            utils::appendNumber(buffer, data.digestType);
+            buffer += ",\"digest\":\"";
+            utils::appendHex(buffer, data.digest);
+            buffer += "\"}";
+        }
+
+        void renderData(const dns::rdata::DNSKEY &data) {
+            buffer += "{\"flags\":";
+            utils::appendNumber(buffer, data.flags);
+            buffer += ",\"protocol\":";
+            utils::appendNumber(buffer, data.protocol);
+            buffer += ",\"algorithm\":";
+            utils::appendNumber(buffer, data.algorithm);
+            buffer += ",\"publicKey\":\"";
+            utils::appendBase64(buffer, data.publicKey);
+            buffer += "\"}";
+        }
+
+        void renderData(const dns::rdata::RRSIG &data) {
+            buffer += "{\"typeCovered\":";
+            utils::appendNumber(buffer, data.typeCovered);
+            buffer += ",\"algorithm\":";
+            utils::appendNumber(buffer, data.algorithm);
+            buffer += ",\"labels\":";
+            utils::appendNumber(buffer, data.labels);
+            buffer += ",\"originalTtl\":";
+            utils::appendNumber(buffer, data.originalTtl);
+            buffer += ",\"expiration\":";
+            utils::appendNumber(buffer, data.expiration);
+            buffer += ",\"inception\":";
+            utils::appendNumber(buffer, data.inception);
+            buffer += ",\"keyTag\":";
+            utils::appendNumber(buffer, data.keyTag);
+            buffer += ",\"signer\":";
+            utils::appendJsonName(buffer, data.signer);
+            buffer += ",\"signature\":\"";
+            utils::appendBase64(buffer, data.signature);
+            buffer += "\"}";
+        }
+
+        void renderData(const dns::rdata::CAA &data) {
+            buffer += "{\"flags\":";
+            utils::appendNumber(buffer, data.flags);
+            buffer += ",\"tag\":";
+            utils::appendJsonString(buffer, data.tag);
+            buffer += ",\"value\":";
+            utils::appendJsonString(buffer, std::string_view(reinterpret_cast<const char *>(data.value.data()),
+                                                             data.value.size()));
+            buffer += '}';
+        }
+
+        // parameters as an object of presentation keys and values
+        void renderData(const dns::rdata::SVCB &data) {
+            buffer += "{\"priority\":";
+            utils::appendNumber(buffer, data.priority);
+            buffer += ",\"target\":";
+            utils::appendJsonName(buffer, data.target);
+            buffer += ",\"params\":{";
+            bool firstParam = true;
+            data.forEachParam([&](uint16_t key, dns::PacketView value) {
+                text.clear();
+                utils::appendSvcParamKey(text, key);
+                buffer += firstParam ? "" : ",";
+                utils::appendJsonString(buffer, text);
+                buffer += ':';
+                text.clear();
+                utils::appendSvcParamValue(text, key, value);
+                utils::appendJsonString(buffer, text);
+                firstParam = false;
+            });
+            buffer += "}}";
+        }
+
+        void renderData(const dns::rdata::Unknown &data) {
+            buffer += '"';
+            utils::appendHex(buffer, data.data);
+            buffer += '"';
+        }
+
+        // presentation of an SVCB parameter before it is escaped, kept from one record to the next
+        std::string text;
+    };
+
+    /**
+     * Stream of frames, each prefixed with its length as a 32-bit big-endian number:
+     *   message frame:  kind(1) id(2) flags(2) qdcount(2) ancount(2) nscount(2) arcount(2)
+     *   question frame: kind(1) name(wire) type(2) class(2)
+     *   record frame:   kind(1) name(wire) type(2) class(2) ttl(4) rdlength(2) rdata
+     * Names are uncompressed wire format, names inside RDATA of the known types are decompressed too,
+     * so every frame can be decoded on its own.
+     */
+    class BinarySink : public Sink {
+    public:
+        using Sink::Sink;
+
+    protected:
+        void render(const dns::DNSMessage &message) override {
+            const DNSHeader &header = message.getHeader();
+            size_t frame = beginFrame(FRAME_MESSAGE);
+            for (uint16_t field : {header.id, header.flags, header.qdcount, header.ancount, header.nscount,
+                                   header.arcount}) {
+                utils::appendUint16(buffer, field);
+            }
+            endFrame(frame);
+
+            for (const dns::QuestionView &question : message.questions()) {
+                frame = beginFrame(FRAME_QUESTION);
+                question.name.appendWireTo(buffer);
+                utils::appendUint16(buffer, question.qtype);
+                utils::appendUint16(buffer, question.qclass);
+                endFrame(frame);
+            }
+            renderSection(FRAME_ANSWER, message.answers());
+            renderSection(FRAME_AUTHORITY, message.authorities());
+            renderSection(FRAME_ADDITIONAL, message.additionals());
+        }
+
+    private:
+        size_t beginFrame(uint8_t kind) {
+            size_t frame = buffer.size();
+            utils::appendUint32(buffer, 0);
+            buffer += static_cast<char>(kind);
+            return frame;
+        }
+
+        void endFrame(size_t frame) {
+            const uint32_t length = buffer.size() - frame - 4;
+            for (size_t i = 0; i < 4; ++i) {
+                buffer[frame + i] = static_cast<char>(length >> (24 - i * 8));
+            }
+        }
+
+        void renderSection(uint8_t kind, const dns::Section<dns::ResourceRecordView> &section) {
+            for (const dns::ResourceRecordView &record : section) {
+                size_t frame = beginFrame(kind);
+                record.name.appendWireTo(buffer);
+                utils::appendUint16(buffer, record.type);
+                utils::appendUint16(buffer, record.rclass);
+                utils::appendUint32(buffer, record.ttl);
+                const size_t rdlengthOffset = buffer.size();
+                utils::appendUint16(buffer, 0);
+                std::visit([this](const auto &data) { renderData(data); }, dns::rdata::decode(record));
+                const size_t rdlength = buffer.size() - rdlengthOffset - 2;
+                buffer[rdlengthOffset] = static_cast<char>(rdlength >> 8);
+                buffer[rdlengthOffset + 1] = static_cast<char>(rdlength & 0xFF);
+                endFrame(frame);
+            }
+        }
+
+        void appendBytes(dns::PacketView bytes) {
+            buffer.append(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        }
+
+        void renderData(const dns::rdata::A &data) {
+            appendBytes(data.address);
+        }
+
+        void renderData(const dns::rdata::AAAA &data) {
+            appendBytes(data.address);
+        }
+
+        void renderData(const dns::rdata::DomainName &data) {
+            data.target.appendWireTo(buffer);
+        }
+
+        void renderData(const dns::rdata::MX &data) {
+            utils::appendUint16(buffer, data.preference);
+            data.exchange.appendWireTo(buffer);
+        }
+
+        void renderData(const dns::rdata::SOA &data) {
+            data.mname.appendWireTo(buffer);
+            data.rname.appendWireTo(buffer);
+            for (uint32_t number : {data.serial, data.refresh, data.retry, data.expire, data.minimum}) {
+                utils::appendUint32(buffer, number);
+            }
+        }
+
+        void renderData(const dns::rdata::TXT &data) {
+            appendBytes(data.strings);
+        }
+
+        void renderData(const dns::rdata::OPT &data) {
+            appendBytes(data.options);
+        }
+
+        void renderData(const dns::rdata::SRV &data) {
+            for (uint16_t number : {data.priority, data.weight, data.port}) {
+                utils::appendUint16(buffer, number);
+            }
+            data.target.appendWireTo(buffer);
+        }
+
+        void renderData(const dns::rdata::NAPTR &data) {
+            utils::appendUint16(buffer, data.order);
+            utils::appendUint16(buffer, data.preference);
+            for (std::string_view string : {data.flags, data.services, data.regexp}) {
+                buffer += static_cast<char>(string.size());
+                buffer += string;
+            }
+            data.replacement.appendWireTo(buffer);
+        }
+
+        void renderData(const dns::rdata::DS &data) {
+            utils::appendUint16(buffer, data.keyTag);
+            buffer += static_cast<char>(data.algorithm);
+            buffer += static_cast<char>(data.digestType);
+            appendBytes(data.digest);
+        }
+
+        void renderData(const dns::rdata::DNSKEY &data) {
+            utils::appendUint16(buffer, data.flags);
+            buffer += static_cast<char>(data.protocol);
+            buffer += static_cast<char>(data.algorithm);
+            appendBytes(data.publicKey);
+        }
+
+        void renderData(const dns::rdata::RRSIG &data) {
+            utils::appendUint16(buffer, data.typeCovered);
+            buffer += static_cast<char>(data.algorithm);
+            buffer += static_cast<char>(data.labels);
+            for (uint32_t number : {data.originalTtl, data.expiration, data.inception}) {
+                utils::appendUint32(buffer, number);
+            }
+            utils::appendUint16(buffer, data.keyTag);
+            data.signer.appendWireTo(buffer);
+            appendBytes(data.signature);
+        }
+
+        void renderData(const dns::rdata::CAA &data) {
+            buffer += static_cast<char>(data.flags);
+            buffer += static_cast<char>(data.tag.size());
+            buffer += data.tag;
+            appendBytes(data.value);
+        }
+
+        void renderData(const dns::rdata::SVCB &data) {
+            utils::appendUint16(buffer, data.priority);
+            data.target.appendWireTo(buffer);
+            appendBytes(data.params);
+        }
+
+        void renderData(const dns::rdata::Unknown &data) {
+            appendBytes(data.data);
+        }
+    };
+
+    template<typename Destination>
+    std::unique_ptr<Sink> makeSink(OUTPUT_FORMAT format, Destination &&destination) {
+        switch (format) {
+            case OUTPUT_FORMAT_JSON:
+                return std::make_unique<JsonSink>(destination);
+            case OUTPUT_FORMAT_BINARY:
+                return std::make_unique<BinarySink>(destination);
+            case OUTPUT_FORMAT_TEXT:
+            default:
+                return std::make_unique<TextSink>(destination);
+        }
+    }
+}
@@ -0,0 +1,585 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dns.h"
+#include "output.h"
+#include "utils.h"
+#include "workers.h"
+
+
+// classic pcap with microsecond or nanosecond timestamps, as written by the capturing host
+const uint32_t PCAP_MAGIC_MICROSECONDS = 0xA1B2C3D4;
+const uint32_t PCAP_MAGIC_NANOSECONDS = 0xA1B23C4D;
+const size_t PCAP_FILE_HEADER_SIZE = 24;
+const size_t PCAP_RECORD_HEADER_SIZE = 16;
+// pcapng block types and the byte-order magic of the section header
+const uint32_t PCAPNG_SECTION_HEADER = 0x0A0D0D0A;
+const uint32_t PCAPNG_INTERFACE_DESCRIPTION = 1;
+const uint32_t PCAPNG_PACKET = 2;
+const uint32_t PCAPNG_SIMPLE_PACKET = 3;
+const uint32_t PCAPNG_ENHANCED_PACKET = 6;
+const uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+// link-layer header types of https://www.tcpdump.org/linktypes.html
+const uint32_t LINKTYPE_NULL = 0;
+const uint32_t LINKTYPE_ETHERNET = 1;
+const uint32_t LINKTYPE_RAW = 101;
+const uint32_t LINKTYPE_LOOP = 108;
+const uint32_t LINKTYPE_LINUX_SLL = 113;
+const uint32_t LINKTYPE_IPV4 = 228;
+const uint32_t LINKTYPE_IPV6 = 229;
+const uint32_t LINKTYPE_LINUX_SLL2 = 276;
+const uint16_t ETHERTYPE_IPV4 = 0x0800;
+const uint16_t ETHERTYPE_IPV6 = 0x86DD;
+const uint16_t ETHERTYPE_VLAN = 0x8100;
+const uint16_t ETHERTYPE_QINQ = 0x88A8;
+const uint8_t IP_PROTOCOL_TCP = 6;
+const uint8_t IP_PROTOCOL_UDP = 17;
+// frames a thread takes from the capture at once
+const size_t PCAP_CHUNK = 4096;
+
+namespace pcap {
+    /**
+     * Read-only mapping of a whole capture file, the kernel is told it is read front to back.
+     */
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string &path) {
+            const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to open capture file " + path);
+            }
+            struct stat status{};
+            if (fstat(fd, &status) < 0) {
+                const int err = errno;
+                close(fd);
+                throw std::system_error(err, std::generic_category(), "Failed to stat capture file " + path);
+            }
+            size = static_cast<size_t>(status.st_size);
+            if (size) {
+                mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            const int err = errno;
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                throw std::system_error(err, std::generic_category(), "Failed to map capture file " + path);
+            }
+            if (size) {
+                madvise(mapping, size, MADV_SEQUENTIAL);
+            }
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile() {
+            if (size) {
+                munmap(mapping, size);
+            }
+        }
+
+        dns::PacketView data() const {
+            return size ? dns::PacketView(static_cast<const uint8_t *>(mapping), size) : dns::PacketView();
+        }
+
+    private:
+        void *mapping = nullptr;
+        size_t size = 0;
+    };
+
+    /**
+     * One captured frame, referencing the mapped file.
+     */
+    struct Frame {
+        dns::PacketView data;
+        uint32_t linkType;
+    };
+
+    /**
+     * Walks the records of a pcap or pcapng file. Only the record headers are read here, the frames
+     * themselves are decoded by whoever takes them. A truncated last record ends the capture.
+     */
+    class Reader {
+    public:
+        explicit Reader(dns::PacketView file) : file(file) {
+            if (file.size() < 4) {
+                throwInvalid("file too short");
+            }
+            const uint32_t magic = readUint32(0);
+            if (magic == PCAPNG_SECTION_HEADER) {
+                nextGeneration = true;
+                return;
+            }
+            if (magic == PCAP_MAGIC_MICROSECONDS || magic == PCAP_MAGIC_NANOSECONDS) {
+                swapped = false;
+            } else if (__builtin_bswap32(magic) == PCAP_MAGIC_MICROSECONDS
+                       || __builtin_bswap32(magic) == PCAP_MAGIC_NANOSECONDS) {
+                swapped = true;
+            } else {
+                throwInvalid("not a pcap or pcapng file");
+            }
+            if (file.size() < PCAP_FILE_HEADER_SIZE) {
+                throwInvalid("file header too short");
+            }
+            linkType = readUint32(20) & 0x0FFFFFFF;
+            offset = PCAP_FILE_HEADER_SIZE;
+        }
+
+        std::optional<Frame> next() {
+            return nextGeneration ? nextBlock() : nextRecord();
+        }
+
+    private:
+        [[noreturn]] static void throwInvalid(const std::string &reason) {
+            throw std::system_error(EINVAL, std::generic_category(), "Invalid capture file: " + reason);
+        }
+
+        uint32_t readUint32(size_t position) const {
+            uint32_t value;
+            std::memcpy(&value, file.data() + position, sizeof(value));
+            return swapped ? __builtin_bswap32(value) : value;
+        }
+
+        uint16_t readUint16(size_t position) const {
+            uint16_t value;
+            std::memcpy(&value, file.data() + position, sizeof(value));
+            return swapped ? __builtin_bswap16(value) : value;
+        }
+
+        std::optional<Frame> nextRecord() {
+            if (offset + PCAP_RECORD_HEADER_SIZE > file.size()) {
+                return std::nullopt;
+            }
+            const uint32_t captured = readUint32(offset + 8);
+            const size_t start = offset + PCAP_RECORD_HEADER_SIZE;
+            if (captured > file.size() - start) {
+                return std::nullopt;
+            }
+            offset = start + captured;
+            return Frame{file.subspan(start, captured), linkType};
+        }
+
+        // skips section headers and interface descriptions until the next packet block
+        std::optional<Frame> nextBlock() {
+            while (offset + 12 <= file.size()) {
+                uint32_t type = readUint32(offset);
+                if (type == PCAPNG_SECTION_HEADER) {
+                    // the byte order of a section follows from its byte-order magic
+                    swapped = false;
+                    const uint32_t byteOrder = readUint32(offset + 8);
+                    if (byteOrder != PCAPNG_BYTE_ORDER_MAGIC) {
+                        if (__builtin_bswap32(byteOrder) != PCAPNG_BYTE_ORDER_MAGIC) {
+                            throwInvalid("unknown section byte order");
+                        }
+                        swapped = true;
+                    }
+                    interfaces.clear();
+                }
+                const uint32_t length = readUint32(offset + 4);
+                if (length < 12 || length % 4 || length > file.size() - offset) {
+                    return std::nullopt;
+                }
+                const size_t body = offset + 8;
+                const size_t bodyEnd = offset + length - 4;
+                offset += length;
+                switch (type) {
+                    case PCAPNG_INTERFACE_DESCRIPTION:
+                        if (body + 2 <= bodyEnd) {
+                            interfaces.push_back(readUint16(body));
+                        }
+                        break;
+                    case PCAPNG_ENHANCED_PACKET:
+                        if (body + 20 <= bodyEnd) {
+                            return frame(readUint32(body), body + 20, readUint32(body + 12), bodyEnd);
+                        }
+                        break;
+                    case PCAPNG_PACKET:
+                        if (body + 20 <= bodyEnd) {
+                            return frame(readUint16(body), body + 20, readUint32(body + 12), bodyEnd);
+                        }
+                        break;
+                    case PCAPNG_SIMPLE_PACKET:
+                        if (body + 4 <= bodyEnd) {
+                            // the original length, the block holds as much of it as was captured
+                            return frame(0, body + 4, readUint32(body), bodyEnd);
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return std::nullopt;
+        }
+
+        Frame frame(uint32_t interface, size_t start, uint32_t captured, size_t end) const {
+            const size_t length = std::min<size_t>(captured, end - start);
+            return {file.subspan(start, length), interface < interfaces.size() ? interfaces[interface] : LINKTYPE_ETHERNET};
+        }
+
+        dns::PacketView file;
+        size_t offset = 0;
+        bool nextGeneration = false;
+        bool swapped = false;
+        uint32_t linkType = LINKTYPE_ETHERNET;
+        // link type of every interface of the current pcapng section
+        std::vector<uint32_t> interfaces;
+    };
+
+    struct Summary {
+        size_t frames = 0;
+        size_t messages = 0;
+        size_t queries = 0;
+        size_t responses = 0;
+        size_t malformed = 0;
+        size_t truncated = 0;
+        // IP fragments are not reassembled
+        size_t fragments = 0;
+        // TCP segments that do not hold whole length-prefixed messages, streams are not reassembled
+        size_t partialTcp = 0;
+        std::array<size_t, 16> rcodes{};
+        // type of the first question of every message
+        std::map<uint16_t, size_t> qtypes;
+
+        void merge(const Summary &other) {
+            frames += other.frames;
+            messages += other.messages;
+            queries += other.queries;
+            responses += other.responses;
+            malformed += other.malformed;
+            truncated += other.truncated;
+            fragments += other.fragments;
+            partialTcp += other.partialTcp;
+            for (size_t rcode = 0; rcode < rcodes.size(); ++rcode) {
+                rcodes[rcode] += other.rcodes[rcode];
+            }
+            for (const auto &[qtype, count] : other.qtypes) {
+                qtypes[qtype] += count;
+            }
+        }
+    };
+
+    // the counters on one line, as the other modes print them on stderr
+    std::ostream &printTotals(std::ostream &stream, const Summary &summary) {
+        return stream << "Frames: " << summary.frames << ", DNS messages: " << summary.messages
+                      << ", Queries: " << summary.queries << ", Responses: " << summary.responses
+                      << ", Malformed: " << summary.malformed << ", Truncated: " << summary.truncated
+                      << ", Fragments skipped: " << summary.fragments
+                      << ", Partial TCP segments: " << summary.partialTcp << std::endl;
+    }
+
+    std::ostream &operator<<(std::ostream &stream, const Summary &summary) {
+        printTotals(stream, summary);
+        stream << "RCODE:";
+        bool first = true;
+        for (size_t rcode = 0; rcode < summary.rcodes.size(); ++rcode) {
+            if (summary.rcodes[rcode]) {
+                stream << (first ? " " : ", ") << dns::parsing::utils::rcodeToString(rcode) << ": "
+                       << summary.rcodes[rcode];
+                first = false;
+            }
+        }
+        stream << (first ? " none" : "") << std::endl;
+        stream << "QTYPE:";
+        first = true;
+        for (const auto &[qtype, count] : summary.qtypes) {
+            stream << (first ? " " : ", ") << dns::parsing::utils::typeToString(qtype);
+            stream << ": " << count;
+            first = false;
+        }
+        return stream << (first ? " none" : "") << std::endl;
+    }
+
+    /**
+     * Finds the DNS messages in captured frames: Ethernet (with VLAN tags), Linux cooked, loopback or raw IP,
+     * then IPv4 or IPv6, then UDP or TCP from or to `port`. Every message is parsed and counted, and unless
+     * the output is only a summary, written to the sink.
+     */
+    class Decoder {
+    public:
+        Decoder(uint16_t port, output::Sink *sink) : port(port), sink(sink) {}
+
+        void decode(const Frame &frame) {
+            summary.frames++;
+            const dns::PacketView data = frame.data;
+            switch (frame.linkType) {
+                case LINKTYPE_ETHERNET: {
+                    size_t offset = 12;
+                    while (offset + 2 <= data.size()) {
+                        const uint16_t etherType = readUint16(data, offset);
+                        if (etherType != ETHERTYPE_VLAN && etherType != ETHERTYPE_QINQ) {
+                            decodeNetwork(etherType, data.subspan(offset + 2));
+                            return;
+                        }
+                        offset += 4;
+                    }
+                    return;
+                }
+                case LINKTYPE_LINUX_SLL:
+                    if (data.size() >= 16) {
+                        decodeNetwork(readUint16(data, 14), data.subspan(16));
+                    }
+                    return;
+                case LINKTYPE_LINUX_SLL2:
+                    if (data.size() >= 20) {
+                        decodeNetwork(readUint16(data, 0), data.subspan(20));
+                    }
+                    return;
+                case LINKTYPE_NULL:
+                case LINKTYPE_LOOP:
+                    // the address family is in the byte order of the capturing host, the IP version says enough
+                    if (data.size() > 4) {
+                        decodeIp(data.subspan(4));
+                    }
+                    return;
+                case LINKTYPE_RAW:
+                case LINKTYPE_IPV4:
+                case LINKTYPE_IPV6:
+                    decodeIp(data);
+                    return;
+                default:
+                    return;
+            }
+        }
+
+        const Summary &getSummary() const {
+            return summary;
+        }
+
+    private:
+        static uint16_t readUint16(dns::PacketView data, size_t offset) {
+            return static_cast<uint16_t>((data[offset] << 8) | data[offset + 1]);
+        }
+
+        void decodeNetwork(uint16_t etherType, dns::PacketView data) {
+            if (etherType == ETHERTYPE_IPV4 || etherType == ETHERTYPE_IPV6) {
+                decodeIp(data);
+            }
+        }
+
+        void decodeIp(dns::PacketView data) {
+            if (data.empty()) {
+                return;
+            }
+            if (data[0] >> 4 == 4) {
+                decodeIpv4(data);
+            } else if (data[0] >> 4 == 6) {
+                decodeIpv6(data);
+            }
+        }
+
+        void decodeIpv4(dns::PacketView data) {
+            const size_t headerLength = (data[0] & 0x0F) * 4;
+            if (headerLength < 20 || data.size() < headerLength) {
+                return;
+            }
+            // more fragments or a fragment offset
+            if (readUint16(data, 6) & 0x3FFF) {
+                summary.fragments++;
+                return;
+            }
+            const size_t totalLength = std::min<size_t>(readUint16(data, 2), data.size());
+            if (totalLength < headerLength) {
+                return;
+            }
+            decodeTransport(data[9], data.subspan(headerLength, totalLength - headerLength));
+        }
+
+        void decodeIpv6(dns::PacketView data) {
+            const size_t headerLength = 40;
+            if (data.size() < headerLength) {
+                return;
+            }
+            const size_t end = std::min<size_t>(headerLength + readUint16(data, 4), data.size());
+            uint8_t nextHeader = data[6];
+            size_t offset = headerLength;
+            while (true) {
+                switch (nextHeader) {
+                    case 0:   // hop-by-hop options
+                    case 43:  // routing
+                    case 60:  // destination options
+                        if (offset + 2 > end) {
+                            return;
+                        }
+                        nextHeader = data[offset];
+                        offset += (data[offset + 1] + 1) * 8;
+                        continue;
+                    case 51:  // authentication header
+                        if (offset + 2 > end) {
+                            return;
+                        }
+                        nextHeader = data[offset];
+                        offset += (data[offset + 1] + 2) * 4;
+                        continue;
+                    case 44:  // fragment
+                        summary.fragments++;
+                        return;
+                    default:
+                        break;
+                }
+                break;
+            }
+            if (offset <= end) {
+                decodeTransport(nextHeader, data.subspan(offset, end - offset));
+            }
+        }
+
+        void decodeTransport(uint8_t protocol, dns::PacketView data) {
+            if (protocol == IP_PROTOCOL_UDP) {
+                if (data.size() < 8 || (readUint16(data, 0) != port && readUint16(data, 2) != port)) {
+                    return;
+                }
+                const size_t length = std::clamp<size_t>(readUint16(data, 4), 8, data.size());
+                decodeMessage(data.subspan(8, length - 8));
+            } else if (protocol == IP_PROTOCOL_TCP) {
+                if (data.size() < 20 || (readUint16(data, 0) != port && readUint16(data, 2) != port)) {
+                    return;
+                }
+                const size_t headerLength = (data[12] >> 4) * 4;
+                if (headerLength < 20 || headerLength > data.size()) {
+                    return;
+                }
+                // RFC 7766 length-prefixed messages, only segments that start with one are understood
+                dns::PacketView stream = data.subspan(headerLength);
+                while (stream.size() >= 2) {
+                    const size_t length = readUint16(stream, 0);
+                    if (length + 2 > stream.size()) {
+                        summary.partialTcp++;
+                        return;
+                    }
+                    decodeMessage(stream.subspan(2, length));
+                    stream = stream.subspan(length + 2);
+                }
+                if (!stream.empty()) {
+                    summary.partialTcp++;
+                }
+            }
+        }
+
+        void decodeMessage(dns::PacketView payload) {
+            summary.messages++;
+            try {
+                const dns::DNSMessage message = dns::parseResponsePacket(payload);
+                const DNSHeader &header = message.getHeader();
+                if (header.flags & FLAG_QR) {
+                    summary.responses++;
+                    summary.rcodes[header.flags & RCODE_MASK]++;
+                } else {
+                    summary.queries++;
+                }
+                if (header.flags & FLAG_TRUNC) {
+                    summary.truncated++;
+                }
+                if (header.qdcount) {
+                    summary.qtypes[(*message.questions().begin()).qtype]++;
+                }
+                if (sink) {
+                    sink->write(message);
+                }
+            } catch (const std::system_error &err) {
+                debugMsg("Skipping DNS message: " << err.what() << std::endl);
+                summary.malformed++;
+            }
+        }
+
+        uint16_t port;
+        output::Sink *sink;
+        Summary summary;
+    };
+
+    struct Options {
+        size_t threads;
+        bool pin;
+        uint16_t port;
+        OUTPUT_FORMAT format;
+        // count the messages without writing them out
+        bool summaryOnly;
+    };
+
+    /**
+     * Decodes a capture on `options.threads` threads. The threads take the frames in chunks of PCAP_CHUNK,
+     * only walking the record headers takes the lock. Each thread writes its messages through its own sink,
+     * so with more than one thread the output follows the capture only chunk by chunk.
+     */
+    Summary run(const std::string &path, const Options &options) {
+        MappedFile file(path);
+        Reader reader(file.data());
+        std::mutex lock;
+        auto take = [&](std::vector<Frame> &chunk) {
+            std::lock_guard<std::mutex> guard(lock);
+            chunk.clear();
+            while (chunk.size() < PCAP_CHUNK) {
+                std::optional<Frame> frame = reader.next();
+                if (!frame) {
+                    break;
+                }
+                chunk.push_back(*frame);
+            }
+            return !chunk.empty();
+        };
+
+        output::Output output(STDOUT_FILENO);
+        const size_t threadCount = std::max<size_t>(options.threads, 1);
+        std::vector<Summary> summaries(threadCount);
+        std::vector<std::optional<std::string>> errors(threadCount);
+        auto work = [&](size_t index) {
+            if (options.pin) {
+                workers::pinToCpu(index);
+            }
+            try {
+                std::unique_ptr<output::Sink> sink;
+                if (!options.summaryOnly) {
+                    sink = output::makeSink(options.format, output);
+                }
+                Decoder decoder(options.port, sink.get());
+                std::vector<Frame> chunk;
+                chunk.reserve(PCAP_CHUNK);
+                while (take(chunk)) {
+                    for (const Frame &frame : chunk) {
+                        decoder.decode(frame);
+                    }
+                }
+                if (sink) {
+                    sink->flush();
+                }
+                summaries[index] = decoder.getSummary();
+            } catch (const std::system_error &err) {
+                errors[index] = err.what();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t index = 1; index < threadCount; ++index) {
+            threads.emplace_back(work, index);
+        }
+        work(0);
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        Summary total;
+        for (size_t index = 0; index < threadCount; ++index) {
+            if (errors[index]) {
+                throw std::system_error(EIO, std::generic_category(), *errors[index]);
+            }
+            total.merge(summaries[index]);
+        }
+        return total;
+    }
+}
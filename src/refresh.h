@@ -0,0 +1,282 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory_resource>
+#include <queue>
+#include <chrono>
+#include <random>
+#include <optional>
+#include <ostream>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <system_error>
+#include <poll.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "dns.h"
+#include "transport.h"
+#include "utils.h"
+
+
+// answers are refreshed when this share of their TTL is left, in percent
+const size_t REFRESH_DEFAULT_AHEAD_PERCENT = 10;
+// no name is asked for more often, whatever its TTL
+const auto REFRESH_MIN_INTERVAL = std::chrono::seconds(1);
+// a failed refresh is retried after 1 s, doubled for every further failure up to this
+const auto REFRESH_MAX_RETRY_INTERVAL = std::chrono::seconds(60);
+// queries built and handed to the transport at once
+const size_t REFRESH_SEND_CHUNK = 256;
+
+namespace refresh {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Settings {
+        uint16_t flags;
+        uint16_t ednsPayloadSize;
+        int timeoutSec;
+        // most refreshes waiting for an answer at once
+        size_t window;
+        // share of the TTL left when an answer is refreshed, between 0 and 0.5
+        double ahead;
+        // stop after this long, run until SIGINT or SIGTERM without it
+        std::optional<std::chrono::seconds> duration;
+    };
+
+    struct Summary {
+        size_t watched = 0;
+        size_t sent = 0;
+        size_t refreshed = 0;
+        size_t failed = 0;
+        size_t truncated = 0;
+        size_t unmatched = 0;
+        const char *transport = "";
+        udp::SyscallStats sendCalls;
+        udp::SyscallStats receiveCalls;
+    };
+
+    std::ostream &operator<<(std::ostream &stream, const Summary &summary) {
+        stream << "Watched: " << summary.watched << ", Sent: " << summary.sent << ", Refreshed: " << summary.refreshed
+               << ", Failed: " << summary.failed << ", Truncated: " << summary.truncated
+               << ", Unmatched: " << summary.unmatched << std::endl;
+        stream << summary.transport << " send: " << summary.sendCalls << std::endl;
+        stream << summary.transport << " receive: " << summary.receiveCalls << std::endl;
+        return stream;
+    }
+
+    /**
+     * How long after receiving an answer with `ttl` it is refreshed: when `ahead` of the TTL is left,
+     * moved earlier by `jitter` (0 to 1) times another `ahead`, so names cached together do not expire together.
+     */
+    Clock::duration refreshDelay(uint32_t ttl, double ahead, double jitter) {
+        const std::chrono::duration<double> delay(ttl * (1 - ahead * (1 + jitter)));
+        return std::max<Clock::duration>(std::chrono::duration_cast<Clock::duration>(delay), REFRESH_MIN_INTERVAL);
+    }
+
+    // how long to wait before the `failures`-th retry of a name the server did not answer usably
+    Clock::duration retryDelay(unsigned failures) {
+        const std::chrono::seconds delay(int64_t{1} << std::min(failures - 1, 6u));
+        return std::min<Clock::duration>(delay, REFRESH_MAX_RETRY_INTERVAL);
+    }
+
+    /**
+     * Keeps the answers of a watch list in the shared cache file before they expire. Every name is asked for
+     * once at start and again shortly before its answer runs out, so processes reading the cache (dns -c) never
+     * see it cold. A refresh that fails is retried with backoff while the cache keeps serving the previous answer.
+     */
+    class Refresher : private transport::ResponseHandler {
+    public:
+        Refresher(transport::Transport &transport, cache::Cache &cache, const Settings &settings)
+                : transport(transport), cache(cache), settings(settings), inFlight(batch::makeSlots(&buffers)),
+                  watchIndex(DNS_ID_SPACE), timeout(settings.timeoutSec), random(std::random_device{}()) {}
+
+        Summary run(const std::vector<dns::Question> &watchList) {
+            questions = &watchList;
+            summary.watched = watchList.size();
+            const Clock::time_point start = Clock::now();
+            for (size_t index = 0; index < watchList.size(); ++index) {
+                due.push({start, index});
+            }
+
+            const StopSignals stop;
+            loop(start, stop);
+
+            summary.transport = transport.name();
+            summary.sendCalls = transport.getSendStats();
+            summary.receiveCalls = transport.getReceiveStats();
+            return summary;
+        }
+
+    private:
+        typedef std::pair<Clock::time_point, size_t> Refresh;
+
+        void loop(Clock::time_point start, const StopSignals &stop) {
+            const size_t window = std::clamp<size_t>(settings.window, 1, DNS_ID_SPACE);
+            while (!stop.requested()) {
+                Clock::time_point now = Clock::now();
+                if (settings.duration && now - start >= *settings.duration) {
+                    break;
+                }
+                issue(now, std::min(window - active, REFRESH_SEND_CHUNK));
+
+                Clock::duration wait = Clock::duration::max();
+                if (!due.empty() && active < window) {
+                    wait = due.top().first - now;
+                }
+                while (!sendOrder.empty() && !inFlight[sendOrder.front()].active) {
+                    sendOrder.pop_front();
+                }
+                if (!sendOrder.empty()) {
+                    wait = std::min(wait, inFlight[sendOrder.front()].sentAt + timeout - now);
+                }
+                if (settings.duration) {
+                    wait = std::min(wait, start + *settings.duration - now);
+                }
+                waitFor(wait, stop.waitMask());
+                transport.receive(*this);
+                expire();
+            }
+        }
+
+        // sends up to `count` of the refreshes that are due
+        void issue(Clock::time_point now, size_t count) {
+            staged.clear();
+            packets.clear();
+            while (staged.size() < count && !due.empty() && due.top().first <= now) {
+                const size_t index = due.top().second;
+                due.pop();
+                uint16_t id = ids.acquire();
+                batch::startQuery(inFlight[id], id, settings.flags, (*questions)[index], settings.ednsPayloadSize);
+                watchIndex[id] = index;
+                staged.push_back(id);
+                packets.push_back(inFlight[id].packet);
+            }
+            if (staged.empty()) {
+                return;
+            }
+            const size_t sent = transport.send(packets);
+            for (size_t i = 0; i < staged.size(); ++i) {
+                const uint16_t id = staged[i];
+                if (i < sent) {
+                    inFlight[id].sentAt = now;
+                    sendOrder.push_back(id);
+                } else {
+                    // the socket is full, the rest goes out on the next turn
+                    batch::finishQuery(inFlight[id]);
+                    ids.release(id);
+                    due.push({now, watchIndex[id]});
+                }
+            }
+            if (!sent) {
+                transport.waitWritable();
+            }
+            active += sent;
+            summary.sent += sent;
+        }
+
+        void waitFor(Clock::duration wait, const sigset_t &waitMask) const {
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::clamp<Clock::duration>(wait, Clock::duration::zero(), std::chrono::hours(24))).count();
+            const timespec timeout{static_cast<time_t>(nanoseconds / 1000000000), static_cast<long>(nanoseconds % 1000000000)};
+            pollfd pfd{transport.descriptor(), POLLIN, 0};
+            if (ppoll(&pfd, 1, &timeout, &waitMask) < 0 && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll transport");
+            }
+        }
+
+        void onResponse(dns::PacketView packet) override {
+            if (packet.size() < DNS_HEADER_SIZE) {
+                summary.unmatched++;
+                return;
+            }
+            const uint16_t id = (packet[0] << 8) | packet[1];
+            batch::InFlightQuery &query = inFlight[id];
+            if (!query.active || !batch::responseMatches(packet, query)) {
+                summary.unmatched++;
+                return;
+            }
+            const size_t index = watchIndex[id];
+            finish(id);
+            if (dns::isTruncated(packet)) {
+                // an answer too large for UDP would not fit a cache slot either
+                summary.truncated++;
+                failed(index);
+                return;
+            }
+            std::optional<uint32_t> ttl;
+            try {
+                ttl = cache::cacheableTtl(dns::DNSMessage::parse(packet));
+            } catch (const std::system_error &) {
+            }
+            if (!ttl) {
+                failed(index);
+                return;
+            }
+            cache.store((*questions)[index], packet);
+            failures.erase(index);
+            summary.refreshed++;
+            const double jitter = std::uniform_real_distribution<double>(0, 1)(random);
+            due.push({Clock::now() + refreshDelay(*ttl, settings.ahead, jitter), index});
+        }
+
+        void failed(size_t index) {
+            summary.failed++;
+            due.push({Clock::now() + retryDelay(++failures[index]), index});
+        }
+
+        void finish(uint16_t id) {
+            batch::finishQuery(inFlight[id]);
+            ids.release(id);
+            active--;
+        }
+
+        void expire() {
+            const Clock::time_point now = Clock::now();
+            while (!sendOrder.empty()) {
+                const uint16_t id = sendOrder.front();
+                if (inFlight[id].active) {
+                    if (now - inFlight[id].sentAt < timeout) {
+                        break;
+                    }
+                    finish(id);
+                    failed(watchIndex[id]);
+                }
+                sendOrder.pop_front();
+            }
+        }
+
+        transport::Transport &transport;
+        cache::Cache &cache;
+        const Settings &settings;
+        const std::vector<dns::Question> *questions = nullptr;
+        // names and packets of the refreshes in flight, recycled from one refresh to the next
+        std::pmr::unsynchronized_pool_resource buffers;
+        batch::IdAllocator ids;
+        std::vector<batch::InFlightQuery> inFlight;
+        // refreshes of the current issue() and their packets, kept between calls
+        std::vector<uint16_t> staged;
+        std::vector<dns::PacketView> packets;
+        // entry of the watch list each query ID refreshes
+        std::vector<size_t> watchIndex;
+        std::deque<uint16_t> sendOrder;
+        // soonest refresh on top
+        std::priority_queue<Refresh, std::vector<Refresh>, std::greater<>> due;
+        // consecutive failed refreshes of the names that have any
+        std::unordered_map<size_t, unsigned> failures;
+        const std::chrono::seconds timeout;
+        size_t active = 0;
+        std::mt19937 random;
+        Summary summary;
+    };
+
+    Summary run(const std::vector<dns::Question> &watchList, transport::Transport &transport, cache::Cache &cache,
+                const Settings &settings) {
+        Refresher refresher(transport, cache, settings);
+        return refresher.run(watchList);
+    }
+}
@@ -0,0 +1,212 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+
+// retransmission timeout before the first sample, RFC 6298 suggests 1 s
+const auto RTO_INITIAL = std::chrono::milliseconds(1000);
+const auto RTO_MIN = std::chrono::milliseconds(50);
+const auto RTO_MAX = std::chrono::milliseconds(2000);
+// clock granularity G of RFC 6298
+const auto RTO_GRANULARITY = std::chrono::milliseconds(1);
+// a query is sent at most this many times more before it times out
+const unsigned MAX_RETRANSMITS = 2;
+// every first transmission earns this fraction of a retransmission
+const double RETRY_BUDGET_RATIO = 0.5;
+// retransmissions allowed before any query earned them, also the most that can be saved up
+const double RETRY_BUDGET_MIN = 10;
+const double RETRY_BUDGET_MAX = 100;
+// every level of the timer wheel has 2^WHEEL_SLOT_BITS slots, a slot of level 0 is one tick
+const unsigned WHEEL_SLOT_BITS = 6;
+const unsigned WHEEL_LEVELS = 4;
+const auto WHEEL_TICK = std::chrono::milliseconds(1);
+
+namespace retransmit {
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Smoothed RTT and retransmission timeout of one server as in RFC 6298.
+     */
+    class RttEstimator {
+    public:
+        void sample(Clock::duration rtt) {
+            if (!sampled) {
+                srtt = rtt;
+                rttvar = rtt / 2;
+                sampled = true;
+            } else {
+                const Clock::duration delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+                rttvar = (rttvar * 3 + delta) / 4;
+                srtt = (srtt * 7 + rtt) / 8;
+            }
+        }
+
+        Clock::duration rto() const {
+            if (!sampled) {
+                return RTO_INITIAL;
+            }
+            const Clock::duration rto = srtt + std::max<Clock::duration>(RTO_GRANULARITY, rttvar * 4);
+            return std::clamp<Clock::duration>(rto, RTO_MIN, RTO_MAX);
+        }
+
+        // how long to wait after the `transmissions`-th send, doubled for every retransmission
+        Clock::duration backoff(unsigned transmissions) const {
+            return std::min<Clock::duration>(rto() * (1u << (std::clamp(transmissions, 1u, 17u) - 1)), RTO_MAX * 4);
+        }
+
+        // no answer within the timeout counts as a round trip of twice the timeout
+        void penalize() {
+            sample(std::min<Clock::duration>(rto() * 2, RTO_MAX * 2));
+        }
+
+        Clock::duration getSrtt() const {
+            return srtt;
+        }
+
+        bool hasSample() const {
+            return sampled;
+        }
+
+    private:
+        bool sampled = false;
+        Clock::duration srtt{};
+        Clock::duration rttvar{};
+    };
+
+    /**
+     * Caps retransmissions at a fraction of the queries sent, so a dead server does not get
+     * every query several times over.
+     */
+    class RetryBudget {
+    public:
+        void deposit() {
+            tokens = std::min(RETRY_BUDGET_MAX, tokens + RETRY_BUDGET_RATIO);
+        }
+
+        bool withdraw() {
+            if (tokens < 1) {
+                return false;
+            }
+            tokens -= 1;
+            return true;
+        }
+
+    private:
+        double tokens = RETRY_BUDGET_MIN;
+    };
+
+    /**
+     * Hierarchical timer wheel: level 0 holds timers due within 2^WHEEL_SLOT_BITS ticks, each further level
+     * covers 2^WHEEL_SLOT_BITS times more and is cascaded down as the wheel turns. Scheduling and firing are O(1),
+     * timers are not cancelled but carry a key the owner checks when they fire.
+     */
+    class TimerWheel {
+    public:
+        explicit TimerWheel(Clock::time_point origin = Clock::now()) : origin(origin) {}
+
+        void schedule(uint64_t key, Clock::time_point when) {
+            // a deadline inside the current tick still waits for the next one
+            place({key, std::max(toTick(when), current + 1)});
+        }
+
+        /**
+         * Turns the wheel up to `now` and calls fire(key) for every timer that became due.
+         */
+        template<typename Fire>
+        void advance(Clock::time_point now, Fire fire) {
+            const uint64_t target = toTick(now);
+            while (current < target) {
+                if (!count) {
+                    current = target;
+                    break;
+                }
+                current++;
+                cascade();
+                // firing may schedule new timers, but never into the slot being fired
+                firing.clear();
+                firing.swap(slots[0][current & SLOT_MASK]);
+                count -= firing.size();
+                for (const Entry &entry : firing) {
+                    fire(entry.key);
+                }
+            }
+        }
+
+        /**
+         * Time until the wheel has to turn again: the next timer on level 0, or the next cascade.
+         */
+        Clock::duration untilNext(Clock::time_point now) const {
+            if (!count) {
+                return Clock::duration::max();
+            }
+            uint64_t tick = current + 1;
+            for (; tick <= (current | SLOT_MASK); ++tick) {
+                if (!slots[0][tick & SLOT_MASK].empty()) {
+                    break;
+                }
+            }
+            return std::max<Clock::duration>(Clock::duration::zero(), origin + WHEEL_TICK * static_cast<int64_t>(tick) - now);
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+    private:
+        struct Entry {
+            uint64_t key;
+            uint64_t tick;
+        };
+
+        static constexpr uint64_t SLOTS = uint64_t{1} << WHEEL_SLOT_BITS;
+        static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+        uint64_t toTick(Clock::time_point when) const {
+            if (when <= origin) {
+                return 0;
+            }
+            // rounded up, a timer never fires early
+            return static_cast<uint64_t>((when - origin + WHEEL_TICK - Clock::duration(1)) / WHEEL_TICK);
+        }
+
+        void place(const Entry &entry) {
+            const uint64_t delta = entry.tick - current;
+            unsigned level = 0;
+            while (level + 1 < WHEEL_LEVELS && delta >= (uint64_t{1} << ((level + 1) * WHEEL_SLOT_BITS))) {
+                level++;
+            }
+            // beyond the last level the timer waits in its farthest slot and is placed again on cascade
+            const uint64_t tick = std::min(entry.tick, current + (uint64_t{1} << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1);
+            slots[level][(tick >> (level * WHEEL_SLOT_BITS)) & SLOT_MASK].push_back(entry);
+            count++;
+        }
+
+        // moves the timers of every higher level slot that starts at the current tick one level down
+        void cascade() {
+            for (unsigned level = 1; level < WHEEL_LEVELS; ++level) {
+                if (current & ((uint64_t{1} << (level * WHEEL_SLOT_BITS)) - 1)) {
+                    return;
+                }
+                std::vector<Entry> moved;
+                moved.swap(slots[level][(current >> (level * WHEEL_SLOT_BITS)) & SLOT_MASK]);
+                count -= moved.size();
+                for (const Entry &entry : moved) {
+                    place(entry);
+                }
+            }
+        }
+
+        Clock::time_point origin;
+        uint64_t current = 0;
+        size_t count = 0;
+        std::array<std::array<std::vector<Entry>, SLOTS>, WHEEL_LEVELS> slots;
+        std::vector<Entry> firing;
+    };
+}
@@ -0,0 +1,189 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+// Phase timers and counters of the query path. Only a build with -DSTATS (make stats) collects them,
+// otherwise statsPhase and statsCount expand to nothing, the same way debugMsg does.
+
+#ifdef STATS
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <csignal>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+
+namespace stats {
+
+    enum PHASE {
+        PHASE_RESOLVE,
+        PHASE_SOCKET,
+        PHASE_CONSTRUCT,
+        PHASE_SEND,
+        PHASE_WAIT,
+        PHASE_PARSE,
+        PHASE_FORMAT,
+        PHASE_COUNT
+    };
+
+    enum COUNTER {
+        COUNTER_BYTES_OUT,
+        COUNTER_BYTES_IN,
+        COUNTER_RETRIES,
+        COUNTER_COMPRESSION_HOPS,
+        COUNTER_ALLOCATIONS,
+        COUNTER_ALLOCATED_BYTES,
+        COUNTER_COUNT
+    };
+
+    const char *const PHASE_NAMES[PHASE_COUNT] = {"resolve", "socket", "construct", "send", "wait", "parse", "format"};
+
+    // name in the text dump, metric name and help line in the Prometheus one
+    const char *const COUNTER_NAMES[COUNTER_COUNT][3] = {
+        {"bytes out", "dns_sent_bytes_total", "Bytes of DNS messages sent."},
+        {"bytes in", "dns_received_bytes_total", "Bytes of DNS messages received."},
+        {"retries", "dns_retries_total", "Queries sent again after a timeout, or over TCP after a truncated response."},
+        {"compression hops", "dns_compression_hops_total", "Compression pointers followed while reading names."},
+        {"allocations", "dns_allocations_total", "Calls of operator new."},
+        {"allocated bytes", "dns_allocated_bytes_total", "Bytes requested from operator new."},
+    };
+
+    struct PhaseTotal {
+        std::atomic<uint64_t> calls = 0;
+        std::atomic<uint64_t> nanoseconds = 0;
+    };
+
+    // workers update these concurrently, relaxed atomics keep that cheap
+    PhaseTotal phases[PHASE_COUNT];
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    STATS_FORMAT format = STATS_FORMAT_TEXT;
+
+    void add(COUNTER counter, uint64_t amount) {
+        counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    /**
+     * Adds the time from its construction to its destruction to one phase.
+     */
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(PHASE phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+
+        PhaseTimer(const PhaseTimer &) = delete;
+        PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+        ~PhaseTimer() {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            phases[phase].calls.fetch_add(1, std::memory_order_relaxed);
+            phases[phase].nanoseconds.fetch_add(elapsed, std::memory_order_relaxed);
+        }
+
+    private:
+        PHASE phase;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    std::string renderText() {
+        std::string text = "Statistics:\n";
+        for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+            const uint64_t calls = phases[phase].calls.load(std::memory_order_relaxed);
+            const uint64_t nanoseconds = phases[phase].nanoseconds.load(std::memory_order_relaxed);
+            text += std::string("  ") + PHASE_NAMES[phase] + ": " + std::to_string(calls) + " calls, "
+                    + std::to_string(nanoseconds / 1000) + " us total, "
+                    + std::to_string(calls ? nanoseconds / calls / 1000 : 0) + " us avg\n";
+        }
+        for (size_t counter = 0; counter < COUNTER_COUNT; ++counter) {
+            text += std::string("  ") + COUNTER_NAMES[counter][0] + ": "
+                    + std::to_string(counters[counter].load(std::memory_order_relaxed)) + "\n";
+        }
+        return text;
+    }
+
+    std::string renderPrometheus() {
+        std::string text = "# HELP dns_phase_seconds_total Time spent in each phase of a query.\n"
+                           "# TYPE dns_phase_seconds_total counter\n";
+        for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+            const uint64_t nanoseconds = phases[phase].nanoseconds.load(std::memory_order_relaxed);
+            text += std::string("dns_phase_seconds_total{phase=\"") + PHASE_NAMES[phase] + "\"} "
+                    + std::to_string(static_cast<double>(nanoseconds) / 1e9) + "\n";
+        }
+        text += "# HELP dns_phase_calls_total Times each phase of a query ran.\n"
+                "# TYPE dns_phase_calls_total counter\n";
+        for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+            text += std::string("dns_phase_calls_total{phase=\"") + PHASE_NAMES[phase] + "\"} "
+                    + std::to_string(phases[phase].calls.load(std::memory_order_relaxed)) + "\n";
+        }
+        for (size_t counter = 0; counter < COUNTER_COUNT; ++counter) {
+            const std::string name = COUNTER_NAMES[counter][1];
+            text += "# HELP " + name + " " + COUNTER_NAMES[counter][2] + "\n# TYPE " + name + " counter\n" + name + " "
+                    + std::to_string(counters[counter].load(std::memory_order_relaxed)) + "\n";
+        }
+        return text;
+    }
+
+    void dump() {
+        const std::string text = format == STATS_FORMAT_PROMETHEUS ? renderPrometheus() : renderText();
+        size_t written = 0;
+        while (written < text.size()) {
+            const ssize_t result = ::write(STDERR_FILENO, text.data() + written, text.size() - written);
+            if (result <= 0) {
+                return;
+            }
+            written += result;
+        }
+    }
+
+    /**
+     * Dumps the statistics at exit and every time SIGUSR1 arrives. Has to run before any other thread
+     * starts, so that all of them inherit the blocked signal and only the dumping thread takes it.
+     */
+    void install(STATS_FORMAT selected) {
+        format = selected;
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        std::thread([signals]() {
+            int signal;
+            while (sigwait(&signals, &signal) == 0) {
+                dump();
+            }
+        }).detach();
+        std::atexit(dump);
+    }
+}
+
+void *operator new(size_t size) {
+    stats::add(stats::COUNTER_ALLOCATIONS, 1);
+    stats::add(stats::COUNTER_ALLOCATED_BYTES, size);
+    if (void *pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define statsPhase(phase) stats::PhaseTimer STATS_CONCAT(statsTimer, __LINE__)(stats::phase)
+#define statsCount(counter, amount) stats::add(stats::counter, amount)
+#else
+#define statsPhase(phase) do {} while(0)
+#define statsCount(counter, amount) do {} while(0)
+#endif
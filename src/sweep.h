@@ -0,0 +1,127 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <array>
+#include <optional>
+#include <cstdint>
+#include <charconv>
+#include <system_error>
+#include <arpa/inet.h>
+
+#include "batch.h"
+#include "dns.h"
+
+
+namespace sweep {
+
+    /**
+     * Network of a CIDR range, host bits cleared, and its last address.
+     */
+    struct Range {
+        std::array<uint8_t, INET6_ADDRLEN> first{};
+        std::array<uint8_t, INET6_ADDRLEN> last{};
+        // 4 for IPv4, 16 for IPv6
+        size_t length = 0;
+        int family = AF_UNSPEC;
+    };
+
+    Range parseRange(const std::string &cidr) {
+        const size_t slash = cidr.find('/');
+        if (slash == std::string::npos) {
+            throw std::system_error(EINVAL, std::generic_category(), "Sweep range \"" + cidr + "\" lacks a prefix length");
+        }
+        Range range;
+        const std::string address = cidr.substr(0, slash);
+        if (inet_pton(AF_INET, address.c_str(), range.first.data()) == 1) {
+            range.length = sizeof(in_addr);
+            range.family = AF_INET;
+        } else if (inet_pton(AF_INET6, address.c_str(), range.first.data()) == 1) {
+            range.length = INET6_ADDRLEN;
+            range.family = AF_INET6;
+        } else {
+            throw std::system_error(EINVAL, std::generic_category(), "Invalid sweep range address \"" + address + "\"");
+        }
+        unsigned prefix = 0;
+        const char *begin = cidr.data() + slash + 1;
+        const char *end = cidr.data() + cidr.size();
+        auto [parsed, error] = std::from_chars(begin, end, prefix);
+        if (begin == end || error != std::errc() || parsed != end || prefix > range.length * 8) {
+            throw std::system_error(EINVAL, std::generic_category(), "Invalid sweep prefix length in \"" + cidr + "\"");
+        }
+        for (size_t i = 0; i < range.length; ++i) {
+            const unsigned networkBits = std::min(8u, prefix - std::min<unsigned>(prefix, i * 8));
+            const uint8_t mask = static_cast<uint8_t>(0xFF00 >> networkBits);
+            range.first[i] &= mask;
+            range.last[i] = range.first[i] | static_cast<uint8_t>(~mask);
+        }
+        return range;
+    }
+
+    /**
+     * PTR questions for every address of a range in ascending order, the batch engine pulls them as its window
+     * frees up. The reverse name of the previous address is patched in place: only the labels of the bytes
+     * the increment touched are written again.
+     */
+    class SweepQuerySource : public batch::QuerySource {
+    public:
+        explicit SweepQuerySource(const Range &range) : range(range), address(range.first) {
+            dns::constructorUtils::appendReverseLabels(name, {address.data(), range.length}, range.family);
+            name += range.family == AF_INET6 ? "ip6.arpa" : "in-addr.arpa";
+        }
+
+        bool next(dns::Question &question) override {
+            if (done) {
+                return false;
+            }
+            question.name.assign(name);
+            question.qtype = TYPE_PTR;
+            question.qclass = CLASS_IN;
+            if (address == range.last) {
+                done = true;
+            } else {
+                advance();
+            }
+            return true;
+        }
+
+    private:
+        void advance() {
+            // the least significant byte is the first label of the name
+            size_t changed = 0;
+            for (size_t i = range.length; i-- > 0;) {
+                changed++;
+                if (++address[i] != 0) {
+                    break;
+                }
+            }
+            if (range.family == AF_INET6) {
+                // two one-character nibble labels per byte at fixed positions
+                const char *hexadec = "0123456789abcdef";
+                for (size_t k = 0; k < changed; ++k) {
+                    const uint8_t byte = address[INET6_ADDRLEN - 1 - k];
+                    name[4 * k] = hexadec[byte & 0x0F];
+                    name[4 * k + 2] = hexadec[byte >> 4];
+                }
+                return;
+            }
+            // decimal labels change their width, the changed ones are written again in front of the rest
+            size_t prefixEnd = 0;
+            for (size_t k = 0; k < changed; ++k) {
+                prefixEnd = name.find('.', prefixEnd) + 1;
+            }
+            labels.clear();
+            dns::constructorUtils::appendReverseLabels(
+                    labels, {address.data() + range.length - changed, changed}, AF_INET);
+            name.replace(0, prefixEnd, labels);
+        }
+
+        Range range;
+        std::array<uint8_t, INET6_ADDRLEN> address;
+        std::string name;
+        // scratch space for the rewritten IPv4 labels
+        std::string labels;
+        bool done = false;
+    };
+}
@@ -0,0 +1,261 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <vector>
+#include <span>
+#include <string>
+#include <map>
+#include <chrono>
+#include <system_error>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "stats.h"
+#include "udp.h"
+#include "utils.h"
+
+
+const size_t TCP_READ_CHUNK = 64 * 1024;
+
+namespace tcp {
+
+    /**
+     * Persistent DNS over TCP connection (RFC 7766). Any number of queries can be pipelined,
+     * responses are handed out in the order the server sends them and are matched by the caller.
+     * Queries still waiting for an answer are sent again if the server closes the connection.
+     * The server is resolved once in the constructor, connecting again does not look it up.
+     * Without `waitForConnect` connecting never blocks: queries are held back until the handshake completes,
+     * and a connection that fails or is closed is dropped rather than made again, its queries time out.
+     */
+    class Connection {
+    public:
+        Connection(const std::string &server, uint16_t port, int timeoutSec, bool waitForConnect = true)
+                : server(server), port(port), timeoutSec(timeoutSec), waitForConnect(waitForConnect) {
+            udp::AddressInfo res = udp::resolveServer(server, port, SOCK_STREAM);
+            std::memcpy(&address, res->ai_addr, res->ai_addrlen);
+            addressLength = res->ai_addrlen;
+        }
+
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        ~Connection() {
+            disconnect();
+        }
+
+        void send(uint16_t id, std::span<const uint8_t> packet) {
+            if (fd < 0) {
+                connectToServer();
+            }
+            outstanding[id].assign(packet.begin(), packet.end());
+            enqueue(packet);
+            flush();
+        }
+
+        // the query was answered or abandoned, it will not be sent again after a reconnect
+        void forget(uint16_t id) {
+            outstanding.erase(id);
+        }
+
+        // calls visit(uint16_t id) for every query still waiting for an answer
+        template<typename Visitor>
+        void forEachOutstanding(Visitor visit) const {
+            for (const auto &[id, packet] : outstanding) {
+                visit(id);
+            }
+        }
+
+        int descriptor() const {
+            return fd;
+        }
+
+        bool wantsWrite() const {
+            return outgoingOffset < outgoing.size();
+        }
+
+        void flush() {
+            while (fd >= 0 && wantsWrite()) {
+                ssize_t written = ::send(fd, outgoing.data() + outgoingOffset, outgoing.size() - outgoingOffset,
+                                         MSG_NOSIGNAL);
+                if (written < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    reconnect();
+                    return;
+                }
+                outgoingOffset += written;
+            }
+            outgoing.clear();
+            outgoingOffset = 0;
+        }
+
+        /**
+         * Reads whatever is available and calls handle(std::span<const uint8_t> message) for every complete message.
+         * The message points into the receive buffer and is only valid during the call.
+         */
+        template<typename Handler>
+        void receive(Handler handle) {
+            while (fd >= 0) {
+                const size_t used = incoming.size();
+                incoming.resize(used + TCP_READ_CHUNK);
+                ssize_t received = recv(fd, incoming.data() + used, TCP_READ_CHUNK, 0);
+                incoming.resize(used + std::max<ssize_t>(received, 0));
+                if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (received <= 0) {
+                    // closed by the server, possibly with answers still buffered
+                    extractMessages(handle);
+                    reconnect();
+                    return;
+                }
+                extractMessages(handle);
+            }
+        }
+
+        /**
+         * Blocks until something can be read or written, returns false on timeout.
+         */
+        bool wait(int timeoutMs) const {
+            pollfd pfd{fd, static_cast<short>(POLLIN | (wantsWrite() ? POLLOUT : 0)), 0};
+            int ready = poll(&pfd, 1, timeoutMs);
+            if (ready < 0 && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll TCP socket");
+            }
+            return ready > 0;
+        }
+
+    private:
+        void connectToServer() {
+            fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to create TCP socket");
+            }
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+            if (connect(fd, reinterpret_cast<const sockaddr *>(&address), addressLength) < 0 && errno != EINPROGRESS) {
+                int err = errno;
+                disconnect();
+                throw std::system_error(err, std::generic_category(), "Failed to connect to DNS server over TCP");
+            }
+            if (!waitForConnect) {
+                return;
+            }
+            pollfd pfd{fd, POLLOUT, 0};
+            int error = 0;
+            socklen_t errorLength = sizeof(error);
+            if (poll(&pfd, 1, timeoutSec * 1000) <= 0) {
+                error = ETIMEDOUT;
+            } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0) {
+                error = errno;
+            }
+            if (error != 0) {
+                disconnect();
+                throw std::system_error(error, std::generic_category(), "Failed to connect to DNS server over TCP");
+            }
+            debugMsg("TCP connection to " << server << ":" << port << " established" << std::endl);
+        }
+
+        void disconnect() {
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            outgoing.clear();
+            outgoingOffset = 0;
+            incoming.clear();
+        }
+
+        void reconnect() {
+            disconnect();
+            if (!waitForConnect) {
+                outstanding.clear();
+                return;
+            }
+            if (outstanding.empty()) {
+                return;
+            }
+            connectToServer();
+            for (const auto &[id, packet] : outstanding) {
+                enqueue(packet);
+            }
+            flush();
+        }
+
+        void enqueue(std::span<const uint8_t> packet) {
+            outgoing.push_back(static_cast<uint8_t>(packet.size() >> 8));
+            outgoing.push_back(static_cast<uint8_t>(packet.size() & 0xFF));
+            outgoing.insert(outgoing.end(), packet.begin(), packet.end());
+        }
+
+        template<typename Handler>
+        void extractMessages(Handler &handle) {
+            size_t offset = 0;
+            while (incoming.size() >= offset + 2) {
+                const size_t length = (incoming[offset] << 8) | incoming[offset + 1];
+                if (incoming.size() - offset - 2 < length) {
+                    break;
+                }
+                handle(std::span<const uint8_t>(incoming.data() + offset + 2, length));
+                offset += 2 + length;
+            }
+            // a handler that dropped the connection has emptied the buffer already
+            incoming.erase(incoming.begin(), incoming.begin() + std::min(offset, incoming.size()));
+        }
+
+        std::string server;
+        uint16_t port;
+        int timeoutSec;
+        bool waitForConnect;
+        sockaddr_storage address{};
+        socklen_t addressLength = 0;
+        int fd = -1;
+        std::vector<uint8_t> outgoing;
+        size_t outgoingOffset = 0;
+        std::vector<uint8_t> incoming;
+        std::map<uint16_t, std::vector<uint8_t>> outstanding;
+    };
+
+    std::vector<uint8_t> sendQuery(const std::string &server, uint16_t port, const std::vector<uint8_t> &queryPacket, int timeoutSec) {
+        if (queryPacket.size() < 2) {
+            throw std::system_error(EINVAL, std::generic_category(), "DNS query too short");
+        }
+        const uint16_t id = (queryPacket[0] << 8) | queryPacket[1];
+        Connection connection(server, port, timeoutSec);
+        connection.send(id, queryPacket);
+        statsCount(COUNTER_BYTES_OUT, queryPacket.size());
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSec);
+        std::vector<uint8_t> response;
+        while (response.empty()) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            statsPhase(PHASE_WAIT);
+            if (remaining <= 0 || !connection.wait(static_cast<int>(remaining))) {
+                throw std::system_error(ETIMEDOUT, std::generic_category(), "Failed to receive DNS response over TCP or timed out");
+            }
+            connection.flush();
+            connection.receive([&](std::span<const uint8_t> message) {
+                if (message.size() >= 2 && ((message[0] << 8) | message[1]) == id) {
+                    statsCount(COUNTER_BYTES_IN, message.size());
+                    response.assign(message.begin(), message.end());
+                    connection.forget(id);
+                }
+            });
+        }
+        return response;
+    }
+}
@@ -0,0 +1,261 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <span>
+#include <optional>
+#include <ostream>
+#include <system_error>
+
+#include "dns.h"
+#include "names.h"
+#include "output.h"
+#include "stats.h"
+#include "tcp.h"
+
+
+namespace transfer {
+
+    struct Settings {
+        std::string zone;
+        // IXFR from this serial, a full AXFR without it
+        std::optional<uint32_t> serial;
+        // longest wait for the next part of the transfer
+        int timeoutSec;
+    };
+
+    struct Summary {
+        size_t messages = 0;
+        size_t records = 0;
+        size_t bytes = 0;
+        // serial of the zone the server sent
+        uint32_t serial = 0;
+        // AXFR, IXFR with the differences, or an IXFR the client was already up to date for
+        const char *kind = "";
+    };
+
+    std::ostream &operator<<(std::ostream &stream, const Summary &summary) {
+        stream << "Transfer: " << summary.kind << ", Serial: " << summary.serial << ", Messages: " << summary.messages
+               << ", Records: " << summary.records << ", Bytes: " << summary.bytes << std::endl;
+        return stream;
+    }
+
+    // RFC 1982 serial number arithmetic
+    bool serialNewer(uint32_t serial, uint32_t than) {
+        return serial != than && static_cast<uint32_t>(serial - than) < 0x80000000u;
+    }
+
+    /**
+     * AXFR query for the zone, or IXFR with the SOA of the version the client has in the authority
+     * section (RFC 1995). Only the serial of that SOA is looked at, the other fields are left empty.
+     */
+    dns::Packet constructTransferQuery(uint16_t id, const Settings &settings) {
+        const dns::Question question{std::pmr::string(settings.zone), settings.serial ? TYPE_IXFR : TYPE_AXFR, CLASS_IN};
+        dns::Packet packet;
+        dns::writeQueryPacket(packet, id, 0, question);
+        if (!settings.serial) {
+            return packet;
+        }
+        const uint32_t serial = *settings.serial;
+        // owner compressed to the question name, TYPE, CLASS, TTL, RDLENGTH, root MNAME and RNAME, SERIAL,
+        // REFRESH, RETRY, EXPIRE and MINIMUM
+        const uint8_t soa[] = {
+            0xC0, DNS_HEADER_SIZE,
+            TYPE_SOA >> 8, TYPE_SOA & 0xFF,
+            CLASS_IN >> 8, CLASS_IN & 0xFF,
+            0, 0, 0, 0,
+            0, 22,
+            0, 0,
+            static_cast<uint8_t>(serial >> 24), static_cast<uint8_t>(serial >> 16),
+            static_cast<uint8_t>(serial >> 8), static_cast<uint8_t>(serial),
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        };
+        packet.insert(packet.end(), std::begin(soa), std::end(soa));
+        // NSCOUNT = 1
+        packet[9] = 1;
+        return packet;
+    }
+
+    /**
+     * Finds the end of a transfer in its stream of answer records, which has no other end marker. Both kinds
+     * open with the SOA of the zone. An AXFR, or an IXFR the server answers with the whole zone, closes with it
+     * again (RFC 5936). An incremental IXFR is a run of differences, each an SOA followed by the deleted
+     * records and another SOA followed by the added ones, and closes with the opening SOA where the next
+     * deletions would start (RFC 1995). A single SOA answers an IXFR from the current serial or a newer one.
+     */
+    class Progress {
+    public:
+        explicit Progress(std::optional<uint32_t> clientSerial) : clientSerial(clientSerial) {}
+
+        void record(const dns::ResourceRecordView &record) {
+            const bool soa = record.type == TYPE_SOA;
+            const uint32_t serial = soa ? dns::rdata::SOA::read(record).serial : 0;
+            switch (state) {
+                case State::START:
+                    if (!soa) {
+                        dns::parsing::utils::throwMalformed("zone transfer does not start with an SOA record");
+                    }
+                    zoneSerial = serial;
+                    if (clientSerial && !serialNewer(serial, *clientSerial)) {
+                        kind = "IXFR, up to date";
+                        state = State::DONE;
+                        return;
+                    }
+                    state = State::FIRST;
+                    return;
+                case State::FIRST:
+                    if (!soa) {
+                        kind = "AXFR";
+                        state = State::WHOLE_ZONE;
+                    } else if (!clientSerial || serial == zoneSerial) {
+                        // a zone of nothing but its SOA
+                        kind = "AXFR";
+                        state = State::DONE;
+                    } else {
+                        kind = "IXFR";
+                        state = State::DELETING;
+                    }
+                    return;
+                case State::WHOLE_ZONE:
+                    if (soa) {
+                        state = State::DONE;
+                    }
+                    return;
+                case State::DELETING:
+                    if (soa) {
+                        state = State::ADDING;
+                    }
+                    return;
+                case State::ADDING:
+                    if (soa) {
+                        state = serial == zoneSerial ? State::DONE : State::DELETING;
+                    }
+                    return;
+                case State::DONE:
+                    return;
+            }
+        }
+
+        bool done() const {
+            return state == State::DONE;
+        }
+
+        uint32_t serial() const {
+            return zoneSerial;
+        }
+
+        const char *describe() const {
+            return kind;
+        }
+
+    private:
+        enum class State {
+            START,
+            FIRST,
+            WHOLE_ZONE,
+            DELETING,
+            ADDING,
+            DONE,
+        };
+
+        std::optional<uint32_t> clientSerial;
+        State state = State::START;
+        uint32_t zoneSerial = 0;
+        const char *kind = "";
+    };
+
+    /**
+     * Receives one transfer over TCP. Every length-prefixed message is parsed in the receive buffer and
+     * written to the sink as soon as it is complete, so memory stays the same whatever the size of the zone:
+     * one read chunk, one message and the output buffer of the sink.
+     */
+    class Transfer {
+    public:
+        Transfer(const std::string &server, uint16_t port, const Settings &settings, output::Sink &sink)
+                : connection(server, port, settings.timeoutSec), settings(settings), sink(sink),
+                  id(dns::randomQueryId()), query(constructTransferQuery(id, settings)), progress(settings.serial) {}
+
+        Summary run() {
+            connection.send(id, query);
+            // a transfer cut short is not asked for again behind the caller's back, part of it is written already
+            connection.forget(id);
+            statsCount(COUNTER_BYTES_OUT, query.size());
+
+            while (!progress.done()) {
+                statsPhase(PHASE_WAIT);
+                if (!connection.wait(settings.timeoutSec * 1000)) {
+                    throw std::system_error(ETIMEDOUT, std::generic_category(), "Zone transfer timed out");
+                }
+                connection.flush();
+                connection.receive([this](std::span<const uint8_t> message) {
+                    onMessage(message);
+                });
+                if (!progress.done() && connection.descriptor() < 0) {
+                    throw std::system_error(ECONNRESET, std::generic_category(),
+                                            "Server closed the connection before the zone transfer completed");
+                }
+            }
+            sink.flush();
+
+            summary.serial = progress.serial();
+            summary.kind = progress.describe();
+            return summary;
+        }
+
+    private:
+        void onMessage(dns::PacketView packet) {
+            if (progress.done()) {
+                return;
+            }
+            statsCount(COUNTER_BYTES_IN, packet.size());
+            statsPhase(PHASE_PARSE);
+            const dns::DNSMessage message = dns::DNSMessage::parse(packet);
+            const DNSHeader &header = message.getHeader();
+            if (header.id != id || !(header.flags & FLAG_QR)) {
+                dns::parsing::utils::throwMalformed("zone transfer message for another query");
+            }
+            // only the first message has to repeat the question
+            if ((header.qdcount || !summary.messages) && !questionMatches(packet)) {
+                dns::parsing::utils::throwMalformed("zone transfer message for another question");
+            }
+            if (const uint8_t rcode = header.flags & RCODE_MASK) {
+                throw std::system_error(EPROTO, std::generic_category(),
+                                        "Zone transfer of " + settings.zone + " failed with "
+                                        + dns::parsing::utils::rcodeToString(rcode));
+            }
+            for (const dns::ResourceRecordView &record : message.answers()) {
+                progress.record(record);
+            }
+            sink.write(message);
+            summary.messages++;
+            summary.records += header.ancount;
+            summary.bytes += packet.size();
+        }
+
+        bool questionMatches(dns::PacketView response) const {
+            const size_t questionEnd = DNS_HEADER_SIZE + names::wireLength(settings.zone) + 4;
+            if (response.size() < questionEnd || response[4] != 0 || response[5] != 1) {
+                return false;
+            }
+            const dns::PacketView asked(query);
+            const size_t typeOffset = questionEnd - 4;
+            return names::equalsIgnoreCase(asked.subspan(DNS_HEADER_SIZE, typeOffset - DNS_HEADER_SIZE),
+                                           response.subspan(DNS_HEADER_SIZE, typeOffset - DNS_HEADER_SIZE))
+                   && std::equal(asked.begin() + typeOffset, asked.begin() + questionEnd, response.begin() + typeOffset);
+        }
+
+        tcp::Connection connection;
+        const Settings &settings;
+        output::Sink &sink;
+        const uint16_t id;
+        const dns::Packet query;
+        Progress progress;
+        Summary summary;
+    };
+
+    Summary run(const std::string &server, uint16_t port, const Settings &settings, output::Sink &sink) {
+        Transfer transfer(server, port, settings, sink);
+        return transfer.run();
+    }
+}
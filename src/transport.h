@@ -0,0 +1,126 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <system_error>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "udp.h"
+#include "utils.h"
+
+
+namespace transport {
+
+    class ResponseHandler {
+    public:
+        virtual ~ResponseHandler() = default;
+        // the view is only valid during the call
+        virtual void onResponse(std::span<const uint8_t> response) = 0;
+    };
+
+    /**
+     * Datagram path between the batch engine and one server.
+     */
+    class Transport {
+    public:
+        virtual ~Transport() = default;
+
+        // sends or queues the packets in order, returns how many were taken
+        virtual size_t send(std::span<const std::span<const uint8_t>> packets) = 0;
+
+        // hands every response that is already available to the handler, never blocks
+        virtual void receive(ResponseHandler &handler) = 0;
+
+        // readable whenever receive() has something to do
+        virtual int descriptor() const = 0;
+
+        // blocks until send() can take packets again
+        virtual void waitWritable() = 0;
+
+        virtual const char *name() const = 0;
+
+        // address family of the server, AF_INET or AF_INET6
+        virtual int family() const = 0;
+
+        virtual const udp::SyscallStats &getSendStats() const = 0;
+        virtual const udp::SyscallStats &getReceiveStats() const = 0;
+    };
+
+    /**
+     * Readiness based transport: the connected socket is watched by epoll and drained with recvmmsg.
+     */
+    class EpollTransport : public Transport {
+    public:
+        EpollTransport(const std::string &server, uint16_t port, size_t bufferSize, size_t window)
+                : socket(server, port, bufferSize), ring(MMSG_BATCH_SIZE, bufferSize) {
+            // a whole window of responses may arrive before we get to read them
+            socket.reserveReceiveBuffer(window * (bufferSize + DATAGRAM_OVERHEAD));
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            if (epollFd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to create epoll instance");
+            }
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = socket.descriptor();
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socket.descriptor(), &event) < 0) {
+                int err = errno;
+                close(epollFd);
+                throw std::system_error(err, std::generic_category(), "Failed to watch UDP socket");
+            }
+        }
+
+        EpollTransport(const EpollTransport &) = delete;
+        EpollTransport &operator=(const EpollTransport &) = delete;
+
+        ~EpollTransport() override {
+            close(epollFd);
+        }
+
+        size_t send(std::span<const std::span<const uint8_t>> packets) override {
+            return socket.sendMany(packets);
+        }
+
+        void receive(ResponseHandler &handler) override {
+            size_t received;
+            while ((received = socket.receiveMany(ring)) > 0) {
+                for (size_t i = 0; i < received; ++i) {
+                    handler.onResponse(ring.message(i));
+                }
+            }
+        }
+
+        int descriptor() const override {
+            return epollFd;
+        }
+
+        void waitWritable() override {
+            socket.wait(POLLOUT, -1);
+        }
+
+        const char *name() const override {
+            return "epoll";
+        }
+
+        int family() const override {
+            return socket.family();
+        }
+
+        const udp::SyscallStats &getSendStats() const override {
+            return socket.getSendStats();
+        }
+
+        const udp::SyscallStats &getReceiveStats() const override {
+            return socket.getReceiveStats();
+        }
+
+    private:
+        udp::Socket socket;
+        udp::MessageRing ring;
+        int epollFd = -1;
+    };
+}
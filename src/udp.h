@@ -12,21 +12,41 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <span>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <functional>
+#include <random>
+#include <optional>
+#include <chrono>
 
+#include "retransmit.h"
+#include "stats.h"
 #include "utils.h"
 
 
 const size_t DNS_PACKET_SIZE = 512;
+const size_t MMSG_BATCH_SIZE = 64;
+// kernel bookkeeping per queued datagram, on top of the payload
+const size_t DATAGRAM_OVERHEAD = 1024;
+// connected sockets a ServerEndpoint rotates queries over
+const size_t ENDPOINT_POOL_SIZE = 4;
+// random source ports are drawn above the well-known and registered system range
+const uint16_t ENDPOINT_MIN_PORT = 1024;
+const size_t ENDPOINT_BIND_ATTEMPTS = 8;
 
 namespace udp {
 
-    std::vector<uint8_t> sendQuery(const std::string &server, uint16_t port, const std::vector<uint8_t> &queryPacket, int timeoutSec) {
+    typedef std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> AddressInfo;
+
+    AddressInfo resolveServer(const std::string &server, uint16_t port, int socktype) {
+        statsPhase(PHASE_RESOLVE);
         addrinfo hints{}, *res;
         hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_socktype = socktype;
 
         if (getIpAddrType(server) != ADDR_TYPE_UNKNOWN) {
             hints.ai_flags = AI_NUMERICHOST;
@@ -36,38 +56,432 @@ namespace udp {
         if (svaddr_status != 0) {
             throw std::system_error(svaddr_status, std::generic_category(), gai_strerror(svaddr_status));
         }
-        std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> res_guard(res, freeaddrinfo);
+        return {res, freeaddrinfo};
+    }
+
+    /**
+     * How many datagrams each send or receive call moved, sendmmsg/recvmmsg or an io_uring submission/drain.
+     */
+    struct SyscallStats {
+        size_t calls = 0;
+        size_t messages = 0;
+        size_t maxPerCall = 0;
+
+        void record(size_t count) {
+            calls++;
+            messages += count;
+            maxPerCall = std::max(maxPerCall, count);
+        }
+
+        void merge(const SyscallStats &other) {
+            calls += other.calls;
+            messages += other.messages;
+            maxPerCall = std::max(maxPerCall, other.maxPerCall);
+        }
+    };
+
+    std::ostream &operator<<(std::ostream &stream, const SyscallStats &stats) {
+        stream << stats.calls << " calls, " << stats.messages << " messages, ";
+        if (stats.calls) {
+            stream << static_cast<double>(stats.messages) / stats.calls << " avg";
+        } else {
+            stream << "0 avg";
+        }
+        return stream << ", " << stats.maxPerCall << " max per call";
+    }
+
+    /**
+     * Preallocated receive buffers wired to mmsghdr entries once, recvmmsg fills them in place.
+     */
+    class MessageRing {
+    public:
+        MessageRing(size_t count, size_t bufferSize)
+                : bufferSize(bufferSize), storage(count * bufferSize), vectors(count), headers(count) {
+            for (size_t i = 0; i < count; ++i) {
+                vectors[i] = {storage.data() + i * bufferSize, bufferSize};
+                headers[i].msg_hdr.msg_iov = &vectors[i];
+                headers[i].msg_hdr.msg_iovlen = 1;
+            }
+        }
+
+        std::span<const uint8_t> message(size_t index) const {
+            return {storage.data() + index * bufferSize, headers[index].msg_len};
+        }
+
+        size_t size() const {
+            return headers.size();
+        }
+
+        mmsghdr *data() {
+            return headers.data();
+        }
+
+    private:
+        size_t bufferSize;
+        std::vector<uint8_t> storage;
+        std::vector<iovec> vectors;
+        std::vector<mmsghdr> headers;
+    };
+
+    /**
+     * Non-blocking UDP socket connected to a single server, so the kernel filters out datagrams
+     * from other peers and plain send/recv can be used for many queries.
+     */
+    class Socket {
+    public:
+        Socket(const std::string &server, uint16_t port, size_t bufferSize = DNS_PACKET_SIZE) : bufferSize(bufferSize) {
+            AddressInfo res = resolveServer(server, port, SOCK_DGRAM);
+            addressFamily = res->ai_family;
+            fd = socket(res->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to create UDP socket");
+            }
+            if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+                int err = errno;
+                close(fd);
+                throw std::system_error(err, std::generic_category(), "Failed to connect UDP socket");
+            }
+        }
+
+        Socket(const Socket &) = delete;
+        Socket &operator=(const Socket &) = delete;
+
+        ~Socket() {
+            close(fd);
+        }
+
+        // returns false when the socket buffer is full and the caller has to wait for POLLOUT
+        bool send(const std::vector<uint8_t> &packet) const {
+            if (::send(fd, packet.data(), packet.size(), 0) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                throw std::system_error(errno, std::generic_category(), "Failed to send DNS query");
+            }
+            return true;
+        }
+
+        // returns false when there is nothing left to read
+        bool receive(std::vector<uint8_t> &buffer) const {
+            buffer.resize(bufferSize);
+            ssize_t received = recv(fd, buffer.data(), buffer.size(), 0);
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                if (errno == ECONNREFUSED) {
+                    // ICMP port unreachable from an earlier datagram, the query will time out
+                    return receive(buffer);
+                }
+                throw std::system_error(errno, std::generic_category(), "Failed to receive DNS response");
+            }
+            buffer.resize(received);
+            return true;
+        }
 
-        auto sockfd_deleter = [](int* pfd) {
-            if (pfd && *pfd >= 0) {
-                close(*pfd);
-                delete pfd;
+        /**
+         * Sends as many of the packets as the socket buffer takes with sendmmsg, returns how many were sent.
+         */
+        size_t sendMany(std::span<const std::span<const uint8_t>> packets) {
+            // kept between calls, sending a window does not allocate once the first one was sent
+            if (headers.size() < packets.size()) {
+                vectors.resize(packets.size());
+                headers.resize(packets.size());
             }
-        };
-        std::unique_ptr<int, decltype(sockfd_deleter)> sockfd(new int(socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP)), sockfd_deleter);
-        if (*sockfd < 0) {
-            throw std::system_error(errno, std::generic_category(), "Failed to create UDP socket");
+            for (size_t i = 0; i < packets.size(); ++i) {
+                vectors[i] = {const_cast<uint8_t *>(packets[i].data()), packets[i].size()};
+                headers[i].msg_hdr.msg_iov = &vectors[i];
+                headers[i].msg_hdr.msg_iovlen = 1;
+            }
+            size_t sent = 0;
+            while (sent < packets.size()) {
+                int result = sendmmsg(fd, headers.data() + sent, packets.size() - sent, 0);
+                if (result < 0) {
+                    // ECONNREFUSED reports an ICMP error for an earlier datagram, this one was not sent yet
+                    if (errno == EINTR || errno == ECONNREFUSED) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "Failed to send DNS queries");
+                }
+                debugMsg("sendmmsg sent " << result << " of " << packets.size() - sent << " queries" << std::endl);
+                sendStats.record(result);
+                sent += result;
+            }
+            return sent;
+        }
+
+        /**
+         * Drains up to ring.size() datagrams with one recvmmsg call, returns 0 when there is nothing to read.
+         */
+        size_t receiveMany(MessageRing &ring) {
+            while (true) {
+                int result = recvmmsg(fd, ring.data(), ring.size(), MSG_DONTWAIT, nullptr);
+                if (result >= 0) {
+                    debugMsg("recvmmsg received " << result << " responses" << std::endl);
+                    receiveStats.record(result);
+                    return result;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if (errno != EINTR && errno != ECONNREFUSED) {
+                    throw std::system_error(errno, std::generic_category(), "Failed to receive DNS responses");
+                }
+            }
+        }
+
+        // best effort, the kernel caps the size at net.core.rmem_max
+        void reserveReceiveBuffer(size_t bytes) const {
+            int size = static_cast<int>(std::min<size_t>(bytes, INT32_MAX));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+
+        const SyscallStats &getSendStats() const {
+            return sendStats;
+        }
+
+        const SyscallStats &getReceiveStats() const {
+            return receiveStats;
         }
 
-        ssize_t sent_bytes = sendto(*sockfd, queryPacket.data(), queryPacket.size(), 0, res->ai_addr, res->ai_addrlen);
-        if (sent_bytes < 0) {
-            throw std::system_error(errno, std::generic_category(), "Failed to send DNS query");
+        size_t getBufferSize() const {
+            return bufferSize;
         }
 
-        timeval tv{};
-        tv.tv_sec = timeoutSec;
-        tv.tv_usec = 0;
-        if (setsockopt(*sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-            throw std::system_error(errno, std::generic_category(), "Failed to set socket timeout");
+        int descriptor() const {
+            return fd;
         }
 
-        std::vector<uint8_t> responseBuffer(DNS_PACKET_SIZE);
-        ssize_t received_bytes = recvfrom(*sockfd, responseBuffer.data(), responseBuffer.size(), 0, nullptr, nullptr);
-        if (received_bytes < 0) {
-            throw std::system_error(errno, std::generic_category(), "Failed to receive DNS response or timed out");
+        int family() const {
+            return addressFamily;
         }
 
-        responseBuffer.resize(received_bytes);
-        return responseBuffer;
+        bool wait(short events, int timeoutMs) const {
+            pollfd pfd{fd, events, 0};
+            int ready = poll(&pfd, 1, timeoutMs);
+            if (ready < 0 && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll UDP socket");
+            }
+            return ready > 0;
+        }
+
+    private:
+        int fd;
+        int addressFamily;
+        size_t bufferSize;
+        SyscallStats sendStats;
+        SyscallStats receiveStats;
+        // sendmmsg arguments of the last sendMany
+        std::vector<iovec> vectors;
+        std::vector<mmsghdr> headers;
+    };
+
+    /**
+     * A server resolved once and a small pool of connected UDP sockets to it, each bound to its own
+     * random source port. Queries rotate over the pool, so consecutive ones leave from different ports
+     * and no query pays for getaddrinfo, socket or connect after the first use of a socket.
+     */
+    class ServerEndpoint {
+    public:
+        ServerEndpoint(const std::string &server, uint16_t port, size_t poolSize = ENDPOINT_POOL_SIZE,
+                       size_t bufferSize = DNS_PACKET_SIZE)
+                : bufferSize(bufferSize), sockets(std::max<size_t>(poolSize, 1), -1), generator(std::random_device{}()) {
+            AddressInfo res = resolveServer(server, port, SOCK_DGRAM);
+            std::memcpy(&address, res->ai_addr, res->ai_addrlen);
+            addressLength = res->ai_addrlen;
+        }
+
+        ServerEndpoint(const ServerEndpoint &) = delete;
+        ServerEndpoint &operator=(const ServerEndpoint &) = delete;
+
+        ~ServerEndpoint() {
+            for (int fd : sockets) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+
+        /**
+         * Sends the packet from the next socket of the pool, or again from socket `index`,
+         * returns the socket to wait on for the response.
+         */
+        size_t send(const std::vector<uint8_t> &packet, std::optional<size_t> socketIndex = std::nullopt) {
+            const size_t index = socketIndex.value_or(next);
+            if (!socketIndex) {
+                next = (next + 1) % sockets.size();
+            }
+            const int fd = open(index);
+            ssize_t sent;
+            {
+                statsPhase(PHASE_SEND);
+                sent = ::send(fd, packet.data(), packet.size(), 0);
+            }
+            if (sent < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to send DNS query");
+            }
+            statsCount(COUNTER_BYTES_OUT, sent);
+            return index;
+        }
+
+        /**
+         * Waits until `deadline` for a datagram with transaction ID `id` on the socket returned by send.
+         */
+        std::optional<std::vector<uint8_t>> recv(size_t index, uint16_t id, retransmit::Clock::time_point deadline) {
+            while (true) {
+                if (std::optional<std::vector<uint8_t>> response = tryRecv(index, id)) {
+                    return response;
+                }
+                auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                        deadline - retransmit::Clock::now()).count();
+                pollfd pfd{sockets[index], POLLIN, 0};
+                int ready;
+                {
+                    statsPhase(PHASE_WAIT);
+                    ready = remaining > 0 ? poll(&pfd, 1, static_cast<int>(remaining)) : 0;
+                }
+                if (ready < 0 && errno != EINTR) {
+                    throw std::system_error(errno, std::generic_category(), "Failed to poll UDP socket");
+                }
+                if (ready == 0) {
+                    return std::nullopt;
+                }
+            }
+        }
+
+        /**
+         * Reads what is queued on the socket without waiting. Late answers to earlier queries
+         * on the same socket are dropped. A server port that is closed throws ECONNREFUSED.
+         */
+        std::optional<std::vector<uint8_t>> tryRecv(size_t index, uint16_t id) {
+            std::vector<uint8_t> response;
+            while (true) {
+                response.resize(bufferSize);
+                ssize_t received = ::recv(sockets[index], response.data(), response.size(), MSG_DONTWAIT);
+                if (received < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return std::nullopt;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "Failed to receive DNS response");
+                }
+                statsCount(COUNTER_BYTES_IN, received);
+                response.resize(received);
+                if (received >= 2 && ((response[0] << 8) | response[1]) == id) {
+                    return std::optional(std::move(response));
+                }
+                debugMsg("Dropping stale response with ID " << ((response[0] << 8) | response[1]) << std::endl);
+            }
+        }
+
+        // the socket returned by send, -1 before anything was sent from it
+        int descriptor(size_t index) const {
+            return sockets[index];
+        }
+
+        int family() const {
+            return address.ss_family;
+        }
+
+        retransmit::RttEstimator &getRtt() {
+            return rtt;
+        }
+
+    private:
+        // opens the socket on first use: bound to a random port, then connected to the server
+        int open(size_t index) {
+            if (sockets[index] >= 0) {
+                return sockets[index];
+            }
+            int fd;
+            {
+                statsPhase(PHASE_SOCKET);
+                fd = socket(address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+            }
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to create UDP socket");
+            }
+            bindRandomPort(fd);
+            if (connect(fd, reinterpret_cast<const sockaddr *>(&address), addressLength) < 0) {
+                int err = errno;
+                close(fd);
+                throw std::system_error(err, std::generic_category(), "Failed to connect UDP socket");
+            }
+            sockets[index] = fd;
+            return fd;
+        }
+
+        // best effort, connect picks an ephemeral port when every attempt is taken
+        void bindRandomPort(int fd) {
+            std::uniform_int_distribution<uint32_t> ports(ENDPOINT_MIN_PORT, UINT16_MAX);
+            for (size_t attempt = 0; attempt < ENDPOINT_BIND_ATTEMPTS; ++attempt) {
+                sockaddr_storage local{};
+                socklen_t length;
+                const uint16_t port = htons(static_cast<uint16_t>(ports(generator)));
+                if (address.ss_family == AF_INET6) {
+                    auto *ipv6 = reinterpret_cast<sockaddr_in6 *>(&local);
+                    ipv6->sin6_family = AF_INET6;
+                    ipv6->sin6_addr = in6addr_any;
+                    ipv6->sin6_port = port;
+                    length = sizeof(sockaddr_in6);
+                } else {
+                    auto *ipv4 = reinterpret_cast<sockaddr_in *>(&local);
+                    ipv4->sin_family = AF_INET;
+                    ipv4->sin_addr.s_addr = htonl(INADDR_ANY);
+                    ipv4->sin_port = port;
+                    length = sizeof(sockaddr_in);
+                }
+                if (bind(fd, reinterpret_cast<const sockaddr *>(&local), length) == 0) {
+                    return;
+                }
+            }
+        }
+
+        size_t bufferSize;
+        sockaddr_storage address{};
+        socklen_t addressLength = 0;
+        std::vector<int> sockets;
+        size_t next = 0;
+        std::mt19937 generator;
+        retransmit::RttEstimator rtt;
+    };
+
+    std::vector<uint8_t> sendQuery(ServerEndpoint &endpoint, const std::vector<uint8_t> &queryPacket, int timeoutSec) {
+        if (queryPacket.size() < 2) {
+            throw std::system_error(EINVAL, std::generic_category(), "DNS query too short");
+        }
+        const uint16_t id = (queryPacket[0] << 8) | queryPacket[1];
+        const auto deadline = retransmit::Clock::now() + std::chrono::seconds(timeoutSec);
+        const size_t index = endpoint.send(queryPacket);
+        auto sentAt = retransmit::Clock::now();
+        for (unsigned transmissions = 1;; ++transmissions) {
+            const bool last = transmissions > MAX_RETRANSMITS;
+            const auto wakeAt = last ? deadline : std::min(deadline, sentAt + endpoint.getRtt().backoff(transmissions));
+            if (std::optional<std::vector<uint8_t>> response = endpoint.recv(index, id, wakeAt)) {
+                // Karn's algorithm, only an unambiguous round trip is a sample
+                if (transmissions == 1) {
+                    endpoint.getRtt().sample(retransmit::Clock::now() - sentAt);
+                }
+                return std::move(*response);
+            }
+            if (last || retransmit::Clock::now() >= deadline) {
+                throw std::system_error(ETIMEDOUT, std::generic_category(), "Failed to receive DNS response or timed out");
+            }
+            debugMsg("Retransmitting query " << id << " after " << transmissions << " tries" << std::endl);
+            statsCount(COUNTER_RETRIES, 1);
+            endpoint.send(queryPacket, index);
+            sentAt = retransmit::Clock::now();
+        }
+    }
+
+    std::vector<uint8_t> sendQuery(const std::string &server, uint16_t port, const std::vector<uint8_t> &queryPacket, int timeoutSec,
+                                   size_t bufferSize = DNS_PACKET_SIZE) {
+        ServerEndpoint endpoint(server, port, 1, bufferSize);
+        return sendQuery(endpoint, queryPacket, timeoutSec);
     }
 }
@@ -0,0 +1,273 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <system_error>
+#include <poll.h>
+
+#include "retransmit.h"
+#include "tcp.h"
+#include "transport.h"
+#include "udp.h"
+#include "utils.h"
+
+
+// head start of the primary server before a raced query also goes to its partner, as in RFC 8305
+const auto RACE_DELAY_DEFAULT = std::chrono::milliseconds(50);
+const auto RACE_DELAY_MIN = std::chrono::milliseconds(10);
+const auto RACE_DELAY_MAX = std::chrono::milliseconds(250);
+// every n-th query goes to a random other server, so the estimates of the slower ones stay current
+const size_t UPSTREAM_EXPLORE_INTERVAL = 32;
+
+namespace upstream {
+    typedef retransmit::Clock Clock;
+
+    struct Candidate {
+        retransmit::RttEstimator *rtt;
+        // AF_INET or AF_INET6
+        int family;
+    };
+
+    /**
+     * Ranks servers by their smoothed RTT. Servers without a measurement are taken in turns first, so every
+     * one of them gets measured, and one that does not answer in time is penalized until it proves faster again.
+     */
+    class Selector {
+    public:
+        explicit Selector(std::vector<Candidate> candidates)
+                : candidates(std::move(candidates)), generator(std::random_device{}()) {}
+
+        // server for the next query
+        size_t pick() {
+            ++picks;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                const size_t index = (picks + i) % candidates.size();
+                if (!candidates[index].rtt->hasSample()) {
+                    return index;
+                }
+            }
+            const size_t primary = *best(std::nullopt);
+            if (candidates.size() > 1 && picks % UPSTREAM_EXPLORE_INTERVAL == 0) {
+                const size_t other = std::uniform_int_distribution<size_t>(0, candidates.size() - 2)(generator);
+                return other >= primary ? other + 1 : other;
+            }
+            return primary;
+        }
+
+        // server to race against `primary`: the best one of the other address family if there is one
+        std::optional<size_t> partner(size_t primary) const {
+            const int otherFamily = candidates[primary].family == AF_INET6 ? AF_INET : AF_INET6;
+            std::optional<size_t> partner = best(primary, otherFamily);
+            return partner ? partner : best(primary);
+        }
+
+        /**
+         * Next server to try after `current` did not answer in time or refused the query, `current` itself when it
+         * is the only one. Servers marked in `refused` are not tried again.
+         */
+        size_t fallback(size_t current, const std::vector<bool> &refused = {}) const {
+            return best(current, std::nullopt, refused).value_or(current);
+        }
+
+        // about twice the primary's RTT, so the partner is only asked when the primary is slower than usual
+        Clock::duration raceDelay(size_t primary) const {
+            const retransmit::RttEstimator &estimate = *candidates[primary].rtt;
+            if (!estimate.hasSample()) {
+                return RACE_DELAY_DEFAULT;
+            }
+            return std::clamp<Clock::duration>(estimate.getSrtt() * 2, RACE_DELAY_MIN, RACE_DELAY_MAX);
+        }
+
+        retransmit::RttEstimator &rtt(size_t index) {
+            return *candidates[index].rtt;
+        }
+
+        size_t size() const {
+            return candidates.size();
+        }
+
+    private:
+        static Clock::duration score(const Candidate &candidate) {
+            return candidate.rtt->hasSample() ? candidate.rtt->getSrtt() : Clock::duration::zero();
+        }
+
+        std::optional<size_t> best(std::optional<size_t> exclude, std::optional<int> family = std::nullopt,
+                                   const std::vector<bool> &skip = {}) const {
+            std::optional<size_t> found;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                if (i == exclude || (family && candidates[i].family != *family) || (i < skip.size() && skip[i])) {
+                    continue;
+                }
+                if (!found || score(candidates[i]) < score(candidates[*found])) {
+                    found = i;
+                }
+            }
+            return found;
+        }
+
+        std::vector<Candidate> candidates;
+        size_t picks = 0;
+        std::mt19937 generator;
+    };
+
+    /**
+     * One server of a batch run: its UDP transport, the TCP connection for truncated answers and its RTT estimate.
+     */
+    struct Upstream {
+        std::unique_ptr<transport::Transport> transport;
+        std::unique_ptr<tcp::Connection> connection;
+        retransmit::RttEstimator rtt;
+    };
+
+    // the upstreams must not move while the selector is in use
+    Selector makeSelector(std::vector<Upstream> &upstreams) {
+        std::vector<Candidate> candidates;
+        for (Upstream &upstream : upstreams) {
+            candidates.push_back({&upstream.rtt, upstream.transport->family()});
+        }
+        return Selector(std::move(candidates));
+    }
+
+    Selector makeSelector(std::vector<std::unique_ptr<udp::ServerEndpoint>> &endpoints) {
+        std::vector<Candidate> candidates;
+        for (std::unique_ptr<udp::ServerEndpoint> &endpoint : endpoints) {
+            candidates.push_back({&endpoint->getRtt(), endpoint->family()});
+        }
+        return Selector(std::move(candidates));
+    }
+
+    struct Answer {
+        std::vector<uint8_t> response;
+        // index of the endpoint that answered
+        size_t server;
+    };
+
+    /**
+     * Sends the query to the best ranked endpoint and, when it does not answer within its RTO, to the next
+     * best one. With `race` a copy also goes to the partner after the race delay. The first answer wins.
+     * A server whose port is closed (ICMP port unreachable) is penalized and the next one is asked at once,
+     * the query fails right away when every server refused it.
+     */
+    Answer sendQuery(std::vector<std::unique_ptr<udp::ServerEndpoint>> &endpoints, Selector &selector,
+                     const std::vector<uint8_t> &queryPacket, int timeoutSec, bool race) {
+        if (queryPacket.size() < 2) {
+            throw std::system_error(EINVAL, std::generic_category(), "DNS query too short");
+        }
+        struct Attempt {
+            size_t server;
+            size_t socket;
+            Clock::time_point sentAt;
+            unsigned transmissions;
+        };
+        const uint16_t id = (queryPacket[0] << 8) | queryPacket[1];
+        const Clock::time_point deadline = Clock::now() + std::chrono::seconds(timeoutSec);
+        std::vector<Attempt> attempts;
+        // returns the transmissions to `server` so far
+        auto transmit = [&](size_t server) {
+            for (Attempt &attempt : attempts) {
+                if (attempt.server == server) {
+                    endpoints[server]->send(queryPacket, attempt.socket);
+                    attempt.sentAt = Clock::now();
+                    return ++attempt.transmissions;
+                }
+            }
+            const size_t socket = endpoints[server]->send(queryPacket);
+            attempts.push_back({server, socket, Clock::now(), 1});
+            return 1u;
+        };
+
+        size_t current = selector.pick();
+        transmit(current);
+        // the primary itself when there is nothing to race against
+        const size_t partner = race ? selector.partner(current).value_or(current) : current;
+        Clock::time_point raceAt = partner != current ? attempts[0].sentAt + selector.raceDelay(current)
+                                                      : Clock::time_point::max();
+        Clock::time_point retransmitAt = attempts[0].sentAt + selector.rtt(current).backoff(1);
+        unsigned retransmissions = 0;
+        std::vector<bool> refused(endpoints.size());
+
+        while (true) {
+            for (const Attempt &attempt : attempts) {
+                if (refused[attempt.server]) {
+                    continue;
+                }
+                std::optional<std::vector<uint8_t>> response;
+                try {
+                    response = endpoints[attempt.server]->tryRecv(attempt.socket, id);
+                } catch (const std::system_error &err) {
+                    if (err.code() != std::errc::connection_refused) {
+                        throw;
+                    }
+                    debugMsg("Server " << attempt.server << " refused query " << id << std::endl);
+                    refused[attempt.server] = true;
+                    selector.rtt(attempt.server).penalize();
+                    if (std::all_of(refused.begin(), refused.end(), [](bool server) { return server; })) {
+                        throw;
+                    }
+                    continue;
+                }
+                if (response) {
+                    // Karn's algorithm, only an unambiguous round trip is a sample
+                    if (attempt.transmissions == 1) {
+                        selector.rtt(attempt.server).sample(Clock::now() - attempt.sentAt);
+                    }
+                    // a primary that lost the race takes at least this long
+                    if (&attempt != &attempts.front() && attempts.front().transmissions == 1) {
+                        selector.rtt(attempts.front().server).sample(Clock::now() - attempts.front().sentAt);
+                    }
+                    return {std::move(*response), attempt.server};
+                }
+            }
+            const Clock::time_point now = Clock::now();
+            if (refused[partner]) {
+                raceAt = Clock::time_point::max();
+            }
+            if (refused[current]) {
+                // no point waiting for the RTO of a server that said no
+                current = selector.fallback(current, refused);
+                if (!refused[current]) {
+                    debugMsg("Sending query " << id << " to server " << current << " instead" << std::endl);
+                    retransmitAt = now + selector.rtt(current).backoff(transmit(current));
+                    continue;
+                }
+            }
+            if (now >= deadline) {
+                throw std::system_error(ETIMEDOUT, std::generic_category(), "Failed to receive DNS response or timed out");
+            }
+            if (now >= raceAt) {
+                debugMsg("Racing query " << id << " against server " << partner << std::endl);
+                transmit(partner);
+                raceAt = Clock::time_point::max();
+                continue;
+            }
+            if (now >= retransmitAt) {
+                selector.rtt(current).penalize();
+                retransmitAt = Clock::time_point::max();
+                if (retransmissions++ < MAX_RETRANSMITS) {
+                    current = selector.fallback(current, refused);
+                    debugMsg("Retransmitting query " << id << " to server " << current << std::endl);
+                    statsCount(COUNTER_RETRIES, 1);
+                    retransmitAt = now + selector.rtt(current).backoff(transmit(current));
+                }
+                continue;
+            }
+
+            std::vector<pollfd> fds;
+            for (const Attempt &attempt : attempts) {
+                fds.push_back({endpoints[attempt.server]->descriptor(attempt.socket), POLLIN, 0});
+            }
+            const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                    std::min({raceAt, retransmitAt, deadline}) - now);
+            statsPhase(PHASE_WAIT);
+            if (poll(fds.data(), fds.size(), static_cast<int>(remaining.count())) < 0 && errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "Failed to poll UDP sockets");
+            }
+        }
+    }
+}
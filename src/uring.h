@@ -0,0 +1,417 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <span>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <cstdio>
+#include <system_error>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "udp.h"
+#include "utils.h"
+
+
+const unsigned URING_MIN_ENTRIES = 64;
+const unsigned URING_MAX_ENTRIES = 4096;
+const uint16_t URING_BUFFER_GROUP = 0;
+// user_data of the multishot receive, send completions carry their slot index
+const uint64_t URING_RECEIVE_TAG = UINT64_MAX;
+
+namespace uring {
+
+    int setup(unsigned entries, io_uring_params &params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    }
+
+    int enter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    int registerResource(int ringFd, unsigned opcode, void *arg, unsigned count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+    }
+
+    /**
+     * Provided buffer rings and multishot receive are both needed, they came with Linux 5.19 and 6.0.
+     */
+    bool kernelSupported() {
+        utsname name{};
+        unsigned major = 0;
+        if (uname(&name) < 0 || sscanf(name.release, "%u.", &major) != 1) {
+            return false;
+        }
+        return major >= 6;
+    }
+
+    /**
+     * Completion based transport on top of a raw io_uring instance. Queries are copied into a registered
+     * buffer and sent with IORING_OP_WRITE_FIXED, one io_uring_enter submits a whole batch. Responses
+     * arrive through a single multishot receive that picks buffers from a provided buffer ring, so the
+     * kernel needs no further submissions while responses keep coming. An eventfd registered with the ring
+     * lets the engine poll completions together with the TCP socket.
+     */
+    class UringTransport : public transport::Transport {
+    public:
+        UringTransport(const std::string &server, uint16_t port, size_t bufferSize, size_t window)
+                : socket(server, port, bufferSize), bufferSize(bufferSize) {
+            if (!kernelSupported()) {
+                throw std::system_error(ENOSYS, std::generic_category(), "io_uring multishot receive needs Linux 6.0 or newer");
+            }
+            socket.reserveReceiveBuffer(window * (bufferSize + DATAGRAM_OVERHEAD));
+            // io_uring waits for readiness itself, on a non-blocking socket it would complete with EAGAIN instead
+            const int fd = socket.descriptor();
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+            entries = std::clamp<unsigned>(std::bit_ceil(static_cast<unsigned>(std::min<size_t>(window, URING_MAX_ENTRIES))),
+                                           URING_MIN_ENTRIES, URING_MAX_ENTRIES);
+            try {
+                setupRing();
+                registerSendBuffers();
+                registerReceiveBuffers();
+                registerEventFd();
+                armReceive();
+                submit();
+            } catch (...) {
+                release();
+                throw;
+            }
+        }
+
+        UringTransport(const UringTransport &) = delete;
+        UringTransport &operator=(const UringTransport &) = delete;
+
+        ~UringTransport() override {
+            release();
+        }
+
+        size_t send(std::span<const std::span<const uint8_t>> packets) override {
+            size_t queued = 0;
+            for (std::span<const uint8_t> packet : packets) {
+                if (freeSendSlots.empty() || packet.size() > DNS_PACKET_SIZE) {
+                    break;
+                }
+                io_uring_sqe *sqe = nextSqe();
+                if (!sqe) {
+                    break;
+                }
+                const uint32_t slot = freeSendSlots.back();
+                freeSendSlots.pop_back();
+                uint8_t *buffer = sendBuffers.data() + slot * DNS_PACKET_SIZE;
+                std::memcpy(buffer, packet.data(), packet.size());
+                sqe->opcode = IORING_OP_WRITE_FIXED;
+                sqe->fd = socket.descriptor();
+                sqe->addr = reinterpret_cast<uint64_t>(buffer);
+                sqe->len = static_cast<uint32_t>(packet.size());
+                sqe->buf_index = 0;
+                sqe->user_data = slot;
+                queued++;
+            }
+            if (queued) {
+                submit();
+                debugMsg("io_uring submitted " << queued << " of " << packets.size() << " queries" << std::endl);
+                sendStats.record(queued);
+            }
+            return queued;
+        }
+
+        void receive(transport::ResponseHandler &handler) override {
+            uint64_t signalled;
+            if (read(eventFd, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN) {
+                throw std::system_error(errno, std::generic_category(), "Failed to read io_uring eventfd");
+            }
+            size_t responses = 0;
+            bool rearm = false;
+            std::atomic_ref<uint32_t> head(*cqHead), tail(*cqTail);
+            while (true) {
+                uint32_t current = head.load(std::memory_order_relaxed);
+                const uint32_t last = tail.load(std::memory_order_acquire);
+                if (current == last) {
+                    if (!overflowed()) {
+                        break;
+                    }
+                    // completions the CQ had no room for wait in the kernel until we ask for them
+                    enter(ringFd, 0, 0, IORING_ENTER_GETEVENTS);
+                    continue;
+                }
+                for (; current != last; ++current) {
+                    const io_uring_cqe &cqe = cqes[current & *cqMask];
+                    if (cqe.user_data != URING_RECEIVE_TAG) {
+                        completeSend(cqe);
+                        continue;
+                    }
+                    if (cqe.flags & IORING_CQE_F_BUFFER) {
+                        const uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                        if (cqe.res > 0) {
+                            handler.onResponse({receiveBuffers.data() + bid * bufferSize, static_cast<size_t>(cqe.res)});
+                            responses++;
+                        }
+                        recycle(bid);
+                    } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECONNREFUSED && cqe.res != -EINTR) {
+                        head.store(current + 1, std::memory_order_release);
+                        throw std::system_error(-cqe.res, std::generic_category(), "Failed to receive DNS responses");
+                    }
+                    // the kernel ends a multishot request on errors and when it runs out of buffers
+                    rearm |= !(cqe.flags & IORING_CQE_F_MORE);
+                }
+                head.store(current, std::memory_order_release);
+            }
+            std::atomic_ref<uint16_t>(bufferRing->tail).store(bufferTail, std::memory_order_release);
+            if (rearm) {
+                armReceive();
+                submit();
+            }
+            if (responses) {
+                debugMsg("io_uring completed " << responses << " responses" << std::endl);
+                receiveStats.record(responses);
+            }
+        }
+
+        int descriptor() const override {
+            return eventFd;
+        }
+
+        void waitWritable() override {
+            // send slots and submission entries come back with completions
+            while (enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                if (errno != EINTR) {
+                    throw std::system_error(errno, std::generic_category(), "Failed to wait for io_uring completions");
+                }
+            }
+        }
+
+        const char *name() const override {
+            return "io_uring";
+        }
+
+        int family() const override {
+            return socket.family();
+        }
+
+        const udp::SyscallStats &getSendStats() const override {
+            return sendStats;
+        }
+
+        const udp::SyscallStats &getReceiveStats() const override {
+            return receiveStats;
+        }
+
+    private:
+        void setupRing() {
+            io_uring_params params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            // every send and every received datagram posts a completion
+            params.cq_entries = entries * 4;
+            ringFd = setup(entries, params);
+            if (ringFd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to set up io_uring");
+            }
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+                throw std::system_error(ENOSYS, std::generic_category(), "io_uring is missing required features");
+            }
+            ringSize = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                                        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            if (ring == MAP_FAILED) {
+                ring = nullptr;
+                throw std::system_error(errno, std::generic_category(), "Failed to map io_uring");
+            }
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            void *sqesMapping = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                                     IORING_OFF_SQES);
+            if (sqesMapping == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "Failed to map io_uring submission entries");
+            }
+            sqes = static_cast<io_uring_sqe *>(sqesMapping);
+
+            uint8_t *base = static_cast<uint8_t *>(ring);
+            sqHead = reinterpret_cast<uint32_t *>(base + params.sq_off.head);
+            sqTail = reinterpret_cast<uint32_t *>(base + params.sq_off.tail);
+            sqMask = reinterpret_cast<uint32_t *>(base + params.sq_off.ring_mask);
+            sqFlags = reinterpret_cast<uint32_t *>(base + params.sq_off.flags);
+            cqHead = reinterpret_cast<uint32_t *>(base + params.cq_off.head);
+            cqTail = reinterpret_cast<uint32_t *>(base + params.cq_off.tail);
+            cqMask = reinterpret_cast<uint32_t *>(base + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+            sqEntries = params.sq_entries;
+            // entries are always used in ring order, the indirection array never changes
+            uint32_t *sqArray = reinterpret_cast<uint32_t *>(base + params.sq_off.array);
+            for (uint32_t i = 0; i < sqEntries; ++i) {
+                sqArray[i] = i;
+            }
+            sqLocalTail = *sqTail;
+            sqSubmitted = sqLocalTail;
+        }
+
+        void registerSendBuffers() {
+            sendBuffers.resize(entries * DNS_PACKET_SIZE);
+            iovec region{sendBuffers.data(), sendBuffers.size()};
+            if (registerResource(ringFd, IORING_REGISTER_BUFFERS, &region, 1) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to register io_uring send buffers");
+            }
+            freeSendSlots.resize(entries);
+            for (uint32_t slot = 0; slot < entries; ++slot) {
+                freeSendSlots[slot] = entries - 1 - slot;
+            }
+        }
+
+        void registerReceiveBuffers() {
+            receiveBuffers.resize(entries * bufferSize);
+            bufferRingSize = entries * sizeof(io_uring_buf);
+            void *mapping = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "Failed to allocate io_uring buffer ring");
+            }
+            bufferRing = static_cast<io_uring_buf_ring *>(mapping);
+            // the ring is a plain array of entries, g++ lays out io_uring_buf_ring::bufs 8 bytes too far
+            bufferEntries = static_cast<io_uring_buf *>(mapping);
+
+            io_uring_buf_reg registration{};
+            registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+            registration.ring_entries = entries;
+            registration.bgid = URING_BUFFER_GROUP;
+            if (registerResource(ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to register io_uring buffer ring");
+            }
+            for (uint16_t bid = 0; bid < entries; ++bid) {
+                recycle(bid);
+            }
+            std::atomic_ref<uint16_t>(bufferRing->tail).store(bufferTail, std::memory_order_release);
+        }
+
+        void registerEventFd() {
+            eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (eventFd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to create eventfd");
+            }
+            if (registerResource(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0) {
+                throw std::system_error(errno, std::generic_category(), "Failed to register io_uring eventfd");
+            }
+        }
+
+        void armReceive() {
+            io_uring_sqe *sqe = nextSqe();
+            if (!sqe) {
+                // all entries hold sends, submit them to make room
+                submit();
+                sqe = nextSqe();
+            }
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = socket.descriptor();
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUFFER_GROUP;
+            sqe->user_data = URING_RECEIVE_TAG;
+        }
+
+        // hands the buffer back to the kernel, published with the next tail store
+        void recycle(uint16_t bid) {
+            io_uring_buf &buffer = bufferEntries[bufferTail & (entries - 1)];
+            buffer.addr = reinterpret_cast<uint64_t>(receiveBuffers.data() + bid * bufferSize);
+            buffer.len = static_cast<uint32_t>(bufferSize);
+            buffer.bid = bid;
+            bufferTail++;
+        }
+
+        void completeSend(const io_uring_cqe &cqe) {
+            if (cqe.res < 0) {
+                // the query is not retried here, it times out like a lost datagram
+                debugMsg("io_uring send failed: " << std::strerror(-cqe.res) << std::endl);
+            }
+            freeSendSlots.push_back(static_cast<uint32_t>(cqe.user_data));
+        }
+
+        io_uring_sqe *nextSqe() {
+            const uint32_t head = std::atomic_ref<uint32_t>(*sqHead).load(std::memory_order_acquire);
+            if (sqLocalTail - head >= sqEntries) {
+                return nullptr;
+            }
+            io_uring_sqe *sqe = &sqes[sqLocalTail & *sqMask];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqLocalTail++;
+            return sqe;
+        }
+
+        void submit() {
+            std::atomic_ref<uint32_t>(*sqTail).store(sqLocalTail, std::memory_order_release);
+            while (sqSubmitted != sqLocalTail) {
+                int submitted = enter(ringFd, sqLocalTail - sqSubmitted, 0, 0);
+                if (submitted < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "Failed to submit to io_uring");
+                }
+                sqSubmitted += submitted;
+            }
+        }
+
+        bool overflowed() const {
+            return std::atomic_ref<uint32_t>(*sqFlags).load(std::memory_order_acquire) & IORING_SQ_CQ_OVERFLOW;
+        }
+
+        void release() {
+            // closing the ring cancels whatever is still pending
+            if (ringFd >= 0) {
+                close(ringFd);
+                ringFd = -1;
+            }
+            if (eventFd >= 0) {
+                close(eventFd);
+                eventFd = -1;
+            }
+            if (sqes) {
+                munmap(sqes, sqesSize);
+                sqes = nullptr;
+            }
+            if (ring) {
+                munmap(ring, ringSize);
+                ring = nullptr;
+            }
+            if (bufferRing) {
+                munmap(bufferRing, bufferRingSize);
+                bufferRing = nullptr;
+            }
+        }
+
+        udp::Socket socket;
+        size_t bufferSize;
+        unsigned entries = 0;
+        int ringFd = -1;
+        int eventFd = -1;
+
+        void *ring = nullptr;
+        size_t ringSize = 0;
+        io_uring_sqe *sqes = nullptr;
+        size_t sqesSize = 0;
+        uint32_t *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqFlags = nullptr;
+        uint32_t *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+        io_uring_cqe *cqes = nullptr;
+        uint32_t sqEntries = 0;
+        // prepared entries, and how many of them the kernel has taken
+        uint32_t sqLocalTail = 0;
+        uint32_t sqSubmitted = 0;
+
+        std::vector<uint8_t> sendBuffers;
+        std::vector<uint32_t> freeSendSlots;
+        std::vector<uint8_t> receiveBuffers;
+        io_uring_buf_ring *bufferRing = nullptr;
+        io_uring_buf *bufferEntries = nullptr;
+        size_t bufferRingSize = 0;
+        uint16_t bufferTail = 0;
+
+        udp::SyscallStats sendStats;
+        udp::SyscallStats receiveStats;
+    };
+}
@@ -3,16 +3,60 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <optional>
+#include <cstdint>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <csignal>
+#include <pthread.h>
+
+const uint16_t EDNS_MIN_PAYLOAD_SIZE = 512;
+// largest share of the TTL, in percent, watched answers may be refreshed ahead of their expiry
+const size_t REFRESH_MAX_AHEAD_PERCENT = 50;
+
+enum OUTPUT_FORMAT {
+    OUTPUT_FORMAT_TEXT,
+    OUTPUT_FORMAT_JSON,
+    OUTPUT_FORMAT_BINARY
+};
+
+enum STATS_FORMAT {
+    STATS_FORMAT_TEXT,
+    STATS_FORMAT_PROMETHEUS
+};
 
 typedef struct DNSConfiguration {
     bool recursionRequested;
     bool reverseQuery;
     bool queryTypeAAAA;
-    std::string server;
+    bool tcpOnly;
+    bool ioUring;
+    bool pinWorkers;
+    bool race;
+    bool iterative;
+    bool pcapSummary;
+    std::vector<std::string> servers;
     std::optional<uint16_t> port;
     std::string address;
+    std::optional<std::string> batchFile;
+    std::optional<std::string> sweepRange;
+    std::optional<std::string> pcapFile;
+    std::optional<size_t> window;
+    std::optional<size_t> workers;
+    std::optional<OUTPUT_FORMAT> outputFormat;
+    std::optional<uint16_t> ednsPayloadSize;
+    std::optional<std::string> cacheFile;
+    std::optional<std::string> loadFile;
+    std::optional<std::string> watchFile;
+    std::optional<size_t> refreshAheadPercent;
+    std::optional<std::string> listenAddress;
+    std::optional<uint16_t> listenPort;
+    std::optional<std::string> transferZone;
+    std::optional<uint32_t> transferSerial;
+    std::optional<size_t> qps;
+    std::optional<size_t> durationSec;
+    std::optional<STATS_FORMAT> statsFormat;
 } DNSConfiguration;
 
 
@@ -35,6 +79,58 @@ ADDR_TYPE getIpAddrType(const std::string &address) {
     return ADDR_TYPE_UNKNOWN;
 }
 
+// set by SIGINT and SIGTERM while a StopSignals is alive
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+/**
+ * Lets a long-running mode finish its turn and return on SIGINT or SIGTERM. The signals stay blocked
+ * except while waiting with ppoll(..., waitMask()), so a stop request cannot slip in between checking
+ * requested() and starting to wait.
+ */
+class StopSignals {
+public:
+    StopSignals() {
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &mask);
+        sigdelset(&mask, SIGINT);
+        sigdelset(&mask, SIGTERM);
+        struct sigaction action{};
+        action.sa_handler = requestStop;
+        sigaction(SIGINT, &action, &previousInterrupt);
+        sigaction(SIGTERM, &action, &previousTerminate);
+        stopRequested = 0;
+    }
+
+    StopSignals(const StopSignals &) = delete;
+    StopSignals &operator=(const StopSignals &) = delete;
+
+    ~StopSignals() {
+        sigaction(SIGINT, &previousInterrupt, nullptr);
+        sigaction(SIGTERM, &previousTerminate, nullptr);
+        pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+    }
+
+    bool requested() const {
+        return stopRequested;
+    }
+
+    const sigset_t &waitMask() const {
+        return mask;
+    }
+
+private:
+    sigset_t signals;
+    sigset_t mask;
+    struct sigaction previousInterrupt{};
+    struct sigaction previousTerminate{};
+};
+
 #ifdef DEBUG
 #define debugMsg(msg) do {std::cout << msg; } while(0)
 #else
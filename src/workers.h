@@ -0,0 +1,244 @@
+// Author: Aliaksandr Skuratovich (xskura01)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <system_error>
+#include <pthread.h>
+#include <sched.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "dns.h"
+#include "output.h"
+#include "tcp.h"
+#include "transport.h"
+#include "upstream.h"
+#include "utils.h"
+
+
+// questions a worker takes from the shared input at once
+const size_t WORK_CHUNK = 64;
+
+namespace workers {
+
+    /**
+     * Questions taken from the input but not sent yet by one worker. The owner pops from the front,
+     * idle workers steal half from the back.
+     */
+    class WorkQueue {
+    public:
+        std::optional<dns::Question> pop() {
+            std::lock_guard<std::mutex> guard(lock);
+            if (questions.empty()) {
+                return std::nullopt;
+            }
+            dns::Question question = std::move(questions.front());
+            questions.pop_front();
+            length.store(questions.size(), std::memory_order_relaxed);
+            return question;
+        }
+
+        void push(std::vector<dns::Question> &&batch) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (dns::Question &question : batch) {
+                questions.push_back(std::move(question));
+            }
+            length.store(questions.size(), std::memory_order_relaxed);
+        }
+
+        std::vector<dns::Question> stealHalf() {
+            std::lock_guard<std::mutex> guard(lock);
+            const size_t count = (questions.size() + 1) / 2;
+            std::vector<dns::Question> stolen(std::make_move_iterator(questions.end() - count),
+                                              std::make_move_iterator(questions.end()));
+            questions.erase(questions.end() - count, questions.end());
+            length.store(questions.size(), std::memory_order_relaxed);
+            return stolen;
+        }
+
+        // read without the lock, only a hint for picking a victim
+        size_t size() const {
+            return length.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::mutex lock;
+        std::deque<dns::Question> questions;
+        std::atomic<size_t> length = 0;
+    };
+
+    /**
+     * The input every worker reads from, handed out in chunks so the lock is taken rarely.
+     */
+    class SharedSource {
+    public:
+        explicit SharedSource(batch::QuerySource &source) : source(source) {}
+
+        std::vector<dns::Question> take(size_t count) {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<dns::Question> chunk;
+            dns::Question question;
+            while (!exhausted && chunk.size() < count) {
+                if (!source.next(question)) {
+                    exhausted = true;
+                    break;
+                }
+                chunk.push_back(question);
+            }
+            return chunk;
+        }
+
+    private:
+        std::mutex lock;
+        batch::QuerySource &source;
+        bool exhausted = false;
+    };
+
+    /**
+     * What one engine sees as its input: its own queue, refilled from the shared input and,
+     * once that runs dry, from the longest queue of the other workers.
+     */
+    class WorkerSource : public batch::QuerySource {
+    public:
+        WorkerSource(size_t index, SharedSource &shared, std::vector<WorkQueue> &queues)
+                : index(index), shared(shared), queues(queues) {}
+
+        bool next(dns::Question &question) override {
+            if (std::optional<dns::Question> queued = queues[index].pop()) {
+                question = std::move(*queued);
+                return true;
+            }
+            std::vector<dns::Question> chunk = shared.take(WORK_CHUNK);
+            if (chunk.empty()) {
+                chunk = steal();
+                stolen += chunk.size();
+            }
+            if (chunk.empty()) {
+                return false;
+            }
+            question = std::move(chunk.front());
+            chunk.erase(chunk.begin());
+            queues[index].push(std::move(chunk));
+            return true;
+        }
+
+        size_t getStolen() const {
+            return stolen;
+        }
+
+    private:
+        std::vector<dns::Question> steal() {
+            while (true) {
+                WorkQueue *victim = nullptr;
+                for (size_t i = 0; i < queues.size(); ++i) {
+                    if (i != index && queues[i].size() > 0 && (!victim || queues[i].size() > victim->size())) {
+                        victim = &queues[i];
+                    }
+                }
+                if (!victim) {
+                    return {};
+                }
+                std::vector<dns::Question> chunk = victim->stealHalf();
+                if (!chunk.empty()) {
+                    return chunk;
+                }
+                // the owner emptied it in the meantime, look again
+            }
+        }
+
+        size_t index;
+        SharedSource &shared;
+        std::vector<WorkQueue> &queues;
+        size_t stolen = 0;
+    };
+
+    struct Options {
+        size_t count;
+        // pin worker i to the i-th CPU the process may run on
+        bool pin;
+        OUTPUT_FORMAT format;
+    };
+
+    struct WorkerResult {
+        batch::Summary summary{};
+        size_t stolen = 0;
+        std::optional<std::string> error;
+    };
+
+    struct Result {
+        batch::Summary total{};
+        std::vector<WorkerResult> workers;
+    };
+
+    void pinToCpu(size_t index) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0) {
+            return;
+        }
+        size_t position = index % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed) && position-- == 0) {
+                cpu_set_t target;
+                CPU_ZERO(&target);
+                CPU_SET(cpu, &target);
+                pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+                debugMsg("Worker " << index << " pinned to CPU " << cpu << std::endl);
+                return;
+            }
+        }
+    }
+
+    typedef std::function<std::vector<upstream::Upstream>()> UpstreamFactory;
+
+    /**
+     * Shards the input across `options.count` threads. Every worker runs its own batch engine with its
+     * own upstreams (UDP transports, TCP connections and RTT estimates), ID space and output buffer,
+     * only the input, the cache and the output file descriptor are shared.
+     */
+    Result run(batch::QuerySource &source, const Options &options, const batch::Settings &settings,
+               cache::Cache *cache, const UpstreamFactory &makeUpstreams) {
+        SharedSource shared(source);
+        std::vector<WorkQueue> queues(options.count);
+        output::Output output(STDOUT_FILENO);
+        Result result;
+        result.workers.resize(options.count);
+
+        std::vector<std::thread> threads;
+        threads.reserve(options.count);
+        for (size_t index = 0; index < options.count; ++index) {
+            threads.emplace_back([&, index]() {
+                WorkerResult &worker = result.workers[index];
+                if (options.pin) {
+                    pinToCpu(index);
+                }
+                WorkerSource workerSource(index, shared, queues);
+                try {
+                    std::vector<upstream::Upstream> upstreams = makeUpstreams();
+                    std::unique_ptr<output::Sink> sink = output::makeSink(options.format, output);
+                    worker.summary = batch::run(workerSource, upstreams, cache, settings, *sink);
+                } catch (const std::system_error &err) {
+                    worker.error = err.what();
+                }
+                worker.stolen = workerSource.getStolen();
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        for (const WorkerResult &worker : result.workers) {
+            result.total.merge(worker.summary);
+        }
+        return result;
+    }
+}
@@ -2,7 +2,15 @@
 
 import unittest
 import subprocess
+import shlex
 import socket
+import struct
+import threading
+import dns.flags
+import dns.message
+import dns.rcode
+import dns.rdatatype
+import dns.rrset
 from dns import resolver
 from typing import List
 from datetime import datetime
@@ -34,6 +42,7 @@ def get_ipv4_servers() -> List:
 
 
 PROGRAM_NAME = './dns'
+EXAMPLE_NAME = './dnsclient_example'
 
 V4_SITES = [
     'https://ipv4.tlund.se',
@@ -87,6 +96,397 @@ REV_V4_QUERIES = get_reverse_queries(V4_IPS, get_ipv4_servers())
 NON_REV_V6_QUERIES = get_non_rev_queres(V6_SITES, get_ipv6_servers(), True)
 REV_V6_QUERIES = get_reverse_queries(V6_IPS, get_ipv6_servers(), True)
 
+# stand-in authoritative servers for iterative mode, each listens on its own loopback address and the same port
+STAND_IN_PORT = 10053
+STAND_IN_ZONES = {
+    # root: delegates test. with glue
+    '127.0.0.1': {
+        'referrals': {'test.': (['ns.test.'], {'ns.test.': '127.0.0.2'})},
+        'records': {},
+    },
+    # test.: delegates example.test. with glue and glueless.test. without
+    '127.0.0.2': {
+        'referrals': {
+            'example.test.': (['ns1.example.test.'], {'ns1.example.test.': '127.0.0.3'}),
+            'glueless.test.': (['ns1.example.test.'], {}),
+        },
+        'records': {},
+    },
+    '127.0.0.3': {
+        'referrals': {},
+        'records': {
+            'example.test.': {},
+            'ns1.example.test.': {'A': '127.0.0.3'},
+            'www.example.test.': {'A': '192.0.2.1', 'AAAA': '2001:db8::1'},
+            'mail.example.test.': {'A': '192.0.2.2'},
+            'large.example.test.': {'A': '192.0.2.4'},
+            'glueless.test.': {},
+            'www.glueless.test.': {'A': '192.0.2.3'},
+            'records.example.test.': {
+                'SRV': '10 5 5060 sip.example.test.',
+                'NAPTR': '100 10 "U" "E2U+sip" "!^.*$!sip:info@example.test!" .',
+                'CAA': '0 issue "letsencrypt.org"',
+                'DS': '60485 13 2 d4b7d520e7bb5f0f67674a0cceb1e3e0614b93c4f9e99b8383f6a1e4469da50a',
+                'DNSKEY': '257 3 13 mdsswUyr3DPW132mOi8V9xESWE8jTo0dxCjjnopKl+GqJxpVXckHAeF+KkxLbxILfDLUT0rAK9iUzy1L53eKGQ==',
+                'HTTPS': '1 . alpn="h3,h2" port=443 ipv4hint=192.0.2.1 ipv6hint=2001:db8::1',
+                'TYPE65280': '\\# 4 01020304',
+            },
+        },
+    },
+}
+
+
+def answer_stand_in(zones: dict, query: dns.message.Message) -> dns.message.Message:
+    response = dns.message.make_response(query)
+    question = query.question[0]
+    name = question.name.to_text().lower()
+    for child, (servers, glue) in zones['referrals'].items():
+        if name == child or name.endswith('.' + child):
+            response.authority.append(dns.rrset.from_text_list(child, 3600, 'IN', 'NS', servers))
+            for server, address in glue.items():
+                response.additional.append(dns.rrset.from_text(server, 3600, 'IN', 'A', address))
+            return response
+    response.flags |= dns.flags.AA
+    records = zones['records']
+    if name not in records:
+        response.set_rcode(dns.rcode.NXDOMAIN)
+    elif dns.rdatatype.to_text(question.rdtype) in records[name]:
+        rdtype = dns.rdatatype.to_text(question.rdtype)
+        response.answer.append(dns.rrset.from_text(name, 300, 'IN', rdtype, records[name][rdtype]))
+    return response
+
+
+# answered over UDP with TC set and no records, the whole answer only comes over TCP
+STAND_IN_TRUNCATED = 'large.example.test.'
+
+
+def serve_stand_in(address: str, zones: dict):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((address, STAND_IN_PORT))
+    while True:
+        packet, client = sock.recvfrom(4096)
+        response = answer_stand_in(zones, dns.message.from_wire(packet))
+        if response.question[0].name.to_text().lower() == STAND_IN_TRUNCATED:
+            response.flags |= dns.flags.TC
+            response.answer = []
+        sock.sendto(response.to_wire(), client)
+
+
+# served over TCP by 127.0.0.3 next to its zones, the whole zone goes out in many messages
+TRANSFER_ZONE = 'transfer.test.'
+TRANSFER_SERIAL = 2026101600
+TRANSFER_HOSTS = 5000
+TRANSFER_MESSAGE_RECORDS = 100
+
+
+def transfer_soa(serial: int) -> dns.rrset.RRset:
+    return dns.rrset.from_text(TRANSFER_ZONE, 3600, 'IN', 'SOA',
+                               f'ns1.{TRANSFER_ZONE} hostmaster.{TRANSFER_ZONE} {serial} 7200 900 1209600 300')
+
+
+TRANSFER_RECORDS = ([transfer_soa(TRANSFER_SERIAL)] +
+                    [dns.rrset.from_text(f'host{i}.{TRANSFER_ZONE}', 300, 'IN', 'A', f'10.0.{i // 256}.{i % 256}')
+                     for i in range(TRANSFER_HOSTS)] +
+                    [transfer_soa(TRANSFER_SERIAL)])
+
+
+def answer_transfer(query: dns.message.Message) -> List[bytes]:
+    """AXFR of the whole zone, IXFR with a single difference or just the SOA when the client is up to date."""
+    question = query.question[0]
+    if question.name.to_text().lower() != TRANSFER_ZONE:
+        response = dns.message.make_response(query)
+        response.set_rcode(dns.rcode.REFUSED)
+        return [response.to_wire()]
+    records = TRANSFER_RECORDS
+    if question.rdtype == dns.rdatatype.IXFR:
+        client_serial = query.authority[0][0].serial
+        soa = transfer_soa(TRANSFER_SERIAL)
+        records = [soa] if client_serial >= TRANSFER_SERIAL else [
+            soa, transfer_soa(client_serial), dns.rrset.from_text(f'old.{TRANSFER_ZONE}', 300, 'IN', 'A', '10.1.0.1'),
+            soa, dns.rrset.from_text(f'new.{TRANSFER_ZONE}', 300, 'IN', 'A', '10.1.0.2'), soa,
+        ]
+    messages = []
+    for start in range(0, len(records), TRANSFER_MESSAGE_RECORDS):
+        response = dns.message.make_response(query)
+        response.flags |= dns.flags.AA
+        # only the first message repeats the question
+        if start:
+            response.question = []
+        response.authority = []
+        response.answer = records[start:start + TRANSFER_MESSAGE_RECORDS]
+        messages.append(response.to_wire())
+    return messages
+
+
+def serve_stand_in_tcp(address: str, zones: dict):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind((address, STAND_IN_PORT))
+    sock.listen()
+    while True:
+        connection, _ = sock.accept()
+        with connection, connection.makefile('rb') as stream:
+            while len(prefix := stream.read(2)) == 2:
+                query = dns.message.from_wire(stream.read(struct.unpack('!H', prefix)[0]))
+                if query.question[0].rdtype in (dns.rdatatype.AXFR, dns.rdatatype.IXFR):
+                    messages = answer_transfer(query)
+                else:
+                    messages = [answer_stand_in(zones, query).to_wire()]
+                connection.sendall(b''.join(struct.pack('!H', len(message)) + message for message in messages))
+
+
+def start_stand_in_servers():
+    for address, zones in STAND_IN_ZONES.items():
+        threading.Thread(target=serve_stand_in, args=(address, zones), daemon=True).start()
+    threading.Thread(target=serve_stand_in_tcp, args=('127.0.0.3', STAND_IN_ZONES['127.0.0.3']), daemon=True).start()
+
+
+ITERATIVE_QUERIES = [
+    (f'{PROGRAM_NAME} -i -s 127.0.0.1 -p {STAND_IN_PORT} www.example.test', 'Iterative query with glue', 0),
+    (f'{PROGRAM_NAME} -i -6 -s 127.0.0.1 -p {STAND_IN_PORT} www.example.test', 'Iterative AAAA query', 0),
+    (f'{PROGRAM_NAME} -i -s 127.0.0.1 -p {STAND_IN_PORT} www.glueless.test', 'Iterative query without glue', 0),
+    (f'{PROGRAM_NAME} -i -s 127.0.0.1 -p {STAND_IN_PORT} missing.example.test', 'Iterative NXDOMAIN', 0),
+    (
+        f'printf "www.example.test\\nmail.example.test\\nwww.glueless.test\\n" | '
+        f'{PROGRAM_NAME} -i -s 127.0.0.1 -p {STAND_IN_PORT} -b -',
+        'Iterative batch sharing delegations',
+        0
+    ),
+]
+
+# the UDP answer for large.example.test is truncated, the record only arrives over TCP
+TRUNCATED_QUERIES = [
+    (
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} large.example.test | grep "large.example.test, A, IN, 300, 192.0.2.4"',
+        'Truncated answer retried over TCP',
+        0
+    ),
+    (
+        f'output=$(printf "large.example.test\\nwww.example.test\\n" | '
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} -b - 2>&1) && '
+        f'echo "$output" | grep "large.example.test, A, IN, 300, 192.0.2.4" && '
+        f'echo "$output" | grep "Retried over TCP: 1,"',
+        'Truncated batch answer retried over TCP',
+        0
+    ),
+    # nothing listens for TCP on 127.0.0.1, only the truncated query fails and the rest are answered
+    (
+        f'output=$(printf "www.example.test\\nlarge.example.test\\nmail.example.test\\n" | '
+        f'{PROGRAM_NAME} -s 127.0.0.1 -p {STAND_IN_PORT} -b - 2>&1) && '
+        f'echo "$output" | grep "large.example.test A: .*Connection refused" && '
+        f'echo "$output" | grep "Answered: 2, Timed out: 1,"',
+        'Truncated batch answer without a TCP server',
+        0
+    ),
+]
+
+# nothing listens on 127.0.0.9, its ICMP port unreachable must not wait for a timeout; of two servers
+# without an RTT sample the second one is asked first
+REFUSED_QUERIES = [
+    (f'{PROGRAM_NAME} -s 127.0.0.9 -p {STAND_IN_PORT} www.example.test 2>&1 | grep "Connection refused"',
+     'Refused port fails at once', 0),
+    (
+        f'timeout 0.5 {PROGRAM_NAME} -s 127.0.0.3,127.0.0.9 -p {STAND_IN_PORT} www.example.test | '
+        f'grep "www.example.test, A, IN, 300, 192.0.2.1"',
+        'Refused server skipped at once',
+        0
+    ),
+]
+
+# the stand-in root answers every in-addr.arpa and ip6.arpa name with NXDOMAIN
+SWEEP_QUERIES = [
+    (f'{PROGRAM_NAME} -s 127.0.0.1 -p {STAND_IN_PORT} --sweep 192.0.2.0/24', 'Sweep over an IPv4 /24', 0),
+    (f'{PROGRAM_NAME} -s 127.0.0.1 -p {STAND_IN_PORT} --sweep 2001:db8::/120 -j 2', 'Sweep over an IPv6 /120', 0),
+    (f'{PROGRAM_NAME} -i -s 127.0.0.1 -p {STAND_IN_PORT} --sweep 192.0.2.0/30', 'Iterative sweep', 0),
+]
+
+PCAP_FILE = 'test_capture.pcap'
+PCAPNG_FILE = 'test_capture.pcapng'
+
+
+def udp_frame(payload: bytes, source_port: int, destination_port: int) -> bytes:
+    udp = struct.pack('!HHHH', source_port, destination_port, 8 + len(payload), 0) + payload
+    ip = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(udp), 1, 0, 64, 17, 0,
+                     socket.inet_aton('192.0.2.1'), socket.inet_aton('192.0.2.53'))
+    return b'\x00' * 12 + b'\x08\x00' + ip + udp
+
+
+def tcp_frame(payload: bytes, source_port: int, destination_port: int) -> bytes:
+    tcp = struct.pack('!HHIIBBHHH', source_port, destination_port, 0, 0, 5 << 4, 0x18, 1024, 0, 0) + payload
+    ip = struct.pack('!IHBB16s16s', 6 << 28, len(tcp), 6, 64,
+                     socket.inet_pton(socket.AF_INET6, '2001:db8::1'), socket.inet_pton(socket.AF_INET6, '2001:db8::53'))
+    return b'\x00' * 12 + b'\x86\xdd' + ip + tcp
+
+
+def pcapng_block(block_type: int, body: bytes) -> bytes:
+    body += b'\x00' * (-len(body) % 4)
+    return struct.pack('<II', block_type, len(body) + 12) + body + struct.pack('<I', len(body) + 12)
+
+
+def write_captures():
+    """A query and its answer over UDP, an NXDOMAIN exchange in one TCP segment and a malformed message."""
+    query = dns.message.make_query('www.example.test', 'A')
+    response = answer_stand_in(STAND_IN_ZONES['127.0.0.3'], query)
+    missing = dns.message.make_query('missing.example.test', 'AAAA')
+    stream = b''.join(struct.pack('!H', len(message)) + message
+                      for message in (missing.to_wire(), answer_stand_in(STAND_IN_ZONES['127.0.0.3'], missing).to_wire()))
+    frames = [udp_frame(query.to_wire(), 40000, 53), udp_frame(response.to_wire(), 53, 40000),
+              tcp_frame(stream, 40001, 53), udp_frame(b'\x00\x01\x02', 40002, 53)]
+    with open(PCAP_FILE, 'wb') as file:
+        file.write(struct.pack('<IHHiIII', 0xA1B2C3D4, 2, 4, 0, 0, 65535, 1))
+        for frame in frames:
+            file.write(struct.pack('<IIII', 0, 0, len(frame), len(frame)) + frame)
+    with open(PCAPNG_FILE, 'wb') as file:
+        file.write(pcapng_block(0x0A0D0D0A, struct.pack('<IHHq', 0x1A2B3C4D, 1, 0, -1)))
+        file.write(pcapng_block(1, struct.pack('<HHI', 1, 0, 65535)))
+        for frame in frames:
+            file.write(pcapng_block(6, struct.pack('<IIIII', 0, 0, 0, len(frame), len(frame)) + frame))
+
+
+PCAP_QUERIES = [
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE}', 'Messages of a pcap file', 0),
+    (f'{PROGRAM_NAME} --pcap {PCAPNG_FILE} -f json', 'Messages of a pcapng file', 0),
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE} --summary', 'Summary of a pcap file', 0),
+    (f'{PROGRAM_NAME} --pcap {PCAPNG_FILE} --summary -j 4', 'Summary of a pcapng file on threads', 0),
+    (f'{PROGRAM_NAME} --pcap /nonexistent/capture.pcap', 'Missing capture file', -1),
+    (f'{PROGRAM_NAME} --pcap {PROGRAM_NAME}', 'Not a capture file', -1),
+    (f'{PROGRAM_NAME} --summary -s 1.1.1.1 www.fit.vut.cz', 'Summary without capture file', -1),
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE} -s 1.1.1.1', 'Server with capture file', -1),
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE} --axfr transfer.test', 'Zone transfer with capture file', -1),
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE} --qps 100', 'QPS with capture file', -1),
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE} --duration 1', 'Duration with capture file', -1),
+    (f'{PROGRAM_NAME} --pcap {PCAP_FILE} --refresh-ahead 50', 'Refresh ahead with capture file', -1),
+]
+
+RECORD_TYPES = 'SRV NAPTR CAA DS DNSKEY HTTPS TYPE65280'
+DS_DIGEST = 'd4b7d520e7bb5f0f67674a0cceb1e3e0614b93c4f9e99b8383f6a1e4469da50a'
+DNSKEY_KEY = 'mdsswUyr3DPW132mOi8V9xESWE8jTo0dxCjjnopKl+GqJxpVXckHAeF+KkxLbxILfDLUT0rAK9iUzy1L53eKGQ=='
+# rendered rdata of every type of RECORD_TYPES, in order
+RECORD_TYPE_RDATA = {
+    'text': [
+        'Priority: 10, Weight: 5, Port: 5060, Target: sip.example.test',
+        'Order: 100, Preference: 10, Flags: U, Services: E2U+sip, Regexp: !^.*$!sip:info@example.test!, Replacement: ',
+        'Flags: 0, Tag: issue, Value: letsencrypt.org',
+        f'Key Tag: 60485, Algorithm: 13, Digest Type: 2, Digest: {DS_DIGEST}',
+        f'Flags: 257, Protocol: 3, Algorithm: 13, Public Key: {DNSKEY_KEY}',
+        'Priority: 1, Target: , Params: alpn=h3,h2 port=443 ipv4hint=192.0.2.1 ipv6hint=2001:db8::1',
+        '300, \\# 4 01020304',
+    ],
+    'json': [
+        '"data":{"priority":10,"weight":5,"port":5060,"target":"sip.example.test"}',
+        '"data":{"order":100,"preference":10,"flags":"U","services":"E2U+sip",'
+        '"regexp":"!^.*$!sip:info@example.test!","replacement":""}',
+        '"data":{"flags":0,"tag":"issue","value":"letsencrypt.org"}',
+        f'"data":{{"keyTag":60485,"algorithm":13,"digestType":2,"digest":"{DS_DIGEST}"}}',
+        f'"data":{{"flags":257,"protocol":3,"algorithm":13,"publicKey":"{DNSKEY_KEY}"}}',
+        '"data":{"priority":1,"target":"","params":{"alpn":"h3,h2","port":"443","ipv4hint":"192.0.2.1",'
+        '"ipv6hint":"2001:db8::1"}}',
+        '"type":65280,"class":1,"ttl":300,"data":"01020304"',
+    ],
+}
+
+# batch mode exits 0 whatever the answers are, every rendered rdata has to be on its own line of the output
+RECORD_TYPE_QUERIES = [
+    (
+        f'for type in {RECORD_TYPES}; do echo records.example.test $type; done | '
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} -b - -f {output_format} | '
+        f'grep -cF {" ".join("-e " + shlex.quote(rdata) for rdata in rdata_list)} | grep -x {len(rdata_list)}',
+        f'Record types in {output_format} output',
+        0
+    )
+    for output_format, rdata_list in RECORD_TYPE_RDATA.items()
+]
+
+WATCH_CACHE = 'test_watch.cache'
+
+# the second command asks a server that does not exist, it only succeeds from the cache the first one kept warm;
+# the invalid line of the watch list is skipped
+WATCH_QUERIES = [
+    (
+        f'rm -f {WATCH_CACHE} && printf "www.example.test\\nfoo..bar.test\\nwww.example.test AAAA\\n" | '
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} -c {WATCH_CACHE} --watch - --duration 1 && '
+        f'{PROGRAM_NAME} -6 -s 127.0.0.9 -c {WATCH_CACHE} www.example.test',
+        'Watched answers served from the cache',
+        0
+    ),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --watch -', 'Watch mode without a cache', -1),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 -c {WATCH_CACHE} --watch - --refresh-ahead 60', 'Refresh ahead out of range', -1),
+]
+
+# an invalid name is skipped with the number of its line, the names around it are still answered
+INVALID_LINE_QUERIES = [
+    (
+        f'output=$(printf "www.example.test\\nfoo..bar.test\\nmail.example.test\\n" | '
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} -b - 2>&1) && '
+        f'echo "$output" | grep "line 2: .*empty label.*skipped" && '
+        f'echo "$output" | grep "Answered: 2,"',
+        'Invalid name in batch mode',
+        0
+    ),
+    (
+        f'rm -f {WATCH_CACHE} && output=$(printf "www.example.test\\nfoo..bar.test\\nmail.example.test\\n" | '
+        f'{PROGRAM_NAME} -i -s 127.0.0.1 -p {STAND_IN_PORT} -c {WATCH_CACHE} -b - 2>&1) && '
+        f'echo "$output" | grep "line 2: .*empty label.*skipped" && '
+        f'echo "$output" | grep "mail.example.test, A, IN, 300, 192.0.2.2"',
+        'Invalid name in iterative batch mode with a cache',
+        0
+    ),
+]
+
+FORWARD_PORT = 10054
+
+# the forwarder runs in the background for a second, the queries of the batch all ask for the same name
+LISTEN_QUERIES = [
+    (
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --listen 127.0.0.1:{FORWARD_PORT} --duration 1 2>&1 >/dev/null '
+        f'| grep -q "Forwarded: 1," & sleep 0.2; '
+        f'for i in $(seq 100); do echo www.example.test; done | {PROGRAM_NAME} -s 127.0.0.1 -p {FORWARD_PORT} -b - && '
+        f'{PROGRAM_NAME} -t -s 127.0.0.1 -p {FORWARD_PORT} www.example.test; status=$?; wait $!; '
+        f'forwarded=$?; exit $((status || forwarded))',
+        'Forwarder over UDP and TCP',
+        0
+    ),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 --listen 70000', 'Forwarder port out of range', -1),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 --listen {FORWARD_PORT} -c {WATCH_CACHE}', 'Forwarder with a cache file', -1),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 --listen {FORWARD_PORT} --watch -', 'Forwarder with a watch file', -1),
+]
+
+# the summary on stderr tells whether the end of the transfer was found where the stand-in put it
+TRANSFER_QUERIES = [
+    (
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --axfr {TRANSFER_ZONE} 2>&1 >/dev/null | '
+        f'grep "Transfer: AXFR, Serial: {TRANSFER_SERIAL}, Messages: 51, Records: {TRANSFER_HOSTS + 2},"',
+        'AXFR over many messages',
+        0
+    ),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --axfr {TRANSFER_ZONE} -f json', 'AXFR in json output', 0),
+    (
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --ixfr {TRANSFER_ZONE}:{TRANSFER_SERIAL - 100} 2>&1 | '
+        f'grep "Transfer: IXFR, Serial: {TRANSFER_SERIAL}, Messages: 1, Records: 6,"',
+        'IXFR with a difference',
+        0
+    ),
+    (
+        f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --ixfr {TRANSFER_ZONE}:{TRANSFER_SERIAL} 2>&1 | '
+        f'grep "Transfer: IXFR, up to date"',
+        'IXFR from the current serial',
+        0
+    ),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 -p {STAND_IN_PORT} --axfr example.test', 'Refused zone transfer', -1),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 --ixfr {TRANSFER_ZONE}', 'IXFR without a serial', -1),
+    (f'{PROGRAM_NAME} -s 127.0.0.3 --ixfr {TRANSFER_ZONE}:4294967296', 'IXFR serial out of range', -1),
+    (f'{PROGRAM_NAME} -r -s 127.0.0.3 --axfr {TRANSFER_ZONE}', 'Zone transfer with recursion', -1),
+]
+
+LIBRARY_QUERIES = [
+    (
+        f'{EXAMPLE_NAME} 127.0.0.3 {STAND_IN_PORT} www.example.test mail.example.test nothere.example.test',
+        'Library resolver against the stand-in',
+        0
+    ),
+    (f'{EXAMPLE_NAME} 127.0.0.3 {STAND_IN_PORT}', 'Library example without names', -1),
+]
+
 INVALID_ARGUMENTS = [
     (f'{PROGRAM_NAME}', 'No arguments', -1),
     (f'{PROGRAM_NAME} invalid', 'Invalid arguments', -1),
@@ -97,12 +497,38 @@ INVALID_ARGUMENTS = [
     (f'{PROGRAM_NAME} -s 1.1.1.1 -r www.fit.vut.cz invalid', 'Invalid argument after all arguments', -1),
     (f'{PROGRAM_NAME} -s 1.1.1.1 -r www.fit.vut.cz -p "-9000"', 'Invalid port', -1),
     (f'{PROGRAM_NAME} -s 1.1.1.1 -r www.fit.vut.cz -p abubus', 'Invalid port', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -b - www.fit.vut.cz', 'Address in batch mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -b - -w 0', 'Invalid window', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -w 10 www.fit.vut.cz', 'Window without batch mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -u www.fit.vut.cz', 'io_uring without batch mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -b - -j 0', 'Invalid workers', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -b - -a', 'Pinning without workers', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -b /nonexistent/names.txt', 'Missing batch file', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --load - -b -', 'Load and batch mode together', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --qps 100 www.fit.vut.cz', 'QPS without load mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --load - --qps 0', 'Invalid QPS', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --load - -c cache.db', 'Cache in load mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -f xml www.fit.vut.cz', 'Invalid output format', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --stats xml www.fit.vut.cz', 'Invalid statistics format', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1,,8.8.8.8 www.fit.vut.cz', 'Empty server in list', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --race www.fit.vut.cz', 'Race with a single server', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1,8.8.8.8 --load -', 'Several servers in load mode', -1),
+    (f'{PROGRAM_NAME} -i -r www.fit.vut.cz', 'Iterative with recursion', -1),
+    (f'{PROGRAM_NAME} -i -b - -j 2', 'Iterative with workers', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --sweep 192.0.2.0/24 www.fit.vut.cz', 'Address in sweep mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --sweep 192.0.2.0/24 -b -', 'Sweep and batch mode together', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --sweep 192.0.2.0/24 -x', 'Reversed query in sweep mode', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --sweep 192.0.2.0', 'Sweep range without prefix length', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 --sweep 192.0.2.0/33', 'Sweep prefix length too long', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -e 100 www.fit.vut.cz', 'EDNS0 payload size too small', -1),
+    (f'{PROGRAM_NAME} -s 1.1.1.1 -e 70000 www.fit.vut.cz', 'EDNS0 payload size too large', -1),
 ]
 
 INVALID_ADDRESSES = [
     (f'{PROGRAM_NAME} -s 999.999.999.999 www.fit.vut.cz', 'Invalid server', -1),
     (f'{PROGRAM_NAME} -s 8.8.8.8.8.8 www.fit.vut.cz', 'Invalid server', -1),
     (f'{PROGRAM_NAME} -s 8.8.8.8.8 "aaaaaa---aa---aaaaaa" ', 'Invalid address', -1),
+    (f'{PROGRAM_NAME} -s 8.8.8.8 -c /nonexistent/cache.db www.fit.vut.cz', 'Invalid cache file', -1),
 ]
 
 TEST_FILENAME = f'test_log_{datetime.now().strftime("%Y-%m-%d_%H-%M-%S")}.log'
@@ -175,11 +601,25 @@ if __name__ == '__main__':
             INVALID_ARGUMENTS +
             INVALID_ADDRESSES +
 
+            TRUNCATED_QUERIES +
+            REFUSED_QUERIES +
+            ITERATIVE_QUERIES +
+            SWEEP_QUERIES +
+            PCAP_QUERIES +
+            RECORD_TYPE_QUERIES +
+            WATCH_QUERIES +
+            INVALID_LINE_QUERIES +
+            LISTEN_QUERIES +
+            TRANSFER_QUERIES +
+            LIBRARY_QUERIES +
+
             NON_REV_V4_QUERIES +
             REV_V4_QUERIES +
 
             NON_REV_V6_QUERIES +
             REV_V6_QUERIES
     )
+    start_stand_in_servers()
+    write_captures()
     generate_test_cases(TEST_CASES)
     unittest.main()